@@ -71,7 +71,7 @@ tau_sendto (tr_session * session,
     }
 
     tau_sockaddr_setport (ai->ai_addr, port);
-    return sendto (sockfd, buf, buflen, 0, ai->ai_addr, ai->ai_addrlen);
+    return tr_udpSendTo (session, sockfd, buf, buflen, ai->ai_addr, ai->ai_addrlen);
 }
 
 /****
@@ -525,9 +525,10 @@ tau_tracker_send_request (struct tau_tracker  * tracker,
                           tracker->connection_id);
     evbuffer_add_hton_64 (buf, tracker->connection_id);
     evbuffer_add_reference (buf, payload, payload_len, NULL, NULL);
-    tau_sendto (tracker->session, tracker->addr, tracker->port,
-                evbuffer_pullup (buf, -1),
-                evbuffer_get_length (buf));
+    if (tau_sendto (tracker->session, tracker->addr, tracker->port,
+                    evbuffer_pullup (buf, -1),
+                    evbuffer_get_length (buf)) < 0)
+        dbgmsg (tracker->key, "couldn't send request: %s", tr_strerror (errno));
     evbuffer_free (buf);
 }
 
@@ -710,9 +711,11 @@ tau_tracker_upkeep (struct tau_tracker * tracker)
         evbuffer_add_hton_64 (buf, 0x41727101980LL);
         evbuffer_add_hton_32 (buf, TAU_ACTION_CONNECT);
         evbuffer_add_hton_32 (buf, tracker->connection_transaction_id);
-        tau_sendto (tracker->session, tracker->addr, tracker->port,
-                    evbuffer_pullup (buf, -1),
-                    evbuffer_get_length (buf));
+        if (tau_sendto (tracker->session, tracker->addr, tracker->port,
+                        evbuffer_pullup (buf, -1),
+                        evbuffer_get_length (buf)) < 0)
+            dbgmsg (tracker->key, "couldn't send connect request: %s",
+                    tr_strerror (errno));
         evbuffer_free (buf);
         return;
     }
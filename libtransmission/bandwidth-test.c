@@ -0,0 +1,159 @@
+#include <stdlib.h> /* abs () */
+#include <string.h> /* memset () */
+
+#include "transmission.h"
+#include "bandwidth.h"
+
+#include "libtransmission-test.h"
+
+static int
+test_token_buckets (void)
+{
+  tr_bandwidth parent;
+  tr_bandwidth child;
+
+  memset (&parent, 0, sizeof (tr_bandwidth));
+  memset (&child, 0, sizeof (tr_bandwidth));
+  tr_bandwidthConstruct (&parent, NULL, NULL);
+  tr_bandwidthConstruct (&child, NULL, &parent);
+  tr_bandwidthSetLimited (&parent, TR_UP, true);
+  tr_bandwidthSetDesiredSpeed_Bps (&parent, TR_UP, 10000);
+  tr_bandwidthSetLimited (&child, TR_UP, true);
+  tr_bandwidthSetDesiredSpeed_Bps (&child, TR_UP, 4000);
+
+  /* each bucket gets the period's worth of its speed,
+     and a child is held to its parent's bucket too */
+  tr_bandwidthAllocate (&parent, TR_UP, 100);
+  check_int_eq (1000, tr_bandwidthClamp (&parent, TR_UP, 100000));
+  check_int_eq (400, tr_bandwidthClamp (&child, TR_UP, 100000));
+  check_int_eq (100, tr_bandwidthClamp (&child, TR_UP, 100));
+
+  /* unused tokens carry over, up to a quarter second's worth
+     on top of the period's */
+  tr_bandwidthAllocate (&parent, TR_UP, 100);
+  check_int_eq (2000, tr_bandwidthClamp (&parent, TR_UP, 100000));
+  check_int_eq (800, tr_bandwidthClamp (&child, TR_UP, 100000));
+  tr_bandwidthAllocate (&parent, TR_UP, 100);
+  check_int_eq (3000, tr_bandwidthClamp (&parent, TR_UP, 100000));
+  check_int_eq (1200, tr_bandwidthClamp (&child, TR_UP, 100000));
+  tr_bandwidthAllocate (&parent, TR_UP, 100);
+  check_int_eq (3500, tr_bandwidthClamp (&parent, TR_UP, 100000));
+  check_int_eq (1400, tr_bandwidthClamp (&child, TR_UP, 100000));
+  tr_bandwidthAllocate (&parent, TR_UP, 100);
+  check_int_eq (3500, tr_bandwidthClamp (&parent, TR_UP, 100000));
+  check_int_eq (1400, tr_bandwidthClamp (&child, TR_UP, 100000));
+
+  /* piece data uses up the tokens of the bandwidth and its ancestors */
+  tr_bandwidthUsed (&child, TR_UP, 900, true, tr_time_msec ());
+  check_int_eq (2600, tr_bandwidthClamp (&parent, TR_UP, 100000));
+  check_int_eq (500, tr_bandwidthClamp (&child, TR_UP, 100000));
+  tr_bandwidthUsed (&parent, TR_UP, 2550, true, tr_time_msec ());
+  check_int_eq (50, tr_bandwidthClamp (&child, TR_UP, 100000));
+
+  /* unless it's told to ignore its parent's limits */
+  tr_bandwidthHonorParentLimits (&child, TR_UP, false);
+  check_int_eq (500, tr_bandwidthClamp (&child, TR_UP, 100000));
+
+  /* and protocol overhead is free */
+  tr_bandwidthUsed (&child, TR_UP, 100, false, tr_time_msec ());
+  check_int_eq (500, tr_bandwidthClamp (&child, TR_UP, 100000));
+
+  /* a longer period fills the bucket with that period's worth, plus the carry-over */
+  tr_bandwidthAllocate (&parent, TR_UP, 1000);
+  check_int_eq (10050, tr_bandwidthClamp (&parent, TR_UP, 100000));
+
+  /* and with the default half-second tick, what went unused
+     still carries over */
+  tr_bandwidthAllocate (&parent, TR_UP, 500);
+  check_int_eq (7500, tr_bandwidthClamp (&parent, TR_UP, 100000));
+
+  tr_bandwidthDestruct (&child);
+  tr_bandwidthDestruct (&parent);
+  return 0;
+}
+
+/* a torrent in a bandwidth group that ignores the session's limits */
+static int
+test_grandparent_limits (void)
+{
+  tr_bandwidth session;
+  tr_bandwidth group;
+  tr_bandwidth torrent;
+  tr_bandwidth peer;
+
+  memset (&session, 0, sizeof (tr_bandwidth));
+  memset (&group, 0, sizeof (tr_bandwidth));
+  memset (&torrent, 0, sizeof (tr_bandwidth));
+  memset (&peer, 0, sizeof (tr_bandwidth));
+  tr_bandwidthConstruct (&session, NULL, NULL);
+  tr_bandwidthConstruct (&group, NULL, &session);
+  tr_bandwidthConstruct (&torrent, NULL, &group);
+  tr_bandwidthConstruct (&peer, NULL, &torrent);
+  tr_bandwidthSetLimited (&session, TR_UP, true);
+  tr_bandwidthSetDesiredSpeed_Bps (&session, TR_UP, 1000);
+  tr_bandwidthSetLimited (&group, TR_UP, true);
+  tr_bandwidthSetDesiredSpeed_Bps (&group, TR_UP, 4000);
+
+  /* every limit up the tree applies... */
+  tr_bandwidthAllocate (&session, TR_UP, 100);
+  check_int_eq (100, tr_bandwidthClamp (&peer, TR_UP, 100000));
+
+  /* ...until the torrent stops at its group's */
+  tr_bandwidthHonorGrandparentLimits (&torrent, TR_UP, false);
+  check_int_eq (400, tr_bandwidthClamp (&peer, TR_UP, 100000));
+  check_int_eq (400, tr_bandwidthClamp (&torrent, TR_UP, 100000));
+
+  /* the group's own setting still applies to its other children */
+  check_int_eq (100, tr_bandwidthClamp (&group, TR_UP, 100000));
+
+  tr_bandwidthDestruct (&peer);
+  tr_bandwidthDestruct (&torrent);
+  tr_bandwidthDestruct (&group);
+  tr_bandwidthDestruct (&session);
+  return 0;
+}
+
+static int
+test_speed_average (void)
+{
+  int i;
+  unsigned int Bps;
+  tr_bandwidth b;
+  const uint64_t start = 100000;
+  uint64_t now = start;
+
+  memset (&b, 0, sizeof (tr_bandwidth));
+  tr_bandwidthConstruct (&b, NULL, NULL);
+  check_int_eq (0, tr_bandwidthGetPieceSpeed_Bps (&b, now, TR_DOWN));
+
+  /* a steady 1000 B/s for twenty time constants */
+  for (i=0; i<200; ++i, now+=100)
+    tr_bandwidthUsed (&b, TR_DOWN, 100, true, now);
+  Bps = tr_bandwidthGetPieceSpeed_Bps (&b, now, TR_DOWN);
+  check (900 <= Bps && Bps <= 1100);
+  check_int_eq (Bps, tr_bandwidthGetRawSpeed_Bps (&b, now, TR_DOWN));
+  check_int_eq (0, tr_bandwidthGetPieceSpeed_Bps (&b, now, TR_UP));
+
+  /* protocol overhead only counts towards the raw speed */
+  tr_bandwidthUsed (&b, TR_DOWN, 1000, false, now);
+  check_int_eq (Bps, tr_bandwidthGetPieceSpeed_Bps (&b, now, TR_DOWN));
+  check_int_eq (Bps + 1000, tr_bandwidthGetRawSpeed_Bps (&b, now, TR_DOWN));
+
+  /* when the transfers stop, the speed decays by e each time constant */
+  i = tr_bandwidthGetPieceSpeed_Bps (&b, now + DEFAULT_SPEED_TIME_CONSTANT_MSEC, TR_DOWN);
+  check (abs (i - (int)(Bps * 0.3679)) <= 1);
+  check (tr_bandwidthGetPieceSpeed_Bps (&b, now + 20 * DEFAULT_SPEED_TIME_CONSTANT_MSEC, TR_DOWN) == 0);
+
+  tr_bandwidthDestruct (&b);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_token_buckets,
+                             test_grandparent_limits,
+                             test_speed_average };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -11,6 +11,7 @@
  */
 
 #include <assert.h>
+#include <math.h> /* exp () */
 #include <string.h> /* memset () */
 
 #include "transmission.h"
@@ -33,56 +34,41 @@
 ***/
 
 static unsigned int
-getSpeed_Bps (const struct bratecontrol * r, unsigned int interval_msec, uint64_t now)
+getTimeConstant (const tr_bandwidth * b)
 {
-  if (!now)
-    now = tr_time_msec ();
-
-  if (now != r->cache_time)
-    {
-      int i = r->newest;
-      uint64_t bytes = 0;
-      const uint64_t cutoff = now - interval_msec;
-      struct bratecontrol * rvolatile = (struct bratecontrol*) r;
-
-      for (;;)
-        {
-          if (r->transfers[i].date <= cutoff)
-            break;
-
-          bytes += r->transfers[i].size;
+  return b->session != NULL ? (unsigned int) tr_sessionGetSpeedTimeConstantMsec (b->session)
+                            : DEFAULT_SPEED_TIME_CONSTANT_MSEC;
+}
 
-          if (--i == -1)
-            i = HISTORY_SIZE - 1; /* circular history */
+/* how much of a rate is left after `age' msec */
+static double
+getDecay (uint64_t age, unsigned int tau_msec)
+{
+  return age ? exp (-(double)age / tau_msec) : 1.0;
+}
 
-          if (i == r->newest)
-            break; /* we've come all the way around */
-        }
+static unsigned int
+getSpeed_Bps (const struct bratecontrol * r, unsigned int tau_msec, uint64_t now)
+{
+  if (!now)
+    now = tr_time_msec ();
 
-      rvolatile->cache_val = (unsigned int)((bytes * 1000u) / interval_msec);
-      rvolatile->cache_time = now;
-    }
+  if (now <= r->date)
+    return (unsigned int) r->rate_Bps;
 
-  return r->cache_val;
+  return (unsigned int)(r->rate_Bps * getDecay (now - r->date, tau_msec));
 }
 
 static void
-bytesUsed (const uint64_t now, struct bratecontrol * r, size_t size)
+bytesUsed (const uint64_t now, struct bratecontrol * r, unsigned int tau_msec, size_t size)
 {
-  if (r->transfers[r->newest].date + GRANULARITY_MSEC >= now)
+  if (now > r->date)
     {
-      r->transfers[r->newest].size += size;
-    }
-  else
-    {
-      if (++r->newest == HISTORY_SIZE)
-        r->newest = 0;
-      r->transfers[r->newest].date = now;
-      r->transfers[r->newest].size = size;
+      r->rate_Bps *= getDecay (now - r->date, tau_msec);
+      r->date = now;
     }
 
-  /* invalidate cache_val*/
-  r->cache_time = 0;
+  r->rate_Bps += (size * 1000.0) / tau_msec;
 }
 
 /******
@@ -113,6 +99,8 @@ tr_bandwidthConstruct (tr_bandwidth * b, tr_session * session, tr_bandwidth * pa
   b->uniqueKey = uniqueKey++;
   b->band[TR_UP].honorParentLimits = true;
   b->band[TR_DOWN].honorParentLimits = true;
+  b->band[TR_UP].honorGrandparentLimits = true;
+  b->band[TR_DOWN].honorGrandparentLimits = true;
   tr_bandwidthSetParent (b, parent);
 }
 
@@ -161,77 +149,154 @@ tr_bandwidthSetParent (tr_bandwidth  * b,
 ****
 ***/
 
+enum
+{
+  /* value of 3000 bytes chosen so that when using uTP we'll send a full-size
+   * frame right away and leave enough buffered data for the next frame to go
+   * out in a timely manner. */
+  DRR_QUANTUM = 3000,
+
+  /* the most a peer with a big share is offered in one round */
+  DRR_MAX_QUANTUM = DRR_QUANTUM * 64,
+
+  /* unused bandwidth carries over into the next period, up to this
+   * much time's worth on top of what the period itself adds */
+  BUCKET_CARRYOVER_MSEC = 250
+};
+
+struct bandwidth_peer
+{
+  tr_peerIo * io;
+  double share;            /* of the bandwidth tr_bandwidthAllocate () was called on */
+  unsigned int quantum;
+  unsigned int deficit;
+};
+
+/* count the peers in each subtree, so that allocateBandwidth ()
+ * can split each node's share between the children that have peers */
+static int
+countPeers (tr_bandwidth * b)
+{
+  int i;
+  const int n = tr_ptrArraySize (&b->children);
+  struct tr_bandwidth ** children = (struct tr_bandwidth**) tr_ptrArrayBase (&b->children);
+
+  b->peerCount = b->peer != NULL ? 1 : 0;
+
+  for (i=0; i<n; ++i)
+    b->peerCount += countPeers (children[i]);
+
+  return b->peerCount;
+}
+
 static void
-allocateBandwidth (tr_bandwidth  * b,
-                   tr_priority_t   parent_priority,
-                   tr_direction    dir,
-                   unsigned int    period_msec,
-                   tr_ptrArray   * peer_pool)
+refillBucket (struct tr_band * band, unsigned int period_msec)
 {
+  const uint64_t rate = band->desiredSpeed_Bps;
+  const uint64_t depth = rate * (period_msec + BUCKET_CARRYOVER_MSEC) / 1000u;
+  const uint64_t tokens = band->bytesLeft + rate * period_msec / 1000u;
+
+  band->bytesLeft = (unsigned int) MIN (tokens, depth);
+}
+
+static void
+allocateBandwidth (tr_bandwidth           * b,
+                   tr_priority_t            parent_priority,
+                   tr_direction             dir,
+                   unsigned int             period_msec,
+                   double                   share,
+                   struct bandwidth_peer ** walk)
+{
+  int i;
+  int busyChildren;
   const tr_priority_t priority = MAX (parent_priority, b->priority);
+  const int n = tr_ptrArraySize (&b->children);
+  struct tr_bandwidth ** children = (struct tr_bandwidth**) tr_ptrArrayBase (&b->children);
 
   assert (tr_isBandwidth (b));
   assert (tr_isDirection (dir));
 
-  /* set the available bandwidth */
+  /* top up the token bucket */
   if (b->band[dir].isLimited)
-    {
-      const uint64_t nextPulseSpeed = b->band[dir].desiredSpeed_Bps;
-      b->band[dir].bytesLeft = nextPulseSpeed * period_msec / 1000u;
-    }
+    refillBucket (&b->band[dir], period_msec);
 
   /* add this bandwidth's peer, if any, to the peer pool */
+  busyChildren = 0;
+  for (i=0; i<n; ++i)
+    if (children[i]->peerCount > 0)
+      ++busyChildren;
+
   if (b->peer != NULL)
     {
+      ++busyChildren;
       b->peer->priority = priority;
-      tr_ptrArrayAppend (peer_pool, b->peer);
+      (*walk)->io = b->peer;
+      (*walk)->share = share / busyChildren;
+      ++*walk;
     }
 
-  /* traverse & repeat for the subtree */
-  if (1)
-    {
-      int i;
-      struct tr_bandwidth ** children = (struct tr_bandwidth**) tr_ptrArrayBase (&b->children);
-      const int n = tr_ptrArraySize (&b->children);
-      for (i=0; i<n; ++i)
-        allocateBandwidth (children[i], priority, dir, period_msec, peer_pool);
-    }
+  /* traverse & repeat for the subtree. the ones without peers still
+   * need their buckets topped up, since webseeds are clamped by them */
+  for (i=0; i<n; ++i)
+    allocateBandwidth (children[i], priority, dir, period_msec,
+                       busyChildren ? share / busyChildren : 0, walk);
 }
 
+/* First phase of IO. Tries to distribute bandwidth fairly to keep faster
+ * peers from starving the others. This is a deficit round-robin: each
+ * round, every peer is offered a quantum proportional to its share, and
+ * peers drop out once they can't use all that they're offered. Keep going
+ * until we run out of bandwidth and/or peers that can use it */
 static void
-phaseOne (tr_ptrArray * peerArray, tr_direction dir)
+phaseOne (struct bandwidth_peer ** peers, int n, tr_direction dir)
 {
-  int n;
-  int peerCount = tr_ptrArraySize (peerArray);
-  struct tr_peerIo ** peers = (struct tr_peerIo**) tr_ptrArrayBase (peerArray);
-
-  /* First phase of IO. Tries to distribute bandwidth fairly to keep faster
-   * peers from starving the others. Loop through the peers, giving each a
-   * small chunk of bandwidth. Keep looping until we run out of bandwidth
-   * and/or peers that can use it */
-  n = peerCount;
+  int i;
+  double minShare;
+
+  if (n < 1)
+    return;
+
+  minShare = peers[0]->share;
+  for (i=1; i<n; ++i)
+    minShare = MIN (minShare, peers[i]->share);
+
+  for (i=0; i<n; ++i)
+    {
+      const double quantum = DRR_QUANTUM * (peers[i]->share / minShare);
+      peers[i]->quantum = quantum < DRR_MAX_QUANTUM ? (unsigned int)quantum : DRR_MAX_QUANTUM;
+      peers[i]->deficit = 0;
+    }
+
+  /* start each round at a random peer so that nobody's always last */
+  i = tr_cryptoWeakRandInt (n);
+
   dbgmsg ("%d peers to go round-robin for %s", n, (dir==TR_UP?"upload":"download"));
   while (n > 0)
     {
-      const int i = tr_cryptoWeakRandInt (n); /* pick a peer at random */
+      int bytesUsed;
+      struct bandwidth_peer * p;
 
-      /* value of 3000 bytes chosen so that when using uTP we'll send a full-size
-       * frame right away and leave enough buffered data for the next frame to go
-       * out in a timely manner. */
-      const size_t increment = 3000;
+      if (i >= n)
+        i = 0;
 
-      const int bytesUsed = tr_peerIoFlush (peers[i], dir, increment);
+      p = peers[i];
+      p->deficit += p->quantum;
+      bytesUsed = tr_peerIoFlush (p->io, dir, p->deficit);
 
-      dbgmsg ("peer #%d of %d used %d bytes in this pass", i, n, bytesUsed);
+      dbgmsg ("peer #%d of %d used %d of %u bytes in this round", i, n, bytesUsed, p->deficit);
 
-      if (bytesUsed != (int)increment)
+      if (bytesUsed < (int)p->deficit)
         {
-          /* peer is done writing for now; move it to the end of the list */
-          tr_peerIo * pio = peers[i];
+          /* peer is done for now; move it to the end of the list */
           peers[i] = peers[n-1];
-          peers[n-1] = pio;
+          peers[n-1] = p;
           --n;
         }
+      else
+        {
+          p->deficit = 0;
+          ++i;
+        }
     }
 }
 
@@ -240,58 +305,61 @@ tr_bandwidthAllocate (tr_bandwidth  * b,
                       tr_direction    dir,
                       unsigned int    period_msec)
 {
-  int i, peerCount;
-  tr_ptrArray tmp = TR_PTR_ARRAY_INIT;
-  tr_ptrArray low = TR_PTR_ARRAY_INIT;
-  tr_ptrArray high = TR_PTR_ARRAY_INIT;
-  tr_ptrArray normal = TR_PTR_ARRAY_INIT;
-  struct tr_peerIo ** peers;
-
-  /* allocateBandwidth () is a helper function with two purposes:
-   * 1. allocate bandwidth to b and its subtree
-   * 2. accumulate an array of all the peerIos from b and its subtree. */
-  allocateBandwidth (b, TR_PRI_LOW, dir, period_msec, &tmp);
-  peers = (struct tr_peerIo**) tr_ptrArrayBase (&tmp);
-  peerCount = tr_ptrArraySize (&tmp);
+  int i;
+  int peerCount;
+  int lowCount = 0;
+  int highCount = 0;
+  int normalCount = 0;
+  struct bandwidth_peer * pool;
+  struct bandwidth_peer * walk;
+  struct bandwidth_peer ** low;
+  struct bandwidth_peer ** high;
+  struct bandwidth_peer ** normal;
+
+  /* refill b and its subtree's token buckets, and
+   * accumulate an array of all the peerIos from b and its subtree
+   * along with their share of b's bandwidth */
+  peerCount = countPeers (b);
+  walk = pool = tr_new (struct bandwidth_peer, peerCount);
+  allocateBandwidth (b, TR_PRI_LOW, dir, period_msec, 1.0, &walk);
+  assert (walk - pool == peerCount);
+
+  low = tr_new (struct bandwidth_peer*, peerCount * 3);
+  normal = low + peerCount;
+  high = normal + peerCount;
 
   for (i=0; i<peerCount; ++i)
     {
-      tr_peerIo * io = peers[i];
-      tr_peerIoRef (io);
+      struct bandwidth_peer * p = &pool[i];
+      tr_peerIoRef (p->io);
 
-      tr_peerIoFlushOutgoingProtocolMsgs (io);
+      tr_peerIoFlushOutgoingProtocolMsgs (p->io);
 
-      switch (io->priority)
+      switch (p->io->priority)
         {
-          case TR_PRI_HIGH:   tr_ptrArrayAppend (&high,   io); /* fall through */
-          case TR_PRI_NORMAL: tr_ptrArrayAppend (&normal, io); /* fall through */
-          default:            tr_ptrArrayAppend (&low,    io);
+          case TR_PRI_HIGH:   high[highCount++] = p;     /* fall through */
+          case TR_PRI_NORMAL: normal[normalCount++] = p; /* fall through */
+          default:            low[lowCount++] = p;
         }
     }
 
-  /* First phase of IO. Tries to distribute bandwidth fairly to keep faster
-   * peers from starving the others. Loop through the peers, giving each a
-   * small chunk of bandwidth. Keep looping until we run out of bandwidth
-   * and/or peers that can use it */
-  phaseOne (&high, dir);
-  phaseOne (&normal, dir);
-  phaseOne (&low, dir);
+  phaseOne (high, highCount, dir);
+  phaseOne (normal, normalCount, dir);
+  phaseOne (low, lowCount, dir);
 
   /* Second phase of IO. To help us scale in high bandwidth situations,
    * enable on-demand IO for peers with bandwidth left to burn.
    * This on-demand IO is enabled until (1) the peer runs out of bandwidth,
    * or (2) the next tr_bandwidthAllocate () call, when we start over again. */
   for (i=0; i<peerCount; ++i)
-    tr_peerIoSetEnabled (peers[i], dir, tr_peerIoHasBandwidthLeft (peers[i], dir));
+    tr_peerIoSetEnabled (pool[i].io, dir, tr_peerIoHasBandwidthLeft (pool[i].io, dir));
 
   for (i=0; i<peerCount; ++i)
-    tr_peerIoUnref (peers[i]);
+    tr_peerIoUnref (pool[i].io);
 
   /* cleanup */
-  tr_ptrArrayDestruct (&normal, NULL);
-  tr_ptrArrayDestruct (&high, NULL);
-  tr_ptrArrayDestruct (&low, NULL);
-  tr_ptrArrayDestruct (&tmp, NULL);
+  tr_free (low);
+  tr_free (pool);
 }
 
 void
@@ -307,56 +375,32 @@ tr_bandwidthSetPeer (tr_bandwidth * b, tr_peerIo * peer)
 ****
 ***/
 
-static unsigned int
-bandwidthClamp (const tr_bandwidth  * b,
-                uint64_t              now,
-                tr_direction          dir,
-                unsigned int          byteCount)
+unsigned int
+tr_bandwidthClamp (const tr_bandwidth  * b,
+                   tr_direction          dir,
+                   unsigned int          byteCount)
 {
+  bool honorGrandparent = true;
+
   assert (tr_isBandwidth (b));
   assert (tr_isDirection (dir));
 
-  if (b)
+  /* a peer may use no more than what's left in its own bucket
+   * and those of its ancestors, unless it's told to ignore them */
+  for (;;)
     {
       if (b->band[dir].isLimited)
-        {
-          byteCount = MIN (byteCount, b->band[dir].bytesLeft);
-
-          /* if we're getting close to exceeding the speed limit,
-           * clamp down harder on the bytes available */
-          if (byteCount > 0)
-            {
-              double current;
-              double desired;
-              double r;
-
-              if (now == 0)
-                now = tr_time_msec ();
-
-              current = tr_bandwidthGetRawSpeed_Bps (b, now, TR_DOWN);
-              desired = tr_bandwidthGetDesiredSpeed_Bps (b, TR_DOWN);
-              r = desired >= 1 ? current / desired : 0;
-
-                   if (r > 1.0) byteCount = 0;
-              else if (r > 0.9) byteCount *= 0.8;
-              else if (r > 0.8) byteCount *= 0.9;
-            }
-        }
+        byteCount = MIN (byteCount, b->band[dir].bytesLeft);
 
-      if (b->parent && b->band[dir].honorParentLimits && (byteCount > 0))
-        byteCount = bandwidthClamp (b->parent, now, dir, byteCount);
+      if (!byteCount || !b->parent || !b->band[dir].honorParentLimits || !honorGrandparent)
+        break;
+
+      honorGrandparent = b->band[dir].honorGrandparentLimits;
+      b = b->parent;
     }
 
   return byteCount;
 }
-unsigned int
-tr_bandwidthClamp (const tr_bandwidth  * b,
-                   tr_direction          dir,
-                   unsigned int          byteCount)
-{
-  return bandwidthClamp (b, 0, dir, byteCount);
-}
-
 
 unsigned int
 tr_bandwidthGetRawSpeed_Bps (const tr_bandwidth * b, const uint64_t now, const tr_direction dir)
@@ -364,7 +408,7 @@ tr_bandwidthGetRawSpeed_Bps (const tr_bandwidth * b, const uint64_t now, const t
   assert (tr_isBandwidth (b));
   assert (tr_isDirection (dir));
 
-  return getSpeed_Bps (&b->band[dir].raw, HISTORY_MSEC, now);
+  return getSpeed_Bps (&b->band[dir].raw, getTimeConstant (b), now);
 }
 
 unsigned int
@@ -373,7 +417,7 @@ tr_bandwidthGetPieceSpeed_Bps (const tr_bandwidth * b, const uint64_t now, const
   assert (tr_isBandwidth (b));
   assert (tr_isDirection (dir));
 
-  return getSpeed_Bps (&b->band[dir].piece, HISTORY_MSEC, now);
+  return getSpeed_Bps (&b->band[dir].piece, getTimeConstant (b), now);
 }
 
 void
@@ -384,11 +428,13 @@ tr_bandwidthUsed (tr_bandwidth  * b,
                   uint64_t        now)
 {
   struct tr_band * band;
+  unsigned int tau_msec;
 
   assert (tr_isBandwidth (b));
   assert (tr_isDirection (dir));
 
   band = &b->band[dir];
+  tau_msec = getTimeConstant (b);
 
   if (band->isLimited && isPieceData)
     band->bytesLeft -= MIN (band->bytesLeft, byteCount);
@@ -399,10 +445,10 @@ fprintf (stderr, "%p consumed %5"TR_PRIuSIZE" bytes of %5s data... was %6"TR_PRI
          b, byteCount, (isPieceData?"piece":"raw"), oldBytesLeft, band->bytesLeft);
 #endif
 
-  bytesUsed (now, &band->raw, byteCount);
+  bytesUsed (now, &band->raw, tau_msec, byteCount);
 
   if (isPieceData)
-    bytesUsed (now, &band->piece, byteCount);
+    bytesUsed (now, &band->piece, tau_msec, byteCount);
 
   if (b->parent != NULL)
     tr_bandwidthUsed (b->parent, dir, byteCount, isPieceData, now);
@@ -34,21 +34,20 @@ struct tr_peerIo;
  * it's included in the header for inlining and composition. */
 enum
 {
-  HISTORY_MSEC = 2000u,
-  INTERVAL_MSEC = HISTORY_MSEC,
-  GRANULARITY_MSEC = 200,
-  HISTORY_SIZE = (INTERVAL_MSEC / GRANULARITY_MSEC),
+  DEFAULT_SPEED_TIME_CONSTANT_MSEC = 1000,
   BANDWIDTH_MAGIC_NUMBER = 43143
 };
 
 /* these are PRIVATE IMPLEMENTATION details that should not be touched.
- * it's included in the header for inlining and composition. */
+ * it's included in the header for inlining and composition.
+ *
+ * an exponentially-weighted moving average of the transfer speed.
+ * rate_Bps is the speed as of `date'; it decays by e^(-dt/tau) as
+ * time passes, and each transfer adds its bytes divided by tau. */
 struct bratecontrol
 {
-  int newest;
-  struct { uint64_t date, size; } transfers[HISTORY_SIZE];
-  uint64_t cache_time;
-  unsigned int cache_val;
+  uint64_t date;
+  double rate_Bps;
 };
 
 /* these are PRIVATE IMPLEMENTATION details that should not be touched.
@@ -57,7 +56,8 @@ struct tr_band
 {
   bool isLimited;
   bool honorParentLimits;
-  unsigned int bytesLeft;
+  bool honorGrandparentLimits;
+  unsigned int bytesLeft;  /* the tokens in this band's bucket */
   unsigned int desiredSpeed_Bps;
   struct bratecontrol raw;
   struct bratecontrol piece;
@@ -76,6 +76,7 @@ struct tr_band
  *   At the top is the global bandwidth object owned by tr_session.
  *   Its children are per-torrent bandwidth objects owned by tr_torrent.
  *   Underneath those are per-peer bandwidth objects owned by tr_peer.
+ *   Any node can have children, so other levels can be slotted in between.
  *
  *   tr_session also owns a tr_handshake's bandwidths, so that the handshake
  *   I/O can be counted in the global raw totals. When the handshake is done,
@@ -88,11 +89,19 @@ struct tr_band
  *   speed by quering tr_session's bandwidth, per-torrent speeds by asking
  *   tr_torrent's bandwidth, and per-peer speeds by asking tr_peer's bandwidth.
  *
+ *   Speeds are exponentially-weighted moving averages, so both counting
+ *   bytes and reading a speed are O(1). The averages' time constant is
+ *   tr_sessionGetSpeedTimeConstantMsec ().
+ *
  * CONSTRAINING
  *
- *   Call tr_bandwidthAllocate () periodically. tr_bandwidth knows its current
- *   speed and will decide how many bytes to make available over the
- *   user-specified period to reach the user-specified desired speed.
+ *   Call tr_bandwidthAllocate () periodically. Each limited node in the tree
+ *   is a token bucket that's topped up with the period's worth of its
+ *   desired speed. Unused tokens carry over into the next period, up to
+ *   a quarter second's worth, so a peer that was briefly idle can catch up
+ *   and a shorter period gives smoother output.
+ *   The peers are then served in deficit round-robin order, where each
+ *   node's share is split evenly between its children that have peers.
  *   If appropriate, it notifies its peer-ios that new bandwidth is available.
  *
  *   tr_bandwidthAllocate () operates on the tr_bandwidth subtree, so usually
@@ -115,6 +124,7 @@ typedef struct tr_bandwidth
   tr_session * session;
   tr_ptrArray children; /* struct tr_bandwidth */
   struct tr_peerIo * peer;
+  int peerCount; /* peers in this subtree, as of the last tr_bandwidthAllocate () */
 }
 tr_bandwidth;
 
@@ -262,6 +272,33 @@ tr_bandwidthAreParentLimitsHonored (const tr_bandwidth  * bandwidth,
   return bandwidth->band[direction].honorParentLimits;
 }
 
+/**
+ * A torrent in a bandwidth group always honors the group's cap,
+ * but whether it honors the session's cap above that is up to it.
+ * Turning this off stops at the parent's limits, even if the parent
+ * itself honors its own parent's.
+ */
+static inline bool
+tr_bandwidthHonorGrandparentLimits (tr_bandwidth   * bandwidth,
+                                    tr_direction     direction,
+                                    bool             isEnabled)
+{
+  bool * value = &bandwidth->band[direction].honorGrandparentLimits;
+  const bool didChange = isEnabled != *value;
+  *value = isEnabled;
+  return didChange;
+}
+
+static inline bool
+tr_bandwidthAreGrandparentLimitsHonored (const tr_bandwidth  * bandwidth,
+                                         tr_direction          direction)
+{
+  assert (tr_isBandwidth (bandwidth));
+  assert (tr_isDirection (direction));
+
+  return bandwidth->band[direction].honorGrandparentLimits;
+}
+
 /******
 *******
 ******/
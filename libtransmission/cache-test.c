@@ -0,0 +1,447 @@
+#include <stdio.h> /* remove() */
+#include <string.h> /* memcmp(), memset() */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "cache.h"
+#include "disk-io.h"
+#include "platform.h" /* tr_lock */
+#include "session.h"
+#include "torrent.h"
+#include "trevent.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+/***
+****
+***/
+
+struct cache_test_data
+{
+  tr_torrent * tor;
+  bool ok;
+  bool done;
+};
+
+static tr_block_index_t
+gcd (tr_block_index_t a, tr_block_index_t b)
+{
+  while (b != 0)
+    {
+      const tr_block_index_t t = a % b;
+      a = b;
+      b = t;
+    }
+
+  return a;
+}
+
+static void
+writeBlock (tr_torrent * tor, tr_block_index_t block, uint8_t fill)
+{
+  uint8_t * data;
+  tr_piece_index_t piece;
+  uint32_t offset;
+  uint32_t length;
+  struct evbuffer * buf = evbuffer_new ();
+
+  tr_torrentGetBlockLocation (tor, block, &piece, &offset, &length);
+  data = tr_new (uint8_t, length);
+  memset (data, fill, length);
+  evbuffer_add (buf, data, length);
+  tr_cacheWriteBlock (tor->session->cache, tor, piece, offset, length, buf);
+
+  evbuffer_free (buf);
+  tr_free (data);
+}
+
+static bool
+blockHasFill (tr_torrent * tor, tr_block_index_t block, uint8_t fill)
+{
+  bool ok;
+  uint32_t i;
+  uint8_t * data;
+  tr_piece_index_t piece;
+  uint32_t offset;
+  uint32_t length;
+
+  tr_torrentGetBlockLocation (tor, block, &piece, &offset, &length);
+  data = tr_new (uint8_t, length);
+  ok = !tr_cacheReadBlock (tor->session->cache, tor, piece, offset, length, data);
+  for (i=0; ok && i<length; ++i)
+    ok = data[i] == fill;
+
+  tr_free (data);
+  return ok;
+}
+
+/* write every block out of order, so that the cache has to keep
+   creating, growing, and joining runs; then flush it in pieces */
+static void
+test_cache_runs_threadfunc (void * vdata)
+{
+  tr_block_index_t i;
+  tr_block_index_t stride;
+  struct cache_test_data * data = vdata;
+  tr_torrent * tor = data->tor;
+  const tr_block_index_t n = tor->blockCount;
+
+  for (stride=n/3+1; gcd (stride, n)!=1; ++stride)
+    ;
+
+  data->ok = true;
+
+  for (i=0; i<n; ++i)
+    writeBlock (tor, (i * stride) % n, (uint8_t)(1 + ((i * stride) % n) % 200));
+  for (i=0; data->ok && i<n; ++i)
+    data->ok = blockHasFill (tor, i, (uint8_t)(1 + i % 200));
+
+  /* overwrite everything with the real (zeroed) contents */
+  for (i=0; i<n; ++i)
+    writeBlock (tor, n - 1 - i, 0);
+  for (i=0; data->ok && i<n; ++i)
+    data->ok = blockHasFill (tor, i, 0);
+
+  /* flushing one file splits the runs that cross its edges */
+  if (data->ok)
+    data->ok = !tr_cacheFlushFile (tor->session->cache, tor, 1);
+  for (i=0; data->ok && i<n; ++i)
+    data->ok = blockHasFill (tor, i, 0);
+
+  if (data->ok)
+    data->ok = !tr_cacheFlushTorrent (tor->session->cache, tor);
+
+  data->done = true;
+}
+
+static int
+test_cache_runs (void)
+{
+  tr_session * session;
+  tr_torrent * tor;
+  tr_variant settings;
+  struct cache_test_data data;
+
+  /* big enough that nothing's flushed until we ask */
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddInt (&settings, TR_KEY_cache_size_mb, 64);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, false);
+  check (tor->info.fileCount > 2);
+
+  data.tor = tor;
+  data.ok = false;
+  data.done = false;
+  tr_runInEventThread (session, test_cache_runs_threadfunc, &data);
+  do { tr_wait_msec (50); } while (!data.done);
+  check (data.ok);
+
+  /* the flushed blocks must have made it to disk */
+  libttest_blockingTorrentVerify (tor);
+  check_int_eq (0, tr_torrentStat(tor)->leftUntilDone);
+
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+/* read `block', then report whether it was a read cache hit */
+static bool
+readIsHit (tr_torrent * tor, tr_block_index_t block, uint8_t fill)
+{
+  uint64_t hits, misses, hits2, misses2;
+
+  tr_sessionGetReadCacheStats (tor->session, &hits, &misses);
+  if (!blockHasFill (tor, block, fill))
+    return false;
+  tr_sessionGetReadCacheStats (tor->session, &hits2, &misses2);
+
+  return (hits2 == hits + 1) && (misses2 == misses);
+}
+
+static void
+test_read_cache_threadfunc (void * vdata)
+{
+  tr_block_index_t i;
+  struct cache_test_data * data = vdata;
+  tr_torrent * tor = data->tor;
+
+  /* the first read misses; the second doesn't */
+  data->ok = !readIsHit (tor, 0, 0) && readIsHit (tor, 0, 0);
+
+  /* a pass over every other block pushes them through the cache,
+     but doesn't push out the block that was read twice */
+  for (i=1; data->ok && i<tor->blockCount; ++i)
+    data->ok = !readIsHit (tor, i, 0);
+  if (data->ok)
+    data->ok = readIsHit (tor, 0, 0);
+
+  /* writing a block drops the read cache's stale copy */
+  writeBlock (tor, 0, 1);
+  if (data->ok)
+    data->ok = !tr_cacheFlushFile (tor->session->cache, tor, 0);
+  if (data->ok)
+    data->ok = !readIsHit (tor, 0, 1);
+
+  data->done = true;
+}
+
+static int
+test_read_cache (void)
+{
+  tr_session * session;
+  tr_torrent * tor;
+  tr_variant settings;
+  struct cache_test_data data;
+
+  /* smaller than the torrent */
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddInt (&settings, TR_KEY_read_cache_size_mb, 1);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+  check_int_eq (1, tr_sessionGetReadCacheLimit_MB (session));
+
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+  check (tor->blockCount * tor->blockSize > 1024 * 1024);
+
+  data.tor = tor;
+  data.ok = false;
+  data.done = false;
+  tr_runInEventThread (session, test_read_cache_threadfunc, &data);
+  do { tr_wait_msec (50); } while (!data.done);
+  check (data.ok);
+
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+/* pretend that every torrent lives on its own disk */
+static dev_t
+getTorrentIdAsDevice (const tr_torrent * tor)
+{
+  return (dev_t) tor->uniqueId;
+}
+
+struct stall_data
+{
+  tr_lock * lock;
+  int stalled;
+  bool released;
+};
+
+/* keep a disk I/O worker busy until the test lets it go */
+static void
+stallFunc (void * vdata)
+{
+  struct stall_data * data = vdata;
+  bool released;
+
+  tr_lockLock (data->lock);
+  ++data->stalled;
+  tr_lockUnlock (data->lock);
+
+  do
+    {
+      tr_wait_msec (10);
+      tr_lockLock (data->lock);
+      released = data->released;
+      tr_lockUnlock (data->lock);
+    }
+  while (!released);
+}
+
+struct device_test_data
+{
+  tr_torrent * a;
+  tr_torrent * b;
+  size_t a_write_bytes;
+  size_t b_write_bytes;
+  bool done;
+};
+
+/* b has a few blocks cached when a floods the cache. Every flush
+   is stuck in the disk I/O queue, so nothing leaves it. */
+static void
+test_device_writes_threadfunc (void * vdata)
+{
+  tr_block_index_t i;
+  struct device_test_data * data = vdata;
+  tr_cache * cache = data->a->session->cache;
+
+  for (i=0; i<4; ++i)
+    writeBlock (data->b, i, 1);
+
+  /* every other block, so that each one is a run of its own */
+  for (i=0; i<52; i+=2)
+    writeBlock (data->a, i, 2);
+
+  data->a_write_bytes = tr_cacheGetDeviceWriteBytes (cache, data->a);
+  data->b_write_bytes = tr_cacheGetDeviceWriteBytes (cache, data->b);
+  data->done = true;
+}
+
+static int
+test_device_writes (void)
+{
+  int i;
+  tr_session * session;
+  tr_torrent * a;
+  tr_torrent * b;
+  tr_variant settings;
+  struct stall_data stall;
+  struct device_test_data data;
+  const int64_t cacheSize = 256 * 1024;
+
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddInt (&settings, TR_KEY_disk_io_threads, 2);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+
+  tr_sessionLock (session);
+  tr_cacheSetDeviceFunc (session->cache, getTorrentIdAsDevice);
+  tr_cacheSetLimit (session->cache, cacheSize);
+  tr_sessionUnlock (session);
+
+  a = libttest_zero_torrent_init (session);
+  b = libttest_fill_torrent_init (session, "device-b", 0, 32768, 8);
+  check (a->blockCount >= 52);
+
+  /* tie up both workers so that every write stays queued */
+  stall.lock = tr_lockNew ();
+  stall.stalled = 0;
+  stall.released = false;
+  for (i=0; i<2; ++i)
+    tr_diskIoAdd (session->diskIo, 0, stallFunc, NULL, &stall);
+  while (stall.stalled < 2)
+    tr_wait_msec (10);
+
+  data.a = a;
+  data.b = b;
+  data.done = false;
+  tr_runInEventThread (session, test_device_writes_threadfunc, &data);
+  do { tr_wait_msec (50); } while (!data.done);
+
+  /* the two devices split the cache, so a can only
+     tie up half of it... */
+  check (data.a_write_bytes > 0);
+  check (data.a_write_bytes <= (size_t)cacheSize / 2);
+
+  /* ...and when it's used that up, b's blocks are still flushed
+     to its own device instead of waiting behind a's */
+  check_int_eq (4 * b->blockSize, data.b_write_bytes);
+
+  tr_lockLock (stall.lock);
+  stall.released = true;
+  tr_lockUnlock (stall.lock);
+
+  tr_torrentRemove (b, true, remove);
+  tr_torrentRemove (a, true, remove);
+  libttest_session_close (session);
+  tr_lockFree (stall.lock);
+  return 0;
+}
+
+/***
+****
+***/
+
+struct flush_done_data
+{
+  tr_torrent * a;
+  tr_torrent * b;
+  int err;
+  bool done;
+};
+
+/* a fills more than its share of the cache with blocks from a piece
+   it doesn't have yet, and b caches a piece that it does have */
+static void
+test_flush_done_threadfunc (void * vdata)
+{
+  tr_block_index_t i;
+  struct flush_done_data * data = vdata;
+
+  for (i=0; i<20; i+=2)
+    writeBlock (data->a, i, 1);
+  for (i=0; i<2; ++i)
+    writeBlock (data->b, i, 2);
+
+  data->err = tr_cacheFlushDone (data->a->session->cache);
+  data->done = true;
+}
+
+static int
+test_flush_done (void)
+{
+  tr_block_index_t i;
+  tr_session * session;
+  tr_torrent * a;
+  tr_torrent * b;
+  struct flush_done_data data;
+
+  session = libttest_session_init (NULL);
+
+  /* room for 16 blocks, so each torrent's share is 8 */
+  tr_sessionLock (session);
+  tr_cacheSetLimit (session->cache, 16 * 16384);
+  tr_sessionUnlock (session);
+
+  a = libttest_fill_torrent_init (session, "flush-a", 1, 32 * 16384, 2);
+  b = libttest_fill_torrent_init (session, "flush-b", 2, 2 * 16384, 4);
+  libttest_fill_torrent_populate (b, 2, -1);
+  libttest_blockingTorrentVerify (b);
+  check (tr_torrentPieceIsComplete (b, 0));
+  check (!tr_torrentPieceIsComplete (a, 0));
+
+  data.a = a;
+  data.b = b;
+  data.done = false;
+  tr_runInEventThread (session, test_flush_done_threadfunc, &data);
+  do { tr_wait_msec (50); } while (!data.done);
+  check_int_eq (0, data.err);
+
+  /* b's finished piece is flushed even though a's runs sort first... */
+  tr_sessionLock (session);
+  for (i=0; i<2; ++i)
+    check (!tr_cacheHasBlock (session->cache, b, 0, i * 16384, 16384));
+
+  /* ...and a's unfinished piece stays */
+  for (i=0; i<20; i+=2)
+    check (tr_cacheHasBlock (session->cache, a, 0, i * 16384, 16384));
+  tr_sessionUnlock (session);
+
+  tr_torrentRemove (b, true, remove);
+  tr_torrentRemove (a, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_cache_runs,
+                             test_read_cache,
+                             test_device_writes,
+                             test_flush_done };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
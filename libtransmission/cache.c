@@ -10,16 +10,23 @@
  * $Id$
  */
 
+#include <assert.h>
 #include <stdlib.h> /* qsort () */
+#include <string.h> /* memcpy () */
+#include <sys/types.h> /* dev_t */
+#include <sys/stat.h> /* stat () */
 
 #include <event2/buffer.h>
 
 #include "transmission.h"
 #include "cache.h"
+#include "disk-io.h"
 #include "inout.h"
+#include "list.h"
 #include "log.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
 #include "ptrarray.h"
+#include "session.h"
 #include "torrent.h"
 #include "trevent.h"
 #include "utils.h"
@@ -38,6 +45,8 @@
 *****
 ****/
 
+struct cache_run;
+
 struct cache_block
 {
   tr_torrent * tor;
@@ -50,11 +59,109 @@ struct cache_block
   tr_block_index_t block;
 
   struct evbuffer * evbuf;
+
+  struct cache_block * hash_next;
+  struct cache_run * run;
+};
+
+/* a torrent's contiguous blocks [first...last], all of which are cached */
+struct cache_run
+{
+  tr_block_index_t first;
+  tr_block_index_t last;
+
+  struct cache_run * prev;
+  struct cache_run * next;
+};
+
+/* a disk that some of the cached torrents live on.
+   Writes to one device go through the tr_disk_io pool one at a time,
+   in the order they were queued, using the device's serial */
+struct cache_device
+{
+  dev_t dev;
+  int serial;
+
+  int block_count;      /* how many cached blocks will go to this device */
+  size_t write_bytes;   /* how much is being written to it in the background */
+  size_t trim_bytes;    /* scratch space for cacheTrim () */
+};
+
+/* the runs for one torrent, in no particular order */
+struct cache_torrent
+{
+  tr_torrent * tor;
+  struct cache_device * device;
+  struct cache_run * runs;
+  int block_count;
+};
+
+/* a run of blocks that's been taken out of the cache
+   and is being written to disk by a tr_disk_io worker */
+struct cache_write
+{
+  int torrent_id;
+  struct cache_device * device;
+  tr_block_index_t first_block;
+  tr_block_index_t last_block;
+
+  /* the blocks' buffers, which are written straight from their chains */
+  struct evbuffer ** bufs;
+  struct evbuffer_iovec * vec;
+  int vec_count;
+  uint32_t length;
+
+  tr_io_request * req;
+  tr_file_index_t failed_file;
+  int err;
+
+  /* true once it's been removed from the cache's `writes' list */
+  bool reaped;
+};
+
+/* a block that was read from disk, kept in the read cache */
+struct read_block
+{
+  tr_torrent * tor;
+  tr_block_index_t block;
+  uint32_t length;
+  uint8_t * data;
+
+  bool is_hot;
+  struct read_block * prev; /* more recently used */
+  struct read_block * next; /* less recently used */
+  struct read_block * hash_next;
+};
+
+struct read_list
+{
+  struct read_block * head; /* most recently used */
+  struct read_block * tail; /* least recently used */
+  int count;
+};
+
+enum
+{
+  /* must be a power of two */
+  MIN_BUCKET_COUNT = 256,
+
+  /* how much of the read cache can be given over to blocks
+     that have been read more than once */
+  READ_HOT_PERCENT = 80
 };
 
 struct tr_cache
 {
-  tr_ptrArray blocks;
+  /* the blocks, hashed by torrent and block index */
+  struct cache_block ** buckets;
+  size_t bucket_count;
+  int block_count;
+  int run_count;
+
+  tr_ptrArray torrents; /* struct cache_torrent, sorted by torrent id */
+  tr_ptrArray devices; /* struct cache_device, in the order they were found */
+  tr_list * writes; /* struct cache_write, oldest first */
+  tr_cache_device_func device_func;
   int max_blocks;
   size_t max_bytes;
 
@@ -62,56 +169,582 @@ struct tr_cache
   size_t disk_write_bytes;
   size_t cache_writes;
   size_t cache_write_bytes;
+
+  /* the read cache, which is separate from the blocks waiting to be
+     written. It's a segmented LRU, hashed by torrent and block index */
+  struct read_block ** read_buckets;
+  size_t read_bucket_count;
+  struct read_list probation; /* blocks that have been read once */
+  struct read_list hot; /* blocks that have been read again since */
+  int read_max_blocks;
+  int64_t read_max_bytes;
+
+  uint64_t read_hits;
+  uint64_t read_misses;
 };
 
 /****
-*****
+*****  The block hash table
 ****/
 
-struct run_info
+static inline size_t
+hashBlock (size_t bucket_count, const tr_torrent * tor, tr_block_index_t block)
 {
-  int pos;
-  int rank;
-  time_t last_block_time;
-  bool is_multi_piece;
-  bool is_piece_done;
-  unsigned len;
-};
+  uint64_t h = ((uint64_t)(uint32_t)tor->uniqueId << 32) ^ block;
 
+  h *= 0x9E3779B97F4A7C15ull;
+  return (size_t)(h >> 32) & (bucket_count - 1);
+}
+
+static struct cache_block *
+findBlockByIndex (const tr_cache * cache, const tr_torrent * tor, tr_block_index_t block)
+{
+  struct cache_block * cb;
+
+  for (cb=cache->buckets[hashBlock (cache->bucket_count, tor, block)]; cb!=NULL; cb=cb->hash_next)
+    if ((cb->block == block) && (cb->tor == tor))
+      break;
+
+  return cb;
+}
+
+static void
+rehash (tr_cache * cache, size_t bucket_count)
+{
+  size_t i;
+  struct cache_block ** old_buckets = cache->buckets;
+  const size_t old_bucket_count = cache->bucket_count;
+
+  cache->buckets = tr_new0 (struct cache_block*, bucket_count);
+  cache->bucket_count = bucket_count;
+
+  for (i=0; i<old_bucket_count; ++i)
+    {
+      struct cache_block * cb;
+      struct cache_block * next;
+
+      for (cb=old_buckets[i]; cb!=NULL; cb=next)
+        {
+          const size_t pos = hashBlock (cache->bucket_count, cb->tor, cb->block);
+          next = cb->hash_next;
+          cb->hash_next = cache->buckets[pos];
+          cache->buckets[pos] = cb;
+        }
+    }
+
+  tr_free (old_buckets);
+}
+
+static void
+hashInsert (tr_cache * cache, struct cache_block * cb)
+{
+  size_t pos;
+
+  if ((size_t)cache->block_count >= cache->bucket_count)
+    rehash (cache, cache->bucket_count * 2);
+
+  pos = hashBlock (cache->bucket_count, cb->tor, cb->block);
+  cb->hash_next = cache->buckets[pos];
+  cache->buckets[pos] = cb;
+  ++cache->block_count;
+}
+
+static void
+hashRemove (tr_cache * cache, struct cache_block * cb)
+{
+  struct cache_block ** walk = &cache->buckets[hashBlock (cache->bucket_count, cb->tor, cb->block)];
+
+  while (*walk != cb)
+    walk = &(*walk)->hash_next;
+
+  *walk = cb->hash_next;
+  cb->hash_next = NULL;
+  --cache->block_count;
+}
+
+/****
+*****  Runs of contiguous blocks
+****/
 
-/* return a count of how many contiguous blocks there are starting at this pos */
 static int
-getBlockRun (const tr_cache * cache, int pos, struct run_info * info)
+compareTorrentId (const void * va, const void * vb)
+{
+  const struct cache_torrent * a = va;
+  const struct cache_torrent * b = vb;
+
+  if (a->tor->uniqueId != b->tor->uniqueId)
+    return a->tor->uniqueId < b->tor->uniqueId ? -1 : 1;
+
+  return 0;
+}
+
+static struct cache_torrent *
+findCacheTorrent (tr_cache * cache, tr_torrent * tor)
+{
+  struct cache_torrent key;
+  key.tor = tor;
+  return tr_ptrArrayFindSorted (&cache->torrents, &key, compareTorrentId);
+}
+
+/* Torrents whose directory can't be found share a device. */
+static dev_t
+getTorrentDevice (const tr_torrent * tor)
+{
+  struct stat sb;
+
+  if ((tor->currentDir != NULL) && !stat (tor->currentDir, &sb))
+    return sb.st_dev;
+
+  return 0;
+}
+
+/* find the device that the torrent's files are being written to */
+static struct cache_device *
+getCacheDevice (tr_cache * cache, const tr_torrent * tor)
 {
   int i;
-  const int n = tr_ptrArraySize (&cache->blocks);
-  const struct cache_block ** blocks = (const struct cache_block**) tr_ptrArrayBase (&cache->blocks);
-  const struct cache_block * ref = blocks[pos];
-  tr_block_index_t block = ref->block;
+  int n;
+  struct cache_device * device;
+  const dev_t dev = cache->device_func (tor);
 
-  for (i=pos; i<n; ++i, ++block)
+  for (i=0, n=tr_ptrArraySize (&cache->devices); i<n; ++i)
     {
-      const struct cache_block * b = blocks[i];
-      if (b->block != block)
-        break;
-      if (b->tor != ref->tor)
-        break;
-      //fprintf (stderr, "pos %d tor %d block %"TR_PRIuSIZE" time %"TR_PRIuSIZE"\n", i, b->tor->uniqueId, (size_t)b->block, (size_t)b->time);
+      device = tr_ptrArrayNth (&cache->devices, i);
+
+      if (device->dev == dev)
+        return device;
     }
 
-  //fprintf (stderr, "run is %d long from [%d to %d)\n", (int)(i-pos), i, (int)pos);
+  /* torrent ids are positive, so these serials can't collide with them */
+  device = tr_new0 (struct cache_device, 1);
+  device->dev = dev;
+  device->serial = -(n + 1);
+  tr_ptrArrayAppend (&cache->devices, device);
+  return device;
+}
+
+static struct cache_torrent *
+getCacheTorrent (tr_cache * cache, tr_torrent * tor)
+{
+  struct cache_torrent * ct = findCacheTorrent (cache, tor);
 
-  if (info != NULL)
+  if (ct == NULL)
     {
-      const struct cache_block * b = blocks[i-1];
-      info->last_block_time = b->time;
-      info->is_piece_done = tr_torrentPieceIsComplete (b->tor, b->piece);
-      info->is_multi_piece = b->piece != blocks[pos]->piece;
-      info->len = i - pos;
-      info->pos = pos;
+      ct = tr_new0 (struct cache_torrent, 1);
+      ct->tor = tor;
+      ct->device = getCacheDevice (cache, tor);
+      tr_ptrArrayInsertSorted (&cache->torrents, ct, compareTorrentId);
     }
 
-  return i-pos;
+  return ct;
+}
+
+static struct cache_run *
+runNew (tr_cache * cache, struct cache_torrent * ct, tr_block_index_t first, tr_block_index_t last)
+{
+  struct cache_run * run = tr_new0 (struct cache_run, 1);
+
+  run->first = first;
+  run->last = last;
+  run->next = ct->runs;
+  if (ct->runs != NULL)
+    ct->runs->prev = run;
+  ct->runs = run;
+  ++cache->run_count;
+
+  return run;
+}
+
+static void
+runFree (tr_cache * cache, struct cache_torrent * ct, struct cache_run * run)
+{
+  if (run->prev != NULL)
+    run->prev->next = run->next;
+  else
+    ct->runs = run->next;
+
+  if (run->next != NULL)
+    run->next->prev = run->prev;
+
+  tr_free (run);
+  --cache->run_count;
+
+  if (ct->runs == NULL)
+    {
+      tr_ptrArrayRemoveSortedPointer (&cache->torrents, ct, compareTorrentId);
+      tr_free (ct);
+    }
+}
+
+/* point the blocks [first...last] at `run' */
+static void
+runClaimBlocks (tr_cache * cache, tr_torrent * tor, struct cache_run * run,
+                tr_block_index_t first, tr_block_index_t last)
+{
+  tr_block_index_t i;
+
+  for (i=first; i<=last; ++i)
+    findBlockByIndex (cache, tor, i)->run = run;
+}
+
+/* add a newly-cached block to the runs, joining its neighbors' runs */
+static void
+runsAddBlock (tr_cache * cache, struct cache_block * cb)
+{
+  struct cache_block * left = NULL;
+  struct cache_block * right;
+  struct cache_torrent * ct = getCacheTorrent (cache, cb->tor);
+
+  ++ct->block_count;
+  ++ct->device->block_count;
+
+  if (cb->block > 0)
+    left = findBlockByIndex (cache, cb->tor, cb->block - 1);
+  right = findBlockByIndex (cache, cb->tor, cb->block + 1);
+
+  if ((left != NULL) && (right != NULL))
+    {
+      /* absorb the smaller run into the larger one */
+      struct cache_run * a = left->run;
+      struct cache_run * b = right->run;
+
+      if (b->last - b->first > a->last - a->first)
+        {
+          b->first = a->first;
+          runClaimBlocks (cache, cb->tor, b, a->first, cb->block - 1);
+          runFree (cache, ct, a);
+          cb->run = b;
+        }
+      else
+        {
+          a->last = b->last;
+          runClaimBlocks (cache, cb->tor, a, cb->block + 1, b->last);
+          runFree (cache, ct, b);
+          cb->run = a;
+        }
+    }
+  else if (left != NULL)
+    {
+      cb->run = left->run;
+      cb->run->last = cb->block;
+    }
+  else if (right != NULL)
+    {
+      cb->run = right->run;
+      cb->run->first = cb->block;
+    }
+  else
+    {
+      cb->run = runNew (cache, ct, cb->block, cb->block);
+    }
+}
+
+/* take the blocks [first...last] out of their run, splitting it if needed */
+static void
+runRemoveBlocks (tr_cache * cache, tr_torrent * tor, struct cache_run * run,
+                 tr_block_index_t first, tr_block_index_t last)
+{
+  struct cache_torrent * ct = findCacheTorrent (cache, tor);
+
+  assert (ct != NULL);
+  assert (run->first <= first);
+  assert (last <= run->last);
+
+  ct->block_count -= last + 1 - first;
+  ct->device->block_count -= last + 1 - first;
+
+  if ((run->first == first) && (run->last == last))
+    {
+      runFree (cache, ct, run);
+    }
+  else if (run->first == first)
+    {
+      run->first = last + 1;
+    }
+  else if (run->last == last)
+    {
+      run->last = first - 1;
+    }
+  else
+    {
+      struct cache_run * tail = runNew (cache, ct, last + 1, run->last);
+      runClaimBlocks (cache, tor, tail, tail->first, tail->last);
+      run->last = first - 1;
+    }
+}
+
+/****
+*****  The read cache
+*****
+*****  Blocks read from disk start out in `probation'. If one's read again
+*****  it's promoted to `hot', so that a single pass over a lot of blocks,
+*****  such as checking a newly-downloaded piece, only pushes out other
+*****  blocks that have been read once. Blocks are dropped from the read
+*****  cache when they're written and when their torrent is flushed.
+****/
+
+static void
+readListRemove (struct read_list * list, struct read_block * rb)
+{
+  if (rb->prev != NULL)
+    rb->prev->next = rb->next;
+  else
+    list->head = rb->next;
+
+  if (rb->next != NULL)
+    rb->next->prev = rb->prev;
+  else
+    list->tail = rb->prev;
+
+  rb->prev = rb->next = NULL;
+  --list->count;
+}
+
+static void
+readListPushFront (struct read_list * list, struct read_block * rb)
+{
+  rb->prev = NULL;
+  rb->next = list->head;
+
+  if (list->head != NULL)
+    list->head->prev = rb;
+  else
+    list->tail = rb;
+
+  list->head = rb;
+  ++list->count;
+}
+
+static inline struct read_list *
+readListOf (tr_cache * cache, const struct read_block * rb)
+{
+  return rb->is_hot ? &cache->hot : &cache->probation;
+}
+
+static inline int
+readBlockCount (const tr_cache * cache)
+{
+  return cache->probation.count + cache->hot.count;
+}
+
+static struct read_block *
+readHashFind (const tr_cache * cache, const tr_torrent * tor, tr_block_index_t block)
+{
+  struct read_block * rb;
+
+  for (rb=cache->read_buckets[hashBlock (cache->read_bucket_count, tor, block)]; rb!=NULL; rb=rb->hash_next)
+    if ((rb->block == block) && (rb->tor == tor))
+      break;
+
+  return rb;
+}
+
+static void
+readRehash (tr_cache * cache, size_t bucket_count)
+{
+  size_t i;
+  struct read_block ** old_buckets = cache->read_buckets;
+  const size_t old_bucket_count = cache->read_bucket_count;
+
+  cache->read_buckets = tr_new0 (struct read_block*, bucket_count);
+  cache->read_bucket_count = bucket_count;
+
+  for (i=0; i<old_bucket_count; ++i)
+    {
+      struct read_block * rb;
+      struct read_block * next;
+
+      for (rb=old_buckets[i]; rb!=NULL; rb=next)
+        {
+          const size_t pos = hashBlock (bucket_count, rb->tor, rb->block);
+          next = rb->hash_next;
+          rb->hash_next = cache->read_buckets[pos];
+          cache->read_buckets[pos] = rb;
+        }
+    }
+
+  tr_free (old_buckets);
+}
+
+static void
+readBlockFree (tr_cache * cache, struct read_block * rb)
+{
+  struct read_block ** walk = &cache->read_buckets[hashBlock (cache->read_bucket_count, rb->tor, rb->block)];
+
+  while (*walk != rb)
+    walk = &(*walk)->hash_next;
+  *walk = rb->hash_next;
+
+  readListRemove (readListOf (cache, rb), rb);
+  tr_free (rb->data);
+  tr_free (rb);
+}
+
+/* demote the least-used hot blocks and evict the least-used blocks
+   until both segments fit */
+static void
+readCacheTrim (tr_cache * cache)
+{
+  const int max_hot = (int)(((int64_t)cache->read_max_blocks * READ_HOT_PERCENT) / 100);
+
+  while (cache->hot.count > max_hot)
+    {
+      struct read_block * rb = cache->hot.tail;
+      readListRemove (&cache->hot, rb);
+      rb->is_hot = false;
+      readListPushFront (&cache->probation, rb);
+    }
+
+  while (readBlockCount (cache) > cache->read_max_blocks)
+    readBlockFree (cache, cache->probation.tail != NULL ? cache->probation.tail : cache->hot.tail);
+}
+
+/* The read cache only holds whole blocks. Returns false if
+   [piece, offset, len] isn't exactly one of the torrent's blocks */
+static bool
+readCacheGetBlock (const tr_torrent  * tor,
+                   tr_piece_index_t    piece,
+                   uint32_t            offset,
+                   uint32_t            len,
+                   tr_block_index_t  * setme)
+{
+  const tr_block_index_t block = _tr_block (tor, piece, offset);
+
+  if ((uint64_t)block * tor->blockSize != (uint64_t)piece * tor->info.pieceSize + offset)
+    return false;
+
+  if (tr_torBlockCountBytes (tor, block) != len)
+    return false;
+
+  *setme = block;
+  return true;
+}
+
+static struct read_block *
+readCacheFind (const tr_cache   * cache,
+               const tr_torrent * tor,
+               tr_piece_index_t   piece,
+               uint32_t           offset,
+               uint32_t           len)
+{
+  tr_block_index_t block;
+
+  if (readBlockCount (cache) == 0)
+    return NULL;
+
+  if (!readCacheGetBlock (tor, piece, offset, len, &block))
+    return NULL;
+
+  return readHashFind (cache, tor, block);
+}
+
+/* a block's been read from the read cache, so move it to the front of `hot' */
+static void
+readCacheTouch (tr_cache * cache, struct read_block * rb)
+{
+  readListRemove (readListOf (cache, rb), rb);
+  rb->is_hot = true;
+  readListPushFront (&cache->hot, rb);
+  readCacheTrim (cache);
+}
+
+static void
+readCacheAdd (tr_cache         * cache,
+              tr_torrent       * tor,
+              tr_piece_index_t   piece,
+              uint32_t           offset,
+              uint32_t           len,
+              const uint8_t    * data)
+{
+  size_t pos;
+  tr_block_index_t block;
+  struct read_block * rb;
+
+  if (cache->read_max_blocks < 1)
+    return;
+  if (!readCacheGetBlock (tor, piece, offset, len, &block))
+    return;
+  if (readHashFind (cache, tor, block) != NULL)
+    return;
+
+  if ((size_t)readBlockCount (cache) >= cache->read_bucket_count)
+    readRehash (cache, cache->read_bucket_count * 2);
+
+  rb = tr_new0 (struct read_block, 1);
+  rb->tor = tor;
+  rb->block = block;
+  rb->length = len;
+  rb->data = tr_memdup (data, len);
+
+  pos = hashBlock (cache->read_bucket_count, tor, block);
+  rb->hash_next = cache->read_buckets[pos];
+  cache->read_buckets[pos] = rb;
+  readListPushFront (&cache->probation, rb);
+
+  readCacheTrim (cache);
+}
+
+static void
+readCacheRemove (tr_cache * cache, const tr_torrent * tor, tr_block_index_t block)
+{
+  struct read_block * rb;
+
+  if ((readBlockCount (cache) > 0) && ((rb = readHashFind (cache, tor, block))))
+    readBlockFree (cache, rb);
+}
+
+static void
+readCacheRemoveList (tr_cache * cache, struct read_list * list, const tr_torrent * tor)
+{
+  struct read_block * rb;
+  struct read_block * next;
+
+  for (rb=list->head; rb!=NULL; rb=next)
+    {
+      next = rb->next;
+
+      if ((tor == NULL) || (rb->tor == tor))
+        readBlockFree (cache, rb);
+    }
+}
+
+/* drop the torrent's blocks, or every block if `tor' is NULL */
+static void
+readCacheRemoveTorrent (tr_cache * cache, const tr_torrent * tor)
+{
+  readCacheRemoveList (cache, &cache->probation, tor);
+  readCacheRemoveList (cache, &cache->hot, tor);
+}
+
+/****
+*****
+****/
+
+struct run_info
+{
+  tr_torrent * tor;
+  struct cache_device * device;
+  struct cache_run * run;
+  int rank;
+  time_t last_block_time;
+  bool is_multi_piece;
+  bool is_piece_done;
+  unsigned len;
+};
+
+static void
+getRunInfo (const tr_cache * cache, tr_torrent * tor, struct cache_run * run, struct run_info * info)
+{
+  const struct cache_block * first = findBlockByIndex (cache, tor, run->first);
+  const struct cache_block * last = findBlockByIndex (cache, tor, run->last);
+
+  info->tor = tor;
+  info->device = NULL;
+  info->run = run;
+  info->last_block_time = last->time;
+  info->is_piece_done = tr_torrentPieceIsComplete (tor, last->piece);
+  info->is_multi_piece = last->piece != first->piece;
+  info->len = run->last + 1 - run->first;
 }
 
 /* higher rank comes before lower rank */
@@ -127,115 +760,351 @@ enum
 {
   MULTIFLAG   = 0x1000,
   DONEFLAG    = 0x2000,
-  SESSIONFLAG = 0x4000
+  SESSIONFLAG = 0x4000,
+  SHAREFLAG   = 0x8000
 };
 
+/* A torrent's share of the cache is weighted by its bandwidth priority:
+ * a high-priority torrent gets four times a low-priority one's share. */
+static inline int
+getShareWeight (const tr_torrent * tor)
+{
+  return 1 << (tr_torrentGetPriority (tor) - TR_PRI_LOW);
+}
+
 /* Calculte runs
+ *   - Runs from torrents that are using more than their share of the cache
+ *     go first, so that one busy torrent can't force everyone else's
+ *     blocks out to disk.
  *   - Stale runs, runs sitting in cache for a long time or runs not growing, get priority.
  *     Returns number of runs.
  */
 static int
 calcRuns (tr_cache * cache, struct run_info * runs)
 {
-  const int n = tr_ptrArraySize (&cache->blocks);
-  int i = 0, pos;
+  int i = 0;
+  int t;
+  int total_weight = 0;
+  const int n = tr_ptrArraySize (&cache->torrents);
   const time_t now = tr_time ();
 
-  for (pos = 0; pos < n; pos += runs[i++].len)
+  for (t=0; t<n; ++t)
+    total_weight += getShareWeight (((struct cache_torrent*)tr_ptrArrayNth (&cache->torrents, t))->tor);
+
+  for (t=0; t<n; ++t)
     {
-      int rank = getBlockRun (cache, pos, &runs[i]);
+      struct cache_run * run;
+      struct cache_torrent * ct = tr_ptrArrayNth (&cache->torrents, t);
+      const int64_t share = ((int64_t)cache->max_blocks * getShareWeight (ct->tor)) / total_weight;
+      const bool is_over_share = ct->block_count > share;
+
+      for (run=ct->runs; run!=NULL; run=run->next, ++i)
+        {
+          int rank;
+
+          getRunInfo (cache, ct->tor, run, &runs[i]);
+          runs[i].device = ct->device;
+          rank = runs[i].len;
 
-      /* This adds ~2 to the relative length of a run for every minute it has
-       * languished in the cache. */
-      rank += (now - runs[i].last_block_time) / 32;
+          /* This adds ~2 to the relative length of a run for every minute it has
+           * languished in the cache. */
+          rank += (now - runs[i].last_block_time) / 32;
 
-      /* Flushing stale blocks should be a top priority as the probability of them
-       * growing is very small, for blocks on piece boundaries, and nonexistant for
-       * blocks inside pieces. */
-      rank |= runs[i].is_piece_done ? DONEFLAG : 0;
+          /* Flushing stale blocks should be a top priority as the probability of them
+           * growing is very small, for blocks on piece boundaries, and nonexistant for
+           * blocks inside pieces. */
+          rank |= runs[i].is_piece_done ? DONEFLAG : 0;
 
-      /* Move the multi piece runs higher */
-      rank |= runs[i].is_multi_piece ? MULTIFLAG : 0;
+          /* Move the multi piece runs higher */
+          rank |= runs[i].is_multi_piece ? MULTIFLAG : 0;
 
-      runs[i].rank = rank;
+          rank |= is_over_share ? SHAREFLAG : 0;
 
-      //fprintf (stderr,"block run at pos %d of length %d and age %ld adjusted +%d\n",runs[i].pos,runs[i].len,now-runs[i].last_block_time,rank-runs[i].len);
+          runs[i].rank = rank;
+        }
     }
 
-  //fprintf (stderr, "%d block runs\n", i);
+  assert (i == cache->run_count);
   qsort (runs, i, sizeof (struct run_info), compareRuns);
   return i;
 }
 
-static int
-flushContiguous (tr_cache * cache, int pos, int n)
+static void
+reapWrite (tr_cache * cache, tr_session * session, struct cache_write * w)
+{
+  tr_torrent * tor;
+
+  assert (!w->reaped);
+
+  tr_list_remove_data (&cache->writes, w);
+  w->reaped = true;
+  w->device->write_bytes -= w->length;
+
+  if (w->err && ((tor = tr_torrentFindFromId (session, w->torrent_id))))
+    {
+      const tr_file * file = &tor->info.files[w->failed_file];
+
+      tr_logAddTorErr (tor, "write failed for \"%s\": %s", file->name, tr_strerror (w->err));
+
+      if (tor->error != TR_STAT_LOCAL_ERROR)
+        {
+          char * path = tr_buildPath (tor->downloadDir, file->name, NULL);
+          tr_torrentSetLocalError (tor, "%s (%s)", tr_strerror (w->err), path);
+          tr_free (path);
+        }
+    }
+}
+
+/* wait for the torrent's background writes to land on disk */
+static void
+waitForWrites (tr_cache * cache, tr_torrent * tor)
+{
+  tr_list * l;
+  tr_list * next;
+
+  for (l=cache->writes; l!=NULL; l=l->next)
+    {
+      const struct cache_write * w = l->data;
+
+      if (w->torrent_id == tor->uniqueId)
+        tr_diskIoWait (tor->session->diskIo, w->device->serial);
+    }
+
+  for (l=cache->writes; l!=NULL; l=next)
+    {
+      struct cache_write * w = l->data;
+      next = l->next;
+
+      if (w->torrent_id == tor->uniqueId)
+        reapWrite (cache, tor->session, w);
+    }
+}
+
+static void
+cacheWriteFunc (void * vw)
+{
+  struct cache_write * w = vw;
+
+  w->err = tr_ioRequestRunv (w->req, w->vec, w->vec_count, &w->failed_file);
+}
+
+static void
+freeBuffers (struct evbuffer ** bufs, int n)
 {
   int i;
+
+  for (i=0; i<n; ++i)
+    evbuffer_free (bufs[i]);
+
+  tr_free (bufs);
+}
+
+static void
+cacheWriteDone (tr_session * session, void * vw)
+{
+  struct cache_write * w = vw;
+
+  if (!w->reaped)
+    reapWrite (session->cache, session, w);
+
+  tr_ioRequestFree (w->req);
+  freeBuffers (w->bufs, w->last_block + 1 - w->first_block);
+  tr_free (w->vec);
+  tr_free (w);
+}
+
+/* Find the newest copy of a block that's still being written to disk */
+static struct evbuffer *
+findWrite (tr_cache * cache, tr_torrent * torrent, tr_block_index_t block)
+{
+  tr_list * l;
+  struct evbuffer * ret = NULL;
+
+  for (l=cache->writes; l!=NULL; l=l->next)
+    {
+      const struct cache_write * w = l->data;
+
+      if ((w->torrent_id == torrent->uniqueId) && (w->first_block <= block) && (block <= w->last_block))
+        ret = w->bufs[block - w->first_block];
+    }
+
+  return ret;
+}
+
+/* Write the cached blocks [first...last], which are all part of `run'.
+ * The blocks' evbuffer chains are written as they are, with no copying.
+ * If `async' is true and the session has a disk I/O pool, the blocks are
+ * written in the background; until they land, findWrite () can see them. */
+static int
+flushContiguous (tr_cache * cache, tr_torrent * tor, struct cache_run * run,
+                 tr_block_index_t first, tr_block_index_t last, bool async)
+{
+  tr_block_index_t i;
+  int j, k;
   int err = 0;
-  uint8_t * buf = tr_new (uint8_t, n * MAX_BLOCK_SIZE);
-  uint8_t * walk = buf;
-  struct cache_block ** blocks = (struct cache_block**) tr_ptrArrayBase (&cache->blocks);
+  int vec_count = 0;
+  uint32_t length = 0;
+  const int n = last + 1 - first;
+  struct evbuffer ** bufs = tr_new (struct evbuffer*, n);
+  struct evbuffer_iovec * vec;
 
-  struct cache_block * b = blocks[pos];
-  tr_torrent * tor = b->tor;
+  struct cache_block * b = findBlockByIndex (cache, tor, first);
   const tr_piece_index_t piece = b->piece;
   const uint32_t offset = b->offset;
+  struct cache_device * device = findCacheTorrent (cache, tor)->device;
 
-  for (i=pos; i<pos+n; ++i)
+  runRemoveBlocks (cache, tor, run, first, last);
+
+  for (i=first; i<=last; ++i)
     {
-      b = blocks[i];
-      evbuffer_copyout (b->evbuf, walk, b->length);
-      walk += b->length;
-      evbuffer_free (b->evbuf);
+      b = findBlockByIndex (cache, tor, i);
+      hashRemove (cache, b);
+      bufs[i - first] = b->evbuf;
+      length += b->length;
+      vec_count += evbuffer_peek (b->evbuf, -1, NULL, NULL, 0);
       tr_free (b);
     }
-  tr_ptrArrayErase (&cache->blocks, pos, pos+n);
 
-  err = tr_ioWrite (tor, piece, offset, walk-buf, buf);
-  tr_free (buf);
+  vec = tr_new (struct evbuffer_iovec, vec_count);
+  for (j=0, k=0; j<n; ++j)
+    k += evbuffer_peek (bufs[j], -1, NULL, vec + k, vec_count - k);
+  assert (k == vec_count);
 
   ++cache->disk_writes;
-  cache->disk_write_bytes += walk-buf;
+  cache->disk_write_bytes += length;
+
+  if (async && tr_diskIoIsEnabled (tor->session->diskIo))
+    {
+      tr_io_request * req = tr_ioRequestNew (tor, true, piece, offset, length, &err);
+
+      if (req != NULL)
+        {
+          struct cache_write * w = tr_new0 (struct cache_write, 1);
+          w->torrent_id = tor->uniqueId;
+          w->device = device;
+          w->first_block = first;
+          w->last_block = last;
+          w->bufs = bufs;
+          w->vec = vec;
+          w->vec_count = vec_count;
+          w->length = length;
+          w->req = req;
+          tr_list_append (&cache->writes, w);
+          device->write_bytes += w->length;
+          tr_diskIoAdd (tor->session->diskIo, device->serial, cacheWriteFunc, cacheWriteDone, w);
+          return 0;
+        }
+    }
+
+  /* write it here. The torrent's background writes go first,
+     so that they can't land on top of these newer blocks */
+  waitForWrites (cache, tor);
+  err = tr_ioWritev (tor, piece, offset, vec, vec_count);
+  freeBuffers (bufs, n);
+  tr_free (vec);
   return err;
 }
 
 static int
-flushRuns (tr_cache * cache, struct run_info * runs, int n)
+flushRun (tr_cache * cache, tr_torrent * tor, struct cache_run * run, bool async)
+{
+  return flushContiguous (cache, tor, run, run->first, run->last, async);
+}
+
+static int
+flushRuns (tr_cache * cache, struct run_info * runs, int n, bool async)
 {
   int i;
   int err = 0;
 
   for (i=0; !err && i<n; i++)
-    {
-      int j;
+    err = flushRun (cache, runs[i].tor, runs[i].run, async);
+
+  return err;
+}
+
+/* group the runs by device, and then in the order they go on disk */
+static int
+compareRunsByDevice (const void * va, const void * vb)
+{
+  const struct run_info * a = va;
+  const struct run_info * b = vb;
+
+  if (a->device->serial != b->device->serial)
+    return a->device->serial > b->device->serial ? -1 : 1;
 
-      err = flushContiguous (cache, runs[i].pos, runs[i].len);
+  if (a->tor->uniqueId != b->tor->uniqueId)
+    return a->tor->uniqueId < b->tor->uniqueId ? -1 : 1;
 
-      for (j=i+1; j<n; j++)
-        if (runs[j].pos > runs[i].pos)
-          runs[j].pos -= runs[i].len;
+  if (a->run->first != b->run->first)
+    return a->run->first < b->run->first ? -1 : 1;
+
+  return 0;
+}
+
+/* How much can be queued up to be written to one device.
+ * The devices with blocks in the cache or on their way to disk split
+ * the cache evenly, so that one slow disk can't tie all of it up.
+ * Past its share, a device's blocks wait in the cache instead of
+ * piling onto a disk that can't keep up. */
+static size_t
+getMaxDeviceWriteBytes (tr_cache * cache)
+{
+  int i, n;
+  int active = 0;
+
+  for (i=0, n=tr_ptrArraySize (&cache->devices); i<n; ++i)
+    {
+      const struct cache_device * device = tr_ptrArrayNth (&cache->devices, i);
+
+      if ((device->block_count > 0) || (device->write_bytes > 0))
+        ++active;
     }
 
-  return err;
+  return MAX (cache->max_bytes / MAX (active, 1), 4 * MAX_BLOCK_SIZE);
 }
 
 static int
-cacheTrim (tr_cache * cache)
+cacheTrim (tr_cache * cache, bool async)
 {
   int err = 0;
 
-  if (tr_ptrArraySize (&cache->blocks) > cache->max_blocks)
+  if (cache->block_count > cache->max_blocks)
     {
       /* Amount of cache that should be removed by the flush. This influences how large
        * runs can grow as well as how often flushes will happen. */
       const int cacheCutoff = 1 + cache->max_blocks / 4;
-      struct run_info * runs = tr_new (struct run_info, tr_ptrArraySize (&cache->blocks));
-      int i=0, j=0;
+      const size_t maxDeviceBytes = getMaxDeviceWriteBytes (cache);
+      struct run_info * runs = tr_new (struct run_info, cache->run_count);
+      int i, n, t, j=0, k=0;
+
+      /* if the cache has grown to twice its size, the devices'
+         write queues will have to grow instead */
+      const bool mustFlush = !async || (cache->block_count > 2 * cache->max_blocks);
+
+      for (t=0, n=tr_ptrArraySize (&cache->devices); t<n; ++t)
+        ((struct cache_device*)tr_ptrArrayNth (&cache->devices, t))->trim_bytes = 0;
 
-      calcRuns (cache, runs);
-      while (j < cacheCutoff)
-        j += runs[i++].len;
-      err = flushRuns (cache, runs, i);
+      /* pick the best runs, skipping devices whose queues are full */
+      n = calcRuns (cache, runs);
+      for (i=0; i<n && j<cacheCutoff; ++i)
+        {
+          struct cache_device * device = runs[i].device;
+          const size_t bytes = (size_t)runs[i].len * runs[i].tor->blockSize;
+          const size_t queued = device->write_bytes + device->trim_bytes;
+
+          /* an idle device always takes the run, however big it is */
+          if (!mustFlush && (queued > 0) && (queued + bytes > maxDeviceBytes))
+            continue;
+
+          device->trim_bytes += bytes;
+          j += runs[i].len;
+          runs[k++] = runs[i];
+        }
+
+      /* write each device's runs together */
+      qsort (runs, k, sizeof (struct run_info), compareRunsByDevice);
+      err = flushRuns (cache, runs, k, async);
       tr_free (runs);
     }
 
@@ -263,7 +1132,7 @@ tr_cacheSetLimit (tr_cache * cache, int64_t max_bytes)
   tr_formatter_mem_B (buf, cache->max_bytes, sizeof (buf));
   tr_logAddNamedDbg (MY_NAME, "Maximum cache size set to %s (%d blocks)", buf, cache->max_blocks);
 
-  return cacheTrim (cache);
+  return cacheTrim (cache, false);
 }
 
 int64_t
@@ -272,21 +1141,74 @@ tr_cacheGetLimit (const tr_cache * cache)
   return cache->max_bytes;
 }
 
+void
+tr_cacheSetReadLimit (tr_cache * cache, int64_t max_bytes)
+{
+  char buf[128];
+
+  cache->read_max_bytes = max_bytes;
+  cache->read_max_blocks = getMaxBlocks (max_bytes);
+
+  tr_formatter_mem_B (buf, cache->read_max_bytes, sizeof (buf));
+  tr_logAddNamedDbg (MY_NAME, "Maximum read cache size set to %s (%d blocks)", buf, cache->read_max_blocks);
+
+  readCacheTrim (cache);
+}
+
+int64_t
+tr_cacheGetReadLimit (const tr_cache * cache)
+{
+  return cache->read_max_bytes;
+}
+
+size_t
+tr_cacheGetDeviceWriteBytes (tr_cache * cache, const tr_torrent * tor)
+{
+  return getCacheDevice (cache, tor)->write_bytes;
+}
+
+void
+tr_cacheSetDeviceFunc (tr_cache * cache, tr_cache_device_func func)
+{
+  assert (tr_ptrArrayEmpty (&cache->devices));
+
+  cache->device_func = func != NULL ? func : getTorrentDevice;
+}
+
+void
+tr_cacheGetReadStats (const tr_cache * cache, uint64_t * setme_hits, uint64_t * setme_misses)
+{
+  *setme_hits = cache->read_hits;
+  *setme_misses = cache->read_misses;
+}
+
 tr_cache *
 tr_cacheNew (int64_t max_bytes)
 {
   tr_cache * cache = tr_new0 (tr_cache, 1);
-  cache->blocks = TR_PTR_ARRAY_INIT;
+  cache->buckets = tr_new0 (struct cache_block*, MIN_BUCKET_COUNT);
+  cache->bucket_count = MIN_BUCKET_COUNT;
+  cache->torrents = TR_PTR_ARRAY_INIT;
+  cache->devices = TR_PTR_ARRAY_INIT;
+  cache->device_func = getTorrentDevice;
   cache->max_bytes = max_bytes;
   cache->max_blocks = getMaxBlocks (max_bytes);
+  cache->read_buckets = tr_new0 (struct read_block*, MIN_BUCKET_COUNT);
+  cache->read_bucket_count = MIN_BUCKET_COUNT;
   return cache;
 }
 
 void
 tr_cacheFree (tr_cache * cache)
 {
-  assert (tr_ptrArrayEmpty (&cache->blocks));
-  tr_ptrArrayDestruct (&cache->blocks, NULL);
+  assert (cache->block_count == 0);
+  assert (tr_ptrArrayEmpty (&cache->torrents));
+  assert (cache->writes == NULL);
+  readCacheRemoveTorrent (cache, NULL);
+  tr_ptrArrayDestruct (&cache->torrents, NULL);
+  tr_ptrArrayDestruct (&cache->devices, tr_free);
+  tr_free (cache->read_buckets);
+  tr_free (cache->buckets);
   tr_free (cache);
 }
 
@@ -294,34 +1216,13 @@ tr_cacheFree (tr_cache * cache)
 ****
 ***/
 
-static int
-cache_block_compare (const void * va, const void * vb)
-{
-  const struct cache_block * a = va;
-  const struct cache_block * b = vb;
-
-  /* primary key: torrent id */
-  if (a->tor->uniqueId != b->tor->uniqueId)
-    return a->tor->uniqueId < b->tor->uniqueId ? -1 : 1;
-
-  /* secondary key: block # */
-  if (a->block != b->block)
-    return a->block < b->block ? -1 : 1;
-
-  /* they're equal */
-  return 0;
-}
-
 static struct cache_block *
 findBlock (tr_cache           * cache,
            tr_torrent         * torrent,
            tr_piece_index_t     piece,
            uint32_t             offset)
 {
-  struct cache_block key;
-  key.tor = torrent;
-  key.block = _tr_block (torrent, piece, offset);
-  return tr_ptrArrayFindSorted (&cache->blocks, &key, cache_block_compare);
+  return findBlockByIndex (cache, torrent, _tr_block (torrent, piece, offset));
 }
 
 int
@@ -338,18 +1239,22 @@ tr_cacheWriteBlock (tr_cache         * cache,
 
   if (cb == NULL)
     {
-      cb = tr_new (struct cache_block, 1);
+      cb = tr_new0 (struct cache_block, 1);
       cb->tor = torrent;
       cb->piece = piece;
       cb->offset = offset;
       cb->length = length;
       cb->block = _tr_block (torrent, piece, offset);
       cb->evbuf = evbuffer_new ();
-      tr_ptrArrayInsertSorted (&cache->blocks, cb, cache_block_compare);
+      hashInsert (cache, cb);
+      runsAddBlock (cache, cb);
     }
 
   cb->time = tr_time ();
 
+  /* the read cache's copy is out of date now */
+  readCacheRemove (cache, torrent, cb->block);
+
   assert (cb->length == length);
   evbuffer_drain (cb->evbuf, evbuffer_get_length (cb->evbuf));
   evbuffer_remove_buffer (writeme, cb->evbuf, cb->length);
@@ -357,7 +1262,24 @@ tr_cacheWriteBlock (tr_cache         * cache,
   cache->cache_writes++;
   cache->cache_write_bytes += cb->length;
 
-  return cacheTrim (cache);
+  return cacheTrim (cache, true);
+}
+
+/* read a block from disk and remember it in the read cache */
+static int
+readThrough (tr_cache         * cache,
+             tr_torrent       * torrent,
+             tr_piece_index_t   piece,
+             uint32_t           offset,
+             uint32_t           len,
+             uint8_t          * setme)
+{
+  const int err = tr_ioRead (torrent, piece, offset, len, setme);
+
+  if (!err)
+    readCacheAdd (cache, torrent, piece, offset, len, setme);
+
+  return err;
 }
 
 int
@@ -369,12 +1291,78 @@ tr_cacheReadBlock (tr_cache         * cache,
                    uint8_t          * setme)
 {
   int err = 0;
+  struct evbuffer * pending;
+  struct read_block * rb;
   struct cache_block * cb = findBlock (cache, torrent, piece, offset);
 
   if (cb)
-    evbuffer_copyout (cb->evbuf, setme, len);
+    {
+      evbuffer_copyout (cb->evbuf, setme, len);
+    }
+  else if ((pending = findWrite (cache, torrent, _tr_block (torrent, piece, offset))))
+    {
+      evbuffer_copyout (pending, setme, len);
+    }
+  else if ((rb = readCacheFind (cache, torrent, piece, offset, len)))
+    {
+      ++cache->read_hits;
+      memcpy (setme, rb->data, len);
+      readCacheTouch (cache, rb);
+    }
+  else
+    {
+      ++cache->read_misses;
+      err = readThrough (cache, torrent, piece, offset, len, setme);
+    }
+
+  return err;
+}
+
+int
+tr_cacheReadBlockToBuffer (tr_cache         * cache,
+                           tr_torrent       * torrent,
+                           tr_piece_index_t   piece,
+                           uint32_t           offset,
+                           uint32_t           len,
+                           struct evbuffer  * buf,
+                           bool               allowSendfile)
+{
+  int err = 0;
+  struct evbuffer * pending = NULL;
+  struct read_block * rb;
+  struct evbuffer_iovec iovec[1];
+  const tr_session * session = torrent->session;
+  struct cache_block * cb = findBlock (cache, torrent, piece, offset);
+
+  if (cb || ((pending = findWrite (cache, torrent, _tr_block (torrent, piece, offset)))))
+    {
+      evbuffer_reserve_space (buf, len, iovec, 1);
+      evbuffer_copyout (cb ? cb->evbuf : pending, iovec[0].iov_base, len);
+      iovec[0].iov_len = len;
+      evbuffer_commit_space (buf, iovec, 1);
+    }
+  else if ((rb = readCacheFind (cache, torrent, piece, offset, len)))
+    {
+      ++cache->read_hits;
+      evbuffer_add (buf, rb->data, len);
+      readCacheTouch (cache, rb);
+    }
+  else if (!session->isMmapEnabled && !(allowSendfile && session->isSendfileEnabled))
+    {
+      /* it's going to be copied anyway, so copy it through the read cache */
+      ++cache->read_misses;
+      evbuffer_reserve_space (buf, len, iovec, 1);
+      if (!(err = readThrough (cache, torrent, piece, offset, len, iovec[0].iov_base)))
+        {
+          iovec[0].iov_len = len;
+          evbuffer_commit_space (buf, iovec, 1);
+        }
+    }
   else
-    err = tr_ioRead (torrent, piece, offset, len, setme);
+    {
+      ++cache->read_misses;
+      err = tr_ioReadToBuffer (torrent, piece, offset, len, buf, allowSendfile);
+    }
 
   return err;
 }
@@ -389,42 +1377,70 @@ tr_cachePrefetchBlock (tr_cache         * cache,
   int err = 0;
   struct cache_block * cb = findBlock (cache, torrent, piece, offset);
 
-  if (cb == NULL)
+  if ((cb == NULL)
+      && !findWrite (cache, torrent, _tr_block (torrent, piece, offset))
+      && !readCacheFind (cache, torrent, piece, offset, len))
     err = tr_ioPrefetch (torrent, piece, offset, len);
 
   return err;
 }
 
-/***
-****
-***/
+bool
+tr_cacheHasBlock (tr_cache         * cache,
+                  tr_torrent       * torrent,
+                  tr_piece_index_t   piece,
+                  uint32_t           offset,
+                  uint32_t           len)
+{
+  return (findBlock (cache, torrent, piece, offset) != NULL)
+      || (findWrite (cache, torrent, _tr_block (torrent, piece, offset)) != NULL)
+      || (readCacheFind (cache, torrent, piece, offset, len) != NULL);
+}
 
-static int
-findBlockPos (tr_cache * cache, tr_torrent * torrent, tr_piece_index_t block)
+void
+tr_cacheAddReadBlock (tr_cache         * cache,
+                      tr_torrent       * torrent,
+                      tr_piece_index_t   piece,
+                      uint32_t           offset,
+                      uint32_t           len,
+                      const uint8_t    * data)
 {
-  struct cache_block key;
-  key.tor = torrent;
-  key.block = block;
-  return tr_ptrArrayLowerBound (&cache->blocks, &key, cache_block_compare, NULL);
+  const tr_block_index_t block = _tr_block (torrent, piece, offset);
+
+  ++cache->read_misses;
+
+  /* if the block's been written since it was read, `data' is stale */
+  if ((findBlockByIndex (cache, torrent, block) == NULL) && (findWrite (cache, torrent, block) == NULL))
+    readCacheAdd (cache, torrent, piece, offset, len, data);
 }
 
+/***
+****
+***/
+
 int tr_cacheFlushDone (tr_cache * cache)
 {
   int err = 0;
 
-  if (tr_ptrArraySize (&cache->blocks) > 0)
+  if (cache->run_count > 0)
     {
-      int i, n;
+      int i, k, n;
       struct run_info * runs;
 
-      runs = tr_new (struct run_info, tr_ptrArraySize (&cache->blocks));
-      i = 0;
+      runs = tr_new (struct run_info, cache->run_count);
       n = calcRuns (cache, runs);
 
-      while (i < n && (runs[i].is_piece_done || runs[i].is_multi_piece))
-        runs[i++].rank |= SESSIONFLAG;
-
-      err = flushRuns (cache, runs, i);
+      /* runs from torrents over their share sort first whether they're
+         done or not, so pick out the done ones instead of stopping at
+         the first run that isn't */
+      for (i=k=0; i<n; ++i)
+        if (runs[i].is_piece_done || runs[i].is_multi_piece)
+          {
+            runs[i].rank |= SESSIONFLAG;
+            runs[k++] = runs[i];
+          }
+
+      err = flushRuns (cache, runs, k, false);
       tr_free (runs);
     }
 
@@ -434,47 +1450,47 @@ int tr_cacheFlushDone (tr_cache * cache)
 int
 tr_cacheFlushFile (tr_cache * cache, tr_torrent * torrent, tr_file_index_t i)
 {
-  int pos;
   int err = 0;
   tr_block_index_t first;
   tr_block_index_t last;
+  struct cache_torrent * ct;
 
   tr_torGetFileBlockRange (torrent, i, &first, &last);
-  pos = findBlockPos (cache, torrent, first);
   dbgmsg ("flushing file %d from cache to disk: blocks [%"TR_PRIuSIZE"...%"TR_PRIuSIZE"]", (int)i, (size_t)first, (size_t)last);
 
   /* flush out all the blocks in that file */
-  while (!err && (pos < tr_ptrArraySize (&cache->blocks)))
+  if ((ct = findCacheTorrent (cache, torrent)))
     {
-      const struct cache_block * b = tr_ptrArrayNth (&cache->blocks, pos);
-
-      if (b->tor != torrent)
-        break;
-      if ((b->block < first) || (b->block > last))
-        break;
-
-      err = flushContiguous (cache, pos, getBlockRun (cache, pos, NULL));
+      struct cache_run * run;
+      struct cache_run * next;
+
+      /* flushing can free `run' -- and `ct', along with its last run --
+         so don't touch either of them afterwards */
+      for (run=ct->runs; !err && run!=NULL; run=next)
+        {
+          next = run->next;
+
+          if ((run->last >= first) && (run->first <= last))
+            err = flushContiguous (cache, torrent, run, MAX (first, run->first), MIN (last, run->last), false);
+        }
     }
 
-    return err;
+  waitForWrites (cache, torrent);
+  return err;
 }
 
 int
 tr_cacheFlushTorrent (tr_cache * cache, tr_torrent * torrent)
 {
   int err = 0;
-  const int pos = findBlockPos (cache, torrent, 0);
-
-  /* flush out all the blocks in that torrent */
-  while (!err && (pos < tr_ptrArraySize (&cache->blocks)))
-    {
-      const struct cache_block * b = tr_ptrArrayNth (&cache->blocks, pos);
-
-      if (b->tor != torrent)
-        break;
+  struct cache_torrent * ct;
 
-      err = flushContiguous (cache, pos, getBlockRun (cache, pos, NULL));
-    }
+  /* flush out all the blocks in that torrent.
+     the last flush frees `ct', so look it up each time */
+  while (!err && ((ct = findCacheTorrent (cache, torrent))))
+    err = flushRun (cache, torrent, ct->runs, false);
 
+  waitForWrites (cache, torrent);
+  readCacheRemoveTorrent (cache, torrent);
   return err;
 }
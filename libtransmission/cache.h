@@ -17,10 +17,15 @@
 #ifndef TR_CACHE_H
 #define TR_CACHE_H
 
+#include <sys/types.h> /* dev_t */
+
 struct evbuffer;
 
 typedef struct tr_cache tr_cache;
 
+/** @brief Returns the device that holds a torrent's files */
+typedef dev_t (*tr_cache_device_func)(const tr_torrent * tor);
+
 /***
 ****
 ***/
@@ -37,6 +42,30 @@ int tr_cacheSetLimit (tr_cache * cache, int64_t max_bytes);
 
 int64_t tr_cacheGetLimit (const tr_cache *);
 
+/** @brief Set the size of the read cache, which keeps blocks that were
+    recently read from disk. It's separate from the blocks waiting to be
+    written, which tr_cacheSetLimit () governs. */
+void tr_cacheSetReadLimit (tr_cache * cache, int64_t max_bytes);
+
+int64_t tr_cacheGetReadLimit (const tr_cache *);
+
+/** @brief Get how many reads were served by the read cache,
+    and how many had to go to the disk */
+void tr_cacheGetReadStats (const tr_cache  * cache,
+                           uint64_t        * setme_hits,
+                           uint64_t        * setme_misses);
+
+/** @brief Get how many bytes are being written in the background
+    to the device that holds the torrent's files */
+size_t tr_cacheGetDeviceWriteBytes (tr_cache          * cache,
+                                    const tr_torrent  * tor);
+
+/** @brief Change how the cache finds the device that holds a torrent's
+    files, or restore the default if `func' is NULL. Writes are throttled
+    per device. Must be called before anything is cached; for tests. */
+void tr_cacheSetDeviceFunc (tr_cache              * cache,
+                            tr_cache_device_func    func);
+
 int tr_cacheWriteBlock (tr_cache         * cache,
                         tr_torrent       * torrent,
                         tr_piece_index_t   piece,
@@ -51,12 +80,42 @@ int tr_cacheReadBlock (tr_cache         * cache,
                        uint32_t           len,
                        uint8_t          * setme);
 
+/**
+ * Like tr_cacheReadBlock (), but appends the block to `buf'.
+ * Blocks that aren't in the cache may be added by reference to
+ * a mapped file or as a file segment; see tr_ioReadToBuffer ().
+ */
+int tr_cacheReadBlockToBuffer (tr_cache         * cache,
+                               tr_torrent       * torrent,
+                               tr_piece_index_t   piece,
+                               uint32_t           offset,
+                               uint32_t           len,
+                               struct evbuffer  * buf,
+                               bool               allowSendfile);
+
 int tr_cachePrefetchBlock (tr_cache         * cache,
                            tr_torrent       * torrent,
                            tr_piece_index_t   piece,
                            uint32_t           offset,
                            uint32_t           len);
 
+/** @brief Returns true if the block can be read without touching the disk:
+    it's in the cache, in the read cache, or still being written to disk */
+bool tr_cacheHasBlock (tr_cache         * cache,
+                       tr_torrent       * torrent,
+                       tr_piece_index_t   piece,
+                       uint32_t           offset,
+                       uint32_t           len);
+
+/** @brief Remember a block that missed the cache and was read from disk
+    somewhere else, such as by a tr_disk_io worker */
+void tr_cacheAddReadBlock (tr_cache         * cache,
+                           tr_torrent       * torrent,
+                           tr_piece_index_t   piece,
+                           uint32_t           offset,
+                           uint32_t           len,
+                           const uint8_t    * data);
+
 /***
 ****
 ***/
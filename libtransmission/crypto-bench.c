@@ -0,0 +1,263 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+/* A microbenchmark for encrypted peer I/O and piece hashing. It isn't
+ * one of the tests; build it with `make crypto-bench' and run it by hand.
+ *
+ * The RC4 rows push the same bytes through RC4 a different way:
+ *   - "flat" is one RC4 () call over a contiguous array, as an upper bound;
+ *   - "per-chunk" peeks at one evbuffer chain at a time, the way
+ *     peer-io.c used to;
+ *   - "whole-buffer" is tr_cryptoEncryptBuffer () and tr_cryptoDecryptBuffer ().
+ *
+ * The SHA1 rows hash the same pieces one at a time with tr_sha1_init ()
+ * and friends, then together with tr_sha1_many (), using whichever SHA1
+ * backend libtransmission was configured with.
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* atoi () */
+#include <string.h> /* memset () */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "crypto.h"
+#include "crypto-utils.h"
+#include "utils.h" /* tr_time_msec () */
+
+#define BLOCK_SIZE (16 * 1024)
+#define MESSAGE_HEADER_LEN 13
+#define READ_SIZE 4096 /* about what evbuffer_read () adds per chain */
+#define BUFFER_LEN (4 * 1024 * 1024)
+#define PIECE_SIZE (256 * 1024)
+#define PIECE_COUNT (BUFFER_LEN / PIECE_SIZE)
+
+static const uint8_t torrentHash[SHA_DIGEST_LENGTH] = "0123456789abcdefghi";
+
+static void
+cryptoInit (tr_crypto * crypto)
+{
+  int len;
+  tr_crypto peer;
+
+  tr_cryptoConstruct (crypto, torrentHash, false);
+  tr_cryptoConstruct (&peer, torrentHash, true);
+  tr_cryptoComputeSecret (crypto, tr_cryptoGetMyPublicKey (&peer, &len));
+  tr_cryptoEncryptInit (crypto);
+  tr_cryptoDecryptInit (crypto);
+  tr_cryptoDestruct (&peer);
+}
+
+/* what peer-msgs hands peer-io when it uploads: a header and a block per message */
+static struct evbuffer *
+newOutgoingBuffer (const uint8_t * block)
+{
+  struct evbuffer * buf = evbuffer_new ();
+
+  while (evbuffer_get_length (buf) < BUFFER_LEN)
+    {
+      uint8_t header[MESSAGE_HEADER_LEN];
+      struct evbuffer * msg = evbuffer_new ();
+      memset (header, 0, sizeof (header));
+      evbuffer_add (msg, header, sizeof (header));
+      evbuffer_add (msg, block, BLOCK_SIZE);
+      evbuffer_add_buffer (buf, msg);
+      evbuffer_free (msg);
+    }
+
+  return buf;
+}
+
+/* what evbuffer_read () leaves in the input buffer when downloading */
+static struct evbuffer *
+newIncomingBuffer (const uint8_t * block)
+{
+  struct evbuffer * buf = evbuffer_new ();
+
+  while (evbuffer_get_length (buf) < BUFFER_LEN)
+    {
+      struct evbuffer * tmp = evbuffer_new ();
+      evbuffer_add (tmp, block, READ_SIZE);
+      evbuffer_add_buffer (buf, tmp);
+      evbuffer_free (tmp);
+    }
+
+  return buf;
+}
+
+static void
+encryptPerChunk (tr_crypto * crypto, struct evbuffer * buf)
+{
+  struct evbuffer_ptr pos;
+  struct evbuffer_iovec iovec;
+
+  evbuffer_ptr_set (buf, &pos, 0, EVBUFFER_PTR_SET);
+  do {
+    evbuffer_peek (buf, -1, &pos, &iovec, 1);
+    tr_cryptoEncrypt (crypto, iovec.iov_len, iovec.iov_base, iovec.iov_base);
+  } while (!evbuffer_ptr_set (buf, &pos, iovec.iov_len, EVBUFFER_PTR_ADD));
+}
+
+static void
+decryptPerChunk (tr_crypto * crypto, struct evbuffer * inbuf, struct evbuffer * outbuf, size_t byteCount)
+{
+  struct evbuffer * tmp;
+  struct evbuffer_ptr pos;
+  struct evbuffer_iovec iovec;
+  const size_t old_length = evbuffer_get_length (outbuf);
+
+  tmp = evbuffer_new ();
+  evbuffer_remove_buffer (inbuf, tmp, byteCount);
+  evbuffer_add_buffer (outbuf, tmp);
+  evbuffer_free (tmp);
+
+  evbuffer_ptr_set (outbuf, &pos, old_length, EVBUFFER_PTR_SET);
+  do {
+    evbuffer_peek (outbuf, byteCount, &pos, &iovec, 1);
+    tr_cryptoDecrypt (crypto, iovec.iov_len, iovec.iov_base, iovec.iov_base);
+  } while (!evbuffer_ptr_set (outbuf, &pos, iovec.iov_len, EVBUFFER_PTR_ADD));
+}
+
+static void
+decryptWholeBuffer (tr_crypto * crypto, struct evbuffer * inbuf, struct evbuffer * outbuf, size_t byteCount)
+{
+  const size_t old_length = evbuffer_get_length (outbuf);
+
+  evbuffer_remove_buffer (inbuf, outbuf, byteCount);
+  tr_cryptoDecryptBuffer (crypto, outbuf, old_length, byteCount);
+}
+
+static void
+report (const char * name, uint64_t bytes, uint64_t msec)
+{
+  printf ("%-24s %8.1f MiB/s\n", name,
+          msec ? (bytes / (1024.0 * 1024.0)) / (msec / 1000.0) : 0.0);
+}
+
+int
+main (int argc, char ** argv)
+{
+  int i;
+  int rounds = argc > 1 ? atoi (argv[1]) : 64;
+  uint64_t begin;
+  tr_crypto crypto;
+  uint8_t * block = tr_new0 (uint8_t, BLOCK_SIZE);
+  uint8_t * flat = tr_new0 (uint8_t, BUFFER_LEN);
+  const uint64_t total = (uint64_t)rounds * BUFFER_LEN;
+
+  cryptoInit (&crypto);
+
+  printf ("%d rounds of %d MiB\n\n", rounds, BUFFER_LEN / (1024 * 1024));
+
+  begin = tr_time_msec ();
+  for (i=0; i<rounds; ++i)
+    tr_cryptoEncrypt (&crypto, BUFFER_LEN, flat, flat);
+  report ("flat", total, tr_time_msec () - begin);
+
+  /* uploading */
+  {
+    uint64_t msec = 0;
+
+    for (i=0; i<rounds; ++i)
+      {
+        struct evbuffer * buf = newOutgoingBuffer (block);
+        begin = tr_time_msec ();
+        encryptPerChunk (&crypto, buf);
+        msec += tr_time_msec () - begin;
+        evbuffer_free (buf);
+      }
+    report ("encrypt per-chunk", total, msec);
+
+    msec = 0;
+    for (i=0; i<rounds; ++i)
+      {
+        struct evbuffer * buf = newOutgoingBuffer (block);
+        begin = tr_time_msec ();
+        tr_cryptoEncryptBuffer (&crypto, buf, 0, evbuffer_get_length (buf));
+        msec += tr_time_msec () - begin;
+        evbuffer_free (buf);
+      }
+    report ("encrypt whole-buffer", total, msec);
+  }
+
+  /* downloading, a block at a time */
+  {
+    uint64_t msec = 0;
+
+    for (i=0; i<rounds; ++i)
+      {
+        struct evbuffer * in = newIncomingBuffer (block);
+        struct evbuffer * out = evbuffer_new ();
+        begin = tr_time_msec ();
+        while (evbuffer_get_length (in) >= BLOCK_SIZE)
+          decryptPerChunk (&crypto, in, out, BLOCK_SIZE);
+        msec += tr_time_msec () - begin;
+        evbuffer_free (out);
+        evbuffer_free (in);
+      }
+    report ("decrypt per-chunk", total, msec);
+
+    msec = 0;
+    for (i=0; i<rounds; ++i)
+      {
+        struct evbuffer * in = newIncomingBuffer (block);
+        struct evbuffer * out = evbuffer_new ();
+        begin = tr_time_msec ();
+        while (evbuffer_get_length (in) >= BLOCK_SIZE)
+          decryptWholeBuffer (&crypto, in, out, BLOCK_SIZE);
+        msec += tr_time_msec () - begin;
+        evbuffer_free (out);
+        evbuffer_free (in);
+      }
+    report ("decrypt whole-buffer", total, msec);
+  }
+
+  /* hashing pieces */
+  {
+    size_t j;
+    uint64_t msec;
+    const void * data[PIECE_COUNT];
+    size_t lengths[PIECE_COUNT];
+    uint8_t hashes[PIECE_COUNT * SHA_DIGEST_LENGTH];
+
+    for (j=0; j<PIECE_COUNT; ++j)
+      {
+        data[j] = flat + j * PIECE_SIZE;
+        lengths[j] = PIECE_SIZE;
+      }
+
+    printf ("\n%d pieces of %d KiB, %d lanes\n\n", PIECE_COUNT, PIECE_SIZE / 1024, tr_sha1_lanes ());
+
+    begin = tr_time_msec ();
+    for (i=0; i<rounds; ++i)
+      for (j=0; j<PIECE_COUNT; ++j)
+        {
+          tr_sha1_ctx_t sha = tr_sha1_init ();
+          tr_sha1_update (sha, data[j], lengths[j]);
+          tr_sha1_final (sha, hashes + j * SHA_DIGEST_LENGTH);
+        }
+    msec = tr_time_msec () - begin;
+    report ("sha1 one at a time", total, msec);
+
+    begin = tr_time_msec ();
+    for (i=0; i<rounds; ++i)
+      tr_sha1_many (PIECE_COUNT, data, lengths, hashes);
+    msec = tr_time_msec () - begin;
+    report ("sha1 many", total, msec);
+  }
+
+  tr_cryptoDestruct (&crypto);
+  tr_free (flat);
+  tr_free (block);
+  return 0;
+}
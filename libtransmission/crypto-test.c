@@ -0,0 +1,244 @@
+#include <string.h> /* memcmp(), memcpy(), memset() */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "crypto.h"
+#include "crypto-utils.h"
+
+#include "libtransmission-test.h"
+
+/***
+****
+***/
+
+static const uint8_t torrentHash[SHA_DIGEST_LENGTH] = "0123456789abcdefghi";
+
+/* set up an outgoing and an incoming end that share a secret */
+static void
+cryptoPairInit (tr_crypto * a, tr_crypto * b)
+{
+  int len;
+
+  tr_cryptoConstruct (a, torrentHash, false);
+  tr_cryptoConstruct (b, torrentHash, true);
+  tr_cryptoComputeSecret (a, tr_cryptoGetMyPublicKey (b, &len));
+  tr_cryptoComputeSecret (b, tr_cryptoGetMyPublicKey (a, &len));
+
+  tr_cryptoEncryptInit (a);
+  tr_cryptoDecryptInit (a);
+  tr_cryptoEncryptInit (b);
+  tr_cryptoDecryptInit (b);
+}
+
+/* build a buffer out of several chains of different sizes */
+static struct evbuffer *
+newChainedBuffer (const uint8_t * bytes, size_t len)
+{
+  size_t chunk = 1;
+  struct evbuffer * buf = evbuffer_new ();
+
+  while (len > 0)
+    {
+      struct evbuffer * tmp = evbuffer_new ();
+      const size_t thisPass = MIN (chunk, len);
+      evbuffer_add (tmp, bytes, thisPass);
+      evbuffer_add_buffer (buf, tmp);
+      evbuffer_free (tmp);
+      bytes += thisPass;
+      len -= thisPass;
+      chunk = chunk * 3 + 7;
+    }
+
+  return buf;
+}
+
+#define PLAINTEXT_LEN (100 * 1024)
+#define PREFIX_LEN 13
+
+static int
+test_crypt_buffer (void)
+{
+  size_t i;
+  tr_crypto a;
+  tr_crypto b;
+  uint8_t * plain = tr_new (uint8_t, PLAINTEXT_LEN);
+  uint8_t * flat = tr_new (uint8_t, PLAINTEXT_LEN);
+  struct evbuffer * buf;
+
+  for (i=0; i<PLAINTEXT_LEN; ++i)
+    plain[i] = (uint8_t)(i * 31);
+
+  cryptoPairInit (&a, &b);
+
+  /* what's encrypted a chain at a time... */
+  buf = newChainedBuffer (plain, PLAINTEXT_LEN);
+  check (evbuffer_peek (buf, -1, NULL, NULL, 0) > 1);
+  tr_cryptoEncryptBuffer (&a, buf, PREFIX_LEN, PLAINTEXT_LEN - PREFIX_LEN);
+  check_int_eq (PLAINTEXT_LEN, evbuffer_get_length (buf));
+  evbuffer_remove (buf, flat, PLAINTEXT_LEN);
+  evbuffer_free (buf);
+
+  /* ...leaves the bytes before the offset alone... */
+  check (!memcmp (plain, flat, PREFIX_LEN));
+  check (memcmp (plain + PREFIX_LEN, flat + PREFIX_LEN, PLAINTEXT_LEN - PREFIX_LEN));
+
+  /* ...and is decrypted by the other end in one go */
+  tr_cryptoDecrypt (&b, PLAINTEXT_LEN - PREFIX_LEN, flat + PREFIX_LEN, flat + PREFIX_LEN);
+  check (!memcmp (plain, flat, PLAINTEXT_LEN));
+
+  /* going the other way, what's encrypted in one go
+     is decrypted a chain at a time */
+  tr_cryptoEncrypt (&b, PLAINTEXT_LEN, plain, flat);
+  buf = newChainedBuffer (flat, PLAINTEXT_LEN);
+  tr_cryptoDecryptBuffer (&a, buf, 0, PLAINTEXT_LEN / 2);
+  tr_cryptoDecryptBuffer (&a, buf, PLAINTEXT_LEN / 2, PLAINTEXT_LEN - PLAINTEXT_LEN / 2);
+  evbuffer_remove (buf, flat, PLAINTEXT_LEN);
+  evbuffer_free (buf);
+  check (!memcmp (plain, flat, PLAINTEXT_LEN));
+
+  tr_cryptoDestruct (&b);
+  tr_cryptoDestruct (&a);
+  tr_free (flat);
+  tr_free (plain);
+  return 0;
+}
+
+static int
+test_sha1 (void)
+{
+  int i;
+  char hex[2 * SHA_DIGEST_LENGTH + 1];
+  uint8_t hash[SHA_DIGEST_LENGTH];
+  uint8_t * million = tr_new (uint8_t, 1000000);
+  tr_sha1_ctx_t sha;
+
+  tr_sha1 (hash, "", 0, NULL);
+  tr_sha1_to_hex (hex, hash);
+  check_streq ("da39a3ee5e6b4b0d3255bfef95601890afd80709", hex);
+
+  tr_sha1 (hash, "a", 1, "bc", 2, NULL);
+  tr_sha1_to_hex (hex, hash);
+  check_streq ("a9993e364706816aba3e25717850c26c9cd0d89d", hex);
+
+  tr_sha1 (hash, "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 56, NULL);
+  tr_sha1_to_hex (hex, hash);
+  check_streq ("84983e441c3bd26ebaae4aa1f95129e5e54670f1", hex);
+
+  /* a million 'a's, fed in pieces that don't line up with SHA1's blocks */
+  memset (million, 'a', 1000000);
+  sha = tr_sha1_init ();
+  check (sha != NULL);
+  for (i=0; i<1000000; )
+    {
+      const int len = MIN (1000000 - i, 1 + (i % 131));
+      check (tr_sha1_update (sha, million + i, len));
+      i += len;
+    }
+  check (tr_sha1_final (sha, hash));
+  tr_sha1_to_hex (hex, hash);
+  check_streq ("34aa973cd4c4daa4f61eeb2bdbad27316534016f", hex);
+
+  tr_sha1 (hash, million, 1000000, NULL);
+  tr_sha1_to_hex (hex, hash);
+  check_streq ("34aa973cd4c4daa4f61eeb2bdbad27316534016f", hex);
+
+  /* freeing a context without finishing it */
+  sha = tr_sha1_init ();
+  tr_sha1_update (sha, million, 100);
+  check (tr_sha1_final (sha, NULL));
+
+  tr_free (million);
+  return 0;
+}
+
+#define MANY_COUNT 37
+
+static int
+test_sha1_many (void)
+{
+  size_t i;
+  size_t total;
+  uint8_t * bytes;
+  const void * data[MANY_COUNT];
+  size_t lengths[MANY_COUNT];
+  uint8_t hashes[MANY_COUNT * SHA_DIGEST_LENGTH];
+
+  check (tr_sha1_lanes () >= 1);
+
+  /* a mix of equal-sized pieces and lengths around the block boundaries */
+  for (i=0, total=0; i<MANY_COUNT; ++i)
+    {
+      if (i < 20)
+        lengths[i] = 16 * 1024;
+      else
+        lengths[i] = 55 + (i - 20) * 5;
+      total += lengths[i];
+    }
+  lengths[MANY_COUNT - 1] = 0;
+
+  bytes = tr_new (uint8_t, total);
+  for (i=0; i<total; ++i)
+    bytes[i] = (uint8_t)(i * 13 + (i >> 8));
+
+  for (i=0, total=0; i<MANY_COUNT; ++i)
+    {
+      data[i] = bytes + total;
+      total += lengths[i];
+    }
+
+  tr_sha1_many (MANY_COUNT, data, lengths, hashes);
+
+  for (i=0; i<MANY_COUNT; ++i)
+    {
+      uint8_t hash[SHA_DIGEST_LENGTH];
+      tr_sha1 (hash, data[i], (int)lengths[i], NULL);
+      check (!memcmp (hash, hashes + i * SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH));
+    }
+
+  /* fewer buffers than lanes, and a single one */
+  tr_sha1_many (3, data + 20, lengths + 20, hashes);
+  for (i=0; i<3; ++i)
+    {
+      uint8_t hash[SHA_DIGEST_LENGTH];
+      tr_sha1 (hash, data[20 + i], (int)lengths[20 + i], NULL);
+      check (!memcmp (hash, hashes + i * SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH));
+    }
+
+  tr_sha1_many (1, data, lengths, hashes + SHA_DIGEST_LENGTH);
+  tr_sha1 (hashes, data[0], (int)lengths[0], NULL);
+  check (!memcmp (hashes, hashes + SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH));
+
+  tr_free (bytes);
+  return 0;
+}
+
+static int
+test_rand_buffer (void)
+{
+  uint8_t a[64];
+  uint8_t b[64];
+
+  memset (a, 0, sizeof (a));
+  memset (b, 0, sizeof (b));
+  check (tr_rand_buffer (a, sizeof (a)));
+  check (tr_rand_buffer (b, sizeof (b)));
+  check (memcmp (a, b, sizeof (a)));
+
+  return 0;
+}
+
+/***
+****
+***/
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_crypt_buffer,
+                             test_sha1,
+                             test_sha1_many,
+                             test_rand_buffer };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -0,0 +1,366 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <string.h> /* memset () */
+
+#include <openssl/bn.h>
+#include <openssl/dh.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/rc4.h>
+#include <openssl/sha.h>
+
+#include "transmission.h"
+#include "crypto-utils.h"
+#include "log.h"
+#include "utils.h"
+
+#define MY_NAME "tr_crypto_utils"
+
+/**
+***
+**/
+
+#define logErrorFromSSL(...) \
+  do { \
+    if (tr_logLevelIsActive (TR_LOG_ERROR)) { \
+      char buf[512]; \
+      ERR_error_string_n (ERR_get_error (), buf, sizeof (buf)); \
+      tr_logAddMessage (__FILE__, __LINE__, TR_LOG_ERROR, MY_NAME, "%s", buf); \
+    } \
+  } while (0)
+
+static bool
+check_openssl_result (int result, int expected_result, const char * file, int line)
+{
+  const bool ret = result == expected_result;
+
+  if (!ret && tr_logLevelIsActive (TR_LOG_ERROR))
+    {
+      char buf[512];
+      ERR_error_string_n (ERR_get_error (), buf, sizeof (buf));
+      tr_logAddMessage (file, line, TR_LOG_ERROR, MY_NAME, "%s", buf);
+    }
+
+  return ret;
+}
+
+#define check_result(result) check_openssl_result ((result), 1, __FILE__, __LINE__)
+
+/* OpenSSL 1.1 made the DH struct opaque */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+
+static int
+DH_set0_pqg (DH * dh, BIGNUM * p, BIGNUM * q, BIGNUM * g)
+{
+  BN_free (dh->p);
+  BN_free (dh->q);
+  BN_free (dh->g);
+  dh->p = p;
+  dh->q = q;
+  dh->g = g;
+  return 1;
+}
+
+static int
+DH_set0_key (DH * dh, BIGNUM * pub_key, BIGNUM * priv_key)
+{
+  if (pub_key != NULL)
+    {
+      BN_free (dh->pub_key);
+      dh->pub_key = pub_key;
+    }
+
+  if (priv_key != NULL)
+    {
+      BN_free (dh->priv_key);
+      dh->priv_key = priv_key;
+    }
+
+  return 1;
+}
+
+static void
+DH_get0_key (const DH * dh, const BIGNUM ** pub_key, const BIGNUM ** priv_key)
+{
+  if (pub_key != NULL)
+    *pub_key = dh->pub_key;
+  if (priv_key != NULL)
+    *priv_key = dh->priv_key;
+}
+
+#endif
+
+/***
+****  SHA1
+***/
+
+#ifndef WITH_BUILTIN_SHA1
+
+tr_sha1_ctx_t
+tr_sha1_init (void)
+{
+  SHA_CTX * handle = tr_new (SHA_CTX, 1);
+
+  if (check_result (SHA1_Init (handle)))
+    return handle;
+
+  tr_free (handle);
+  return NULL;
+}
+
+bool
+tr_sha1_update (tr_sha1_ctx_t   handle,
+                const void    * data,
+                size_t          data_length)
+{
+  assert (handle != NULL);
+
+  if (data_length == 0)
+    return true;
+
+  assert (data != NULL);
+
+  return check_result (SHA1_Update (handle, data, data_length));
+}
+
+bool
+tr_sha1_final (tr_sha1_ctx_t   handle,
+               uint8_t       * hash)
+{
+  bool ret = true;
+
+  if (hash != NULL)
+    {
+      assert (handle != NULL);
+
+      ret = check_result (SHA1_Final (hash, handle));
+    }
+
+  tr_free (handle);
+  return ret;
+}
+
+void
+tr_sha1_many (size_t               count,
+              const void * const * data,
+              const size_t       * data_lengths,
+              uint8_t            * hashes)
+{
+  size_t i;
+
+  for (i=0; i<count; ++i)
+    SHA1 (data[i], data_lengths[i], hashes + i * SHA_DIGEST_LENGTH);
+}
+
+int
+tr_sha1_lanes (void)
+{
+  return 1;
+}
+
+#endif /* WITH_BUILTIN_SHA1 */
+
+/***
+****  RC4
+***/
+
+tr_rc4_ctx_t
+tr_rc4_new (void)
+{
+  return tr_new0 (RC4_KEY, 1);
+}
+
+void
+tr_rc4_free (tr_rc4_ctx_t handle)
+{
+  tr_free (handle);
+}
+
+void
+tr_rc4_set_key (tr_rc4_ctx_t    handle,
+                const uint8_t * key,
+                size_t          key_length)
+{
+  assert (handle != NULL);
+  assert (key != NULL);
+
+  RC4_set_key (handle, key_length, key);
+}
+
+void
+tr_rc4_process (tr_rc4_ctx_t   handle,
+                const void   * input,
+                void         * output,
+                size_t         length)
+{
+  assert (handle != NULL);
+
+  if (length == 0)
+    return;
+
+  assert (input != NULL);
+  assert (output != NULL);
+
+  RC4 (handle, length, input, output);
+}
+
+/***
+****  DH
+***/
+
+tr_dh_ctx_t
+tr_dh_new (const uint8_t * prime_num,
+           size_t          prime_num_length,
+           const uint8_t * generator_num,
+           size_t          generator_num_length)
+{
+  DH * handle = DH_new ();
+  BIGNUM * p;
+  BIGNUM * g;
+
+  assert (prime_num != NULL);
+  assert (generator_num != NULL);
+
+  if (handle == NULL)
+    {
+      logErrorFromSSL ();
+      return NULL;
+    }
+
+  p = BN_bin2bn (prime_num, prime_num_length, NULL);
+  g = BN_bin2bn (generator_num, generator_num_length, NULL);
+
+  if (p == NULL || g == NULL || !check_result (DH_set0_pqg (handle, p, NULL, g)))
+    {
+      logErrorFromSSL ();
+      BN_free (p);
+      BN_free (g);
+      DH_free (handle);
+      return NULL;
+    }
+
+  return handle;
+}
+
+void
+tr_dh_free (tr_dh_ctx_t handle)
+{
+  if (handle != NULL)
+    DH_free (handle);
+}
+
+bool
+tr_dh_make_key (tr_dh_ctx_t   raw_handle,
+                size_t        private_key_length,
+                uint8_t     * public_key,
+                size_t      * public_key_length)
+{
+  DH * handle = raw_handle;
+  BIGNUM * priv_key;
+  const BIGNUM * my_public_key;
+  int dh_size;
+  int my_public_key_length;
+
+  assert (handle != NULL);
+  assert (public_key != NULL);
+
+  /* a strong random private value of exactly private_key_length*8 bits */
+  priv_key = BN_new ();
+  if (!check_result (BN_rand (priv_key, private_key_length * 8, 0, 0)))
+    {
+      BN_free (priv_key);
+      return false;
+    }
+
+  DH_set0_key (handle, NULL, priv_key);
+
+  if (!check_result (DH_generate_key (handle)))
+    return false;
+
+  /* DH can generate key sizes that are smaller than the size of
+     P with exponentially decreasing probability, in which case
+     the msb's of the public key need to be zeroed appropriately. */
+  DH_get0_key (handle, &my_public_key, NULL);
+  my_public_key_length = BN_num_bytes (my_public_key);
+  dh_size = DH_size (handle);
+  assert (my_public_key_length <= dh_size);
+
+  memset (public_key, 0, dh_size - my_public_key_length);
+  BN_bn2bin (my_public_key, public_key + dh_size - my_public_key_length);
+
+  if (public_key_length != NULL)
+    *public_key_length = dh_size;
+
+  return true;
+}
+
+bool
+tr_dh_secret (tr_dh_ctx_t     raw_handle,
+              const uint8_t * other_public_key,
+              size_t          other_public_key_length,
+              uint8_t       * secret,
+              size_t        * secret_length)
+{
+  DH * handle = raw_handle;
+  BIGNUM * other_key;
+  uint8_t * tmp;
+  int dh_size;
+  int len;
+
+  assert (handle != NULL);
+  assert (other_public_key != NULL);
+  assert (secret != NULL);
+
+  other_key = BN_bin2bn (other_public_key, other_public_key_length, NULL);
+  if (other_key == NULL)
+    {
+      logErrorFromSSL ();
+      return false;
+    }
+
+  dh_size = DH_size (handle);
+  tmp = tr_new (uint8_t, dh_size);
+  len = DH_compute_key (tmp, other_key, handle);
+
+  if (len >= 0)
+    {
+      assert (len <= dh_size);
+      memset (secret, 0, dh_size - len);
+      memcpy (secret + dh_size - len, tmp, len);
+
+      if (secret_length != NULL)
+        *secret_length = dh_size;
+    }
+  else
+    {
+      logErrorFromSSL ();
+    }
+
+  tr_free (tmp);
+  BN_free (other_key);
+  return len >= 0;
+}
+
+/***
+****  RANDOM
+***/
+
+bool
+tr_rand_buffer (void   * buffer,
+                size_t   length)
+{
+  assert (buffer != NULL);
+
+  return check_result (RAND_bytes (buffer, (int)length));
+}
@@ -0,0 +1,509 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+/* The SHA1 used by `./configure --with-sha1=builtin'.
+ *
+ * A single stream is hashed with the SHA extensions (SHA-NI) when the
+ * CPU has them, or with plain C otherwise. tr_sha1_many () runs up to
+ * SHA1_LANES streams side by side in vector registers, which is what
+ * makes up for not having SHA-NI. */
+
+#include <assert.h>
+#include <string.h> /* memcpy (), memset () */
+
+#if (defined (__x86_64__) || defined (__i386__)) \
+    && (defined (__clang__) || (defined (__GNUC__) && __GNUC__ >= 5))
+ #include <cpuid.h>
+ #include <immintrin.h>
+ #define SHA1_HAVE_SHANI
+#endif
+
+#include "transmission.h"
+#include "crypto-utils.h"
+#include "utils.h"
+
+#define SHA1_BLOCK_SIZE 64
+
+typedef void (*sha1_compress_func)(uint32_t         state[5],
+                                   const uint8_t  * blocks,
+                                   size_t           n_blocks);
+
+struct sha1_ctx
+{
+  uint32_t state[5];
+  uint64_t length;
+  uint8_t block[SHA1_BLOCK_SIZE];
+  size_t block_used;
+  sha1_compress_func compress;
+};
+
+static const uint32_t sha1_iv[5] =
+{
+  0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+};
+
+#define SHA1_K0 0x5A827999
+#define SHA1_K1 0x6ED9EBA1
+#define SHA1_K2 0x8F1BBCDC
+#define SHA1_K3 0xCA62C1D6
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static inline uint32_t
+load_be32 (const uint8_t * p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+       | ((uint32_t)p[2] << 8)  |  (uint32_t)p[3];
+}
+
+static inline void
+store_be32 (uint8_t * p, uint32_t val)
+{
+  p[0] = (uint8_t)(val >> 24);
+  p[1] = (uint8_t)(val >> 16);
+  p[2] = (uint8_t)(val >> 8);
+  p[3] = (uint8_t)val;
+}
+
+/***
+****  Plain C
+***/
+
+static void
+sha1_compress_c (uint32_t state[5], const uint8_t * blocks, size_t n_blocks)
+{
+  while (n_blocks-- > 0)
+    {
+      int t;
+      uint32_t w[16];
+      uint32_t a = state[0];
+      uint32_t b = state[1];
+      uint32_t c = state[2];
+      uint32_t d = state[3];
+      uint32_t e = state[4];
+
+      for (t=0; t<16; ++t)
+        w[t] = load_be32 (blocks + 4 * t);
+
+      for (t=0; t<80; ++t)
+        {
+          uint32_t f;
+          uint32_t tmp;
+
+          if (t >= 16)
+            w[t & 15] = ROL32 (w[(t + 13) & 15] ^ w[(t + 8) & 15] ^ w[(t + 2) & 15] ^ w[t & 15], 1);
+
+          if (t < 20)
+            f = (d ^ (b & (c ^ d))) + SHA1_K0;
+          else if (t < 40)
+            f = (b ^ c ^ d) + SHA1_K1;
+          else if (t < 60)
+            f = ((b & c) | (d & (b | c))) + SHA1_K2;
+          else
+            f = (b ^ c ^ d) + SHA1_K3;
+
+          tmp = ROL32 (a, 5) + f + e + w[t & 15];
+          e = d;
+          d = c;
+          c = ROL32 (b, 30);
+          b = a;
+          a = tmp;
+        }
+
+      state[0] += a;
+      state[1] += b;
+      state[2] += c;
+      state[3] += d;
+      state[4] += e;
+
+      blocks += SHA1_BLOCK_SIZE;
+    }
+}
+
+/***
+****  SHA-NI
+***/
+
+#ifdef SHA1_HAVE_SHANI
+
+static bool
+sha1_cpu_has_shani (void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+    return false;
+
+  if (__get_cpuid_max (0, NULL) < 7)
+    return false;
+
+  __cpuid_count (7, 0, eax, ebx, ecx, edx);
+  return (ebx & (1u << 29)) != 0; /* CPUID.(EAX=07H, ECX=0):EBX.SHA */
+}
+
+/* Four rounds. `g' counts groups of four rounds, 0 to 19, and has to be
+ * a constant. msg[] holds the message schedule for the next four groups,
+ * which is extended with sha1msg1/xor/sha1msg2 as it's consumed. */
+#define SHANI_ROUNDS(g) \
+  do { \
+    if ((g) == 0) \
+      e[0] = _mm_add_epi32 (e[0], msg[0]); \
+    else \
+      e[(g) % 2] = _mm_sha1nexte_epu32 (e[(g) % 2], msg[(g) % 4]); \
+    e[((g) + 1) % 2] = abcd; \
+    if ((g) >= 3 && (g) <= 18) \
+      msg[((g) + 1) % 4] = _mm_sha1msg2_epu32 (msg[((g) + 1) % 4], msg[(g) % 4]); \
+    abcd = _mm_sha1rnds4_epu32 (abcd, e[(g) % 2], (g) / 5); \
+    if ((g) >= 1 && (g) <= 16) \
+      msg[((g) + 3) % 4] = _mm_sha1msg1_epu32 (msg[((g) + 3) % 4], msg[(g) % 4]); \
+    if ((g) >= 2 && (g) <= 17) \
+      msg[((g) + 2) % 4] = _mm_xor_si128 (msg[((g) + 2) % 4], msg[(g) % 4]); \
+  } while (0)
+
+static void __attribute__ ((target ("sha,sse4.1")))
+sha1_compress_shani (uint32_t state[5], const uint8_t * blocks, size_t n_blocks)
+{
+  int i;
+  __m128i abcd;
+  __m128i e[2];
+  __m128i msg[4];
+  const __m128i byteswap = _mm_set_epi64x (0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+  abcd = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i*) state), 0x1B);
+  e[0] = _mm_set_epi32 ((int)state[4], 0, 0, 0);
+
+  while (n_blocks-- > 0)
+    {
+      const __m128i abcd_save = abcd;
+      const __m128i e_save = e[0];
+
+      for (i=0; i<4; ++i)
+        msg[i] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i*)(blocks + 16 * i)), byteswap);
+
+      SHANI_ROUNDS (0);  SHANI_ROUNDS (1);  SHANI_ROUNDS (2);  SHANI_ROUNDS (3);
+      SHANI_ROUNDS (4);  SHANI_ROUNDS (5);  SHANI_ROUNDS (6);  SHANI_ROUNDS (7);
+      SHANI_ROUNDS (8);  SHANI_ROUNDS (9);  SHANI_ROUNDS (10); SHANI_ROUNDS (11);
+      SHANI_ROUNDS (12); SHANI_ROUNDS (13); SHANI_ROUNDS (14); SHANI_ROUNDS (15);
+      SHANI_ROUNDS (16); SHANI_ROUNDS (17); SHANI_ROUNDS (18); SHANI_ROUNDS (19);
+
+      e[0] = _mm_sha1nexte_epu32 (e[0], e_save);
+      abcd = _mm_add_epi32 (abcd, abcd_save);
+
+      blocks += SHA1_BLOCK_SIZE;
+    }
+
+  _mm_storeu_si128 ((__m128i*) state, _mm_shuffle_epi32 (abcd, 0x1B));
+  state[4] = (uint32_t)_mm_extract_epi32 (e[0], 3);
+}
+
+#endif /* SHA1_HAVE_SHANI */
+
+static sha1_compress_func
+sha1_get_compress (void)
+{
+#ifdef SHA1_HAVE_SHANI
+  if (sha1_cpu_has_shani ())
+    return sha1_compress_shani;
+#endif
+
+  return sha1_compress_c;
+}
+
+/***
+****  Lanes
+***/
+
+#ifdef __GNUC__
+
+#define SHA1_LANES 8
+
+typedef uint32_t sha1_vec __attribute__ ((vector_size (SHA1_LANES * sizeof (uint32_t))));
+
+/* let the loader pick an AVX2 build of the lanes where it can */
+#if defined (__x86_64__) && defined (__linux__) && !defined (__clang__) && __GNUC__ >= 7
+ #define SHA1_LANES_TARGETS __attribute__ ((target_clones ("avx2", "default")))
+#else
+ #define SHA1_LANES_TARGETS
+#endif
+
+/* hash `n_blocks' blocks from each of the SHA1_LANES `data' pointers */
+static void SHA1_LANES_TARGETS
+sha1_compress_lanes (sha1_vec state[5], const uint8_t * const * data, size_t n_blocks)
+{
+  size_t offset;
+
+  for (offset=0; n_blocks>0; --n_blocks, offset+=SHA1_BLOCK_SIZE)
+    {
+      int t;
+      int lane;
+      sha1_vec w[16];
+      sha1_vec a = state[0];
+      sha1_vec b = state[1];
+      sha1_vec c = state[2];
+      sha1_vec d = state[3];
+      sha1_vec e = state[4];
+
+      for (t=0; t<16; ++t)
+        for (lane=0; lane<SHA1_LANES; ++lane)
+          w[t][lane] = load_be32 (data[lane] + offset + 4 * t);
+
+      for (t=0; t<80; ++t)
+        {
+          sha1_vec f;
+          sha1_vec tmp;
+
+          if (t >= 16)
+            w[t & 15] = ROL32 (w[(t + 13) & 15] ^ w[(t + 8) & 15] ^ w[(t + 2) & 15] ^ w[t & 15], 1);
+
+          if (t < 20)
+            f = (d ^ (b & (c ^ d))) + SHA1_K0;
+          else if (t < 40)
+            f = (b ^ c ^ d) + SHA1_K1;
+          else if (t < 60)
+            f = ((b & c) | (d & (b | c))) + SHA1_K2;
+          else
+            f = (b ^ c ^ d) + SHA1_K3;
+
+          tmp = ROL32 (a, 5) + f + e + w[t & 15];
+          e = d;
+          d = c;
+          c = ROL32 (b, 30);
+          b = a;
+          a = tmp;
+        }
+
+      state[0] += a;
+      state[1] += b;
+      state[2] += c;
+      state[3] += d;
+      state[4] += e;
+    }
+}
+
+#endif /* __GNUC__ */
+
+/***
+****
+***/
+
+static void
+sha1_ctx_init (struct sha1_ctx * ctx, sha1_compress_func compress)
+{
+  memcpy (ctx->state, sha1_iv, sizeof (ctx->state));
+  ctx->length = 0;
+  ctx->block_used = 0;
+  ctx->compress = compress;
+}
+
+static void
+sha1_ctx_update (struct sha1_ctx * ctx, const uint8_t * data, size_t len)
+{
+  ctx->length += len;
+
+  if (ctx->block_used > 0)
+    {
+      const size_t n = MIN (len, SHA1_BLOCK_SIZE - ctx->block_used);
+
+      memcpy (ctx->block + ctx->block_used, data, n);
+      ctx->block_used += n;
+      data += n;
+      len -= n;
+
+      if (ctx->block_used < SHA1_BLOCK_SIZE)
+        return;
+
+      ctx->compress (ctx->state, ctx->block, 1);
+      ctx->block_used = 0;
+    }
+
+  if (len >= SHA1_BLOCK_SIZE)
+    {
+      const size_t n_blocks = len / SHA1_BLOCK_SIZE;
+
+      ctx->compress (ctx->state, data, n_blocks);
+      data += n_blocks * SHA1_BLOCK_SIZE;
+      len -= n_blocks * SHA1_BLOCK_SIZE;
+    }
+
+  memcpy (ctx->block, data, len);
+  ctx->block_used = len;
+}
+
+static void
+sha1_ctx_final (struct sha1_ctx * ctx, uint8_t * hash)
+{
+  int i;
+  const uint64_t bit_length = ctx->length * 8;
+
+  ctx->block[ctx->block_used++] = 0x80;
+
+  if (ctx->block_used > SHA1_BLOCK_SIZE - 8)
+    {
+      memset (ctx->block + ctx->block_used, 0, SHA1_BLOCK_SIZE - ctx->block_used);
+      ctx->compress (ctx->state, ctx->block, 1);
+      ctx->block_used = 0;
+    }
+
+  memset (ctx->block + ctx->block_used, 0, SHA1_BLOCK_SIZE - 8 - ctx->block_used);
+  store_be32 (ctx->block + SHA1_BLOCK_SIZE - 8, (uint32_t)(bit_length >> 32));
+  store_be32 (ctx->block + SHA1_BLOCK_SIZE - 4, (uint32_t)bit_length);
+  ctx->compress (ctx->state, ctx->block, 1);
+
+  for (i=0; i<5; ++i)
+    store_be32 (hash + 4 * i, ctx->state[i]);
+}
+
+/* the lanes only pay off when there's no SHA-NI to beat */
+static bool
+sha1_use_lanes (sha1_compress_func compress)
+{
+#ifdef SHA1_LANES
+  return compress == sha1_compress_c;
+#else
+  return false;
+#endif
+}
+
+/***
+****
+***/
+
+tr_sha1_ctx_t
+tr_sha1_init (void)
+{
+  struct sha1_ctx * ctx = tr_new (struct sha1_ctx, 1);
+
+  sha1_ctx_init (ctx, sha1_get_compress ());
+
+  return ctx;
+}
+
+bool
+tr_sha1_update (tr_sha1_ctx_t   handle,
+                const void    * data,
+                size_t          data_length)
+{
+  assert (handle != NULL);
+
+  if (data_length == 0)
+    return true;
+
+  assert (data != NULL);
+
+  sha1_ctx_update (handle, data, data_length);
+  return true;
+}
+
+bool
+tr_sha1_final (tr_sha1_ctx_t   handle,
+               uint8_t       * hash)
+{
+  if (hash != NULL)
+    {
+      assert (handle != NULL);
+
+      sha1_ctx_final (handle, hash);
+    }
+
+  tr_free (handle);
+  return true;
+}
+
+#ifdef SHA1_LANES
+
+/* hash `n' <= SHA1_LANES buffers. the blocks they all have are hashed
+ * in the lanes, then each buffer's tail is finished on its own. */
+static void
+sha1_many_lanes (size_t                n,
+                 const void * const  * data,
+                 const size_t        * data_lengths,
+                 uint8_t             * hashes,
+                 sha1_compress_func    compress)
+{
+  int i;
+  size_t lane;
+  sha1_vec state[5];
+  const uint8_t * lane_data[SHA1_LANES];
+  size_t n_blocks = data_lengths[0] / SHA1_BLOCK_SIZE;
+
+  for (lane=0; lane<n; ++lane)
+    n_blocks = MIN (n_blocks, data_lengths[lane] / SHA1_BLOCK_SIZE);
+
+  /* lanes without a buffer of their own just repeat the first one */
+  for (lane=0; lane<SHA1_LANES; ++lane)
+    lane_data[lane] = data[lane < n ? lane : 0];
+
+  for (i=0; i<5; ++i)
+    {
+      state[i] = (sha1_vec) { 0 };
+      state[i] += sha1_iv[i];
+    }
+
+  if (n_blocks > 0)
+    sha1_compress_lanes (state, lane_data, n_blocks);
+
+  for (lane=0; lane<n; ++lane)
+    {
+      struct sha1_ctx ctx;
+      const size_t done = n_blocks * SHA1_BLOCK_SIZE;
+
+      sha1_ctx_init (&ctx, compress);
+      for (i=0; i<5; ++i)
+        ctx.state[i] = state[i][lane];
+      ctx.length = done;
+
+      sha1_ctx_update (&ctx, lane_data[lane] + done, data_lengths[lane] - done);
+      sha1_ctx_final (&ctx, hashes + lane * SHA_DIGEST_LENGTH);
+    }
+}
+
+#endif /* SHA1_LANES */
+
+void
+tr_sha1_many (size_t               count,
+              const void * const * data,
+              const size_t       * data_lengths,
+              uint8_t            * hashes)
+{
+  size_t i = 0;
+  const sha1_compress_func compress = sha1_get_compress ();
+
+#ifdef SHA1_LANES
+  if (sha1_use_lanes (compress))
+    while (count - i >= 2)
+      {
+        const size_t n = MIN (count - i, SHA1_LANES);
+        sha1_many_lanes (n, data + i, data_lengths + i, hashes + i * SHA_DIGEST_LENGTH, compress);
+        i += n;
+      }
+#endif
+
+  for (; i<count; ++i)
+    {
+      struct sha1_ctx ctx;
+
+      sha1_ctx_init (&ctx, compress);
+      sha1_ctx_update (&ctx, data[i], data_lengths[i]);
+      sha1_ctx_final (&ctx, hashes + i * SHA_DIGEST_LENGTH);
+    }
+}
+
+int
+tr_sha1_lanes (void)
+{
+#ifdef SHA1_LANES
+  if (sha1_use_lanes (sha1_get_compress ()))
+    return SHA1_LANES;
+#endif
+
+  return 1;
+}
@@ -0,0 +1,122 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef TR_CRYPTO_UTILS_H
+#define TR_CRYPTO_UTILS_H
+
+#ifndef __TRANSMISSION__
+#error only libtransmission should #include this header.
+#endif
+
+#include <inttypes.h>
+#include <stddef.h> /* size_t */
+
+/**
+*** @addtogroup utils Utilities
+*** @{
+**/
+
+/**
+ * The crypto primitives libtransmission needs, independent of the
+ * library that provides them. The backend is picked at build time:
+ * crypto-utils-openssl.c implements all of them, and
+ * `./configure --with-sha1=builtin' swaps its SHA1 for the one in
+ * crypto-utils-sha1.c, which uses SHA-NI and SIMD lanes where the
+ * CPU has them.
+ */
+
+/** @brief Opaque SHA1 context type. */
+typedef void * tr_sha1_ctx_t;
+/** @brief Opaque RC4 context type. */
+typedef void * tr_rc4_ctx_t;
+/** @brief Opaque DH context type. */
+typedef void * tr_dh_ctx_t;
+
+/** @brief Allocate and initialize a new SHA1 hasher context. */
+tr_sha1_ctx_t   tr_sha1_init      (void);
+
+/** @brief Add `data_length' bytes of `data' to the hash. */
+bool            tr_sha1_update    (tr_sha1_ctx_t   handle,
+                                   const void    * data,
+                                   size_t          data_length);
+
+/** @brief Write the SHA_DIGEST_LENGTH-byte hash to `hash' and free
+           the context. `hash' may be NULL to just free it. */
+bool            tr_sha1_final     (tr_sha1_ctx_t   handle,
+                                   uint8_t       * hash);
+
+/**
+ * @brief Hash `count' separate buffers, such as several pieces.
+ *
+ * The hash of data[i] is written to `hashes' + i * SHA_DIGEST_LENGTH.
+ * Implementations with lanes hash several of the buffers at once,
+ * which works best when they're all about the same length.
+ */
+void            tr_sha1_many      (size_t               count,
+                                   const void * const * data,
+                                   const size_t       * data_lengths,
+                                   uint8_t            * hashes);
+
+/** @brief Returns how many buffers tr_sha1_many () hashes at once,
+           or 1 if it's no faster than hashing them one at a time. */
+int             tr_sha1_lanes     (void);
+
+/** @brief Allocate and initialize a new RC4 cipher context. */
+tr_rc4_ctx_t    tr_rc4_new        (void);
+
+/** @brief Free an RC4 cipher context. */
+void            tr_rc4_free       (tr_rc4_ctx_t    handle);
+
+/** @brief Set the key of an RC4 cipher context. */
+void            tr_rc4_set_key    (tr_rc4_ctx_t    handle,
+                                   const uint8_t * key,
+                                   size_t          key_length);
+
+/** @brief Encrypt or decrypt `length' bytes. `input' and `output' may be the same. */
+void            tr_rc4_process    (tr_rc4_ctx_t    handle,
+                                   const void    * input,
+                                   void          * output,
+                                   size_t          length);
+
+/** @brief Allocate and initialize a new Diffie-Hellman context.
+    @return the context, or NULL on error */
+tr_dh_ctx_t     tr_dh_new         (const uint8_t * prime_num,
+                                   size_t          prime_num_length,
+                                   const uint8_t * generator_num,
+                                   size_t          generator_num_length);
+
+/** @brief Free a Diffie-Hellman context. */
+void            tr_dh_free        (tr_dh_ctx_t     handle);
+
+/** @brief Generate a private key of `private_key_length' bytes and
+           write the public key to `public_key', left-padded with zeroes
+           to the length of the prime. */
+bool            tr_dh_make_key    (tr_dh_ctx_t     handle,
+                                   size_t          private_key_length,
+                                   uint8_t       * public_key,
+                                   size_t        * public_key_length);
+
+/** @brief Compute the secret shared with the owner of `other_public_key'
+           into `secret', left-padded with zeroes to the length of the prime. */
+bool            tr_dh_secret      (tr_dh_ctx_t     handle,
+                                   const uint8_t * other_public_key,
+                                   size_t          other_public_key_length,
+                                   uint8_t       * secret,
+                                   size_t        * secret_length);
+
+/** @brief Fill a buffer with cryptographically strong random bytes. */
+bool            tr_rand_buffer    (void          * buffer,
+                                   size_t          length);
+
+/* @} */
+
+#endif /* TR_CRYPTO_UTILS_H */
@@ -16,15 +16,11 @@
 #include <stdlib.h> /* abs () */
 #include <string.h> /* memcpy (), memset (), strcmp () */
 
-#include <openssl/bn.h>
-#include <openssl/dh.h>
-#include <openssl/err.h>
-#include <openssl/rc4.h>
-#include <openssl/sha.h>
-#include <openssl/rand.h>
+#include <event2/buffer.h>
 
 #include "transmission.h"
 #include "crypto.h"
+#include "crypto-utils.h"
 #include "log.h"
 #include "utils.h"
 
@@ -38,18 +34,18 @@ void
 tr_sha1 (uint8_t * setme, const void * content1, int content1_len, ...)
 {
   va_list vl;
-  SHA_CTX sha;
+  tr_sha1_ctx_t sha;
   const void * content;
 
-  SHA1_Init (&sha);
-  SHA1_Update (&sha, content1, content1_len);
+  sha = tr_sha1_init ();
+  tr_sha1_update (sha, content1, content1_len);
 
   va_start (vl, content1_len);
   while ((content = va_arg (vl, const void*)))
-    SHA1_Update (&sha, content, va_arg (vl, int));
+    tr_sha1_update (sha, content, va_arg (vl, int));
   va_end (vl);
 
-  SHA1_Final (setme, &sha);
+  tr_sha1_final (sha, setme);
 }
 
 /**
@@ -60,7 +56,6 @@ tr_sha1 (uint8_t * setme, const void * content1, int content1_len, ...)
 
 #define PRIME_LEN 96
 
-#define DH_PRIVKEY_LEN_MIN 16
 #define DH_PRIVKEY_LEN 20
 
 static const uint8_t dh_P[PRIME_LEN] =
@@ -81,53 +76,19 @@ static const uint8_t dh_G[] = { 2 };
 ***
 **/
 
-#define logErrorFromSSL(...) \
-  do { \
-    if (tr_logLevelIsActive (TR_LOG_ERROR)) { \
-      char buf[512]; \
-      ERR_error_string_n (ERR_get_error (), buf, sizeof (buf)); \
-      tr_logAddMessage (__FILE__, __LINE__, TR_LOG_ERROR, MY_NAME, "%s", buf); \
-    } \
-  } while (0)
-
 static void
 ensureKeyExists (tr_crypto * crypto)
 {
   if (crypto->dh == NULL)
     {
-      int len, offset;
-      DH * dh = DH_new ();
-
-      dh->p = BN_bin2bn (dh_P, sizeof (dh_P), NULL);
-      if (dh->p == NULL)
-        logErrorFromSSL ();
-
-      dh->g = BN_bin2bn (dh_G, sizeof (dh_G), NULL);
-      if (dh->g == NULL)
-        logErrorFromSSL ();
-
-      /* private DH value: strong random BN of DH_PRIVKEY_LEN*8 bits */
-      dh->priv_key = BN_new ();
-      do
-        {
-          if (BN_rand (dh->priv_key, DH_PRIVKEY_LEN * 8, -1, 0) != 1)
-            logErrorFromSSL ();
-        }
-      while (BN_num_bits (dh->priv_key) < DH_PRIVKEY_LEN_MIN * 8);
-
-      if (!DH_generate_key (dh))
-        logErrorFromSSL ();
-
-      /* DH can generate key sizes that are smaller than the size of
-         P with exponentially decreasing probability, in which case
-         the msb's of myPublicKey need to be zeroed appropriately. */
-      len = BN_num_bytes (dh->pub_key);
-      offset = KEY_LEN - len;
-      assert (len <= KEY_LEN);
-      memset (crypto->myPublicKey, 0, offset);
-      BN_bn2bin (dh->pub_key, crypto->myPublicKey + offset);
-
-      crypto->dh = dh;
+      size_t public_key_length;
+
+      crypto->dh = tr_dh_new (dh_P, sizeof (dh_P), dh_G, sizeof (dh_G));
+      if (crypto->dh == NULL
+          || !tr_dh_make_key (crypto->dh, DH_PRIVKEY_LEN, crypto->myPublicKey, &public_key_length))
+        tr_logAddNamedError (MY_NAME, "Unable to create a Diffie-Hellman key");
+      else
+        assert (public_key_length == KEY_LEN);
     }
 }
 
@@ -144,8 +105,9 @@ tr_cryptoConstruct (tr_crypto * crypto, const uint8_t * torrentHash, bool isInco
 void
 tr_cryptoDestruct (tr_crypto * crypto)
 {
-  if (crypto->dh != NULL)
-    DH_free (crypto->dh);
+  tr_dh_free (crypto->dh);
+  tr_rc4_free (crypto->enc_key);
+  tr_rc4_free (crypto->dec_key);
 }
 
 /**
@@ -156,32 +118,17 @@ const uint8_t*
 tr_cryptoComputeSecret (tr_crypto *     crypto,
                         const uint8_t * peerPublicKey)
 {
-  DH * dh;
-  int len;
-  uint8_t secret[KEY_LEN];
-  BIGNUM * bn = BN_bin2bn (peerPublicKey, KEY_LEN, NULL);
+  size_t secret_length;
 
   ensureKeyExists (crypto);
-  dh = crypto->dh;
-
-  assert (DH_size (dh) == KEY_LEN);
 
-  len = DH_compute_key (secret, bn, dh);
-  if (len == -1)
+  if (crypto->dh != NULL
+      && tr_dh_secret (crypto->dh, peerPublicKey, KEY_LEN, crypto->mySecret, &secret_length))
     {
-      logErrorFromSSL ();
-    }
-  else
-    {
-      int offset;
-      assert (len <= KEY_LEN);
-      offset = KEY_LEN - len;
-      memset (crypto->mySecret, 0, offset);
-      memcpy (crypto->mySecret + offset, secret, len);
+      assert (secret_length == KEY_LEN);
       crypto->mySecretIsSet = 1;
     }
 
-  BN_free (bn);
   return crypto->mySecret;
 }
 
@@ -199,27 +146,33 @@ tr_cryptoGetMyPublicKey (const tr_crypto * crypto,
 **/
 
 static void
-initRC4 (tr_crypto  * crypto,
-         RC4_KEY    * setme,
-         const char * key)
+initRC4 (tr_crypto    * crypto,
+         tr_rc4_ctx_t * setme,
+         const char   * key)
 {
-  SHA_CTX sha;
+  tr_sha1_ctx_t sha;
   uint8_t buf[SHA_DIGEST_LENGTH];
 
   assert (crypto->torrentHashIsSet);
   assert (crypto->mySecretIsSet);
 
-  if (SHA1_Init (&sha)
-      && SHA1_Update (&sha, key, 4)
-      && SHA1_Update (&sha, crypto->mySecret, KEY_LEN)
-      && SHA1_Update (&sha, crypto->torrentHash, SHA_DIGEST_LENGTH)
-      && SHA1_Final (buf, &sha))
+  if (*setme == NULL)
+    *setme = tr_rc4_new ();
+
+  sha = tr_sha1_init ();
+  if (sha == NULL)
+    return;
+
+  if (tr_sha1_update (sha, key, 4)
+      && tr_sha1_update (sha, crypto->mySecret, KEY_LEN)
+      && tr_sha1_update (sha, crypto->torrentHash, SHA_DIGEST_LENGTH))
     {
-      RC4_set_key (setme, SHA_DIGEST_LENGTH, buf);
+      if (tr_sha1_final (sha, buf))
+        tr_rc4_set_key (*setme, buf, SHA_DIGEST_LENGTH);
     }
   else
     {
-      logErrorFromSSL ();
+      tr_sha1_final (sha, NULL);
     }
 }
 
@@ -230,7 +183,7 @@ tr_cryptoDecryptInit (tr_crypto * crypto)
   const char * txt = crypto->isIncoming ? "keyA" : "keyB";
 
   initRC4 (crypto, &crypto->dec_key, txt);
-  RC4 (&crypto->dec_key, sizeof (discard), discard, discard);
+  tr_rc4_process (crypto->dec_key, discard, discard, sizeof (discard));
 }
 
 void
@@ -239,9 +192,7 @@ tr_cryptoDecrypt (tr_crypto  * crypto,
                   const void * buf_in,
                   void       * buf_out)
 {
-  RC4 (&crypto->dec_key, buf_len,
-       (const unsigned char*)buf_in,
-       (unsigned char*)buf_out);
+  tr_rc4_process (crypto->dec_key, buf_in, buf_out, buf_len);
 }
 
 void
@@ -251,7 +202,7 @@ tr_cryptoEncryptInit (tr_crypto * crypto)
   const char * txt = crypto->isIncoming ? "keyB" : "keyA";
 
   initRC4 (crypto, &crypto->enc_key, txt);
-  RC4 (&crypto->enc_key, sizeof (discard), discard, discard);
+  tr_rc4_process (crypto->enc_key, discard, discard, sizeof (discard));
 }
 
 void
@@ -260,9 +211,60 @@ tr_cryptoEncrypt (tr_crypto  * crypto,
                   const void * buf_in,
                   void       * buf_out)
 {
-  RC4 (&crypto->enc_key, buf_len,
-       (const unsigned char*)buf_in,
-       (unsigned char*)buf_out);
+  tr_rc4_process (crypto->enc_key, buf_in, buf_out, buf_len);
+}
+
+/* run `key' over `len' bytes of `buf' in place, starting at `offset'.
+   all of the chains are peeked at once, so that a block that spans
+   several of them costs one evbuffer walk and one RC4 pass per chain */
+#define CRYPT_STACK_IOVECS 16
+static void
+cryptBuffer (tr_rc4_ctx_t key, struct evbuffer * buf, size_t offset, size_t len)
+{
+  int i;
+  int n;
+  struct evbuffer_ptr pos;
+  struct evbuffer_iovec stack_iovecs[CRYPT_STACK_IOVECS];
+  struct evbuffer_iovec * iovecs = stack_iovecs;
+
+  assert (offset + len <= evbuffer_get_length (buf));
+
+  if (len == 0)
+    return;
+
+  evbuffer_ptr_set (buf, &pos, offset, EVBUFFER_PTR_SET);
+  n = evbuffer_peek (buf, len, &pos, NULL, 0);
+  if (n > CRYPT_STACK_IOVECS)
+    iovecs = tr_new (struct evbuffer_iovec, n);
+  n = evbuffer_peek (buf, len, &pos, iovecs, n);
+
+  for (i=0; i<n && len>0; ++i)
+    {
+      const size_t thisPass = MIN (iovecs[i].iov_len, len);
+      tr_rc4_process (key, iovecs[i].iov_base, iovecs[i].iov_base, thisPass);
+      len -= thisPass;
+    }
+
+  if (iovecs != stack_iovecs)
+    tr_free (iovecs);
+}
+
+void
+tr_cryptoDecryptBuffer (tr_crypto       * crypto,
+                        struct evbuffer * buf,
+                        size_t            offset,
+                        size_t            len)
+{
+  cryptBuffer (crypto->dec_key, buf, offset, len);
+}
+
+void
+tr_cryptoEncryptBuffer (tr_crypto       * crypto,
+                        struct evbuffer * buf,
+                        size_t            offset,
+                        size_t            len)
+{
+  cryptBuffer (crypto->enc_key, buf, offset, len);
 }
 
 /**
@@ -306,7 +308,7 @@ tr_cryptoRandInt (int upperBound)
 
   assert (upperBound > 0);
 
-  if (RAND_pseudo_bytes ((unsigned char *) &noise, sizeof noise) >= 0)
+  if (tr_rand_buffer (&noise, sizeof (noise)))
     {
       val = abs (noise) % upperBound;
     }
@@ -337,8 +339,8 @@ tr_cryptoWeakRandInt (int upperBound)
 void
 tr_cryptoRandBuf (void * buf, size_t len)
 {
-  if (RAND_pseudo_bytes ((unsigned char*)buf, len) != 1)
-    logErrorFromSSL ();
+  if (!tr_rand_buffer (buf, len))
+    tr_logAddNamedError (MY_NAME, "Unable to get random bytes");
 }
 
 /***
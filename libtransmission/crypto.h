@@ -19,16 +19,16 @@
 
 #include <inttypes.h>
 
+#include "crypto-utils.h"
 #include "utils.h" /* TR_GNUC_NULL_TERMINATED */
 
+struct evbuffer;
+
 /**
 *** @addtogroup peers
 *** @{
 **/
 
-#include <openssl/dh.h> /* RC4_KEY */
-#include <openssl/rc4.h> /* DH */
-
 enum
 {
     KEY_LEN = 96
@@ -37,9 +37,9 @@ enum
 /** @brief Holds state information for encrypted peer communications */
 typedef struct
 {
-    RC4_KEY         dec_key;
-    RC4_KEY         enc_key;
-    DH *            dh;
+    tr_rc4_ctx_t    dec_key;
+    tr_rc4_ctx_t    enc_key;
+    tr_dh_ctx_t     dh;
     uint8_t         myPublicKey[KEY_LEN];
     uint8_t         mySecret[KEY_LEN];
     uint8_t         torrentHash[SHA_DIGEST_LENGTH];
@@ -82,6 +82,18 @@ void           tr_cryptoEncrypt (tr_crypto *  crypto,
                                  const void * buf_in,
                                  void *       buf_out);
 
+/** @brief decrypt `len' bytes of `buf' in place, starting at `offset' */
+void           tr_cryptoDecryptBuffer (tr_crypto       * crypto,
+                                       struct evbuffer * buf,
+                                       size_t            offset,
+                                       size_t            len);
+
+/** @brief encrypt `len' bytes of `buf' in place, starting at `offset' */
+void           tr_cryptoEncryptBuffer (tr_crypto       * crypto,
+                                       struct evbuffer * buf,
+                                       size_t            offset,
+                                       size_t            len);
+
 /* @} */
 
 /**
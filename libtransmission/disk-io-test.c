@@ -0,0 +1,242 @@
+#include <stdio.h> /* remove() */
+#include <string.h> /* memcmp(), memset() */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "cache.h"
+#include "disk-io.h"
+#include "platform.h" /* tr_lock */
+#include "session.h"
+#include "torrent.h"
+#include "trevent.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+/***
+****
+***/
+
+#define JOB_COUNT 32
+
+struct job_data
+{
+  tr_session * session;
+  tr_lock * lock;
+  int * order;
+  int * orderCount;
+  int * doneCount;
+  int index;
+  bool doneInEventThread;
+};
+
+static void
+jobFunc (void * vdata)
+{
+  struct job_data * data = vdata;
+
+  /* give the other workers a chance to jump the queue */
+  tr_wait_msec (1);
+
+  tr_lockLock (data->lock);
+  data->order[(*data->orderCount)++] = data->index;
+  tr_lockUnlock (data->lock);
+}
+
+static void
+jobDoneFunc (tr_session * session, void * vdata)
+{
+  struct job_data * data = vdata;
+
+  data->doneInEventThread = tr_amInEventThread (session);
+
+  tr_lockLock (data->lock);
+  ++*data->doneCount;
+  tr_lockUnlock (data->lock);
+}
+
+static int
+test_serial_jobs (void)
+{
+  int i;
+  int order[JOB_COUNT];
+  int orderCount = 0;
+  int doneCount = 0;
+  struct job_data data[JOB_COUNT];
+  tr_session * session;
+  tr_variant settings;
+  tr_lock * lock = tr_lockNew ();
+  const time_t deadline = time (NULL) + 5;
+
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddInt (&settings, TR_KEY_disk_io_threads, 4);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+  check_int_eq (4, tr_sessionGetDiskIoThreads (session));
+  check (tr_diskIoIsEnabled (session->diskIo));
+
+  for (i=0; i<JOB_COUNT; ++i)
+    {
+      memset (&data[i], 0, sizeof (struct job_data));
+      data[i].session = session;
+      data[i].lock = lock;
+      data[i].order = order;
+      data[i].orderCount = &orderCount;
+      data[i].doneCount = &doneCount;
+      data[i].index = i;
+      tr_diskIoAdd (session->diskIo, 1, jobFunc, jobDoneFunc, &data[i]);
+    }
+
+  /* jobs that share a serial run one at a time, in order */
+  tr_diskIoWait (session->diskIo, 1);
+  check_int_eq (JOB_COUNT, orderCount);
+  for (i=0; i<JOB_COUNT; ++i)
+    check_int_eq (i, order[i]);
+
+  /* and their done callbacks are run in the libevent thread */
+  while ((doneCount < JOB_COUNT) && (time (NULL) <= deadline))
+    tr_wait_msec (10);
+  check_int_eq (JOB_COUNT, doneCount);
+  for (i=0; i<JOB_COUNT; ++i)
+    check (data[i].doneInEventThread);
+
+  libttest_session_close (session);
+  tr_lockFree (lock);
+  return 0;
+}
+
+/* closing the session mustn't drop done callbacks that haven't run yet */
+static int
+test_done_at_close (void)
+{
+  int i;
+  int order[JOB_COUNT];
+  int orderCount = 0;
+  int doneCount = 0;
+  struct job_data data[JOB_COUNT];
+  tr_session * session;
+  tr_variant settings;
+  tr_lock * lock = tr_lockNew ();
+
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddInt (&settings, TR_KEY_disk_io_threads, 4);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+
+  for (i=0; i<JOB_COUNT; ++i)
+    {
+      memset (&data[i], 0, sizeof (struct job_data));
+      data[i].session = session;
+      data[i].lock = lock;
+      data[i].order = order;
+      data[i].orderCount = &orderCount;
+      data[i].doneCount = &doneCount;
+      data[i].index = i;
+      tr_diskIoAdd (session->diskIo, 0, jobFunc, jobDoneFunc, &data[i]);
+    }
+
+  libttest_session_close (session);
+
+  check_int_eq (JOB_COUNT, orderCount);
+  check_int_eq (JOB_COUNT, doneCount);
+  for (i=0; i<JOB_COUNT; ++i)
+    check (data[i].doneInEventThread);
+
+  tr_lockFree (lock);
+  return 0;
+}
+
+/***
+****
+***/
+
+struct write_data
+{
+  tr_session * session;
+  tr_torrent * tor;
+  bool allFound;
+  bool done;
+};
+
+/* with no room in the cache, every block is written in the background.
+   each one must stay readable until it's on disk. */
+static void
+test_cache_writes_threadfunc (void * vdata)
+{
+  tr_block_index_t i, first, last;
+  struct write_data * data = vdata;
+  tr_torrent * tor = data->tor;
+  uint8_t * block = tr_new0 (uint8_t, tor->blockSize);
+  uint8_t * readback = tr_new (uint8_t, tor->blockSize);
+  struct evbuffer * buf = evbuffer_new ();
+
+  data->allFound = true;
+  tr_torGetPieceBlockRange (tor, 0, &first, &last);
+  for (i=first; i<=last; ++i)
+    {
+      const uint32_t offset = i * tor->blockSize;
+      const uint32_t len = tr_torBlockCountBytes (tor, i);
+
+      evbuffer_add (buf, block, len);
+      tr_cacheWriteBlock (data->session->cache, tor, 0, offset, len, buf);
+      tr_torrentGotBlock (tor, i);
+
+      memset (readback, 1, len);
+      data->allFound &= !tr_cacheReadBlock (data->session->cache, tor, 0, offset, len, readback);
+      data->allFound &= !memcmp (block, readback, len);
+    }
+
+  evbuffer_free (buf);
+  tr_free (readback);
+  tr_free (block);
+  data->done = true;
+}
+
+static int
+test_cache_writes (void)
+{
+  tr_session * session;
+  tr_torrent * tor;
+  tr_variant settings;
+  struct write_data data;
+
+  tr_variantInitDict (&settings, 2);
+  tr_variantDictAddInt (&settings, TR_KEY_disk_io_threads, 2);
+  tr_variantDictAddInt (&settings, TR_KEY_cache_size_mb, 0);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+
+  /* the zero torrent is missing its first piece */
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, false);
+  check_int_eq (tor->info.pieceSize, tr_torrentStat(tor)->leftUntilDone);
+
+  data.session = session;
+  data.tor = tor;
+  data.done = false;
+  tr_runInEventThread (session, test_cache_writes_threadfunc, &data);
+  do { tr_wait_msec (50); } while (!data.done);
+  check (data.allFound);
+
+  libttest_blockingTorrentVerify (tor);
+  check_int_eq (0, tr_torrentStat(tor)->leftUntilDone);
+
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_serial_jobs,
+                             test_done_at_close,
+                             test_cache_writes };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -0,0 +1,324 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+
+#include "transmission.h"
+#include "disk-io.h"
+#include "list.h"
+#include "log.h"
+#include "platform.h" /* tr_lock, tr_cond, tr_threadNew () */
+#include "session.h"
+#include "trevent.h" /* tr_runInEventThread () */
+#include "utils.h"
+
+#define MY_NAME "Disk I/O"
+
+#define dbgmsg(...) \
+  do \
+    { \
+      if (tr_logGetDeepEnabled ()) \
+        tr_logAddDeep (__FILE__, __LINE__, MY_NAME, __VA_ARGS__); \
+    } \
+  while (0)
+
+/***
+****
+***/
+
+struct disk_io_job
+{
+  int serial;
+  tr_session * session;
+  tr_disk_io_func func;
+  tr_disk_io_done_func done_func;
+  void * user_data;
+};
+
+struct tr_disk_io
+{
+  tr_session * session;
+
+  tr_lock * lock;
+  tr_cond * workCond; /* signalled when a job is added */
+  tr_cond * doneCond; /* signalled when a job finishes or a thread exits */
+
+  tr_list * queue;    /* struct disk_io_job, oldest first */
+  tr_list * running;  /* struct disk_io_job */
+  tr_list * done;     /* struct disk_io_job whose done_func hasn't run yet */
+  bool isDonePosted;  /* true if onJobsDone () is waiting to run */
+
+  int threadCount;
+  int targetThreadCount;
+};
+
+static bool
+listHasSerial (tr_list * l, int serial)
+{
+  for (; l!=NULL; l=l->next)
+    if (((const struct disk_io_job*)l->data)->serial == serial)
+      return true;
+
+  return false;
+}
+
+/* find the oldest job that isn't waiting for another job with its serial */
+static struct disk_io_job *
+popRunnableJob (tr_disk_io * io)
+{
+  tr_list * l;
+
+  for (l=io->queue; l!=NULL; l=l->next)
+    {
+      struct disk_io_job * job = l->data;
+
+      if (job->serial != 0)
+        {
+          tr_list * prev;
+          bool blocked = listHasSerial (io->running, job->serial);
+
+          for (prev=io->queue; !blocked && prev!=l; prev=prev->next)
+            blocked = ((const struct disk_io_job*)prev->data)->serial == job->serial;
+
+          if (blocked)
+            continue;
+        }
+
+      tr_list_remove_data (&io->queue, job);
+      return job;
+    }
+
+  return NULL;
+}
+
+static void
+jobDone (void * vjob)
+{
+  struct disk_io_job * job = vjob;
+
+  if (job->done_func != NULL)
+    {
+      tr_sessionLock (job->session);
+      job->done_func (job->session, job->user_data);
+      tr_sessionUnlock (job->session);
+    }
+
+  tr_free (job);
+}
+
+/* run the done callbacks of every job that's finished so far */
+static void
+runDoneJobs (tr_disk_io * io)
+{
+  struct disk_io_job * job;
+
+  tr_lockLock (io->lock);
+  io->isDonePosted = false;
+
+  while ((job = tr_list_pop_front (&io->done)))
+    {
+      tr_lockUnlock (io->lock);
+      jobDone (job);
+      tr_lockLock (io->lock);
+    }
+
+  tr_lockUnlock (io->lock);
+}
+
+static void
+onJobsDone (void * vsession)
+{
+  tr_session * session = vsession;
+
+  /* if the pool's already been freed, tr_diskIoFree () ran them */
+  if (session->diskIo != NULL)
+    runDoneJobs (session->diskIo);
+}
+
+static void
+workerThreadFunc (void * vio)
+{
+  tr_disk_io * io = vio;
+
+  tr_lockLock (io->lock);
+
+  for (;;)
+    {
+      struct disk_io_job * job = popRunnableJob (io);
+
+      if (job != NULL)
+        {
+          tr_list_append (&io->running, job);
+          tr_lockUnlock (io->lock);
+
+          job->func (job->user_data);
+
+          tr_lockLock (io->lock);
+          tr_list_remove_data (&io->running, job);
+          tr_list_append (&io->done, job);
+          tr_condBroadcast (io->doneCond);
+
+          /* one onJobsDone () runs every job that's done by then */
+          if (!io->isDonePosted)
+            {
+              io->isDonePosted = true;
+
+              /* this can block if the libevent thread is busy,
+                 so don't hold the lock while doing it */
+              tr_lockUnlock (io->lock);
+              tr_runInEventThread (io->session, onJobsDone, io->session);
+              tr_lockLock (io->lock);
+            }
+        }
+      else if (io->threadCount > io->targetThreadCount)
+        {
+          break;
+        }
+      else
+        {
+          tr_condWait (io->workCond, io->lock);
+        }
+    }
+
+  --io->threadCount;
+  dbgmsg ("worker thread exiting; %d left", io->threadCount);
+  tr_condBroadcast (io->doneCond);
+  tr_lockUnlock (io->lock);
+}
+
+/***
+****
+***/
+
+tr_disk_io *
+tr_diskIoNew (tr_session * session)
+{
+  tr_disk_io * io = tr_new0 (tr_disk_io, 1);
+
+  io->session = session;
+  io->lock = tr_lockNew ();
+  io->workCond = tr_condNew ();
+  io->doneCond = tr_condNew ();
+
+  return io;
+}
+
+void
+tr_diskIoFree (tr_disk_io * io)
+{
+  assert (tr_amInEventThread (io->session));
+
+  tr_lockLock (io->lock);
+
+  /* the workers empty the queue before they exit */
+  io->targetThreadCount = 0;
+  tr_condBroadcast (io->workCond);
+  while (io->threadCount > 0)
+    tr_condWait (io->doneCond, io->lock);
+
+  assert (io->queue == NULL);
+  assert (io->running == NULL);
+
+  tr_lockUnlock (io->lock);
+
+  /* don't leave the last done callbacks to an onJobsDone () that
+     might never run if the libevent loop is about to stop */
+  runDoneJobs (io);
+  assert (io->done == NULL);
+
+  tr_condFree (io->doneCond);
+  tr_condFree (io->workCond);
+  tr_lockFree (io->lock);
+  tr_free (io);
+}
+
+void
+tr_diskIoSetThreadCount (tr_disk_io * io, int threadCount)
+{
+  tr_lockLock (io->lock);
+
+  io->targetThreadCount = MAX (0, threadCount);
+
+  while (io->threadCount < io->targetThreadCount)
+    {
+      ++io->threadCount;
+      tr_threadNew (workerThreadFunc, io);
+    }
+
+  /* let any extra workers notice that they should exit */
+  if (io->threadCount > io->targetThreadCount)
+    tr_condBroadcast (io->workCond);
+
+  tr_lockUnlock (io->lock);
+}
+
+int
+tr_diskIoGetThreadCount (const tr_disk_io * io)
+{
+  return io->targetThreadCount;
+}
+
+bool
+tr_diskIoIsEnabled (const tr_disk_io * io)
+{
+  return (io != NULL) && (io->targetThreadCount > 0);
+}
+
+void
+tr_diskIoAdd (tr_disk_io           * io,
+              int                    serial,
+              tr_disk_io_func        func,
+              tr_disk_io_done_func   done_func,
+              void                 * user_data)
+{
+  struct disk_io_job * job;
+
+  assert (func != NULL);
+
+  job = tr_new (struct disk_io_job, 1);
+  job->serial = serial;
+  job->session = io->session;
+  job->func = func;
+  job->done_func = done_func;
+  job->user_data = user_data;
+
+  tr_lockLock (io->lock);
+
+  if (io->threadCount > 0)
+    {
+      tr_list_append (&io->queue, job);
+      tr_condSignal (io->workCond);
+      job = NULL;
+    }
+
+  tr_lockUnlock (io->lock);
+
+  /* no workers, so do the job here */
+  if (job != NULL)
+    {
+      tr_diskIoWait (io, serial);
+      job->func (job->user_data);
+      jobDone (job);
+    }
+}
+
+void
+tr_diskIoWait (tr_disk_io * io, int serial)
+{
+  tr_lockLock (io->lock);
+
+  if (serial != 0)
+    while (listHasSerial (io->queue, serial) || listHasSerial (io->running, serial))
+      tr_condWait (io->doneCond, io->lock);
+
+  tr_lockUnlock (io->lock);
+}
@@ -0,0 +1,76 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_DISK_IO_H
+#define TR_DISK_IO_H
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/**
+ * A small pool of worker threads that do blocking disk I/O
+ * so that the libevent thread doesn't have to wait on the disk.
+ *
+ * Jobs never touch the session, its torrents, or the file cache:
+ * anything a job needs (such as file descriptors from tr_ioRequestNew ())
+ * must be gathered by the libevent thread when the job is added.
+ */
+typedef struct tr_disk_io tr_disk_io;
+
+/** @brief called in a worker thread to do the job's blocking I/O */
+typedef void (*tr_disk_io_func)(void * user_data);
+
+/** @brief called in the libevent thread, with the session locked,
+           after the job's tr_disk_io_func has returned */
+typedef void (*tr_disk_io_done_func)(tr_session * session, void * user_data);
+
+tr_disk_io * tr_diskIoNew (tr_session * session);
+
+/** @brief Wait for every queued job to run, stop the worker threads,
+    and run the done callbacks that haven't run yet.
+    Must be called in the libevent thread. */
+void tr_diskIoFree (tr_disk_io * io);
+
+/** @brief Set how many worker threads to use. 0 disables the pool. */
+void tr_diskIoSetThreadCount (tr_disk_io * io, int threadCount);
+
+int tr_diskIoGetThreadCount (const tr_disk_io * io);
+
+/** @brief Returns true if jobs can be added to `io'. */
+bool tr_diskIoIsEnabled (const tr_disk_io * io);
+
+/**
+ * @brief Queue a job to be run by one of the worker threads.
+ *
+ * Jobs with the same nonzero `serial' run one at a time,
+ * in the order they were added. Jobs whose serial is 0
+ * can run in any order.
+ */
+void tr_diskIoAdd (tr_disk_io           * io,
+                   int                    serial,
+                   tr_disk_io_func        func,
+                   tr_disk_io_done_func   done_func,
+                   void                 * user_data);
+
+/** @brief Block until none of the jobs with this serial are queued or running.
+    Their done callbacks may still be pending. */
+void tr_diskIoWait (tr_disk_io * io, int serial);
+
+/* @} */
+
+#endif
@@ -17,6 +17,11 @@
  #define _XOPEN_SOURCE 600
 #endif
 
+/* _XOPEN_SOURCE hides preadv () and pwritev () */
+#if defined (HAVE_PREADV) && !defined (_DEFAULT_SOURCE)
+ #define _DEFAULT_SOURCE
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -40,10 +45,25 @@
 #include <sys/resource.h> /* getrlimit */
 #include <fcntl.h> /* O_LARGEFILE posix_fadvise */
 #include <unistd.h> /* lseek (), write (), ftruncate (), pread (), pwrite (), etc */
+#ifdef HAVE_MMAP
+ #include <sys/mman.h> /* mmap (), munmap () */
+#endif
+#if defined (HAVE_PREADV) && defined (HAVE_PWRITEV)
+ #include <sys/uio.h> /* preadv (), pwritev () */
+#endif
+
+#include <event2/buffer.h>
+#include <event2/event.h> /* LIBEVENT_VERSION_NUMBER */
+
+/* evbuffer_file_segment arrived in libevent 2.1 */
+#if LIBEVENT_VERSION_NUMBER >= 0x02010000
+ #define HAVE_EVBUFFER_FILE_SEGMENT
+#endif
 
 #include "transmission.h"
 #include "fdlimit.h"
 #include "log.h"
+#include "platform.h" /* tr_lock */
 #include "session.h"
 #include "torrent.h" /* tr_isTorrent () */
 
@@ -231,6 +251,99 @@ tr_pwrite (int fd, const void *buf, size_t count, off_t offset)
 #endif
 }
 
+/* how many buffers to hand to the kernel at once */
+#define TR_IOV_BATCH 64
+
+/* Returns how many bytes were read or written, or -1 on error.
+ * Short transfers are picked up where they left off, so a write
+ * either writes everything or fails. A read stops early only at
+ * the end of the file. */
+static ssize_t
+readOrWriteVector (int                             fd,
+                   const struct evbuffer_iovec   * vec,
+                   int                             count,
+                   off_t                           offset,
+                   bool                            doWrite)
+{
+  ssize_t total = 0;
+  size_t skip = 0; /* how much of vec[0] has been done already */
+
+  for (;;)
+    {
+      ssize_t rc;
+
+      /* move past the buffers that are done, and any empty ones */
+      while ((count > 0) && (skip >= vec->iov_len))
+        {
+          skip -= vec->iov_len;
+          ++vec;
+          --count;
+        }
+
+      if (count == 0)
+        break;
+
+#if defined (HAVE_PREADV) && defined (HAVE_PWRITEV)
+      {
+        int i;
+        struct iovec iov[TR_IOV_BATCH];
+        const int n = MIN (count, TR_IOV_BATCH);
+
+        for (i=0; i<n; ++i)
+          {
+            iov[i].iov_base = vec[i].iov_base;
+            iov[i].iov_len = vec[i].iov_len;
+          }
+
+        iov[0].iov_base = (char*)iov[0].iov_base + skip;
+        iov[0].iov_len -= skip;
+
+        rc = doWrite ? pwritev (fd, iov, n, offset)
+                     : preadv (fd, iov, n, offset);
+      }
+#else
+      rc = doWrite ? tr_pwrite (fd, (const char*)vec->iov_base + skip, vec->iov_len - skip, offset)
+                   : tr_pread (fd, (char*)vec->iov_base + skip, vec->iov_len - skip, offset);
+#endif
+
+      if (rc < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          return -1;
+        }
+
+      if (rc == 0)
+        {
+          /* end of file */
+          if (!doWrite)
+            break;
+
+          errno = EIO;
+          return -1;
+        }
+
+      total += rc;
+      offset += rc;
+      skip += rc;
+    }
+
+  return total;
+}
+
+ssize_t
+tr_preadv (int fd, const struct evbuffer_iovec * vec, int count, off_t offset)
+{
+  return readOrWriteVector (fd, vec, count, offset, false);
+}
+
+ssize_t
+tr_pwritev (int fd, const struct evbuffer_iovec * vec, int count, off_t offset)
+{
+  return readOrWriteVector (fd, vec, count, offset, true);
+}
+
 int
 tr_prefetch (int fd UNUSED, off_t offset UNUSED, size_t count UNUSED)
 {
@@ -295,6 +408,109 @@ tr_close_file (int fd)
 ******
 *****/
 
+/* A read-only memory mapping of part of a cached file.
+ * Blocks served from it may still be sitting in peers' output buffers
+ * after the file is closed or has moved on to another window,
+ * so it's refcounted and only unmapped when the last one is gone.
+ * Reactor threads drop their references without the session lock,
+ * so the refcount is guarded by a lock of its own. */
+struct tr_file_window
+{
+  tr_lock * lock;
+  int refcount;
+  uint8_t * base;
+  uint64_t offset;
+  size_t length;
+};
+
+enum
+{
+  /* how much of a file to map at a time */
+  FILE_WINDOW_SIZE = (32 * 1024 * 1024)
+};
+
+static void
+file_window_ref (struct tr_file_window * w)
+{
+  tr_lockLock (w->lock);
+  assert (w->refcount > 0);
+  ++w->refcount;
+  tr_lockUnlock (w->lock);
+}
+
+static void
+file_window_unref (struct tr_file_window * w)
+{
+  bool is_last;
+
+  tr_lockLock (w->lock);
+  assert (w->refcount > 0);
+  is_last = --w->refcount == 0;
+  tr_lockUnlock (w->lock);
+
+  if (is_last)
+    {
+#ifdef HAVE_MMAP
+      munmap (w->base, w->length);
+#endif
+      tr_lockFree (w->lock);
+      tr_free (w);
+    }
+}
+
+static void
+file_window_evbuffer_cleanup (const void * data UNUSED, size_t len UNUSED, void * vw)
+{
+  file_window_unref (vw);
+}
+
+/* A dup () of a cached file's fd for requests that run later in another
+ * thread, such as tr_io_requests. They all share it instead of getting
+ * a dup () apiece, and it stays open until the last of them is freed,
+ * even if the file is closed in the meantime.
+ * The refcount is guarded by the session lock. */
+struct tr_shared_fd
+{
+  int refcount;
+  int fd;
+  tr_session * session;
+};
+
+/* returns NULL and sets errno if the fd can't be dup ()ed */
+static tr_shared_fd *
+shared_fd_new (tr_session * session, int fd)
+{
+  tr_shared_fd * h = NULL;
+
+  if ((fd = dup (fd)) >= 0)
+    {
+      h = tr_new (tr_shared_fd, 1);
+      h->refcount = 1; /* the cached file's reference */
+      h->fd = fd;
+      h->session = session;
+    }
+
+  return h;
+}
+
+static void
+shared_fd_unref (tr_shared_fd * h)
+{
+  tr_session * session = h->session;
+
+  tr_sessionLock (session);
+
+  assert (h->refcount > 0);
+
+  if (--h->refcount == 0)
+    {
+      tr_close_file (h->fd);
+      tr_free (h);
+    }
+
+  tr_sessionUnlock (session);
+}
+
 struct tr_cached_file
 {
   bool is_writable;
@@ -302,6 +518,16 @@ struct tr_cached_file
   int torrent_id;
   tr_file_index_t file_index;
   time_t used_at;
+  struct tr_file_window * window;
+  tr_shared_fd * shared;
+#ifdef HAVE_EVBUFFER_FILE_SEGMENT
+  /* the part of the file that peers' output buffers are sending
+   * straight from. It has its own fd, so it outlives the cached
+   * file until the last of them is sent */
+  struct evbuffer_file_segment * segment;
+  uint64_t segment_offset;
+  size_t segment_length;
+#endif
 };
 
 static inline bool
@@ -312,6 +538,16 @@ cached_file_is_open (const struct tr_cached_file * o)
   return o->fd >= 0;
 }
 
+static void
+cached_file_drop_window (struct tr_cached_file * o)
+{
+  if (o->window != NULL)
+    {
+      file_window_unref (o->window);
+      o->window = NULL;
+    }
+}
+
 static void
 cached_file_close (struct tr_cached_file * o)
 {
@@ -319,8 +555,113 @@ cached_file_close (struct tr_cached_file * o)
 
   tr_close_file (o->fd);
   o->fd = -1;
+
+  cached_file_drop_window (o);
+
+  if (o->shared != NULL)
+    {
+      shared_fd_unref (o->shared);
+      o->shared = NULL;
+    }
+
+#ifdef HAVE_EVBUFFER_FILE_SEGMENT
+  if (o->segment != NULL)
+    {
+      evbuffer_file_segment_free (o->segment);
+      o->segment = NULL;
+    }
+#endif
 }
 
+#ifdef HAVE_MMAP
+/**
+ * Maps the part of the file that holds [offset...offset+len).
+ * returns 0 on success, or an errno value on failure.
+ */
+static int
+cached_file_map_window (struct tr_cached_file * o,
+                        uint64_t                 offset,
+                        size_t                   len,
+                        uint64_t                 file_size)
+{
+  void * base;
+  uint64_t begin;
+  struct tr_file_window * w;
+  const uint64_t page_size = sysconf (_SC_PAGESIZE);
+
+  /* map the window that the range falls in, unless it straddles two
+   * windows... in that case, start mapping at the range's first page */
+  begin = offset - (offset % FILE_WINDOW_SIZE);
+  if (offset + len > begin + FILE_WINDOW_SIZE)
+    begin = offset - (offset % page_size);
+
+  len = MIN (FILE_WINDOW_SIZE, file_size - begin);
+  base = mmap (NULL, len, PROT_READ, MAP_SHARED, o->fd, begin);
+  if (base == MAP_FAILED)
+    return errno;
+
+  if (o->window != NULL)
+    file_window_unref (o->window);
+
+  w = tr_new (struct tr_file_window, 1);
+  w->lock = tr_lockNew ();
+  w->refcount = 1; /* the cached file's reference */
+  w->base = base;
+  w->offset = begin;
+  w->length = len;
+  o->window = w;
+  return 0;
+}
+#endif
+
+#ifdef HAVE_EVBUFFER_FILE_SEGMENT
+/**
+ * Makes a file segment for the part of the file that holds
+ * [offset...offset+len). The segment gets its own dup () of the fd,
+ * which it closes when it's freed and no buffer uses it anymore.
+ * returns 0 on success, or an errno value on failure.
+ */
+static int
+cached_file_make_segment (struct tr_cached_file * o, uint64_t offset, size_t len)
+{
+  int fd;
+  uint64_t begin;
+  struct stat sb;
+  struct evbuffer_file_segment * seg;
+
+  if (fstat (o->fd, &sb))
+    return errno;
+
+  if (offset + len > (uint64_t)sb.st_size)
+    return EINVAL;
+
+  /* same windows as cached_file_map_window (), so that a segment that
+   * libevent can't sendfile () from only gets this much mapped */
+  begin = offset - (offset % FILE_WINDOW_SIZE);
+  if (offset + len > begin + FILE_WINDOW_SIZE)
+    begin = offset;
+  len = MIN (FILE_WINDOW_SIZE, (uint64_t)sb.st_size - begin);
+
+  if ((fd = dup (o->fd)) < 0)
+    return errno;
+
+  seg = evbuffer_file_segment_new (fd, begin, len, EVBUF_FS_CLOSE_ON_FREE);
+  if (seg == NULL)
+    {
+      close (fd);
+      return EIO;
+    }
+
+  if (o->segment != NULL)
+    evbuffer_file_segment_free (o->segment);
+
+  o->segment = seg;
+  o->segment_offset = begin;
+  o->segment_length = len;
+  return 0;
+}
+#endif
+
 /**
  * returns 0 on success, or an errno value on failure.
  * errno values include ENOENT if the parent folder doesn't exist,
@@ -412,13 +753,12 @@ static void
 fileset_construct (struct tr_fileset * set, int n)
 {
   struct tr_cached_file * o;
-  const struct tr_cached_file TR_CACHED_FILE_INIT = { 0, -1, 0, 0, 0 };
 
-  set->begin = tr_new (struct tr_cached_file, n);
+  set->begin = tr_new0 (struct tr_cached_file, n);
   set->end = set->begin + n;
 
   for (o=set->begin; o!=set->end; ++o)
-    *o = TR_CACHED_FILE_INIT;
+    o->fd = -1;
 }
 
 static void
@@ -587,6 +927,137 @@ tr_fdFileGetCached (tr_session * s, int torrent_id, tr_file_index_t i, bool writ
   return o->fd;
 }
 
+int
+tr_fdFileAddMappedRef (tr_session       * s,
+                       int                torrent_id,
+                       tr_file_index_t    i,
+                       uint64_t           offset,
+                       size_t             len,
+                       struct evbuffer  * buf)
+{
+#ifdef HAVE_MMAP
+  int err = 0;
+  struct stat sb;
+  struct tr_file_window * w;
+  struct tr_cached_file * o = fileset_lookup (get_fileset (s), torrent_id, i);
+
+  if (o == NULL)
+    return EBADF;
+
+  if (fstat (o->fd, &sb))
+    return errno;
+
+  /* touching mapped pages past the end of the file raises SIGBUS,
+   * so if the file has been truncated since the window was mapped,
+   * let go of it and leave this range to tr_pread () */
+  if (offset + len > (uint64_t)sb.st_size)
+    {
+      cached_file_drop_window (o);
+      return EINVAL;
+    }
+
+  w = o->window;
+  if ((w == NULL) || (offset < w->offset) || (offset + len > w->offset + w->length))
+    {
+      if ((err = cached_file_map_window (o, offset, len, sb.st_size)))
+        return err;
+
+      w = o->window;
+    }
+
+  file_window_ref (w);
+  if (evbuffer_add_reference (buf, w->base + (offset - w->offset), len,
+                              file_window_evbuffer_cleanup, w))
+    {
+      file_window_unref (w);
+      return ENOMEM;
+    }
+
+  o->used_at = tr_time ();
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
+tr_shared_fd *
+tr_fdFileRef (tr_session * s, int torrent_id, tr_file_index_t i, bool writable)
+{
+  tr_shared_fd * h = NULL;
+  struct tr_cached_file * o;
+
+  tr_sessionLock (s);
+
+  o = fileset_lookup (get_fileset (s), torrent_id, i);
+
+  if (o == NULL || (writable && !o->is_writable))
+    {
+      errno = EBADF;
+    }
+  else
+    {
+      if (o->shared == NULL)
+        o->shared = shared_fd_new (s, o->fd);
+
+      if ((h = o->shared) != NULL)
+        {
+          ++h->refcount;
+          o->used_at = tr_time ();
+        }
+    }
+
+  tr_sessionUnlock (s);
+  return h;
+}
+
+int
+tr_sharedFdGetFd (const tr_shared_fd * h)
+{
+  return h->fd;
+}
+
+void
+tr_sharedFdUnref (tr_shared_fd * h)
+{
+  shared_fd_unref (h);
+}
+
+int
+tr_fdFileAddSegment (tr_session       * s,
+                     int                torrent_id,
+                     tr_file_index_t    i,
+                     uint64_t           offset,
+                     size_t             len,
+                     struct evbuffer  * buf)
+{
+#ifdef HAVE_EVBUFFER_FILE_SEGMENT
+  int err = 0;
+  struct tr_cached_file * o = fileset_lookup (get_fileset (s), torrent_id, i);
+
+  if (o == NULL)
+    return EBADF;
+
+  if ((o->segment == NULL) || (offset < o->segment_offset)
+                           || (offset + len > o->segment_offset + o->segment_length))
+    if ((err = cached_file_make_segment (o, offset, len)))
+      return err;
+
+#ifdef EVBUFFER_FLAG_DRAINS_TO_FD
+  /* libevent only uses sendfile () for buffers flagged like this;
+     otherwise it maps the segment into memory */
+  evbuffer_set_flags (buf, EVBUFFER_FLAG_DRAINS_TO_FD);
+#endif
+
+  if (evbuffer_add_file_segment (buf, o->segment, offset - o->segment_offset, len))
+    return EIO;
+
+  o->used_at = tr_time ();
+  return 0;
+#else
+  return ENOSYS;
+#endif
+}
+
 #ifdef SYS_DARWIN
  #define TR_STAT_MTIME(sb)((sb).st_mtimespec.tv_sec)
 #else
@@ -17,6 +17,9 @@
 #include "transmission.h"
 #include "net.h"
 
+struct evbuffer;
+struct evbuffer_iovec;
+
 /**
  * @addtogroup file_io File IO
  * @{
@@ -38,8 +41,17 @@ int tr_fsync (int fd);
 
 ssize_t tr_pread (int fd, void *buf, size_t count, off_t offset);
 ssize_t tr_pwrite (int fd, const void *buf, size_t count, off_t offset);
-int tr_prefetch (int fd, off_t offset, size_t count);
 
+/**
+ * Like tr_pread () and tr_pwrite (), but for a list of buffers.
+ * Uses preadv () and pwritev () where they're available.
+ * Short transfers are retried, so tr_pwritev () writes everything or
+ * fails, and tr_preadv () only comes up short at the end of the file.
+ * @return the number of bytes read or written, or -1 with errno set
+ */
+ssize_t tr_preadv (int fd, const struct evbuffer_iovec * vec, int count, off_t offset);
+ssize_t tr_pwritev (int fd, const struct evbuffer_iovec * vec, int count, off_t offset);
+int tr_prefetch (int fd, off_t offset, size_t count);
 
 /**
  * Returns an fd to the specified filename.
@@ -74,6 +86,68 @@ bool tr_fdFileGetCachedMTime (tr_session       * session,
                               tr_file_index_t    file_num,
                               time_t           * mtime);
 
+/**
+ * Appends `len' bytes of a checked-out file, starting at `offset',
+ * to `buf' as a reference into a read-only memory mapping of the file
+ * rather than copying them. The mapping stays alive until `buf' lets
+ * go of the bytes, even if the file is closed in the meantime.
+ *
+ * returns 0 on success, or an errno value on failure.
+ * On failure, nothing is added to `buf' and the caller should
+ * fall back to tr_pread ().
+ */
+int tr_fdFileAddMappedRef (tr_session       * session,
+                           int                torrent_id,
+                           tr_file_index_t    file_num,
+                           uint64_t           offset,
+                           size_t             len,
+                           struct evbuffer  * buf);
+
+/**
+ * A refcounted fd for a checked-out file that's shared by everyone
+ * who needs the file to stay open after the file cache closes it.
+ * @see tr_fdFileRef
+ */
+typedef struct tr_shared_fd tr_shared_fd;
+
+/**
+ * Returns a new reference to the checked-out file's shared fd,
+ * creating it if needed. The file's users all share a single dup ()
+ * of its fd, which is closed after the file's been closed and the
+ * last reference is released with tr_sharedFdUnref ().
+ *
+ * Returns NULL and sets errno on failure.
+ */
+tr_shared_fd * tr_fdFileRef (tr_session       * session,
+                             int                torrent_id,
+                             tr_file_index_t    file_num,
+                             bool               doWrite);
+
+int tr_sharedFdGetFd (const tr_shared_fd * shared);
+
+/** @brief Release a reference from tr_fdFileRef (). Safe to call from any thread. */
+void tr_sharedFdUnref (tr_shared_fd * shared);
+
+/**
+ * Appends `len' bytes of a checked-out file, starting at `offset',
+ * to `buf' as a file segment so that libevent can write them to a
+ * socket with sendfile () instead of copying them through userspace.
+ *
+ * Each cached file keeps one refcounted segment with its own fd for
+ * the part of the file being served, so blocks added from it don't
+ * cost a descriptor apiece. The segment stays alive until `buf' lets
+ * go of the bytes, even if the file is closed in the meantime.
+ *
+ * returns 0 on success, or an errno value on failure.
+ * On failure, nothing is added to `buf'.
+ */
+int tr_fdFileAddSegment (tr_session       * session,
+                         int                torrent_id,
+                         tr_file_index_t    file_num,
+                         uint64_t           offset,
+                         size_t             len,
+                         struct evbuffer  * buf);
+
 
 /**
  * Closes a file that's being held by our file repository.
@@ -0,0 +1,508 @@
+#include <string.h> /* memcmp(), memset() */
+
+#include <errno.h>
+#include <fcntl.h> /* open() */
+#include <signal.h> /* signal(), SIGXFSZ */
+
+#include <sys/types.h>
+#include <sys/resource.h> /* setrlimit() */
+#include <sys/socket.h> /* socketpair() */
+#include <unistd.h> /* close(), read() */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "fdlimit.h"
+#include "inout.h"
+#include "platform.h" /* tr_threadNew (), tr_lock */
+#include "session.h" /* tr_sessionLock () */
+#include "torrent.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+/***
+****
+***/
+
+static int
+test_read_to_buffer_impl (bool mmap_enabled)
+{
+  tr_piece_index_t i;
+  tr_session * session;
+  tr_torrent * tor;
+  tr_variant settings;
+
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddBool (&settings, TR_KEY_mmap_enabled, mmap_enabled);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+  check (tr_sessionIsMmapEnabled (session) == mmap_enabled);
+
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+  libttest_blockingTorrentVerify (tor);
+  check_int_eq (0, tr_torrentStat(tor)->leftUntilDone);
+
+  for (i=0; i<tor->info.pieceCount; ++i)
+    {
+      const uint32_t len = tr_torPieceCountBytes (tor, i);
+      uint8_t * expected = tr_new (uint8_t, len);
+      struct evbuffer * buf = evbuffer_new ();
+
+      check_int_eq (0, tr_ioRead (tor, i, 0, len, expected));
+      check_int_eq (0, tr_ioReadToBuffer (tor, i, 0, len, buf, false));
+      check_int_eq (len, evbuffer_get_length (buf));
+
+      /* the buffer must stay valid after the files are closed */
+      tr_sessionLock (session);
+      tr_fdTorrentClose (session, tr_torrentId (tor));
+      tr_sessionUnlock (session);
+      check (!memcmp (expected, evbuffer_pullup (buf, -1), len));
+
+      evbuffer_free (buf);
+      tr_free (expected);
+    }
+
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+static int
+test_read_to_buffer (void)
+{
+  int rv;
+
+  if ((rv = test_read_to_buffer_impl (false)))
+    return rv;
+
+  if ((rv = test_read_to_buffer_impl (true)))
+    return rv;
+
+  return 0;
+}
+
+/* buffers that test_mapped_refs_across_threads () hands to a thread
+   that frees them, the way a reactor thread drains its output */
+#define MAPPED_REF_COUNT 2000
+
+struct buffer_queue
+{
+  tr_lock * lock;
+  struct evbuffer * bufs[MAPPED_REF_COUNT];
+  int head;
+  int tail;
+  bool done;
+};
+
+static void
+free_queued_buffers (void * vq)
+{
+  struct buffer_queue * q = vq;
+
+  for (;;)
+    {
+      struct evbuffer * buf = NULL;
+      bool done;
+
+      tr_lockLock (q->lock);
+      if (q->tail < q->head)
+        buf = q->bufs[q->tail++];
+      done = q->done && (q->tail == q->head);
+      tr_lockUnlock (q->lock);
+
+      if (buf != NULL)
+        evbuffer_free (buf);
+      else if (done)
+        break;
+      else
+        tr_wait_msec (1);
+    }
+
+  tr_lockLock (q->lock);
+  q->done = false;
+  tr_lockUnlock (q->lock);
+}
+
+static int
+test_mapped_refs_across_threads (void)
+{
+  int i;
+  bool freeing;
+  uint8_t * expected;
+  tr_session * session;
+  tr_torrent * tor;
+  tr_variant settings;
+  struct buffer_queue q;
+  const uint32_t len = 1024;
+
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddBool (&settings, TR_KEY_mmap_enabled, true);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+  libttest_blockingTorrentVerify (tor);
+
+  expected = tr_new (uint8_t, len);
+  check_int_eq (0, tr_ioRead (tor, 0, 0, len, expected));
+
+  memset (&q, 0, sizeof (q));
+  q.lock = tr_lockNew ();
+  tr_threadNew (free_queued_buffers, &q);
+
+  /* map and drop windows here while the other thread drops its
+     references to them */
+  for (i=0; i<MAPPED_REF_COUNT; ++i)
+    {
+      uint8_t got[1024];
+      struct evbuffer * buf = evbuffer_new ();
+
+      tr_sessionLock (session);
+      check_int_eq (0, tr_ioReadToBuffer (tor, 0, 0, len, buf, false));
+      if (i % 7 == 0)
+        tr_fdTorrentClose (session, tr_torrentId (tor));
+      tr_sessionUnlock (session);
+
+      check_int_eq (len, evbuffer_copyout (buf, got, len));
+      check (!memcmp (expected, got, len));
+
+      tr_lockLock (q.lock);
+      q.bufs[q.head++] = buf;
+      tr_lockUnlock (q.lock);
+    }
+
+  tr_lockLock (q.lock);
+  q.done = true;
+  tr_lockUnlock (q.lock);
+  do
+    {
+      tr_wait_msec (1);
+      tr_lockLock (q.lock);
+      freeing = q.done;
+      tr_lockUnlock (q.lock);
+    }
+  while (freeing);
+
+  tr_lockFree (q.lock);
+  tr_free (expected);
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+static int
+test_mapped_ref_truncated_file (void)
+{
+  int fd;
+  char * path;
+  tr_session * session;
+  tr_torrent * tor;
+  tr_variant settings;
+  tr_file_index_t fi;
+  struct evbuffer * mapped;
+  struct evbuffer * buf;
+  const uint32_t len = 1024;
+
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddBool (&settings, TR_KEY_mmap_enabled, true);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+  libttest_blockingTorrentVerify (tor);
+
+  for (fi=0; fi<tor->info.fileCount; ++fi)
+    if (tor->info.files[fi].length >= 2 * len)
+      break;
+  check (fi < tor->info.fileCount);
+  path = tr_torrentFindFile (tor, fi);
+  check (path != NULL);
+
+  tr_sessionLock (session);
+  fd = tr_fdFileCheckout (session, tr_torrentId (tor), fi, path, false,
+                          TR_PREALLOCATE_NONE, tor->info.files[fi].length);
+  check (fd >= 0);
+  mapped = evbuffer_new ();
+  check_int_eq (0, tr_fdFileAddMappedRef (session, tr_torrentId (tor), fi, len, len, mapped));
+
+  /* once the file shrinks, ranges past its new end must not be
+     handed out from the window that's still mapped */
+  check_int_eq (0, truncate (path, len));
+  buf = evbuffer_new ();
+  check (tr_fdFileAddMappedRef (session, tr_torrentId (tor), fi, len, len, buf) != 0);
+  check_int_eq (0, evbuffer_get_length (buf));
+
+  /* ranges still inside the file get mapped again */
+  check_int_eq (0, tr_fdFileAddMappedRef (session, tr_torrentId (tor), fi, 0, len, buf));
+  check_int_eq (len, evbuffer_get_length (buf));
+  tr_sessionUnlock (session);
+
+  evbuffer_free (mapped);
+  evbuffer_free (buf);
+  tr_free (path);
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/* point `vec' at `buf' in pieces of different sizes */
+static int
+makeVector (uint8_t * buf, size_t len, struct evbuffer_iovec * vec, size_t seed)
+{
+  int n = 0;
+
+  while (len > 0)
+    {
+      const size_t thisPass = MIN (len, 1 + (seed * 7919 + n * 104729) % 5000);
+
+      vec[n].iov_base = buf;
+      vec[n].iov_len = thisPass;
+      ++n;
+
+      buf += thisPass;
+      len -= thisPass;
+    }
+
+  return n;
+}
+
+/* write and read every piece, including the ones that span files,
+   from buffers that are split up at odd places */
+static int
+test_vector_io (void)
+{
+  int n;
+  size_t j;
+  tr_piece_index_t i;
+  tr_session * session;
+  tr_torrent * tor;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+  libttest_blockingTorrentVerify (tor);
+  check (tor->info.fileCount > 1);
+
+  for (i=0; i<tor->info.pieceCount; ++i)
+    {
+      const uint32_t len = tr_torPieceCountBytes (tor, i);
+      uint8_t * writeme = tr_new (uint8_t, len);
+      uint8_t * readback = tr_new0 (uint8_t, len);
+      struct evbuffer_iovec * vec = tr_new (struct evbuffer_iovec, len);
+
+      for (j=0; j<len; ++j)
+        writeme[j] = (uint8_t)(j * 7 + i);
+
+      n = makeVector (writeme, len, vec, i);
+      check_int_eq (0, tr_ioWritev (tor, i, 0, vec, n));
+      check_int_eq (0, tr_ioRead (tor, i, 0, len, readback));
+      check (!memcmp (writeme, readback, len));
+
+      memset (readback, 0, len);
+      n = makeVector (readback, len, vec, i + 1);
+      check_int_eq (0, tr_ioReadv (tor, i, 0, vec, n));
+      check (!memcmp (writeme, readback, len));
+
+      tr_free (vec);
+      tr_free (readback);
+      tr_free (writeme);
+    }
+
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/* a write that the kernel cuts short has to finish or fail, not quietly
+   drop the rest; and a read only stops early at the end of the file */
+static int
+test_short_transfers (void)
+{
+  int i;
+  int fd;
+  char * path;
+  uint8_t data[4][4096];
+  struct evbuffer_iovec vec[5];
+  struct rlimit old_limit;
+  struct rlimit limit;
+  tr_session * session = libttest_session_init (NULL);
+
+  /* four buffers, with an empty one after the first */
+  for (i=0; i<4; ++i)
+    {
+      memset (data[i], 'a' + i, sizeof (data[i]));
+      vec[i ? i + 1 : 0].iov_base = data[i];
+      vec[i ? i + 1 : 0].iov_len = sizeof (data[i]);
+    }
+  vec[1].iov_base = NULL;
+  vec[1].iov_len = 0;
+
+  path = tr_buildPath (tr_sessionGetConfigDir (session), "short", NULL);
+  fd = open (path, O_CREAT|O_RDWR|O_TRUNC, 0600);
+  check (fd >= 0);
+  check_int_eq (2 * 4096, tr_pwritev (fd, vec, 3, 0));
+
+  /* the file can't grow past 10000 bytes, so writing past 8192
+     gets cut short and then fails with EFBIG */
+  signal (SIGXFSZ, SIG_IGN);
+  getrlimit (RLIMIT_FSIZE, &old_limit);
+  limit = old_limit;
+  limit.rlim_cur = 10000;
+  setrlimit (RLIMIT_FSIZE, &limit);
+  errno = 0;
+  check_int_eq (-1, tr_pwritev (fd, vec + 3, 2, 2 * 4096));
+  check_int_eq (EFBIG, errno);
+  setrlimit (RLIMIT_FSIZE, &old_limit);
+  signal (SIGXFSZ, SIG_DFL);
+
+  /* reading everything stops at the end of the file */
+  for (i=0; i<4; ++i)
+    memset (data[i], 0, sizeof (data[i]));
+  check_int_eq (10000, tr_preadv (fd, vec, 5, 0));
+  check (data[0][0] == 'a' && data[1][4095] == 'b');
+  check (data[2][0] == 'c' && data[2][10000 - 2 * 4096 - 1] == 'c');
+  check (data[2][10000 - 2 * 4096] == 0 && data[3][0] == 0);
+
+  close (fd);
+  remove (path);
+  tr_free (path);
+  libttest_session_close (session);
+  return 0;
+}
+
+/* the file segments must go out through a socket, just like to a peer */
+static int
+test_read_to_socket (void)
+{
+  int fds[2];
+  tr_piece_index_t i;
+  tr_session * session;
+  tr_torrent * tor;
+  tr_variant settings;
+
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddBool (&settings, TR_KEY_sendfile_enabled, true);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+  check (tr_sessionIsSendfileEnabled (session));
+
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+  libttest_blockingTorrentVerify (tor);
+  check_int_eq (0, tr_torrentStat(tor)->leftUntilDone);
+  check (!socketpair (AF_UNIX, SOCK_STREAM, 0, fds));
+
+  for (i=0; i<tor->info.pieceCount; ++i)
+    {
+      size_t got = 0;
+      const uint32_t len = tr_torPieceCountBytes (tor, i);
+      uint8_t * expected = tr_new (uint8_t, len);
+      uint8_t * actual = tr_new (uint8_t, len);
+      struct evbuffer * buf = evbuffer_new ();
+
+      check_int_eq (0, tr_ioRead (tor, i, 0, len, expected));
+      check_int_eq (0, tr_ioReadToBuffer (tor, i, 0, len, buf, true));
+      check_int_eq (len, evbuffer_get_length (buf));
+
+      /* the segment holds its own fd, so closing the files is safe */
+      tr_sessionLock (session);
+      tr_fdTorrentClose (session, tr_torrentId (tor));
+      tr_sessionUnlock (session);
+
+      while (got < len)
+        {
+          ssize_t n;
+
+          if (evbuffer_get_length (buf) > 0)
+            check (evbuffer_write (buf, fds[0]) > 0);
+
+          n = read (fds[1], actual + got, len - got);
+          check (n > 0);
+          got += n;
+        }
+
+      check_int_eq (0, evbuffer_get_length (buf));
+      check (!memcmp (expected, actual, len));
+
+      evbuffer_free (buf);
+      tr_free (actual);
+      tr_free (expected);
+    }
+
+  close (fds[0]);
+  close (fds[1]);
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/* returns the lowest fd that isn't in use */
+static int
+lowest_free_fd (void)
+{
+  const int fd = dup (STDIN_FILENO);
+  close (fd);
+  return fd;
+}
+
+#define SHARED_FD_BLOCK_COUNT 64
+
+/* serving lots of blocks from one file mustn't cost an fd apiece */
+static int
+test_read_to_socket_shares_fds (void)
+{
+  int i;
+  int fd_before;
+  tr_session * session;
+  tr_torrent * tor;
+  tr_variant settings;
+  struct evbuffer * bufs[SHARED_FD_BLOCK_COUNT];
+  const uint32_t len = 1024;
+
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddBool (&settings, TR_KEY_sendfile_enabled, true);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+  libttest_blockingTorrentVerify (tor);
+
+  /* open the file and make its segment */
+  bufs[0] = evbuffer_new ();
+  check_int_eq (0, tr_ioReadToBuffer (tor, 0, 0, len, bufs[0], true));
+  fd_before = lowest_free_fd ();
+
+  for (i=1; i<SHARED_FD_BLOCK_COUNT; ++i)
+    {
+      bufs[i] = evbuffer_new ();
+      check_int_eq (0, tr_ioReadToBuffer (tor, 0, (uint32_t)i, len, bufs[i], true));
+      check_int_eq (len, evbuffer_get_length (bufs[i]));
+    }
+
+  check_int_eq (fd_before, lowest_free_fd ());
+
+  for (i=0; i<SHARED_FD_BLOCK_COUNT; ++i)
+    evbuffer_free (bufs[i]);
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_read_to_buffer,
+                             test_read_to_socket,
+                             test_read_to_socket_shares_fds,
+                             test_vector_io,
+                             test_short_transfers,
+                             test_mapped_refs_across_threads,
+                             test_mapped_ref_truncated_file };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -14,17 +14,20 @@
 #include <errno.h>
 #include <stdlib.h> /* bsearch () */
 #include <string.h> /* memcmp () */
+#include <unistd.h> /* dup () */
 
-#include <openssl/sha.h>
+#include <event2/buffer.h>
 
 #include "transmission.h"
 #include "cache.h" /* tr_cacheReadBlock () */
+#include "crypto-utils.h" /* tr_sha1_init (), etc */
 #include "fdlimit.h"
 #include "inout.h"
 #include "log.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
 #include "stats.h" /* tr_statsFileCreated () */
 #include "torrent.h"
+#include "trevent.h" /* tr_amInEventThread () */
 #include "utils.h"
 
 /****
@@ -39,32 +42,21 @@ enum
   TR_IO_WRITE
 };
 
-/* returns 0 on success, or an errno on failure */
+/**
+ * Finds the fd for one of a torrent's files, opening (and, if we're
+ * writing, maybe creating) the file if it's not already cached.
+ * returns 0 on success, or an errno on failure
+ */
 static int
-readOrWriteBytes (tr_session       * session,
-                  tr_torrent       * tor,
-                  int                ioMode,
-                  tr_file_index_t    fileIndex,
-                  uint64_t           fileOffset,
-                  void             * buf,
-                  size_t             buflen)
+getFileFd (tr_session       * session,
+           tr_torrent       * tor,
+           tr_file_index_t    fileIndex,
+           bool               doWrite,
+           int              * setme)
 {
   int fd;
   int err = 0;
-  const bool doWrite = ioMode >= TR_IO_WRITE;
-  const tr_info * const info = &tor->info;
-  const tr_file * const file = &info->files[fileIndex];
-
-  assert (fileIndex < info->fileCount);
-  assert (!file->length || (fileOffset < file->length));
-  assert (fileOffset + buflen <= file->length);
-
-  if (!file->length)
-    return 0;
-
-  /***
-  ****  Find the fd
-  ***/
+  const tr_file * const file = &tor->info.files[fileIndex];
 
   fd = tr_fdFileGetCached (session, tr_torrentId (tor), fileIndex, doWrite);
   if (fd < 0)
@@ -115,6 +107,39 @@ readOrWriteBytes (tr_session       * session,
       tr_free (subpath);
     }
 
+  *setme = fd;
+  return err;
+}
+
+/* returns 0 on success, or an errno on failure */
+static int
+readOrWriteBytes (tr_session       * session,
+                  tr_torrent       * tor,
+                  int                ioMode,
+                  tr_file_index_t    fileIndex,
+                  uint64_t           fileOffset,
+                  void             * buf,
+                  size_t             buflen)
+{
+  int fd;
+  int err = 0;
+  const bool doWrite = ioMode >= TR_IO_WRITE;
+  const tr_info * const info = &tor->info;
+  const tr_file * const file = &info->files[fileIndex];
+
+  assert (fileIndex < info->fileCount);
+  assert (!file->length || (fileOffset < file->length));
+  assert (fileOffset + buflen <= file->length);
+
+  if (!file->length)
+    return 0;
+
+  /***
+  ****  Find the fd
+  ***/
+
+  err = getFileFd (session, tor, fileIndex, doWrite, &fd);
+
   /***
   ****  Use the fd
   ***/
@@ -265,6 +290,367 @@ tr_ioWrite (tr_torrent       * tor,
   return readOrWritePiece (tor, TR_IO_WRITE, pieceIndex, begin, (uint8_t*)buf, len);
 }
 
+/**
+ * Points `out' at the next `len' bytes of the buffers in `*vec',
+ * starting `*skip' bytes into the first one, and advances past them.
+ * @return the number of entries of `out' that were used
+ */
+static int
+sliceVector (const struct evbuffer_iovec  ** vec,
+             size_t                        * skip,
+             size_t                          len,
+             struct evbuffer_iovec         * out)
+{
+  int n = 0;
+
+  while (len > 0)
+    {
+      const size_t avail = (*vec)->iov_len - *skip;
+      const size_t thisPass = MIN (avail, len);
+
+      if (thisPass > 0)
+        {
+          out[n].iov_base = (char*)(*vec)->iov_base + *skip;
+          out[n].iov_len = thisPass;
+          ++n;
+        }
+
+      len -= thisPass;
+
+      if (thisPass == avail)
+        {
+          ++*vec;
+          *skip = 0;
+        }
+      else
+        {
+          *skip += thisPass;
+        }
+    }
+
+  return n;
+}
+
+static size_t
+getVectorLength (const struct evbuffer_iovec * vec, int count)
+{
+  int i;
+  size_t len = 0;
+
+  for (i=0; i<count; ++i)
+    len += vec[i].iov_len;
+
+  return len;
+}
+
+/* returns 0 on success, or an errno on failure */
+static int
+readOrWritePieceVector (tr_torrent                   * tor,
+                        bool                           doWrite,
+                        tr_piece_index_t               pieceIndex,
+                        uint32_t                       pieceOffset,
+                        const struct evbuffer_iovec  * vec,
+                        int                            count)
+{
+  int err = 0;
+  size_t skip = 0;
+  uint64_t fileOffset;
+  tr_file_index_t fileIndex;
+  struct evbuffer_iovec * slice;
+  size_t len = getVectorLength (vec, count);
+
+  if (pieceIndex >= tor->info.pieceCount)
+    return EINVAL;
+
+  /* each file gets at most one piece of each buffer */
+  slice = tr_new (struct evbuffer_iovec, count);
+  tr_ioFindFileLocation (tor, pieceIndex, pieceOffset, &fileIndex, &fileOffset);
+
+  while (len && !err)
+    {
+      int fd;
+      const tr_file * file = &tor->info.files[fileIndex];
+      const uint64_t bytesThisPass = MIN (len, file->length - fileOffset);
+      const int n = sliceVector (&vec, &skip, bytesThisPass, slice);
+
+      if ((bytesThisPass > 0) && !(err = getFileFd (tor->session, tor, fileIndex, doWrite, &fd)))
+        {
+          const ssize_t rc = doWrite ? tr_pwritev (fd, slice, n, fileOffset)
+                                     : tr_preadv (fd, slice, n, fileOffset);
+          if (rc < 0)
+            {
+              err = errno;
+              tr_logAddTorErr (tor, "%s failed for \"%s\": %s", doWrite ? "write" : "read", file->name, tr_strerror (err));
+            }
+        }
+
+      if ((err != 0) && doWrite && (tor->error != TR_STAT_LOCAL_ERROR))
+        {
+          char * path = tr_buildPath (tor->downloadDir, file->name, NULL);
+          tr_torrentSetLocalError (tor, "%s (%s)", tr_strerror (err), path);
+          tr_free (path);
+        }
+
+      len -= bytesThisPass;
+      fileIndex++;
+      fileOffset = 0;
+    }
+
+  tr_free (slice);
+  return err;
+}
+
+int
+tr_ioReadv (tr_torrent                   * tor,
+            tr_piece_index_t               pieceIndex,
+            uint32_t                       begin,
+            const struct evbuffer_iovec  * vec,
+            int                            count)
+{
+  return readOrWritePieceVector (tor, false, pieceIndex, begin, vec, count);
+}
+
+int
+tr_ioWritev (tr_torrent                   * tor,
+             tr_piece_index_t               pieceIndex,
+             uint32_t                       begin,
+             const struct evbuffer_iovec  * vec,
+             int                            count)
+{
+  return readOrWritePieceVector (tor, true, pieceIndex, begin, vec, count);
+}
+
+/* returns 0 on success, or an errno on failure */
+static int
+readBytesToBuffer (tr_torrent       * tor,
+                   tr_file_index_t    fileIndex,
+                   uint64_t           fileOffset,
+                   size_t             len,
+                   struct evbuffer  * buf,
+                   bool               allowSendfile)
+{
+  int fd;
+  int err;
+  ssize_t rc;
+  struct evbuffer_iovec iovec[1];
+  tr_session * session = tor->session;
+  const tr_file * const file = &tor->info.files[fileIndex];
+
+  assert (fileOffset + len <= file->length);
+
+  if (!file->length)
+    return 0;
+
+  if ((err = getFileFd (session, tor, fileIndex, false, &fd)))
+    return err;
+
+  /* if we can, let the socket write straight from the file... */
+  if (allowSendfile && session->isSendfileEnabled)
+    if (!tr_fdFileAddSegment (session, tor->uniqueId, fileIndex, fileOffset, len, buf))
+      return 0;
+
+  /* ...or hand out a reference to the mapped file instead of a copy */
+  if (session->isMmapEnabled)
+    if (!tr_fdFileAddMappedRef (session, tor->uniqueId, fileIndex, fileOffset, len, buf))
+      return 0;
+
+  evbuffer_reserve_space (buf, len, iovec, 1);
+  rc = tr_pread (fd, iovec[0].iov_base, len, fileOffset);
+  if (rc < 0)
+    {
+      err = errno;
+      tr_logAddTorErr (tor, "read failed for \"%s\": %s", file->name, tr_strerror (err));
+    }
+  else
+    {
+      iovec[0].iov_len = len;
+      evbuffer_commit_space (buf, iovec, 1);
+    }
+
+  return err;
+}
+
+int
+tr_ioReadToBuffer (tr_torrent       * tor,
+                   tr_piece_index_t   pieceIndex,
+                   uint32_t           begin,
+                   uint32_t           len,
+                   struct evbuffer  * buf,
+                   bool               allowSendfile)
+{
+  int err = 0;
+  uint64_t fileOffset;
+  tr_file_index_t fileIndex;
+
+  if (pieceIndex >= tor->info.pieceCount)
+    return EINVAL;
+
+  tr_ioFindFileLocation (tor, pieceIndex, begin, &fileIndex, &fileOffset);
+
+  while (len && !err)
+    {
+      const tr_file * file = &tor->info.files[fileIndex];
+      const uint64_t bytesThisPass = MIN (len, file->length - fileOffset);
+
+      err = readBytesToBuffer (tor, fileIndex, fileOffset, bytesThisPass, buf, allowSendfile);
+      len -= bytesThisPass;
+      fileIndex++;
+      fileOffset = 0;
+    }
+
+  return err;
+}
+
+/****
+*****
+****/
+
+struct tr_io_span
+{
+  tr_shared_fd * file;
+  tr_file_index_t fileIndex;
+  uint64_t fileOffset;
+  size_t length;
+};
+
+struct tr_io_request
+{
+  bool doWrite;
+  int spanCount;
+  struct tr_io_span * spans;
+};
+
+tr_io_request *
+tr_ioRequestNew (tr_torrent       * tor,
+                 bool               doWrite,
+                 tr_piece_index_t   pieceIndex,
+                 uint32_t           begin,
+                 uint32_t           len,
+                 int              * err)
+{
+  uint64_t fileOffset;
+  tr_file_index_t fileIndex;
+  tr_io_request * req;
+
+  assert (tr_isTorrent (tor));
+  assert (tr_amInEventThread (tor->session));
+
+  *err = 0;
+
+  if (pieceIndex >= tor->info.pieceCount)
+    {
+      *err = EINVAL;
+      return NULL;
+    }
+
+  req = tr_new0 (tr_io_request, 1);
+  req->doWrite = doWrite;
+
+  tr_ioFindFileLocation (tor, pieceIndex, begin, &fileIndex, &fileOffset);
+
+  while (len && !*err)
+    {
+      int fd;
+      const tr_file * file = &tor->info.files[fileIndex];
+      const uint64_t bytesThisPass = MIN (len, file->length - fileOffset);
+
+      if (bytesThisPass > 0)
+        {
+          /* hold a reference to the file's shared fd so that it
+             stays valid even if the file cache closes the file */
+          if (!(*err = getFileFd (tor->session, tor, fileIndex, doWrite, &fd)))
+            {
+              struct tr_io_span * span;
+
+              req->spans = tr_renew (struct tr_io_span, req->spans, req->spanCount + 1);
+              span = &req->spans[req->spanCount];
+
+              if ((span->file = tr_fdFileRef (tor->session, tor->uniqueId, fileIndex, doWrite)) == NULL)
+                {
+                  *err = errno;
+                }
+              else
+                {
+                  span->fileIndex = fileIndex;
+                  span->fileOffset = fileOffset;
+                  span->length = bytesThisPass;
+                  ++req->spanCount;
+                }
+            }
+        }
+
+      len -= bytesThisPass;
+      fileIndex++;
+      fileOffset = 0;
+    }
+
+  if (*err)
+    {
+      tr_ioRequestFree (req);
+      req = NULL;
+    }
+
+  return req;
+}
+
+int
+tr_ioRequestRunv (tr_io_request                * req,
+                  const struct evbuffer_iovec  * vec,
+                  int                            count,
+                  tr_file_index_t              * setme_file)
+{
+  int i;
+  int err = 0;
+  size_t skip = 0;
+  struct evbuffer_iovec * slice = tr_new (struct evbuffer_iovec, count);
+
+  for (i=0; !err && i<req->spanCount; ++i)
+    {
+      const struct tr_io_span * span = &req->spans[i];
+      const int n = sliceVector (&vec, &skip, span->length, slice);
+      const int fd = tr_sharedFdGetFd (span->file);
+      const ssize_t rc = req->doWrite
+                       ? tr_pwritev (fd, slice, n, span->fileOffset)
+                       : tr_preadv (fd, slice, n, span->fileOffset);
+
+      if (rc < 0)
+        {
+          err = errno;
+          if (setme_file != NULL)
+            *setme_file = span->fileIndex;
+        }
+    }
+
+  tr_free (slice);
+  return err;
+}
+
+int
+tr_ioRequestRun (tr_io_request * req, uint8_t * buf, tr_file_index_t * setme_file)
+{
+  int i;
+  struct evbuffer_iovec vec[1];
+
+  vec[0].iov_base = buf;
+  vec[0].iov_len = 0;
+  for (i=0; i<req->spanCount; ++i)
+    vec[0].iov_len += req->spans[i].length;
+
+  return tr_ioRequestRunv (req, vec, 1, setme_file);
+}
+
+void
+tr_ioRequestFree (tr_io_request * req)
+{
+  int i;
+
+  for (i=0; i<req->spanCount; ++i)
+    tr_sharedFdUnref (req->spans[i].file);
+
+  tr_free (req->spans);
+  tr_free (req);
+}
+
 /****
 *****
 ****/
@@ -277,7 +663,7 @@ recalculateHash (tr_torrent * tor, tr_piece_index_t pieceIndex, uint8_t * setme)
   bool  success = true;
   const size_t buflen = tor->blockSize;
   void * buffer = tr_valloc (buflen);
-  SHA_CTX  sha;
+  tr_sha1_ctx_t sha;
 
   assert (tor != NULL);
   assert (pieceIndex < tor->info.pieceCount);
@@ -285,7 +671,7 @@ recalculateHash (tr_torrent * tor, tr_piece_index_t pieceIndex, uint8_t * setme)
   assert (buflen > 0);
   assert (setme != NULL);
 
-  SHA1_Init (&sha);
+  sha = tr_sha1_init ();
   bytesLeft = tr_torPieceCountBytes (tor, pieceIndex);
 
   tr_ioPrefetch (tor, pieceIndex, offset, bytesLeft);
@@ -296,13 +682,12 @@ recalculateHash (tr_torrent * tor, tr_piece_index_t pieceIndex, uint8_t * setme)
       success = !tr_cacheReadBlock (tor->session->cache, tor, pieceIndex, offset, len, buffer);
       if (!success)
         break;
-      SHA1_Update (&sha, buffer, len);
+      tr_sha1_update (sha, buffer, len);
       offset += len;
       bytesLeft -= len;
     }
 
-  if (success)
-    SHA1_Final (setme, &sha);
+  tr_sha1_final (sha, success ? setme : NULL);
 
   tr_free (buffer);
   return success;
@@ -17,6 +17,8 @@
 #ifndef TR_IO_H
 #define TR_IO_H 1
 
+struct evbuffer;
+struct evbuffer_iovec;
 struct tr_torrent;
 
 /**
@@ -34,6 +36,24 @@ int tr_ioRead (struct tr_torrent   * tor,
                uint32_t              len,
                uint8_t             * setme);
 
+/**
+ * Appends the block specified by the piece index, offset, and length to `buf'.
+ * If the session's mmap mode is enabled, the block is added as a reference
+ * into a read-only mapping of the file instead of being copied, so
+ * `buf' mustn't be modified in place (e.g., encrypted) afterwards.
+ *
+ * If `allowSendfile' is true and the session's sendfile mode is enabled,
+ * the block is added as a file segment instead. Only pass true when `buf'
+ * will be drained straight into a socket with evbuffer_write ().
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioReadToBuffer (struct tr_torrent   * tor,
+                       tr_piece_index_t      pieceIndex,
+                       uint32_t              offset,
+                       uint32_t              len,
+                       struct evbuffer     * buf,
+                       bool                  allowSendfile);
+
 int tr_ioPrefetch (tr_torrent       * tor,
                    tr_piece_index_t   pieceIndex,
                    uint32_t           begin,
@@ -49,6 +69,66 @@ int tr_ioWrite (struct tr_torrent  * tor,
                 uint32_t             len,
                 const uint8_t      * writeme);
 
+/**
+ * Like tr_ioRead () and tr_ioWrite (), but for a list of buffers that
+ * together hold the block, so that the caller doesn't have to copy
+ * them into one buffer first. The length is the sum of the buffers'.
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioReadv (struct tr_torrent             * tor,
+                tr_piece_index_t                pieceIndex,
+                uint32_t                        offset,
+                const struct evbuffer_iovec   * vec,
+                int                             count);
+
+int tr_ioWritev (struct tr_torrent            * tor,
+                 tr_piece_index_t               pieceIndex,
+                 uint32_t                       offset,
+                 const struct evbuffer_iovec  * vec,
+                 int                            count);
+
+/**
+ * A read or write whose files have already been opened, so that it
+ * can be run later from any thread without touching the torrent,
+ * the session, or the file cache; e.g. by a tr_disk_io worker.
+ */
+typedef struct tr_io_request tr_io_request;
+
+/**
+ * Finds and opens the files that hold the block specified by the
+ * piece index, offset, and length. Must be called in the libevent thread.
+ * Requests share each file's fd through tr_fdFileRef (), so queuing
+ * lots of them doesn't use up file descriptors.
+ * @return the request, or NULL with `err' set to an errno value on failure.
+ */
+tr_io_request * tr_ioRequestNew (struct tr_torrent  * tor,
+                                 bool                 doWrite,
+                                 tr_piece_index_t     pieceIndex,
+                                 uint32_t             offset,
+                                 uint32_t             len,
+                                 int                * err);
+
+/**
+ * Reads the request's block into `buf', or writes it from `buf'.
+ * Safe to call from any thread.
+ * @param setme_file if not NULL and the I/O fails, set to the failed file
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioRequestRun (tr_io_request    * req,
+                     uint8_t          * buf,
+                     tr_file_index_t  * setme_file);
+
+/**
+ * Like tr_ioRequestRun (), but reads into or writes from a list of
+ * buffers. Their lengths must add up to the request's.
+ */
+int tr_ioRequestRunv (tr_io_request                * req,
+                      const struct evbuffer_iovec  * vec,
+                      int                            count,
+                      tr_file_index_t              * setme_file);
+
+void tr_ioRequestFree (tr_io_request * req);
+
 /**
  * @brief Test to see if the piece matches its metainfo's SHA1 checksum.
  */
@@ -2,6 +2,7 @@
 #include <stdio.h>
 
 #include "transmission.h"
+#include "crypto.h" /* tr_sha1 () */
 #include "platform.h" /* TR_PATH_DELIMETER */
 #include "torrent.h"
 #include "trevent.h"
@@ -388,6 +389,84 @@ libttest_zero_torrent_populate (tr_torrent * tor, bool complete)
 ****
 ***/
 
+tr_torrent *
+libttest_fill_torrent_init (tr_session   * session,
+                            const char   * name,
+                            uint8_t        fill,
+                            uint32_t       piece_size,
+                            int            piece_count)
+{
+  int i;
+  int err;
+  int len;
+  char * benc;
+  tr_ctor * ctor;
+  tr_torrent * tor;
+  tr_variant top;
+  tr_variant * info;
+  uint8_t * piece = tr_new (uint8_t, piece_size);
+  uint8_t * hashes = tr_new (uint8_t, piece_count * SHA_DIGEST_LENGTH);
+
+  memset (piece, fill, piece_size);
+  for (i=0; i<piece_count; ++i)
+    tr_sha1 (hashes + i * SHA_DIGEST_LENGTH, piece, (int)piece_size, NULL);
+
+  tr_variantInitDict (&top, 1);
+  info = tr_variantDictAddDict (&top, TR_KEY_info, 4);
+  tr_variantDictAddInt (info, TR_KEY_length, (int64_t)piece_count * piece_size);
+  tr_variantDictAddStr (info, TR_KEY_name, name);
+  tr_variantDictAddInt (info, TR_KEY_piece_length, piece_size);
+  tr_variantDictAddRaw (info, TR_KEY_pieces, hashes, piece_count * SHA_DIGEST_LENGTH);
+  benc = tr_variantToStr (&top, TR_VARIANT_FMT_BENC, &len);
+  tr_variantFree (&top);
+
+  ctor = tr_ctorNew (session);
+  tr_ctorSetMetainfo (ctor, (uint8_t*)benc, len);
+  tr_ctorSetPaused (ctor, TR_FORCE, true);
+  err = 0;
+  tor = tr_torrentNew (ctor, &err, NULL);
+  assert (!err);
+
+  tr_ctorFree (ctor);
+  tr_free (benc);
+  tr_free (hashes);
+  tr_free (piece);
+  return tor;
+}
+
+void
+libttest_fill_torrent_populate (tr_torrent * tor, uint8_t fill, int bad_piece)
+{
+  tr_piece_index_t i;
+  FILE * fp;
+  char * path;
+  uint8_t * piece = tr_new (uint8_t, tor->info.pieceSize);
+
+  assert (tor->info.fileCount == 1);
+
+  tr_mkdirp (tor->currentDir, 0700);
+  path = tr_buildPath (tor->currentDir, tor->info.files[0].name, NULL);
+  fp = fopen (path, "wb");
+  assert (fp != NULL);
+
+  memset (piece, fill, tor->info.pieceSize);
+  for (i=0; i<tor->info.pieceCount; ++i)
+    {
+      if ((int)i == bad_piece)
+        piece[0] = (uint8_t)(fill + 1);
+      fwrite (piece, 1, tor->info.pieceSize, fp);
+      piece[0] = fill;
+    }
+
+  fclose (fp);
+  tr_free (path);
+  tr_free (piece);
+}
+
+/***
+****
+***/
+
 static void
 onVerifyDone (tr_torrent * tor UNUSED, bool aborted UNUSED, void * done)
 {
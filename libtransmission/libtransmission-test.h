@@ -72,6 +72,16 @@ void         libttest_session_close (tr_session * session);
 void         libttest_zero_torrent_populate (tr_torrent * tor, bool complete);
 tr_torrent * libttest_zero_torrent_init (tr_session * session);
 
+/* a single-file torrent whose pieces are all filled with `fill' */
+tr_torrent * libttest_fill_torrent_init (tr_session   * session,
+                                         const char   * name,
+                                         uint8_t        fill,
+                                         uint32_t       piece_size,
+                                         int            piece_count);
+
+/* write its file; if `bad_piece' is a piece index, that piece doesn't match its hash */
+void         libttest_fill_torrent_populate (tr_torrent * tor, uint8_t fill, int bad_piece);
+
 void         libttest_blockingTorrentVerify (tr_torrent * tor);
 
 
@@ -24,7 +24,7 @@
 #include <event2/util.h> /* evutil_ascii_strcasecmp () */
 
 #include "transmission.h"
-#include "crypto.h" /* tr_sha1 */
+#include "crypto-utils.h" /* tr_sha1_many () */
 #include "fdlimit.h" /* tr_open_file_for_scanning () */
 #include "log.h"
 #include "session.h"
@@ -205,6 +205,13 @@ tr_metaInfoBuilderFree (tr_metainfo_builder * builder)
 *****
 ****/
 
+/* when tr_sha1_many () has lanes, up to this many pieces
+   are read at a time and hashed together... */
+#define MAX_LANES 16
+
+/* ...as long as they fit in this much memory */
+#define MAX_BATCH_SIZE (8 * 1024 * 1024)
+
 static uint8_t*
 getHashInfo (tr_metainfo_builder * b)
 {
@@ -215,11 +222,20 @@ getHashInfo (tr_metainfo_builder * b)
   uint64_t totalRemain;
   uint64_t off = 0;
   int fd;
+  size_t n = 0;
+  size_t lanes;
+  const void * data[MAX_LANES];
+  size_t lengths[MAX_LANES];
 
   if (!b->totalSize)
     return ret;
 
-  buf = tr_valloc (b->pieceSize);
+  lanes = tr_sha1_lanes ();
+  lanes = MIN (lanes, MAX_LANES);
+  lanes = MIN (lanes, MAX_BATCH_SIZE / b->pieceSize);
+  lanes = MAX (lanes, 1);
+
+  buf = tr_valloc (lanes * b->pieceSize);
   b->pieceIndex = 0;
   totalRemain = b->totalSize;
   fd = tr_open_file_for_scanning (b->files[fileIndex].filename);
@@ -237,7 +253,8 @@ getHashInfo (tr_metainfo_builder * b)
 
   while (totalRemain)
     {
-      uint8_t * bufptr = buf;
+      uint8_t * const pieceStart = buf + n * b->pieceSize;
+      uint8_t * bufptr = pieceStart;
       const uint32_t thisPieceSize = (uint32_t) MIN (b->pieceSize, totalRemain);
       uint32_t leftInPiece = thisPieceSize;
 
@@ -273,10 +290,18 @@ getHashInfo (tr_metainfo_builder * b)
             }
         }
 
-      assert (bufptr - buf == (int)thisPieceSize);
+      assert (bufptr - pieceStart == (int)thisPieceSize);
       assert (leftInPiece == 0);
-      tr_sha1 (walk, buf, thisPieceSize, NULL);
-      walk += SHA_DIGEST_LENGTH;
+      data[n] = pieceStart;
+      lengths[n] = thisPieceSize;
+      ++n;
+
+      if (n == lanes || totalRemain == thisPieceSize)
+        {
+          tr_sha1_many (n, data, lengths, walk);
+          walk += n * SHA_DIGEST_LENGTH;
+          n = 0;
+        }
 
       if (b->abortFlag)
         {
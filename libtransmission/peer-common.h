@@ -27,6 +27,7 @@
  * @{
  */
 
+struct block_request;
 struct tr_peer;
 struct tr_swarm;
 
@@ -115,6 +116,10 @@ typedef struct tr_peer
   /* how many requests we've made and are currently awaiting a response for */
   int pendingReqsToPeer;
 
+  /* the requests we've made to this peer.
+     NOTE: private to peer-mgr.c */
+  struct block_request * requests;
+
   /* Hook to private peer-mgr information */
   struct peer_atom * atom;
 
@@ -28,6 +28,7 @@
 #include "net.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
 #include "peer-io.h"
+#include "reactor.h"
 #include "trevent.h" /* tr_runInEventThread () */
 #include "tr-utp.h"
 #include "utils.h"
@@ -388,6 +389,82 @@ event_write_cb (evutil_socket_t fd, short event UNUSED, void * vio)
         io->gotError (io, what, io->userData);
 }
 
+/* Sockets handed to a reactor thread are read and written there.
+   These do what event_read_cb () and event_write_cb () would've,
+   with the bytes the thread has moved. */
+
+static void
+reactor_read_cb (tr_peerIo * io)
+{
+    io->pendingEvents &= ~EV_READ;
+
+    tr_reactorRead (io->reactor, io->inbuf, SIZE_MAX);
+
+    dbgmsg (io, "reactor says this peer has read %"TR_PRIuSIZE" bytes",
+            evbuffer_get_length (io->inbuf));
+
+    tr_peerIoSetEnabled (io, TR_DOWN, true);
+
+    if (evbuffer_get_length (io->inbuf))
+        canReadWrapper (io);
+}
+
+static void
+reactor_write_cb (tr_peerIo * io)
+{
+    size_t howmuch;
+    const tr_direction dir = TR_UP;
+
+    io->pendingEvents &= ~EV_WRITE;
+    tr_reactorSetWriteWanted (io->reactor, false);
+
+    dbgmsg (io, "reactor says this peer is ready to write");
+
+    howmuch = tr_bandwidthClamp (&io->bandwidth, dir, evbuffer_get_length (io->outbuf));
+
+    /* if we don't have any bandwidth left, stop writing */
+    if (howmuch < 1)
+        return;
+
+    howmuch = tr_reactorWrite (io->reactor, io->outbuf, howmuch);
+
+    if (evbuffer_get_length (io->outbuf))
+        tr_peerIoSetEnabled (io, dir, true);
+
+    if (howmuch > 0)
+        didWriteWrapper (io, howmuch);
+}
+
+static void
+reactor_cb (tr_reactor_conn * conn UNUSED, short what, void * vio)
+{
+    tr_peerIo * io = vio;
+
+    assert (tr_isPeerIo (io));
+
+    tr_peerIoRef (io);
+
+    if ((what & BEV_EVENT_READING) && (io->reactor != NULL))
+        reactor_read_cb (io);
+
+    if ((what & BEV_EVENT_WRITING) && !(what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+                                   && (io->reactor != NULL))
+        reactor_write_cb (io);
+
+    if ((what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) && (io->gotError != NULL))
+    {
+        char errstr[512];
+        const int e = io->reactor ? tr_reactorGetError (io->reactor) : 0;
+
+        dbgmsg (io, "reactor got an error. what is %hd, errno is %d (%s)",
+                what, e, tr_net_strerror (errstr, sizeof (errstr), e));
+
+        io->gotError (io, what, io->userData);
+    }
+
+    tr_peerIoUnref (io);
+}
+
 /**
 ***
 **/
@@ -586,6 +663,21 @@ static struct UTPFunctionTable dummy_utp_function_table = {
 
 #endif /* #ifdef WITH_UTP */
 
+static void
+io_open_events (tr_peerIo * io)
+{
+    tr_session * session = io->session;
+
+    if (io->socket >= 0)
+        io->reactor = tr_reactorAttach (session->reactors, io->socket, reactor_cb, io);
+
+    if (io->reactor == NULL)
+    {
+        io->event_read = event_new (session->event_base, io->socket, EV_READ, event_read_cb, io);
+        io->event_write = event_new (session->event_base, io->socket, EV_WRITE, event_write_cb, io);
+    }
+}
+
 static tr_peerIo*
 tr_peerIoNew (tr_session       * session,
               tr_bandwidth     * parent,
@@ -634,10 +726,7 @@ tr_peerIoNew (tr_session       * session,
     dbgmsg (io, "socket is %d, utp_socket is %p", socket, (void*)utp_socket);
 
     if (io->socket >= 0) {
-        io->event_read = event_new (session->event_base,
-                                    io->socket, EV_READ, event_read_cb, io);
-        io->event_write = event_new (session->event_base,
-                                     io->socket, EV_WRITE, event_write_cb, io);
+        io_open_events (io);
     }
 #ifdef WITH_UTP
     else {
@@ -713,7 +802,7 @@ event_enable (tr_peerIo * io, short event)
     assert (io->session != NULL);
     assert (io->session->events != NULL);
 
-    if (io->socket >= 0)
+    if ((io->socket >= 0) && (io->reactor == NULL))
     {
         assert (event_initialized (io->event_read));
         assert (event_initialized (io->event_write));
@@ -722,15 +811,34 @@ event_enable (tr_peerIo * io, short event)
     if ((event & EV_READ) && ! (io->pendingEvents & EV_READ))
     {
         dbgmsg (io, "enabling ready-to-read polling");
-        if (io->socket >= 0)
-            event_add (io->event_read, NULL);
-        io->pendingEvents |= EV_READ;
+        if (io->reactor != NULL)
+        {
+            /* the reactor can't look at our bandwidth, so tell it up front
+               how much it may read. like event_read_cb (), don't read at all
+               if that's nothing */
+            const unsigned int max = 256 * 1024;
+            const size_t curlen = evbuffer_get_length (io->inbuf)
+                                + tr_reactorGetInputLength (io->reactor);
+            const unsigned int howmuch = tr_bandwidthClamp (&io->bandwidth, TR_DOWN,
+                                                            curlen >= max ? 0 : max - curlen);
+            tr_reactorSetReadLimit (io->reactor, howmuch);
+            if (howmuch > 0)
+                io->pendingEvents |= EV_READ;
+        }
+        else
+        {
+            if (io->socket >= 0)
+                event_add (io->event_read, NULL);
+            io->pendingEvents |= EV_READ;
+        }
     }
 
     if ((event & EV_WRITE) && ! (io->pendingEvents & EV_WRITE))
     {
         dbgmsg (io, "enabling ready-to-write polling");
-        if (io->socket >= 0)
+        if (io->reactor != NULL)
+            tr_reactorSetWriteWanted (io->reactor, true);
+        else if (io->socket >= 0)
             event_add (io->event_write, NULL);
         io->pendingEvents |= EV_WRITE;
     }
@@ -743,7 +851,7 @@ event_disable (struct tr_peerIo * io, short event)
     assert (io->session != NULL);
     assert (io->session->events != NULL);
 
-    if (io->socket >= 0)
+    if ((io->socket >= 0) && (io->reactor == NULL))
     {
         assert (event_initialized (io->event_read));
         assert (event_initialized (io->event_write));
@@ -752,7 +860,9 @@ event_disable (struct tr_peerIo * io, short event)
     if ((event & EV_READ) && (io->pendingEvents & EV_READ))
     {
         dbgmsg (io, "disabling ready-to-read polling");
-        if (io->socket >= 0)
+        if (io->reactor != NULL)
+            tr_reactorSetReadLimit (io->reactor, 0);
+        else if (io->socket >= 0)
             event_del (io->event_read);
         io->pendingEvents &= ~EV_READ;
     }
@@ -760,7 +870,9 @@ event_disable (struct tr_peerIo * io, short event)
     if ((event & EV_WRITE) && (io->pendingEvents & EV_WRITE))
     {
         dbgmsg (io, "disabling ready-to-write polling");
-        if (io->socket >= 0)
+        if (io->reactor != NULL)
+            tr_reactorSetWriteWanted (io->reactor, false);
+        else if (io->socket >= 0)
             event_del (io->event_write);
         io->pendingEvents &= ~EV_WRITE;
     }
@@ -790,6 +902,11 @@ tr_peerIoSetEnabled (tr_peerIo    * io,
 static void
 io_close_socket (tr_peerIo * io)
 {
+    if (io->reactor != NULL) {
+        tr_reactorDetach (io->reactor);
+        io->reactor = NULL;
+    }
+
     if (io->socket >= 0) {
         tr_netClose (io->session, io->socket);
         io->socket = -1;
@@ -939,8 +1056,7 @@ tr_peerIoReconnect (tr_peerIo * io)
     io_close_socket (io);
 
     io->socket = tr_netOpenPeerSocket (session, &io->addr, io->port, io->isSeed);
-    io->event_read = event_new (session->event_base, io->socket, EV_READ, event_read_cb, io);
-    io->event_write = event_new (session->event_base, io->socket, EV_WRITE, event_write_cb, io);
+    io_open_events (io);
 
     if (io->socket >= 0)
     {
@@ -1060,15 +1176,7 @@ static void
 maybeEncryptBuffer (tr_peerIo * io, struct evbuffer * buf)
 {
     if (io->encryption_type == PEER_ENCRYPTION_RC4)
-    {
-        struct evbuffer_ptr pos;
-        struct evbuffer_iovec iovec;
-        evbuffer_ptr_set (buf, &pos, 0, EVBUFFER_PTR_SET);
-        do {
-            evbuffer_peek (buf, -1, &pos, &iovec, 1);
-            tr_cryptoEncrypt (&io->crypto, iovec.iov_len, iovec.iov_base, iovec.iov_base);
-        } while (!evbuffer_ptr_set (buf, &pos, iovec.iov_len, EVBUFFER_PTR_ADD));
-    }
+        tr_cryptoEncryptBuffer (&io->crypto, buf, 0, evbuffer_get_length (buf));
 }
 
 void
@@ -1134,29 +1242,17 @@ evbuffer_add_uint64 (struct evbuffer * outbuf, uint64_t addme_hll)
 void
 tr_peerIoReadBytesToBuf (tr_peerIo * io, struct evbuffer * inbuf, struct evbuffer * outbuf, size_t byteCount)
 {
-    struct evbuffer * tmp;
     const size_t old_length = evbuffer_get_length (outbuf);
 
     assert (tr_isPeerIo (io));
     assert (evbuffer_get_length (inbuf) >= byteCount);
 
-    /* append it to outbuf */
-    tmp = evbuffer_new ();
-    evbuffer_remove_buffer (inbuf, tmp, byteCount);
-    evbuffer_add_buffer (outbuf, tmp);
-    evbuffer_free (tmp);
+    /* append it to outbuf. this moves whole chains where it can */
+    evbuffer_remove_buffer (inbuf, outbuf, byteCount);
 
     /* decrypt if needed */
-    if (io->encryption_type == PEER_ENCRYPTION_RC4) {
-        struct evbuffer_ptr pos;
-        struct evbuffer_iovec iovec;
-        evbuffer_ptr_set (outbuf, &pos, old_length, EVBUFFER_PTR_SET);
-        do {
-            evbuffer_peek (outbuf, byteCount, &pos, &iovec, 1);
-            tr_cryptoDecrypt (&io->crypto, iovec.iov_len, iovec.iov_base, iovec.iov_base);
-            byteCount -= iovec.iov_len;
-        } while (!evbuffer_ptr_set (outbuf, &pos, iovec.iov_len, EVBUFFER_PTR_ADD));
-    }
+    if (io->encryption_type == PEER_ENCRYPTION_RC4)
+        tr_cryptoDecryptBuffer (&io->crypto, outbuf, old_length, byteCount);
 }
 
 void
@@ -1235,6 +1331,14 @@ tr_peerIoTryRead (tr_peerIo * io, size_t howmuch)
             if (evbuffer_get_length (io->inbuf) == 0)
                 UTP_RBDrained (io->utp_socket);
         }
+        else if (io->reactor != NULL) /* tcp, read by a reactor thread */
+        {
+            /* errors are passed along by reactor_cb () */
+            res = tr_reactorRead (io->reactor, io->inbuf, howmuch);
+
+            if (evbuffer_get_length (io->inbuf))
+                canReadWrapper (io);
+        }
         else /* tcp peer connection */
         {
             int e;
@@ -1281,6 +1385,14 @@ tr_peerIoTryWrite (tr_peerIo * io, size_t howmuch)
             UTP_Write (io->utp_socket, howmuch);
             n = old_len - evbuffer_get_length (io->outbuf);
         }
+        else if (io->reactor != NULL) /* tcp, written by a reactor thread */
+        {
+            /* errors are passed along by reactor_cb () */
+            n = tr_reactorWrite (io->reactor, io->outbuf, howmuch);
+
+            if (n > 0)
+                didWriteWrapper (io, n);
+        }
         else
         {
             int e;
@@ -33,6 +33,7 @@ struct evbuffer;
 struct tr_bandwidth;
 struct tr_datatype;
 struct tr_peerIo;
+struct tr_reactor_conn;
 
 /**
  * @addtogroup networked_io Networked IO
@@ -115,6 +116,10 @@ typedef struct tr_peerIo
 
     struct event        * event_read;
     struct event        * event_write;
+
+    /* set when a reactor thread does this TCP socket's IO,
+       in which case event_read and event_write are unused */
+    struct tr_reactor_conn * reactor;
 }
 tr_peerIo;
 
@@ -198,6 +203,20 @@ static inline bool tr_peerIoSupportsUTP (const tr_peerIo * io)
     return io->utpSupported;
 }
 
+static inline bool tr_peerIoIsUTP (const tr_peerIo * io)
+{
+    return io->utp_socket != NULL;
+}
+
+/* whether blocks for this peer can be queued as file segments to be
+ * sent with sendfile (). uTP copies its payload out of the buffer, and
+ * a reactor thread is handed part of the buffer at a time, which
+ * libevent can't do with a file segment */
+static inline bool tr_peerIoCanSendfile (const tr_peerIo * io)
+{
+    return !tr_peerIoIsUTP (io) && (io->reactor == NULL);
+}
+
 /**
 ***
 **/
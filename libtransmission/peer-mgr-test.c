@@ -0,0 +1,936 @@
+#include <stdio.h> /* remove () */
+#include <string.h> /* memset () */
+
+/* the piece buckets, request table, candidate heaps, and host table
+   are private to the peer manager, so test them from the inside.
+   This object defines everything that peer-mgr.o does, so the linker
+   never pulls peer-mgr.o out of libtransmission.a. */
+#include "peer-mgr.c"
+
+#include "libtransmission-test.h"
+
+#define PIECE_SIZE 32768 /* two blocks */
+#define PIECE_COUNT 16
+
+/***
+****
+***/
+
+/* true if `index' is in the bucket for `priority' and `key' */
+static bool
+bucketHas (const tr_swarm * s, tr_priority_t priority, int key, tr_piece_index_t index)
+{
+  tr_piece_index_t i;
+  const struct piece_bucket * bucket = &s->buckets[priority - TR_PRI_LOW];
+
+  if (key >= bucket->count)
+    return false;
+
+  for (i=bucket->heads[key]; i!=NO_PIECE; i=s->pieceNodes[i].next)
+    if (i == index)
+      return true;
+
+  return false;
+}
+
+/* a file's first and last pieces start out high priority, for previews;
+   make them all the same so that only the replication counts differ */
+static void
+resetPiecePriorities (tr_torrent * tor)
+{
+  tr_piece_index_t i;
+
+  for (i=0; i<tor->info.pieceCount; ++i)
+    tor->info.pieces[i].priority = TR_PRI_NORMAL;
+}
+
+static void
+bitfieldInitFromPieces (tr_bitfield * b, const tr_torrent * tor, const tr_piece_index_t * pieces, int n)
+{
+  int i;
+
+  tr_bitfieldConstruct (b, tor->info.pieceCount);
+  for (i=0; i<n; ++i)
+    tr_bitfieldAdd (b, pieces[i]);
+}
+
+static int
+test_bucket_order (void)
+{
+  int i;
+  int got;
+  tr_swarm * s;
+  tr_peer few;
+  tr_peer all;
+  tr_bitfield b;
+  tr_session * session;
+  tr_torrent * tor;
+  tr_block_index_t blocks[2 * PIECE_COUNT];
+  const tr_piece_index_t highPiece = 3;
+  const tr_piece_index_t lowPiece = 9;
+  const tr_piece_index_t missingOne[] = { 0, 1, 2, 3, 4, 5, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+  const tr_piece_index_t missingTwo[] = { 0, 1, 3, 4, 5, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+  const tr_piece_index_t fewPieces[] = { 2, 7, 12 };
+
+  session = libttest_session_init (NULL);
+  tor = libttest_fill_torrent_init (session, "bucket-order", 0, PIECE_SIZE, PIECE_COUNT);
+  tr_sessionLock (session);
+  s = tor->swarm;
+
+  resetPiecePriorities (tor);
+  tor->info.pieces[highPiece].priority = TR_PRI_HIGH;
+  tor->info.pieces[lowPiece].priority = TR_PRI_LOW;
+  pieceListRebuild (s);
+  check_int_eq (PIECE_COUNT, s->bucketedCount);
+  check_int_eq (0, s->pieceCount);
+  check (bucketHas (s, TR_PRI_HIGH, 0, highPiece));
+  check (bucketHas (s, TR_PRI_LOW, 0, lowPiece));
+
+  /* piece 7 is the rarest, then piece 2, then all the others */
+  bitfieldInitFromPieces (&b, tor, missingOne, (int)(sizeof (missingOne) / sizeof (missingOne[0])));
+  tr_incrReplicationFromBitfield (s, &b);
+  tr_bitfieldDestruct (&b);
+  bitfieldInitFromPieces (&b, tor, missingTwo, (int)(sizeof (missingTwo) / sizeof (missingTwo[0])));
+  tr_incrReplicationFromBitfield (s, &b);
+  tr_bitfieldDestruct (&b);
+  check_int_eq (0, s->pieceNodes[7].key);
+  check_int_eq (1, s->pieceNodes[2].key);
+  check_int_eq (2, s->pieceNodes[0].key);
+  check_int_eq (7, s->buckets[TR_PRI_NORMAL - TR_PRI_LOW].heads[0]);
+  check_int_eq (2, s->buckets[TR_PRI_NORMAL - TR_PRI_LOW].heads[1]);
+
+  /* a peer with few pieces gets them rarest first, by walking its bitfield */
+  tr_peerConstruct (&few, tor);
+  for (i=0; i<(int)(sizeof (fewPieces) / sizeof (fewPieces[0])); ++i)
+    tr_bitfieldAdd (&few.have, fewPieces[i]);
+  tr_peerMgrGetNextRequests (tor, &few, 2, blocks, &got, false);
+  check_int_eq (2, got);
+  check_int_eq (14, blocks[0]);
+  check_int_eq (15, blocks[1]);
+  check_int_eq (PIECE_ACTIVE, s->pieceNodes[7].state);
+  tr_peerMgrGetNextRequests (tor, &few, 2, blocks, &got, false);
+  check_int_eq (2, got);
+  check_int_eq (4, blocks[0]);
+  check_int_eq (5, blocks[1]);
+  tr_peerMgrGetNextRequests (tor, &few, 2, blocks, &got, false);
+  check_int_eq (2, got);
+  check_int_eq (24, blocks[0]);
+  check_int_eq (25, blocks[1]);
+  check_int_eq (PIECE_COUNT - 3, s->bucketedCount);
+
+  /* a peer with every piece gets the high priority piece first,
+     then the normal ones, then the low priority one */
+  tr_peerConstruct (&all, tor);
+  tr_bitfieldSetHasAll (&all.have);
+  tr_peerMgrGetNextRequests (tor, &all, 2, blocks, &got, false);
+  check_int_eq (2, got);
+  check_int_eq (highPiece * 2, blocks[0]);
+  check_int_eq (highPiece * 2 + 1, blocks[1]);
+  tr_peerMgrGetNextRequests (tor, &all, 2 * (PIECE_COUNT - 4), blocks, &got, false);
+  check_int_eq (2 * (PIECE_COUNT - 4), got);
+  check_int_eq (lowPiece * 2, blocks[got - 2]);
+  check_int_eq (lowPiece * 2 + 1, blocks[got - 1]);
+  check_int_eq (0, s->bucketedCount);
+
+  /* when the peers go away, the untouched pieces go back in their buckets */
+  tr_peerDestruct (&all);
+  tr_peerDestruct (&few);
+  check_int_eq (PIECE_COUNT, s->bucketedCount);
+  check_int_eq (0, s->pieceCount);
+  check (bucketHas (s, TR_PRI_NORMAL, 0, 7));
+  tr_sessionUnlock (session);
+
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+static int
+test_rebucketing (void)
+{
+  int i;
+  int got;
+  tr_swarm * s;
+  tr_peer peer;
+  tr_bitfield b;
+  tr_session * session;
+  tr_torrent * tor;
+  tr_block_index_t blocks[2];
+  const tr_piece_index_t four[] = { 4 };
+  const tr_piece_index_t five[] = { 5 };
+
+  session = libttest_session_init (NULL);
+  tor = libttest_fill_torrent_init (session, "rebucketing", 0, PIECE_SIZE, PIECE_COUNT);
+  tr_sessionLock (session);
+  s = tor->swarm;
+  resetPiecePriorities (tor);
+  pieceListRebuild (s);
+
+  /* a HAVE moves one piece up a bucket */
+  bitfieldInitFromPieces (&b, tor, four, 1);
+  tr_incrReplicationFromBitfield (s, &b);
+  check_int_eq (1, s->pieceReplication[4]);
+  check (bucketHas (s, TR_PRI_NORMAL, 1, 4));
+  check (!bucketHas (s, TR_PRI_NORMAL, 0, 4));
+
+  /* a HaveAll moves every piece up, without touching the buckets */
+  {
+    tr_bitfield everything;
+    tr_bitfieldConstruct (&everything, tor->info.pieceCount);
+    tr_bitfieldSetHasAll (&everything);
+    tr_incrReplicationFromBitfield (s, &everything);
+    check_int_eq (1, s->replicationOffset);
+    check_int_eq (2, s->pieceReplication[4]);
+    check_int_eq (1, s->pieceReplication[0]);
+    check (bucketHas (s, TR_PRI_NORMAL, 1, 4));
+    check (bucketHas (s, TR_PRI_NORMAL, 0, 0));
+
+    /* so a piece that's had one HAVE since then joins piece 4 */
+    {
+      tr_bitfield bf;
+      bitfieldInitFromPieces (&bf, tor, five, 1);
+      tr_incrReplicationFromBitfield (s, &bf);
+      check_int_eq (2, s->pieceReplication[5]);
+      check (bucketHas (s, TR_PRI_NORMAL, 1, 5));
+      tr_bitfieldDestruct (&bf);
+    }
+
+    tr_decrReplicationFromBitfield (s, &everything);
+    check_int_eq (0, s->replicationOffset);
+    check (bucketHas (s, TR_PRI_NORMAL, 1, 4));
+    check (bucketHas (s, TR_PRI_NORMAL, 1, 5));
+    tr_bitfieldDestruct (&everything);
+  }
+
+  /* losing the peer with piece 4 moves it back down */
+  tr_decrReplicationFromBitfield (s, &b);
+  tr_bitfieldDestruct (&b);
+  check_int_eq (0, s->pieceReplication[4]);
+  check (bucketHas (s, TR_PRI_NORMAL, 0, 4));
+  check (!bucketHas (s, TR_PRI_NORMAL, 1, 4));
+
+  /* a piece we start on leaves the buckets, and goes back if
+     its requests are dropped before anything's downloaded */
+  tr_peerConstruct (&peer, tor);
+  tr_bitfieldAdd (&peer.have, 5);
+  tr_peerMgrGetNextRequests (tor, &peer, 2, blocks, &got, false);
+  check_int_eq (2, got);
+  check_int_eq (10, blocks[0]);
+  check_int_eq (PIECE_ACTIVE, s->pieceNodes[5].state);
+  check_int_eq (PIECE_COUNT - 1, s->bucketedCount);
+  for (i=0; i<PRIORITY_COUNT; ++i)
+    check (!bucketHas (s, TR_PRI_LOW + i, 1, 5));
+  tr_peerDestruct (&peer);
+  check_int_eq (PIECE_BUCKETED, s->pieceNodes[5].state);
+  check_int_eq (PIECE_COUNT, s->bucketedCount);
+  check (bucketHas (s, TR_PRI_NORMAL, 1, 5));
+
+  /* a priority change rebuckets the pieces */
+  tor->info.pieces[5].priority = TR_PRI_HIGH;
+  tr_peerMgrRebuildRequests (tor);
+  check (bucketHas (s, TR_PRI_HIGH, 1, 5));
+  check (!bucketHas (s, TR_PRI_NORMAL, 1, 5));
+  check_int_eq (PIECE_COUNT, s->bucketedCount);
+
+  tr_sessionUnlock (session);
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+#define REQUEST_COUNT 200
+
+static int
+test_request_table (void)
+{
+  int n;
+  tr_block_index_t i;
+  tr_swarm * s;
+  tr_peer a;
+  tr_peer b;
+  tr_ptrArray peers = TR_PTR_ARRAY_INIT;
+  tr_session * session;
+  tr_torrent * tor;
+  const struct block_request * r;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_fill_torrent_init (session, "requests", 0, PIECE_SIZE, REQUEST_COUNT);
+  tr_sessionLock (session);
+  s = tor->swarm;
+  tr_peerConstruct (&a, tor);
+  tr_peerConstruct (&b, tor);
+
+  /* enough requests to make the table grow a few times */
+  for (i=0; i<REQUEST_COUNT; ++i)
+    requestListAdd (s, i, (i % 2) ? &b : &a);
+  requestListAdd (s, 7, &a);
+  check_int_eq (REQUEST_COUNT + 1, s->requestCount);
+  check ((int)s->requestBucketCount >= REQUEST_COUNT + 1);
+  check_int_eq (REQUEST_COUNT / 2 + 1, a.pendingReqsToPeer);
+  check_int_eq (REQUEST_COUNT / 2, b.pendingReqsToPeer);
+
+  for (i=0; i<REQUEST_COUNT; ++i)
+    {
+      check (requestListLookup (s, i, (i % 2) ? &b : &a) != NULL);
+      check (requestListLookup (s, i, (i % 2) ? &a : &b) == NULL || i == 7);
+    }
+
+  /* both peers are asked for block 7 */
+  getBlockRequestPeers (s, 7, &peers);
+  check_int_eq (2, tr_ptrArraySize (&peers));
+  tr_ptrArrayDestruct (&peers, NULL);
+
+  /* the swarm's list is in the order the requests were sent */
+  for (i=0, r=s->oldestRequest; r!=NULL; r=r->next, ++i)
+    if (i < REQUEST_COUNT)
+      check_int_eq (i, r->block);
+  check_int_eq (REQUEST_COUNT + 1, i);
+  check_int_eq (7, s->newestRequest->block);
+  check_ptr_eq (&a, s->newestRequest->peer);
+
+  /* removing from the middle keeps all three lists linked */
+  requestListRemove (s, 100, &a);
+  requestListRemove (s, 7, &b);
+  requestListRemove (s, 0, &a);
+  check (requestListLookup (s, 100, &a) == NULL);
+  check (requestListLookup (s, 7, &b) == NULL);
+  check (requestListLookup (s, 7, &a) != NULL);
+  check_int_eq (REQUEST_COUNT - 2, s->requestCount);
+  check_int_eq (1, s->oldestRequest->block);
+  for (n=0, r=s->oldestRequest; r!=NULL; r=r->next, ++n)
+    check ((r->peer != &a) || ((r->block != 0) && (r->block != 100)));
+  check_int_eq (REQUEST_COUNT - 2, n);
+  for (n=0, r=a.requests; r!=NULL; r=r->peer_next, ++n)
+    check_ptr_eq (&a, r->peer);
+  check_int_eq (REQUEST_COUNT / 2 - 1, n);
+  check_int_eq (n, a.pendingReqsToPeer);
+
+  /* when a peer declines, only its requests go */
+  peerDeclinedAllRequests (s, &b);
+  check (b.requests == NULL);
+  check_int_eq (0, b.pendingReqsToPeer);
+  check_int_eq (REQUEST_COUNT / 2 - 1, s->requestCount);
+  for (r=s->oldestRequest; r!=NULL; r=r->next)
+    check_ptr_eq (&a, r->peer);
+
+  tr_peerDestruct (&b);
+  tr_peerDestruct (&a);
+  check_int_eq (0, s->requestCount);
+  check (s->oldestRequest == NULL);
+  check (s->newestRequest == NULL);
+  tr_sessionUnlock (session);
+
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+static bool
+blocksAreInRange (const tr_block_index_t * blocks, int n, tr_block_index_t first, tr_block_index_t last)
+{
+  int i;
+
+  for (i=0; i<n; ++i)
+    if ((blocks[i] < first) || (blocks[i] > last))
+      return false;
+
+  return true;
+}
+
+static int
+test_streaming_window (void)
+{
+  int got;
+  tr_block_index_t i;
+  tr_swarm * s;
+  tr_peer a;
+  tr_peer b;
+  tr_peer c;
+  tr_bitfield rare;
+  tr_ptrArray peers = TR_PTR_ARRAY_INIT;
+  tr_session * session;
+  tr_torrent * tor;
+  tr_block_index_t blocks[2 * PIECE_COUNT];
+
+  session = libttest_session_init (NULL);
+  tor = libttest_fill_torrent_init (session, "streaming", 0, PIECE_SIZE, PIECE_COUNT);
+  tr_sessionLock (session);
+  s = tor->swarm;
+  resetPiecePriorities (tor);
+  pieceListRebuild (s);
+
+  /* every piece but 12 has been seen once, so 12 is the rarest */
+  tr_bitfieldConstruct (&rare, tor->info.pieceCount);
+  for (i=0; i<PIECE_COUNT; ++i)
+    if (i != 12)
+      tr_bitfieldAdd (&rare, i);
+  tr_incrReplicationFromBitfield (s, &rare);
+  tr_bitfieldDestruct (&rare);
+
+  /* the window covers pieces 5 through 8, which come before the rarest */
+  tr_torrentSetStreamingWindow (tor, 3 * PIECE_SIZE);
+  tr_torrentSetStreamingPosition (tor, 5 * PIECE_SIZE + 100);
+  tr_peerConstruct (&a, tor);
+  tr_bitfieldSetHasAll (&a.have);
+  tr_peerMgrGetNextRequests (tor, &a, 8, blocks, &got, false);
+  check_int_eq (8, got);
+  for (i=0; i<8; ++i)
+    check_int_eq (10 + i, blocks[i]);
+  tr_peerMgrGetNextRequests (tor, &a, 2, blocks, &got, false);
+  check_int_eq (2, got);
+  check_int_eq (24, blocks[0]);
+  check_int_eq (25, blocks[1]);
+
+  /* before the window's pieces are late, another peer isn't asked for them... */
+  tr_peerConstruct (&b, tor);
+  tr_bitfieldAddRange (&b.have, 5, 9);
+  tr_bitfieldAdd (&b.have, 15);
+  tr_peerMgrGetNextRequests (tor, &b, 2, blocks, &got, false);
+  check_int_eq (2, got);
+  check_int_eq (30, blocks[0]);
+  check_int_eq (31, blocks[1]);
+
+  /* ...but once they are, it is */
+  tor->streamingMovedAt = tr_time_msec () - 2 * STREAMING_GRACE_MSEC;
+  tr_peerMgrGetNextRequests (tor, &b, 8, blocks, &got, false);
+  check_int_eq (8, got);
+  check (blocksAreInRange (blocks, got, 10, 17));
+  getBlockRequestPeers (s, 10, &peers);
+  check_int_eq (2, tr_ptrArraySize (&peers));
+  tr_ptrArrayDestruct (&peers, NULL);
+
+  /* without a window, sequential downloads go in piece order
+     and skip the ones that have already been started */
+  tr_torrentSetStreamingWindow (tor, 0);
+  tr_torrentSetSequentialDownload (tor, true);
+  tr_peerConstruct (&c, tor);
+  tr_bitfieldSetHasAll (&c.have);
+  tr_peerMgrGetNextRequests (tor, &c, 4, blocks, &got, false);
+  check_int_eq (4, got);
+  for (i=0; i<4; ++i)
+    check_int_eq (i, blocks[i]);
+  tr_peerMgrGetNextRequests (tor, &c, 8, blocks, &got, false);
+  check_int_eq (8, got);
+  for (i=0; i<6; ++i)
+    check_int_eq (4 + i, blocks[i]);
+  check_int_eq (18, blocks[6]);
+  check_int_eq (19, blocks[7]);
+
+  tr_peerDestruct (&c);
+  tr_peerDestruct (&b);
+  tr_peerDestruct (&a);
+  tr_sessionUnlock (session);
+
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+#define PASS_TORRENT_COUNT 4
+
+static int visitedIds[PASS_TORRENT_COUNT * 2];
+static int visitedCount;
+static bool passIsSlow;
+
+static void
+visitSwarm (tr_swarm * s)
+{
+  visitedIds[visitedCount++] = s->tor->uniqueId;
+
+  /* use up the whole time slice */
+  if (passIsSlow)
+    tr_wait_msec (MAX_PASS_SLICE_MSEC);
+}
+
+static bool
+runTestPass (tr_session * session, int * lastId)
+{
+  bool done;
+
+  tr_sessionLock (session);
+  done = runSwarmPass (session->peerMgr, lastId, visitSwarm);
+  tr_sessionUnlock (session);
+
+  return done;
+}
+
+static int
+test_pass_resumes (void)
+{
+  int i;
+  int lastId;
+  char name[32];
+  tr_session * session;
+  tr_torrent * added;
+  tr_torrent * tor[PASS_TORRENT_COUNT];
+
+  session = libttest_session_init (NULL);
+  for (i=0; i<PASS_TORRENT_COUNT; ++i)
+    {
+      tr_snprintf (name, sizeof (name), "pass-%d", i);
+      tor[i] = libttest_fill_torrent_init (session, name, 0, PIECE_SIZE, 1);
+    }
+
+  /* a quick pass visits every torrent in one go */
+  visitedCount = 0;
+  passIsSlow = false;
+  lastId = 0;
+  check (runTestPass (session, &lastId));
+  check_int_eq (0, lastId);
+  check_int_eq (PASS_TORRENT_COUNT, visitedCount);
+  for (i=0; i<PASS_TORRENT_COUNT; ++i)
+    check_int_eq (tor[i]->uniqueId, visitedIds[i]);
+
+  /* a slow one stops after each torrent and resumes after it */
+  visitedCount = 0;
+  passIsSlow = true;
+  check (!runTestPass (session, &lastId));
+  check_int_eq (tor[0]->uniqueId, lastId);
+  check (!runTestPass (session, &lastId));
+  check_int_eq (tor[1]->uniqueId, lastId);
+  check_int_eq (2, visitedCount);
+
+  /* remove the next torrent and add a new one between slices */
+  tr_torrentRemove (tor[2], true, remove);
+  while (tr_sessionCountTorrents (session) != PASS_TORRENT_COUNT - 1)
+    tr_wait_msec (10);
+  added = libttest_fill_torrent_init (session, "pass-added", 0, PIECE_SIZE, 1);
+
+  /* the pass skips the removed torrent and picks up the new one */
+  check (!runTestPass (session, &lastId));
+  check_int_eq (tor[3]->uniqueId, lastId);
+  check (runTestPass (session, &lastId));
+  check_int_eq (0, lastId);
+  check_int_eq (4, visitedCount);
+  check_int_eq (tor[0]->uniqueId, visitedIds[0]);
+  check_int_eq (tor[1]->uniqueId, visitedIds[1]);
+  check_int_eq (tor[3]->uniqueId, visitedIds[2]);
+  check_int_eq (added->uniqueId, visitedIds[3]);
+
+  tr_torrentRemove (added, true, remove);
+  tr_torrentRemove (tor[3], true, remove);
+  tr_torrentRemove (tor[1], true, remove);
+  tr_torrentRemove (tor[0], true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+#define EXTRA_HOST_COUNT 200
+
+static void
+waitForTorrentCount (tr_session * session, int count)
+{
+  while (tr_sessionCountTorrents (session) != count)
+    tr_wait_msec (10);
+}
+
+static int
+test_host_lifetime (void)
+{
+  int i;
+  char str[32];
+  tr_pex pex;
+  tr_peerMgr * mgr;
+  tr_session * session;
+  tr_torrent * a;
+  tr_torrent * b;
+  struct peer_atom * atomA;
+  struct peer_atom * atomB;
+  struct peer_host * host;
+  struct peer_host * extra[EXTRA_HOST_COUNT];
+
+  session = libttest_session_init (NULL);
+  mgr = session->peerMgr;
+  a = libttest_fill_torrent_init (session, "host-a", 0, PIECE_SIZE, 1);
+  b = libttest_fill_torrent_init (session, "host-b", 0, PIECE_SIZE, 1);
+
+  memset (&pex, 0, sizeof (pex));
+  tr_address_from_string (&pex.addr, "93.184.216.34");
+  pex.port = htons (51413);
+
+  /* two torrents with the same peer share its host */
+  tr_peerMgrAddPex (a, TR_PEER_FROM_PEX, &pex, -1);
+  tr_peerMgrAddPex (b, TR_PEER_FROM_TRACKER, &pex, -1);
+  tr_sessionLock (session);
+  atomA = getExistingAtom (a->swarm, &pex.addr);
+  atomB = getExistingAtom (b->swarm, &pex.addr);
+  check (atomA != NULL);
+  check (atomB != NULL);
+  check (atomA != atomB);
+  check_ptr_eq (atomA->host, atomB->host);
+  check_int_eq (2, atomA->host->refCount);
+  check_int_eq (1, mgr->hostCount);
+  tr_sessionUnlock (session);
+
+  /* so what one learns about the address, the other sees */
+  tr_peerMgrSetUtpFailed (a, &pex.addr, true);
+  tr_sessionLock (session);
+  check (atomB->host->utp_failed);
+
+  /* the table grows, and shrinks back as hosts are released */
+  for (i=0; i<EXTRA_HOST_COUNT; ++i)
+    {
+      tr_address addr;
+      tr_snprintf (str, sizeof (str), "93.184.%d.%d", i / 100, i % 100);
+      tr_address_from_string (&addr, str);
+      extra[i] = hostRef (mgr, &addr);
+    }
+  check_int_eq (EXTRA_HOST_COUNT + 1, mgr->hostCount);
+  check (mgr->hostBucketCount >= EXTRA_HOST_COUNT + 1);
+  for (i=0; i<EXTRA_HOST_COUNT; ++i)
+    check_ptr_eq (extra[i], getExistingHost (mgr, &extra[i]->addr));
+  check_ptr_eq (atomA->host, getExistingHost (mgr, &pex.addr));
+  for (i=0; i<EXTRA_HOST_COUNT; ++i)
+    {
+      tr_address addr = extra[i]->addr;
+      hostUnref (mgr, extra[i]);
+      check (getExistingHost (mgr, &addr) == NULL);
+    }
+  check_int_eq (1, mgr->hostCount);
+  tr_sessionUnlock (session);
+
+  /* the host outlives the first torrent that's removed... */
+  tr_torrentRemove (a, true, remove);
+  waitForTorrentCount (session, 1);
+  tr_sessionLock (session);
+  host = getExistingHost (mgr, &pex.addr);
+  check_ptr_eq (atomB->host, host);
+  check_int_eq (1, host->refCount);
+  check (host->utp_failed);
+  tr_sessionUnlock (session);
+
+  /* ...but not the last */
+  tr_torrentRemove (b, true, remove);
+  waitForTorrentCount (session, 0);
+  tr_sessionLock (session);
+  check (getExistingHost (mgr, &pex.addr) == NULL);
+  check_int_eq (0, mgr->hostCount);
+  tr_sessionUnlock (session);
+
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+#define HEAP_ITEM_COUNT 100
+
+struct heap_item
+{
+  int key;
+  int pos;
+};
+
+static bool
+itemIsBefore (const void * va, const void * vb)
+{
+  const struct heap_item * a = va;
+  const struct heap_item * b = vb;
+
+  return a->key < b->key;
+}
+
+static int *
+itemPosition (void * item)
+{
+  return &((struct heap_item*)item)->pos;
+}
+
+/* pop everything off the heap, checking that it comes off in order */
+static bool
+heapDrainsInOrder (struct candidate_heap * h, int expectedCount)
+{
+  int n = 0;
+  int prev = INT_MIN;
+  struct heap_item * item;
+
+  while ((item = heapPeek (h)))
+    {
+      if (item->key < prev)
+        return false;
+      prev = item->key;
+      heapRemove (h, item);
+      if (item->pos != -1)
+        return false;
+      ++n;
+    }
+
+  return n == expectedCount;
+}
+
+static int
+test_heap_order (void)
+{
+  int i;
+  struct heap_item items[HEAP_ITEM_COUNT];
+  struct candidate_heap h = CANDIDATE_HEAP_INIT (itemIsBefore, itemPosition);
+
+  for (i=0; i<HEAP_ITEM_COUNT; ++i)
+    {
+      items[i].key = tr_cryptoWeakRandInt (1000);
+      items[i].pos = -1;
+      heapInsert (&h, &items[i]);
+    }
+  for (i=0; i<HEAP_ITEM_COUNT; ++i)
+    check_ptr_eq (&items[i], h.items[items[i].pos]);
+  check (heapDrainsInOrder (&h, HEAP_ITEM_COUNT));
+
+  /* items that are removed from the middle, or whose keys change, */
+  for (i=0; i<HEAP_ITEM_COUNT; ++i)
+    heapInsert (&h, &items[i]);
+  for (i=0; i<HEAP_ITEM_COUNT; i+=3)
+    heapRemove (&h, &items[i]);
+  for (i=1; i<HEAP_ITEM_COUNT; i+=3)
+    {
+      items[i].key = tr_cryptoWeakRandInt (1000);
+      heapUpdate (&h, &items[i]);
+    }
+  check (heapDrainsInOrder (&h, HEAP_ITEM_COUNT - (HEAP_ITEM_COUNT + 2) / 3));
+
+  /* or which all change at once, still come off in order */
+  for (i=0; i<HEAP_ITEM_COUNT; ++i)
+    heapInsert (&h, &items[i]);
+  for (i=0; i<HEAP_ITEM_COUNT; ++i)
+    items[i].key = HEAP_ITEM_COUNT - i;
+  heapRebuild (&h);
+  check_ptr_eq (&items[HEAP_ITEM_COUNT - 1], heapPeek (&h));
+  check (heapDrainsInOrder (&h, HEAP_ITEM_COUNT));
+
+  tr_free (h.items);
+  return 0;
+}
+
+static struct peer_atom *
+addTestAtom (tr_torrent * tor, const char * str, time_t lastAttempt)
+{
+  tr_pex pex;
+  struct peer_atom * atom;
+
+  memset (&pex, 0, sizeof (pex));
+  tr_address_from_string (&pex.addr, str);
+  pex.port = htons (51413);
+  tr_peerMgrAddPex (tor, TR_PEER_FROM_TRACKER, &pex, -1);
+
+  atom = getExistingAtom (tor->swarm, &pex.addr);
+  atom->host->lastConnectionAttemptAt = lastAttempt;
+  return atom;
+}
+
+static void
+setSwarmRunning (tr_swarm * s, bool running)
+{
+  s->isRunning = running;
+
+  if (running)
+    candidatesStart (s);
+  else
+    candidatesStop (s);
+}
+
+static int
+test_candidate_order (void)
+{
+  tr_peerMgr * mgr;
+  tr_session * session;
+  tr_torrent * a;
+  tr_torrent * b;
+  struct peer_atom * a1;
+  struct peer_atom * a2;
+  struct peer_atom * a3;
+  struct peer_atom * b1;
+  const time_t now = tr_time ();
+
+  session = libttest_session_init (NULL);
+  mgr = session->peerMgr;
+  a = libttest_fill_torrent_init (session, "candidates-a", 0, PIECE_SIZE, 1);
+  b = libttest_fill_torrent_init (session, "candidates-b", 0, PIECE_SIZE, 1);
+
+  /* keep the manager's timers out of the way while the
+     swarms are marked as running */
+  tr_sessionLock (session);
+
+  /* a stopped swarm's atoms aren't queued */
+  a1 = addTestAtom (a, "93.184.216.1", now - 300);
+  a2 = addTestAtom (a, "93.184.216.2", now - 600);
+  a3 = addTestAtom (a, "93.184.216.3", now - 100);
+  check_int_eq (ATOM_UNQUEUED, a2->queue);
+  check (heapPeek (&mgr->candidateSwarms) == NULL);
+
+  /* the peer we tried least recently goes first */
+  setSwarmRunning (a->swarm, true);
+  check_int_eq (ATOM_READY, a2->queue);
+  check_ptr_eq (a2, heapPeek (&a->swarm->readyAtoms));
+  check_ptr_eq (a->swarm, heapPeek (&mgr->candidateSwarms));
+
+  /* and across swarms, the swarm with the best atom goes first */
+  b1 = addTestAtom (b, "93.184.216.4", now - 900);
+  check_int_eq (ATOM_UNQUEUED, b1->queue);
+  setSwarmRunning (b->swarm, true);
+  check_ptr_eq (b->swarm, heapPeek (&mgr->candidateSwarms));
+
+  /* an atom that's put to sleep leaves its swarm's heap, and
+     its swarm leaves the manager's heap once it has no more */
+  candidateSleep (b1, now + 60);
+  check_int_eq (ATOM_ASLEEP, b1->queue);
+  check_ptr_eq (b1, heapPeek (&mgr->sleepingAtoms));
+  check_int_eq (-1, b->swarm->candidatePos);
+  check_ptr_eq (a->swarm, heapPeek (&mgr->candidateSwarms));
+
+  /* an atom whose score changes moves within its swarm's heap */
+  a3->host->lastConnectionAttemptAt = now - 1200;
+  candidateRequeue (a3);
+  check_ptr_eq (a3, heapPeek (&a->swarm->readyAtoms));
+  candidateSleep (a3, now + 120);
+  check_ptr_eq (a2, heapPeek (&a->swarm->readyAtoms));
+  check_ptr_eq (b1, heapPeek (&mgr->sleepingAtoms));
+
+  /* sleeping atoms wake in order */
+  candidatesWake (mgr, now + 60);
+  check_int_eq (ATOM_READY, b1->queue);
+  check_int_eq (ATOM_ASLEEP, a3->queue);
+  check_ptr_eq (b->swarm, heapPeek (&mgr->candidateSwarms));
+  candidatesWake (mgr, now + 120);
+  check_int_eq (ATOM_READY, a3->queue);
+  check_ptr_eq (a3, heapPeek (&a->swarm->readyAtoms));
+  check_ptr_eq (a->swarm, heapPeek (&mgr->candidateSwarms));
+
+  /* a stopped swarm's atoms are dropped from the queue */
+  setSwarmRunning (a->swarm, false);
+  check_int_eq (ATOM_UNQUEUED, a1->queue);
+  check_int_eq (0, a->swarm->readyAtoms.count);
+  check_ptr_eq (b->swarm, heapPeek (&mgr->candidateSwarms));
+  setSwarmRunning (b->swarm, false);
+  check (heapPeek (&mgr->candidateSwarms) == NULL);
+  check (heapPeek (&mgr->sleepingAtoms) == NULL);
+
+  tr_sessionUnlock (session);
+
+  tr_torrentRemove (b, true, remove);
+  tr_torrentRemove (a, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+static int
+test_adaptive_upload_slots (void)
+{
+  int base;
+  int hi;
+  tr_swarm * s;
+  tr_session * session;
+  tr_torrent * tor;
+  unsigned int rate;
+  const int fast = 1024 * 1024;
+  const uint64_t now = tr_time_msec ();
+
+  session = libttest_session_init (NULL);
+  tor = libttest_fill_torrent_init (session, "upload-slots", 0, PIECE_SIZE, 1);
+  tr_sessionLock (session);
+  s = tor->swarm;
+  base = session->uploadSlotsPerTorrent;
+  hi = base * MAX_ADAPTIVE_UPLOAD_SLOTS_MULTIPLIER;
+  check (base > MIN_ADAPTIVE_UPLOAD_SLOTS);
+
+  /* the fixed count is used until the swarm has been adjusted */
+  check_int_eq (base, getUploadSlots (s));
+  tr_sessionSetUploadSlotsAdaptive (session, true);
+  check_int_eq (base, getUploadSlots (s));
+
+  /* every slot in use, and the slowest peer is fast enough: open one */
+  adjustUploadSlots (s, base, base, base * ADAPTIVE_UPLOAD_SLOT_STEP_Bps, now);
+  check_int_eq (base + 1, getUploadSlots (s));
+
+  /* the slowest peer isn't fast enough: drift back */
+  adjustUploadSlots (s, base + 2, base + 2, (base + 2) * ADAPTIVE_UPLOAD_SLOT_STEP_Bps - 1, now);
+  check_int_eq (base + 1, getUploadSlots (s));
+
+  /* slots to spare: drift back, but no further than the fixed count */
+  adjustUploadSlots (s, base + 1, base, fast, now);
+  check_int_eq (base, getUploadSlots (s));
+  adjustUploadSlots (s, base, base - 1, fast, now);
+  check_int_eq (base, getUploadSlots (s));
+
+  /* never more than the ceiling */
+  adjustUploadSlots (s, hi, hi, fast, now);
+  check_int_eq (hi, getUploadSlots (s));
+
+  /* the fixed count is used again when adaptive slots are turned off */
+  tr_sessionSetUploadSlotsAdaptive (session, false);
+  check_int_eq (base, getUploadSlots (s));
+  tr_sessionSetUploadSlotsAdaptive (session, true);
+
+  /* a saturated upload doesn't open a slot, and keeps one as long
+     as its peer gets its share of the torrent's upload... */
+  tr_torrentSetSpeedLimit_KBps (tor, TR_UP, 1);
+  tr_torrentUseSpeedLimit (tor, TR_UP, true);
+  tr_bandwidthUsed (&tor->bandwidth, TR_UP, 1024 * 1024, true, now);
+  rate = tr_bandwidthGetPieceSpeed_Bps (&tor->bandwidth, now, TR_UP);
+  check (rate > 1024);
+  adjustUploadSlots (s, base, base, rate / base, now);
+  check_int_eq (base, getUploadSlots (s));
+
+  /* ...but closes it, down to the floor, when it doesn't */
+  adjustUploadSlots (s, base, base, rate / base / 4, now);
+  check_int_eq (base - 1, getUploadSlots (s));
+  adjustUploadSlots (s, MIN_ADAPTIVE_UPLOAD_SLOTS, MIN_ADAPTIVE_UPLOAD_SLOTS, 0, now);
+  check_int_eq (MIN_ADAPTIVE_UPLOAD_SLOTS, getUploadSlots (s));
+
+  /* just under saturation, the count holds steady either way... */
+  tr_torrentSetSpeedLimit_Bps (tor, TR_UP, rate * 100 / 90);
+  adjustUploadSlots (s, base, base, fast, now);
+  check_int_eq (base, getUploadSlots (s));
+  adjustUploadSlots (s, base + 1, base, fast, now);
+  check_int_eq (base + 1, getUploadSlots (s));
+
+  /* ...and with room to spare, it grows again */
+  tr_torrentSetSpeedLimit_Bps (tor, TR_UP, rate * 2);
+  adjustUploadSlots (s, base, base, fast, now);
+  check_int_eq (base + 1, getUploadSlots (s));
+
+  tr_sessionUnlock (session);
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_bucket_order,
+                             test_rebucketing,
+                             test_request_table,
+                             test_streaming_window,
+                             test_pass_resumes,
+                             test_host_lifetime,
+                             test_heap_order,
+                             test_candidate_order,
+                             test_adaptive_upload_slots };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
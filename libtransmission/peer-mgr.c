@@ -54,7 +54,26 @@ enum
      for this many calls to rechokeUploads (). */
   OPTIMISTIC_UNCHOKE_MULTIPLIER = 4,
 
-  /* how frequently to reallocate bandwidth */
+  /* with adaptive upload slots, the fewest a torrent can shrink to... */
+  MIN_ADAPTIVE_UPLOAD_SLOTS = 2,
+
+  /* ...and the most it can grow to, as a multiple of upload-slots-per-torrent */
+  MAX_ADAPTIVE_UPLOAD_SLOTS_MULTIPLIER = 4,
+
+  /* with adaptive upload slots, another slot is opened when the slowest
+     unchoked peer is getting at least this much per open slot */
+  ADAPTIVE_UPLOAD_SLOT_STEP_Bps = 1024,
+
+  /* an upload limit that's getting this much of its speed is saturated... */
+  UPLOAD_SATURATED_PERCENT = 95,
+
+  /* ...and one that's getting less than this has room for another slot.
+     In between, the slot count holds steady. */
+  UPLOAD_HEADROOM_PERCENT = 85,
+
+  /* how frequently to do the torrent upkeep and reconnecting that
+     ride along with bandwidth allocation, which can happen more often.
+     @see tr_sessionGetBandwidthTickMsec () */
   BANDWIDTH_PERIOD_MSEC = 500,
 
   /* how frequently to age out old piece request lists */
@@ -63,6 +82,13 @@ enum
   /* how frequently to decide which peers live and die */
   RECONNECT_PERIOD_MSEC = 500,
 
+  /* the longest that a pass over the torrents, such as a rechoke,
+     can hold the libevent thread before it yields to socket I/O */
+  MAX_PASS_SLICE_MSEC = 20,
+
+  /* how long a pass that ran out of time waits before resuming */
+  PASS_SLICE_INTERVAL_MSEC = 5,
+
   /* when many peers are available, keep idle ones this long */
   MIN_UPLOAD_IDLE_SECS = (60),
 
@@ -86,13 +112,20 @@ enum
   MYFLAG_BANNED = 1,
 
   /* use for bitwise operations w/peer_atom.flags2 */
-  /* unreachable for now... but not banned.
-   * if they try to connect to us it's okay */
-  MYFLAG_UNREACHABLE = 2,
+  /* set on atoms that atomPulse () is about to free */
+  MYFLAG_CULLED = 2,
 
   /* the minimum we'll wait before attempting to reconnect to a peer */
   MINIMUM_RECONNECT_INTERVAL_SECS = 5,
 
+  /* how long an atom that isn't a candidate for some reason other than
+     its reconnect interval -- it's in use, banned, blocklisted, or both
+     of us are seeds -- waits before it's looked at again */
+  CANDIDATE_RECHECK_SECS = 60,
+
+  /** how long after the streaming window moves that its first piece is due */
+  STREAMING_GRACE_MSEC = 2000,
+
   /** how long we'll let requests we've made linger before we cancel them */
   REQUEST_TTL_SECS = 90,
 
@@ -109,6 +142,56 @@ const tr_swarm_stats TR_SWARM_STATS_INIT = { { 0, 0 }, 0, 0, { 0, 0, 0, 0, 0, 0,
 ***
 **/
 
+/**
+ * A binary heap that keeps track of where each item is,
+ * so that items can be removed or re-sorted in O(log n)
+ */
+struct candidate_heap
+{
+  void ** items;
+  int     count;
+  int     alloc;
+
+  /* true if `a' belongs closer to the top than `b' */
+  bool (*before) (const void * a, const void * b);
+
+  /* where the item stores its index in the heap */
+  int * (*position) (void * item);
+};
+
+#define CANDIDATE_HEAP_INIT(before, position) { NULL, 0, 0, before, position }
+
+/* where a peer_atom is in the candidate queue */
+enum
+{
+  ATOM_UNQUEUED,   /* the swarm isn't running */
+  ATOM_READY,      /* in its swarm's readyAtoms heap, sorted by score */
+  ATOM_ASLEEP      /* in tr_peerMgr's sleepingAtoms heap, sorted by wake time */
+};
+
+/**
+ * Peer information that's about an address rather than a torrent.
+ * It's kept once per session, in tr_peerMgr's hosts table, and is
+ * shared by every peer_atom with that address.
+ */
+struct peer_host
+{
+  tr_address  addr;
+  int         refCount;           /* how many peer_atoms use this host */
+  int8_t      blocklisted;        /* -1 for unknown, true for blocklisted, false for not blocklisted */
+  bool        utp_supported;      /* the peer groks uTP */
+  bool        utp_failed;         /* We recently failed to connect over uTP */
+
+  /* unreachable for now... but not banned.
+   * if they try to connect to us it's okay */
+  bool        unreachable;
+
+  time_t      lastConnectionAttemptAt;
+  time_t      lastConnectionAt;
+
+  struct peer_host * hash_next;
+};
+
 /**
  * Peer information that should be kept even before we've connected and
  * after we've disconnected. These are kept in a pool of peer_atoms to decide
@@ -122,25 +205,27 @@ struct peer_atom
 {
   uint8_t     fromFirst;          /* where the peer was first found */
   uint8_t     fromBest;           /* the "best" value of where the peer has been found */
-  uint8_t     flags;              /* these match the added_f flags */
+  uint8_t     flags;              /* these match the added_f flags, except ADDED_F_UTP_FLAGS */
   uint8_t     flags2;             /* flags that aren't defined in added_f */
   int8_t      seedProbability;    /* how likely is this to be a seed... [0..100] or -1 for unknown */
-  int8_t      blocklisted;        /* -1 for unknown, true for blocklisted, false for not blocklisted */
 
   tr_port     port;
-  bool        utp_failed;         /* We recently failed to connect over uTP */
   uint16_t    numFails;
   time_t      time;               /* when the peer's connection status last changed */
   time_t      piece_data_time;
 
-  time_t      lastConnectionAttemptAt;
-  time_t      lastConnectionAt;
-
   /* similar to a TTL field, but less rigid --
    * if the swarm is small, the atom will be kept past this date. */
   time_t      shelf_date;
   tr_peer   * peer;               /* will be NULL if not connected */
-  tr_address  addr;
+  struct peer_host * host;
+
+  /* this atom's place in the candidate queue */
+  struct tr_swarm * swarm;
+  uint8_t     queue;              /* ATOM_UNQUEUED, ATOM_READY, or ATOM_ASLEEP */
+  int         heapPos;
+  uint64_t    score;              /* from getPeerCandidateScore (); smaller is better */
+  time_t      wakeAt;             /* when an ATOM_ASLEEP atom should be looked at again */
 };
 
 #ifdef NDEBUG
@@ -152,14 +237,14 @@ tr_isAtom (const struct peer_atom * atom)
   return (atom != NULL)
       && (atom->fromFirst < TR_PEER_FROM__MAX)
       && (atom->fromBest < TR_PEER_FROM__MAX)
-      && (tr_address_is_valid (&atom->addr));
+      && (tr_address_is_valid (&atom->host->addr));
 }
 #endif
 
 static const char*
 tr_atomAddrStr (const struct peer_atom * atom)
 {
-  return atom ? tr_peerIoAddrStr (&atom->addr, atom->port) : "[no atom]";
+  return atom ? tr_peerIoAddrStr (&atom->host->addr, atom->port) : "[no atom]";
 }
 
 struct block_request
@@ -167,6 +252,12 @@ struct block_request
   tr_block_index_t block;
   tr_peer * peer;
   time_t sentAt;
+
+  struct block_request * hash_next; /* next in tr_swarm::requestBuckets */
+  struct block_request * peer_prev; /* neighbors in tr_peer::requests */
+  struct block_request * peer_next;
+  struct block_request * prev;      /* neighbors in the swarm's requests */
+  struct block_request * next;
 };
 
 struct weighted_piece
@@ -183,6 +274,34 @@ enum piece_sort_state
   PIECES_SORTED_BY_WEIGHT
 };
 
+enum piece_state
+{
+  PIECE_UNWANTED, /* we have it, or it's unwanted */
+  PIECE_BUCKETED, /* we want it but haven't started on it yet */
+  PIECE_ACTIVE    /* it's in tr_swarm::pieces */
+};
+
+#define NO_PIECE ((tr_piece_index_t)-1)
+
+#define PRIORITY_COUNT (TR_PRI_HIGH - TR_PRI_LOW + 1)
+
+/* a wanted piece's node in its piece_bucket's list */
+struct piece_node
+{
+  tr_piece_index_t prev;
+  tr_piece_index_t next;
+  int key;
+  uint8_t state;
+};
+
+/* the unstarted pieces of one priority, bucketed by replication count */
+struct piece_bucket
+{
+  tr_piece_index_t * heads;
+  tr_piece_index_t * tails;
+  int count;
+};
+
 /** @brief Opaque, per-torrent data structure for peer connection information */
 typedef struct tr_swarm
 {
@@ -193,23 +312,54 @@ typedef struct tr_swarm
   tr_ptrArray                peers; /* tr_peerMsgs */
   tr_ptrArray                webseeds; /* tr_webseed */
 
+  /* the atoms that are ready to be connected to, best score first.
+     only maintained while the swarm is running. */
+  struct candidate_heap      readyAtoms;
+  int                        candidatePos; /* in tr_peerMgr.candidateSwarms */
+
   tr_torrent               * tor;
   struct tr_peerMgr        * manager;
 
   tr_peerMsgs              * optimistic; /* the optimistic peer, or NULL if none */
   int                        optimisticUnchokeTimeScaler;
 
+  /* with adaptive upload slots, how many this torrent has now.
+     zero means it hasn't been adjusted yet. @see adjustUploadSlots () */
+  int                        uploadSlots;
+  int                        uploadSlotsUsed; /* as of the last rechoke */
+
   bool                       isRunning;
   bool                       needsCompletenessCheck;
 
-  struct block_request     * requests;
+  /* the blocks we've requested, hashed by block index. They're also
+     kept in a list, oldest first, and in each peer's tr_peer::requests */
+  struct block_request    ** requestBuckets;
+  size_t                     requestBucketCount;
+  struct block_request     * oldestRequest;
+  struct block_request     * newestRequest;
   int                        requestCount;
-  int                        requestAlloc;
 
+  /* The pieces we've started on -- ones with blocks that have been
+     downloaded or requested -- sorted by comparePieceByWeight () */
   struct weighted_piece    * pieces;
   int                        pieceCount;
+  int                        pieceAlloc;
   enum piece_sort_state      pieceSortState;
 
+  /* The wanted pieces that we haven't started on, kept in lists by
+     priority and replication count so that they never need sorting.
+     pieceNodes has one entry per piece in the torrent, or is NULL if
+     the lists haven't been built yet. A piece's bucket key is its
+     replication count minus replicationOffset, so HaveAll messages
+     can change every piece's count without moving them. */
+  struct piece_node        * pieceNodes;
+  struct piece_bucket        buckets[PRIORITY_COUNT];
+  int                        bucketedCount;
+  int                        replicationOffset;
+
+  /* no piece before this one is bucketed. Used by sequential downloads */
+  tr_piece_index_t           firstBucketedPiece;
+
   /* An array of pieceCount items stating how many peers have each piece.
      This is used to help us for downloading pieces "rarest first."
      This may be NULL if we don't have metainfo yet, or if we're not
@@ -234,9 +384,29 @@ struct tr_peerMgr
   tr_session    * session;
   tr_ptrArray     incomingHandshakes; /* tr_handshake */
   struct event  * bandwidthTimer;
+  uint64_t        bandwidthAllocatedAt;
+  uint64_t        bandwidthUpkeepAt;
   struct event  * rechokeTimer;
   struct event  * refillUpkeepTimer;
   struct event  * atomTimer;
+
+  /* the running swarms that have ready atoms,
+     sorted by the score of their best atom */
+  struct candidate_heap candidateSwarms;
+
+  /* the atoms of running swarms that aren't ready yet,
+     soonest wakeAt first */
+  struct candidate_heap sleepingAtoms;
+
+  /* struct peer_host, hashed by address */
+  struct peer_host ** hosts;
+  size_t              hostBucketCount;
+  size_t              hostCount;
+
+  /* the uniqueId of the last torrent visited by each pass, or 0 */
+  int             rechokePassId;
+  int             refillUpkeepPassId;
+  int             atomPassId;
 };
 
 #define tordbg(t, ...) \
@@ -389,7 +559,7 @@ comparePeerAtomToAddress (const void * va, const void * vb)
 {
   const struct peer_atom * a = va;
 
-  return tr_address_compare (&a->addr, vb);
+  return tr_address_compare (&a->host->addr, vb);
 }
 
 static int
@@ -399,7 +569,7 @@ compareAtomsByAddress (const void * va, const void * vb)
 
   assert (tr_isAtom (b));
 
-  return comparePeerAtomToAddress (va, &b->addr);
+  return comparePeerAtomToAddress (va, &b->host->addr);
 }
 
 /**
@@ -409,7 +579,7 @@ compareAtomsByAddress (const void * va, const void * vb)
 const tr_address *
 tr_peerAddress (const tr_peer * peer)
 {
-  return &peer->atom->addr;
+  return &peer->atom->host->addr;
 }
 
 static tr_swarm *
@@ -443,8 +613,141 @@ peerIsInUse (const tr_swarm * cs, const struct peer_atom * atom)
   assert (swarmIsLocked (s));
 
   return (atom->peer != NULL)
-      || getExistingHandshake (&s->outgoingHandshakes, &atom->addr)
-      || getExistingHandshake (&s->manager->incomingHandshakes, &atom->addr);
+      || getExistingHandshake (&s->outgoingHandshakes, &atom->host->addr)
+      || getExistingHandshake (&s->manager->incomingHandshakes, &atom->host->addr);
+}
+
+/**
+*** struct peer_host
+**/
+
+#define MIN_HOST_BUCKET_COUNT 64
+
+static size_t
+hashAddress (size_t bucket_count, const tr_address * addr)
+{
+  size_t i, n;
+  const uint8_t * bytes;
+  uint32_t h = 2166136261u;
+
+  if (addr->type == TR_AF_INET)
+    {
+      bytes = (const uint8_t*) &addr->addr.addr4;
+      n = sizeof (addr->addr.addr4);
+    }
+  else
+    {
+      bytes = (const uint8_t*) &addr->addr.addr6;
+      n = sizeof (addr->addr.addr6);
+    }
+
+  h = (h ^ addr->type) * 16777619u;
+  for (i=0; i<n; ++i)
+    h = (h ^ bytes[i]) * 16777619u;
+
+  return h & (bucket_count - 1);
+}
+
+static struct peer_host *
+getExistingHost (const tr_peerMgr * mgr, const tr_address * addr)
+{
+  struct peer_host * host = NULL;
+
+  if (mgr->hostBucketCount > 0)
+    {
+      host = mgr->hosts[hashAddress (mgr->hostBucketCount, addr)];
+
+      while ((host != NULL) && tr_address_compare (&host->addr, addr))
+        host = host->hash_next;
+    }
+
+  return host;
+}
+
+static void
+hostRehash (tr_peerMgr * mgr, size_t bucket_count)
+{
+  size_t i;
+  struct peer_host ** buckets = tr_new0 (struct peer_host*, bucket_count);
+
+  for (i=0; i<mgr->hostBucketCount; ++i)
+    {
+      struct peer_host * host = mgr->hosts[i];
+
+      while (host != NULL)
+        {
+          struct peer_host * next = host->hash_next;
+          const size_t pos = hashAddress (bucket_count, &host->addr);
+          host->hash_next = buckets[pos];
+          buckets[pos] = host;
+          host = next;
+        }
+    }
+
+  tr_free (mgr->hosts);
+  mgr->hosts = buckets;
+  mgr->hostBucketCount = bucket_count;
+}
+
+/* find or create the host for `addr' and take a reference to it */
+static struct peer_host *
+hostRef (tr_peerMgr * mgr, const tr_address * addr)
+{
+  struct peer_host * host = getExistingHost (mgr, addr);
+
+  if (host == NULL)
+    {
+      size_t pos;
+
+      if (mgr->hostCount >= mgr->hostBucketCount)
+        hostRehash (mgr, MAX (MIN_HOST_BUCKET_COUNT, mgr->hostBucketCount * 2));
+
+      host = tr_new0 (struct peer_host, 1);
+      host->addr = *addr;
+      host->blocklisted = -1;
+
+      pos = hashAddress (mgr->hostBucketCount, addr);
+      host->hash_next = mgr->hosts[pos];
+      mgr->hosts[pos] = host;
+      ++mgr->hostCount;
+    }
+
+  ++host->refCount;
+  return host;
+}
+
+static void
+hostUnref (tr_peerMgr * mgr, struct peer_host * host)
+{
+  assert (host->refCount > 0);
+
+  if (--host->refCount == 0)
+    {
+      struct peer_host ** walk;
+
+      walk = &mgr->hosts[hashAddress (mgr->hostBucketCount, &host->addr)];
+      while (*walk != host)
+        walk = &(*walk)->hash_next;
+      *walk = host->hash_next;
+
+      --mgr->hostCount;
+      tr_free (host);
+    }
+}
+
+static void candidateRemove   (struct peer_atom *);
+static void candidateSetReady (struct peer_atom *);
+static void candidateRequeue  (struct peer_atom *);
+static void candidatesStart   (tr_swarm *);
+static void candidatesStop    (tr_swarm *);
+static void candidatesRescore (tr_swarm *);
+
+static void
+atomFree (tr_peerMgr * mgr, struct peer_atom * atom)
+{
+  candidateRemove (atom);
+  hostUnref (mgr, atom->host);
+  tr_free (atom);
 }
 
 static inline bool
@@ -453,9 +756,15 @@ replicationExists (const tr_swarm * s)
   return s->pieceReplication != NULL;
 }
 
+static void pieceListFree (tr_swarm *);
+
+/* the piece buckets are keyed by replication count,
+   so they're freed along with it */
 static void
 replicationFree (tr_swarm * s)
 {
+  pieceListFree (s);
+
   tr_free (s->pieceReplication);
   s->pieceReplication = NULL;
   s->pieceReplicationSize = 0;
@@ -492,6 +801,7 @@ replicationNew (tr_swarm * s)
 static void
 swarmFree (void * vs)
 {
+  int i;
   tr_swarm * s = vs;
 
   assert (s);
@@ -499,17 +809,22 @@ swarmFree (void * vs)
   assert (swarmIsLocked (s));
   assert (tr_ptrArrayEmpty (&s->outgoingHandshakes));
   assert (tr_ptrArrayEmpty (&s->peers));
+  assert (s->readyAtoms.count == 0);
+  assert (s->candidatePos < 0);
 
   tr_ptrArrayDestruct (&s->webseeds, (PtrArrayForeachFunc)tr_peerFree);
-  tr_ptrArrayDestruct (&s->pool, (PtrArrayForeachFunc)tr_free);
+  for (i=0; i<tr_ptrArraySize (&s->pool); ++i)
+    atomFree (s->manager, tr_ptrArrayNth (&s->pool, i));
+  tr_ptrArrayDestruct (&s->pool, NULL);
   tr_ptrArrayDestruct (&s->outgoingHandshakes, NULL);
   tr_ptrArrayDestruct (&s->peers, NULL);
   s->stats = TR_SWARM_STATS_INIT;
 
   replicationFree (s);
 
-  tr_free (s->requests);
-  tr_free (s->pieces);
+  assert (s->requestCount == 0);
+  tr_free (s->requestBuckets);
+  tr_free (s->readyAtoms.items);
   tr_free (s);
 }
 
@@ -534,14 +849,20 @@ rebuildWebseedArray (tr_swarm * s, tr_torrent * tor)
     }
 }
 
+static bool atomIsReadyBefore (const void *, const void *);
+static int * atomHeapPosition (void *);
+
 static tr_swarm *
 swarmNew (tr_peerMgr * manager, tr_torrent * tor)
 {
   tr_swarm * s;
+  const struct candidate_heap ready = CANDIDATE_HEAP_INIT (atomIsReadyBefore, atomHeapPosition);
 
   s = tr_new0 (tr_swarm, 1);
   s->manager = manager;
   s->tor = tor;
+  s->readyAtoms = ready;
+  s->candidatePos = -1;
   s->pool = TR_PTR_ARRAY_INIT;
   s->peers = TR_PTR_ARRAY_INIT;
   s->webseeds = TR_PTR_ARRAY_INIT;
@@ -553,12 +874,20 @@ swarmNew (tr_peerMgr * manager, tr_torrent * tor)
 }
 
 static void ensureMgrTimersExist (struct tr_peerMgr * m);
+static bool swarmIsReadyBefore (const void *, const void *);
+static int * swarmHeapPosition (void *);
+static bool atomWakesBefore (const void *, const void *);
 
 tr_peerMgr*
 tr_peerMgrNew (tr_session * session)
 {
   tr_peerMgr * m = tr_new0 (tr_peerMgr, 1);
+  const struct candidate_heap swarms = CANDIDATE_HEAP_INIT (swarmIsReadyBefore, swarmHeapPosition);
+  const struct candidate_heap sleeping = CANDIDATE_HEAP_INIT (atomWakesBefore, atomHeapPosition);
+
   m->session = session;
+  m->candidateSwarms = swarms;
+  m->sleepingAtoms = sleeping;
   m->incomingHandshakes = TR_PTR_ARRAY_INIT;
   ensureMgrTimersExist (m);
   return m;
@@ -597,6 +926,14 @@ tr_peerMgrFree (tr_peerMgr * manager)
 
   tr_ptrArrayDestruct (&manager->incomingHandshakes, NULL);
 
+  /* the torrents have already freed their atoms */
+  assert (manager->hostCount == 0);
+  tr_free (manager->hosts);
+  assert (manager->candidateSwarms.count == 0);
+  tr_free (manager->candidateSwarms.items);
+  assert (manager->sleepingAtoms.count == 0);
+  tr_free (manager->sleepingAtoms.items);
+
   managerUnlock (manager);
   tr_free (manager);
 }
@@ -608,32 +945,29 @@ tr_peerMgrFree (tr_peerMgr * manager)
 void
 tr_peerMgrOnBlocklistChanged (tr_peerMgr * mgr)
 {
-  tr_torrent * tor = NULL;
-  tr_session * session = mgr->session;
+  size_t i;
 
-  /* we cache whether or not a peer is blocklisted...
+  /* we cache whether or not a host is blocklisted...
      since the blocklist has changed, erase that cached value */
-  while ((tor = tr_torrentNext (session, tor)))
+  for (i=0; i<mgr->hostBucketCount; ++i)
     {
-      int i;
-      tr_swarm * s = tor->swarm;
-      const int n = tr_ptrArraySize (&s->pool);
-      for (i=0; i<n; ++i)
-        {
-          struct peer_atom * atom = tr_ptrArrayNth (&s->pool, i);
-          atom->blocklisted = -1;
-        }
+      struct peer_host * host;
+
+      for (host=mgr->hosts[i]; host!=NULL; host=host->hash_next)
+        host->blocklisted = -1;
     }
 }
 
 static bool
 isAtomBlocklisted (tr_session * session, struct peer_atom * atom)
 {
-  if (atom->blocklisted < 0)
-    atom->blocklisted = tr_sessionIsAddressBlocked (session, &atom->addr);
+  struct peer_host * host = atom->host;
+
+  if (host->blocklisted < 0)
+    host->blocklisted = tr_sessionIsAddressBlocked (session, &host->addr);
 
-  assert (tr_isBool (atom->blocklisted));
-  return atom->blocklisted;
+  assert (tr_isBool (host->blocklisted));
+  return host->blocklisted;
 }
 
 
@@ -693,7 +1027,7 @@ tr_peerMgrSetUtpSupported (tr_torrent * tor, const tr_address * addr)
   struct peer_atom * atom = getExistingAtom (tor->swarm, addr);
 
   if (atom)
-    atom->flags |= ADDED_F_UTP_FLAGS;
+    atom->host->utp_supported = true;
 }
 
 void
@@ -702,7 +1036,7 @@ tr_peerMgrSetUtpFailed (tr_torrent *tor, const tr_address *addr, bool failed)
   struct peer_atom * atom = getExistingAtom (tor->swarm, addr);
 
   if (atom)
-    atom->utp_failed = failed;
+    atom->host->utp_failed = failed;
 }
 
 
@@ -711,74 +1045,93 @@ tr_peerMgrSetUtpFailed (tr_torrent *tor, const tr_address *addr, bool failed)
 ***
 *** There are two data structures associated with managing block requests:
 ***
-*** 1. tr_swarm::requests, an array of "struct block_request" which keeps
-***    track of which blocks have been requested, and when, and by which peers.
-***    This is list is used for (a) cancelling requests that have been pending
+*** 1. tr_swarm::requestBuckets, a hash table of "struct block_request" which
+***    keeps track of which blocks have been requested, and when, and by which
+***    peers. It's used for (a) cancelling requests that have been pending
 ***    for too long and (b) avoiding duplicate requests before endgame.
 ***
 *** 2. tr_swarm::pieces, an array of "struct weighted_piece" which lists the
-***    pieces that we want to request. It's used to decide which blocks to
-***    return next when tr_peerMgrGetBlockRequests () is called.
+***    pieces that we've started on, and tr_swarm::buckets, which lists
+***    the rest of the pieces that we want to request. They're used to
+***    decide which blocks to return next when tr_peerMgrGetBlockRequests ()
+***    is called.
 **/
 
 /**
 *** struct block_request
 **/
 
-static int
-compareReqByBlock (const void * va, const void * vb)
+#define MIN_REQUEST_BUCKET_COUNT 64
+
+static inline size_t
+hashRequestBlock (size_t bucket_count, tr_block_index_t block)
 {
-  const struct block_request * a = va;
-  const struct block_request * b = vb;
+  uint64_t h = block;
 
-  /* primary key: block */
-  if (a->block < b->block) return -1;
-  if (a->block > b->block) return 1;
+  h *= 0x9E3779B97F4A7C15ull;
+  return (size_t)(h >> 32) & (bucket_count - 1);
+}
 
-  /* secondary key: peer */
-  if (a->peer < b->peer) return -1;
-  if (a->peer > b->peer) return 1;
+static void
+requestRehash (tr_swarm * s, size_t bucket_count)
+{
+  struct block_request * b;
 
-  return 0;
+  tr_free (s->requestBuckets);
+  s->requestBuckets = tr_new0 (struct block_request*, bucket_count);
+  s->requestBucketCount = bucket_count;
+
+  for (b=s->oldestRequest; b!=NULL; b=b->next)
+    {
+      const size_t pos = hashRequestBlock (bucket_count, b->block);
+      b->hash_next = s->requestBuckets[pos];
+      s->requestBuckets[pos] = b;
+    }
 }
 
 static void
 requestListAdd (tr_swarm * s, tr_block_index_t block, tr_peer * peer)
 {
-  struct block_request key;
+  size_t pos;
+  struct block_request * b;
+
+  assert (peer != NULL);
 
   /* ensure enough room is available... */
-  if (s->requestCount + 1 >= s->requestAlloc)
-    {
-      const int CHUNK_SIZE = 128;
-      s->requestAlloc += CHUNK_SIZE;
-      s->requests = tr_renew (struct block_request,
-                              s->requests, s->requestAlloc);
-    }
+  if ((size_t)s->requestCount >= s->requestBucketCount)
+    requestRehash (s, MAX (MIN_REQUEST_BUCKET_COUNT, s->requestBucketCount * 2));
 
   /* populate the record we're inserting */
-  key.block = block;
-  key.peer = peer;
-  key.sentAt = tr_time ();
+  b = tr_new (struct block_request, 1);
+  b->block = block;
+  b->peer = peer;
+  b->sentAt = tr_time ();
+
+  /* add it to the block's hash bucket... */
+  pos = hashRequestBlock (s->requestBucketCount, block);
+  b->hash_next = s->requestBuckets[pos];
+  s->requestBuckets[pos] = b;
+
+  /* to the peer's requests... */
+  b->peer_prev = NULL;
+  b->peer_next = peer->requests;
+  if (b->peer_next != NULL)
+    b->peer_next->peer_prev = b;
+  peer->requests = b;
+
+  /* and to the end of the swarm's requests, which are oldest first */
+  b->next = NULL;
+  b->prev = s->newestRequest;
+  if (b->prev != NULL)
+    b->prev->next = b;
+  else
+    s->oldestRequest = b;
+  s->newestRequest = b;
 
-  /* insert the request to our array... */
-  {
-    bool exact;
-    const int pos = tr_lowerBound (&key, s->requests, s->requestCount,
-                                   sizeof (struct block_request),
-                                   compareReqByBlock, &exact);
-    assert (!exact);
-    memmove (s->requests + pos + 1,
-             s->requests + pos,
-             sizeof (struct block_request) * (s->requestCount++ - pos));
-    s->requests[pos] = key;
-  }
+  ++s->requestCount;
 
-  if (peer != NULL)
-    {
-      ++peer->pendingReqsToPeer;
-      assert (peer->pendingReqsToPeer >= 0);
-    }
+  ++peer->pendingReqsToPeer;
+  assert (peer->pendingReqsToPeer >= 0);
 
   /*fprintf (stderr, "added request of block %lu from peer %s... "
                      "there are now %d block\n",
@@ -788,13 +1141,14 @@ requestListAdd (tr_swarm * s, tr_block_index_t block, tr_peer * peer)
 static struct block_request *
 requestListLookup (tr_swarm * s, tr_block_index_t block, const tr_peer * peer)
 {
-  struct block_request key;
-  key.block = block;
-  key.peer = (tr_peer*) peer;
+  struct block_request * b = NULL;
 
-  return bsearch (&key, s->requests, s->requestCount,
-                  sizeof (struct block_request),
-                  compareReqByBlock);
+  if (s->requestBuckets != NULL)
+    for (b=s->requestBuckets[hashRequestBlock (s->requestBucketCount, block)]; b!=NULL; b=b->hash_next)
+      if ((b->block == block) && (b->peer == peer))
+        break;
+
+  return b;
 }
 
 /**
@@ -805,24 +1159,12 @@ static void
 getBlockRequestPeers (tr_swarm * s, tr_block_index_t block,
                       tr_ptrArray * peerArr)
 {
-  bool exact;
-  int i, pos;
-  struct block_request key;
-
-  key.block = block;
-  key.peer = NULL;
-  pos = tr_lowerBound (&key, s->requests, s->requestCount,
-                       sizeof (struct block_request),
-                       compareReqByBlock, &exact);
-
-  assert (!exact); /* shouldn't have a request with .peer == NULL */
+  const struct block_request * b;
 
-  for (i=pos; i<s->requestCount; ++i)
-    {
-      if (s->requests[i].block != block)
-        break;
-      tr_ptrArrayAppend (peerArr, s->requests[i].peer);
-    }
+  if (s->requestBuckets != NULL)
+    for (b=s->requestBuckets[hashRequestBlock (s->requestBucketCount, block)]; b!=NULL; b=b->hash_next)
+      if (b->block == block)
+        tr_ptrArrayAppend (peerArr, b->peer);
 }
 
 static void
@@ -836,19 +1178,41 @@ decrementPendingReqCount (const struct block_request * b)
 static void
 requestListRemove (tr_swarm * s, tr_block_index_t block, const tr_peer * peer)
 {
-  const struct block_request * b = requestListLookup (s, block, peer);
+  struct block_request * b;
+  struct block_request ** walk;
+
+  if (s->requestBuckets == NULL)
+    return;
+
+  for (walk=&s->requestBuckets[hashRequestBlock (s->requestBucketCount, block)]; *walk!=NULL; walk=&(*walk)->hash_next)
+    if (((*walk)->block == block) && ((*walk)->peer == peer))
+      break;
 
-  if (b != NULL)
+  if ((b = *walk) != NULL)
     {
-      const int pos = b - s->requests;
-      assert (pos < s->requestCount);
+      *walk = b->hash_next;
 
-      decrementPendingReqCount (b);
+      if (b->peer_prev != NULL)
+        b->peer_prev->peer_next = b->peer_next;
+      else
+        b->peer->requests = b->peer_next;
+      if (b->peer_next != NULL)
+        b->peer_next->peer_prev = b->peer_prev;
 
-      tr_removeElementFromArray (s->requests,
-                                 pos,
-                                 sizeof (struct block_request),
-                                 s->requestCount--);
+      if (b->prev != NULL)
+        b->prev->next = b->next;
+      else
+        s->oldestRequest = b->next;
+      if (b->next != NULL)
+        b->next->prev = b->prev;
+      else
+        s->newestRequest = b->prev;
+
+      --s->requestCount;
+      assert (s->requestCount >= 0);
+
+      decrementPendingReqCount (b);
+      tr_free (b);
 
       /*fprintf (stderr, "removing request of block %lu from peer %s... "
                          "there are now %d block requests left\n",
@@ -1062,128 +1426,328 @@ assertReplicationCountIsExact (Torrent * t)
 }
 #endif
 
-static struct weighted_piece *
-pieceListLookup (tr_swarm * s, tr_piece_index_t index)
+/**
+*** Buckets of unstarted pieces
+**/
+
+/* true if no blocks in the piece have been downloaded */
+static bool
+pieceIsUntouched (const tr_torrent * tor, tr_piece_index_t index)
 {
-  int i;
+  tr_block_index_t first;
+  tr_block_index_t last;
 
-  for (i=0; i<s->pieceCount; ++i)
-    if (s->pieces[i].index == index)
-      return &s->pieces[i];
+  tr_torGetPieceBlockRange (tor, index, &first, &last);
 
-  return NULL;
+  return tr_torrentMissingBlocksInPiece (tor, index) == last + 1 - first;
+}
+
+static inline struct piece_bucket *
+getPieceBucket (tr_swarm * s, tr_piece_index_t index)
+{
+  return &s->buckets[s->tor->info.pieces[index].priority - TR_PRI_LOW];
 }
 
 static void
-pieceListRebuild (tr_swarm * s)
+bucketAdd (tr_swarm * s, tr_piece_index_t index)
 {
-  if (!tr_torrentIsSeed (s->tor))
-    {
-      tr_piece_index_t i;
-      tr_piece_index_t * pool;
-      tr_piece_index_t poolCount = 0;
-      const tr_torrent * tor = s->tor;
-      const tr_info * inf = tr_torrentInfo (tor);
-      struct weighted_piece * pieces;
-      int pieceCount;
-
-      /* build the new list */
-      pool = tr_new (tr_piece_index_t, inf->pieceCount);
-      for (i=0; i<inf->pieceCount; ++i)
-        if (!inf->pieces[i].dnd)
-          if (!tr_torrentPieceIsComplete (tor, i))
-            pool[poolCount++] = i;
-      pieceCount = poolCount;
-      pieces = tr_new0 (struct weighted_piece, pieceCount);
-      for (i=0; i<poolCount; ++i)
-        {
-          struct weighted_piece * piece = pieces + i;
-          piece->index = pool[i];
-          piece->requestCount = 0;
-          piece->salt = tr_cryptoWeakRandInt (4096);
-        }
+  int key;
+  struct piece_node * node = &s->pieceNodes[index];
+  struct piece_bucket * bucket = getPieceBucket (s, index);
 
-      /* if we already had a list of pieces, merge it into
-       * the new list so we don't lose its requestCounts */
-      if (s->pieces != NULL)
-        {
-          struct weighted_piece * o = s->pieces;
-          struct weighted_piece * oend = o + s->pieceCount;
-          struct weighted_piece * n = pieces;
-          struct weighted_piece * nend = n + pieceCount;
+  assert (node->state != PIECE_BUCKETED);
 
-          pieceListSort (s, PIECES_SORTED_BY_INDEX);
+  key = MAX (0, s->pieceReplication[index] - s->replicationOffset);
 
-          while (o!=oend && n!=nend)
-            {
-              if (o->index < n->index)
-                ++o;
-              else if (o->index > n->index)
-                ++n;
-              else
-                *n++ = *o++;
-            }
+  if (key >= bucket->count)
+    {
+      int i;
+      const int count = MAX (key + 1, bucket->count * 2);
 
-          tr_free (s->pieces);
-        }
+      bucket->heads = tr_renew (tr_piece_index_t, bucket->heads, count);
+      bucket->tails = tr_renew (tr_piece_index_t, bucket->tails, count);
+      for (i=bucket->count; i<count; ++i)
+        bucket->heads[i] = bucket->tails[i] = NO_PIECE;
+      bucket->count = count;
+    }
 
-      s->pieces = pieces;
-      s->pieceCount = pieceCount;
+  node->key = key;
+  node->state = PIECE_BUCKETED;
 
-      pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
+  if (s->firstBucketedPiece > index)
+    s->firstBucketedPiece = index;
 
-      /* cleanup */
-      tr_free (pool);
+  /* adding at either end, at random, keeps peers from
+     all asking for the same pieces in the same order */
+  if (bucket->heads[key] == NO_PIECE)
+    {
+      node->prev = node->next = NO_PIECE;
+      bucket->heads[key] = bucket->tails[key] = index;
+    }
+  else if (tr_cryptoWeakRandInt (2))
+    {
+      node->prev = NO_PIECE;
+      node->next = bucket->heads[key];
+      s->pieceNodes[node->next].prev = index;
+      bucket->heads[key] = index;
+    }
+  else
+    {
+      node->next = NO_PIECE;
+      node->prev = bucket->tails[key];
+      s->pieceNodes[node->prev].next = index;
+      bucket->tails[key] = index;
     }
+
+  ++s->bucketedCount;
 }
 
 static void
-pieceListRemovePiece (tr_swarm * s, tr_piece_index_t piece)
+bucketRemove (tr_swarm * s, tr_piece_index_t index)
 {
-  struct weighted_piece * p;
+  struct piece_node * node = &s->pieceNodes[index];
+  struct piece_bucket * bucket = getPieceBucket (s, index);
 
-  if ((p = pieceListLookup (s, piece)))
-    {
-      const int pos = p - s->pieces;
+  assert (node->state == PIECE_BUCKETED);
 
-      tr_removeElementFromArray (s->pieces,
-                                 pos,
-                                 sizeof (struct weighted_piece),
-                                 s->pieceCount--);
+  if (node->prev != NO_PIECE)
+    s->pieceNodes[node->prev].next = node->next;
+  else
+    bucket->heads[node->key] = node->next;
+
+  if (node->next != NO_PIECE)
+    s->pieceNodes[node->next].prev = node->prev;
+  else
+    bucket->tails[node->key] = node->prev;
+
+  node->state = PIECE_UNWANTED;
+  --s->bucketedCount;
+}
+
+/* move a bucketed piece after its replication count changes */
+static void
+bucketUpdate (tr_swarm * s, tr_piece_index_t index)
+{
+  const struct piece_node * node = &s->pieceNodes[index];
+
+  if (node->state == PIECE_BUCKETED)
+    {
+      const int key = MAX (0, s->pieceReplication[index] - s->replicationOffset);
 
-      if (s->pieceCount == 0)
+      if (key != node->key)
         {
-          tr_free (s->pieces);
-          s->pieces = NULL;
+          bucketRemove (s, index);
+          bucketAdd (s, index);
         }
     }
 }
 
 static void
-pieceListResortPiece (tr_swarm * s, struct weighted_piece * p)
+bucketsClear (tr_swarm * s)
 {
-  int pos;
-  bool isSorted = true;
-
-  if (p == NULL)
-    return;
-
-  /* is the torrent already sorted? */
-  pos = p - s->pieces;
-  setComparePieceByWeightTorrent (s);
-  if (isSorted && (pos > 0) && (comparePieceByWeight (p-1, p) > 0))
-    isSorted = false;
-  if (isSorted && (pos < s->pieceCount - 1) && (comparePieceByWeight (p, p+1) > 0))
-    isSorted = false;
+  int i;
 
-  if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
+  for (i=0; i<PRIORITY_COUNT; ++i)
     {
-      pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
-      isSorted = true;
+      tr_free (s->buckets[i].heads);
+      tr_free (s->buckets[i].tails);
+      s->buckets[i].heads = NULL;
+      s->buckets[i].tails = NULL;
+      s->buckets[i].count = 0;
     }
 
-  /* if it's not sorted, move it around */
-  if (!isSorted)
+  s->bucketedCount = 0;
+  s->replicationOffset = 0;
+  s->firstBucketedPiece = 0;
+}
+
+/**
+*** The active pieces
+**/
+
+static struct weighted_piece *
+pieceListLookup (tr_swarm * s, tr_piece_index_t index)
+{
+  int i;
+
+  if ((s->pieceNodes == NULL) || (s->pieceNodes[index].state != PIECE_ACTIVE))
+    return NULL;
+
+  for (i=0; i<s->pieceCount; ++i)
+    if (s->pieces[i].index == index)
+      return &s->pieces[i];
+
+  return NULL;
+}
+
+static struct weighted_piece *
+pieceListAppend (tr_swarm * s, tr_piece_index_t index)
+{
+  struct weighted_piece * p;
+
+  if (s->pieceCount == s->pieceAlloc)
+    {
+      s->pieceAlloc = MAX (16, s->pieceAlloc * 2);
+      s->pieces = tr_renew (struct weighted_piece, s->pieces, s->pieceAlloc);
+    }
+
+  p = &s->pieces[s->pieceCount++];
+  p->index = index;
+  p->salt = tr_cryptoWeakRandInt (4096);
+  p->requestCount = 0;
+
+  s->pieceNodes[index].state = PIECE_ACTIVE;
+  invalidatePieceSorting (s);
+  return p;
+}
+
+/* move a piece that we're about to start on out of its bucket */
+static struct weighted_piece *
+pieceListActivate (tr_swarm * s, tr_piece_index_t index)
+{
+  bucketRemove (s, index);
+
+  return pieceListAppend (s, index);
+}
+
+static void
+pieceListFree (tr_swarm * s)
+{
+  bucketsClear (s);
+
+  tr_free (s->pieceNodes);
+  s->pieceNodes = NULL;
+
+  tr_free (s->pieces);
+  s->pieces = NULL;
+  s->pieceCount = 0;
+  s->pieceAlloc = 0;
+  invalidatePieceSorting (s);
+}
+
+static void
+pieceListRebuild (tr_swarm * s)
+{
+  if (!tr_torrentIsSeed (s->tor))
+    {
+      int i;
+      int keepCount;
+      tr_piece_index_t piece;
+      const tr_torrent * tor = s->tor;
+      const tr_info * inf = tr_torrentInfo (tor);
+
+      if (!replicationExists (s))
+        replicationNew (s);
+
+      if (s->pieceNodes == NULL)
+        s->pieceNodes = tr_new (struct piece_node, inf->pieceCount);
+      for (piece=0; piece<inf->pieceCount; ++piece)
+        s->pieceNodes[piece].state = PIECE_UNWANTED;
+      bucketsClear (s);
+
+      /* keep the pieces we've started on, so we don't lose their requestCounts */
+      for (i=keepCount=0; i<s->pieceCount; ++i)
+        {
+          const struct weighted_piece * p = &s->pieces[i];
+
+          if (!inf->pieces[p->index].dnd
+              && !tr_torrentPieceIsComplete (tor, p->index)
+              && ((p->requestCount > 0) || !pieceIsUntouched (tor, p->index)))
+            {
+              s->pieces[keepCount++] = *p;
+              s->pieceNodes[p->index].state = PIECE_ACTIVE;
+            }
+        }
+      s->pieceCount = keepCount;
+
+      /* the rest go into the buckets */
+      for (piece=0; piece<inf->pieceCount; ++piece)
+        if (!inf->pieces[piece].dnd)
+          if (s->pieceNodes[piece].state == PIECE_UNWANTED)
+            if (!tr_torrentPieceIsComplete (tor, piece))
+              {
+                if (pieceIsUntouched (tor, piece))
+                  bucketAdd (s, piece);
+                else
+                  pieceListAppend (s, piece);
+              }
+
+      pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
+    }
+}
+
+static void
+pieceListRemovePiece (tr_swarm * s, tr_piece_index_t piece)
+{
+  struct weighted_piece * p;
+
+  if (s->pieceNodes == NULL)
+    return;
+
+  if ((p = pieceListLookup (s, piece)))
+    {
+      const int pos = p - s->pieces;
+
+      tr_removeElementFromArray (s->pieces,
+                                 pos,
+                                 sizeof (struct weighted_piece),
+                                 s->pieceCount--);
+
+      s->pieceNodes[piece].state = PIECE_UNWANTED;
+    }
+  else if (s->pieceNodes[piece].state == PIECE_BUCKETED)
+    {
+      bucketRemove (s, piece);
+    }
+}
+
+/* if nothing's been downloaded or requested from an active piece,
+   put it back in its bucket. Returns true if the piece was moved. */
+static bool
+pieceListDeactivate (tr_swarm * s, struct weighted_piece * p)
+{
+  if ((p->requestCount == 0) && pieceIsUntouched (s->tor, p->index))
+    {
+      const tr_piece_index_t index = p->index;
+
+      tr_removeElementFromArray (s->pieces,
+                                 p - s->pieces,
+                                 sizeof (struct weighted_piece),
+                                 s->pieceCount--);
+
+      s->pieceNodes[index].state = PIECE_UNWANTED;
+      bucketAdd (s, index);
+      return true;
+    }
+
+  return false;
+}
+
+static void
+pieceListResortPiece (tr_swarm * s, struct weighted_piece * p)
+{
+  int pos;
+  bool isSorted = true;
+
+  if (p == NULL)
+    return;
+
+  /* is the torrent already sorted? */
+  pos = p - s->pieces;
+  setComparePieceByWeightTorrent (s);
+  if (isSorted && (pos > 0) && (comparePieceByWeight (p-1, p) > 0))
+    isSorted = false;
+  if (isSorted && (pos < s->pieceCount - 1) && (comparePieceByWeight (p, p+1) > 0))
+    isSorted = false;
+
+  if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
+    {
+      pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
+      isSorted = true;
+    }
+
+  /* if it's not sorted, move it around */
+  if (!isSorted)
     {
       bool exact;
       const struct weighted_piece tmp = *p;
@@ -1207,6 +1771,24 @@ pieceListResortPiece (tr_swarm * s, struct weighted_piece * p)
   assertWeightedPiecesAreSorted (s);
 }
 
+/* a block arrived, so the piece can't be sitting in a bucket */
+static void
+pieceListGotBlock (tr_swarm * s, tr_piece_index_t index)
+{
+  if (s->pieceNodes == NULL)
+    return;
+
+  if (s->pieceNodes[index].state == PIECE_BUCKETED)
+    {
+      if (!pieceIsUntouched (s->tor, index))
+        pieceListActivate (s, index);
+    }
+  else
+    {
+      pieceListResortPiece (s, pieceListLookup (s, index));
+    }
+}
+
 static void
 pieceListRemoveRequest (tr_swarm * s, tr_block_index_t block)
 {
@@ -1216,7 +1798,9 @@ pieceListRemoveRequest (tr_swarm * s, tr_block_index_t block)
   if (((p = pieceListLookup (s, index))) && (p->requestCount > 0))
     {
       --p->requestCount;
-      pieceListResortPiece (s, p);
+
+      if (!pieceListDeactivate (s, p))
+        pieceListResortPiece (s, p);
     }
 }
 
@@ -1228,8 +1812,8 @@ pieceListRemoveRequest (tr_swarm * s, tr_block_index_t block)
 ****/
 
 /**
- * Increase the replication count of this piece and sort it if the
- * piece list is already sorted
+ * Increase the replication count of this piece and move it to its
+ * new bucket, or resort it if the piece list is already sorted
  */
 static void
 tr_incrReplicationOfPiece (tr_swarm * s, const size_t index)
@@ -1240,45 +1824,72 @@ tr_incrReplicationOfPiece (tr_swarm * s, const size_t index)
   /* One more replication of this piece is present in the swarm */
   ++s->pieceReplication[index];
 
+  if (s->pieceNodes != NULL)
+    bucketUpdate (s, index);
+
   /* we only resort the piece if the list is already sorted */
   if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
     pieceListResortPiece (s, pieceListLookup (s, index));
 }
 
 /**
- * Increases the replication count of pieces present in the bitfield
+ * Increase the replication count of every piece
  */
 static void
-tr_incrReplicationFromBitfield (tr_swarm * s, const tr_bitfield * b)
+tr_incrReplication (tr_swarm * s)
 {
-  size_t i;
-  uint16_t * rep = s->pieceReplication;
-  const size_t n = s->tor->info.pieceCount;
+  int i;
+  const int n = s->pieceReplicationSize;
 
   assert (replicationExists (s));
+  assert (s->pieceReplicationSize == s->tor->info.pieceCount);
 
   for (i=0; i<n; ++i)
-    if (tr_bitfieldHas (b, i))
-      ++rep[i];
+    ++s->pieceReplication[i];
 
-  if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
-    invalidatePieceSorting (s);
+  /* every piece moved up by one, so the buckets' order still holds */
+  ++s->replicationOffset;
 }
 
 /**
- * Increase the replication count of every piece
+ * Increases the replication count of pieces present in the bitfield
  */
 static void
-tr_incrReplication (tr_swarm * s)
+tr_incrReplicationFromBitfield (tr_swarm * s, const tr_bitfield * b)
 {
-  int i;
-  const int n = s->pieceReplicationSize;
+  size_t i;
+  uint16_t * rep = s->pieceReplication;
+  const size_t n = s->tor->info.pieceCount;
 
   assert (replicationExists (s));
-  assert (s->pieceReplicationSize == s->tor->info.pieceCount);
 
-  for (i=0; i<n; ++i)
-    ++s->pieceReplication[i];
+  if (tr_bitfieldHasAll (b))
+    {
+      tr_incrReplication (s);
+    }
+  else if (!tr_bitfieldHasNone (b))
+    {
+      for (i=0; i<n; ++i)
+        {
+          /* skip the empty stretches a byte at a time */
+          if (((i & 7) == 0) && ((i >> 3) < b->alloc_count) && (b->bits[i >> 3] == 0))
+            {
+              i += 7;
+              continue;
+            }
+
+          if (tr_bitfieldHas (b, i))
+            {
+              ++rep[i];
+
+              if (s->pieceNodes != NULL)
+                bucketUpdate (s, i);
+            }
+        }
+
+      if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
+        invalidatePieceSorting (s);
+    }
 }
 
 /**
@@ -1287,8 +1898,8 @@ tr_incrReplication (tr_swarm * s)
 static void
 tr_decrReplicationFromBitfield (tr_swarm * s, const tr_bitfield * b)
 {
-  int i;
-  const int n = s->pieceReplicationSize;
+  size_t i;
+  const size_t n = s->pieceReplicationSize;
 
   assert (replicationExists (s));
   assert (s->pieceReplicationSize == s->tor->info.pieceCount);
@@ -1297,12 +1908,27 @@ tr_decrReplicationFromBitfield (tr_swarm * s, const tr_bitfield * b)
     {
       for (i=0; i<n; ++i)
         --s->pieceReplication[i];
+
+      --s->replicationOffset;
     }
   else if (!tr_bitfieldHasNone (b))
     {
       for (i=0; i<n; ++i)
-        if (tr_bitfieldHas (b, i))
-          --s->pieceReplication[i];
+        {
+          if (((i & 7) == 0) && ((i >> 3) < b->alloc_count) && (b->bits[i >> 3] == 0))
+            {
+              i += 7;
+              continue;
+            }
+
+          if (tr_bitfieldHas (b, i))
+            {
+              --s->pieceReplication[i];
+
+              if (s->pieceNodes != NULL)
+                bucketUpdate (s, i);
+            }
+        }
 
       if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
         invalidatePieceSorting (s);
@@ -1321,6 +1947,253 @@ tr_peerMgrRebuildRequests (tr_torrent * tor)
   pieceListRebuild (tor->swarm);
 }
 
+/* request the blocks in `p' that `peer' should ask for.
+   If the piece is late, blocks that have already been requested from
+   another peer may be requested again. Returns the new `got' */
+static int
+requestBlocksFromPiece (tr_swarm               * s,
+                        tr_peer                * peer,
+                        struct weighted_piece  * p,
+                        int                      numwant,
+                        tr_block_index_t       * setme,
+                        int                      got,
+                        bool                     get_intervals,
+                        bool                     late)
+{
+  tr_block_index_t b;
+  tr_block_index_t first;
+  tr_block_index_t last;
+  tr_ptrArray peerArr = TR_PTR_ARRAY_INIT;
+  const tr_torrent * tor = s->tor;
+
+  tr_torGetPieceBlockRange (tor, p->index, &first, &last);
+
+  for (b=first; b<=last && (got<numwant || (get_intervals && setme[2*got-1] == b-1)); ++b)
+    {
+      int peerCount;
+      tr_peer ** peers;
+
+      /* don't request blocks we've already got */
+      if (tr_torrentBlockIsComplete (tor, b))
+        continue;
+
+      /* always add peer if this block has no peers yet */
+      tr_ptrArrayClear (&peerArr);
+      getBlockRequestPeers (s, b, &peerArr);
+      peers = (tr_peer **) tr_ptrArrayPeek (&peerArr, &peerCount);
+      if (peerCount != 0)
+        {
+          /* don't make a second block request until the endgame */
+          if (!s->endgame && !late)
+            continue;
+
+          /* don't have more than two peers requesting this block */
+          if (peerCount > 1)
+            continue;
+
+          /* don't send the same request to the same peer twice */
+          if (peer == peers[0])
+            continue;
+
+          /* in the endgame allow an additional peer to download a
+             block but only if the peer seems to be handling requests
+             relatively fast */
+          if (!late && (peer->pendingReqsToPeer + numwant - got < s->endgame))
+            continue;
+        }
+
+      /* update the caller's table */
+      if (!get_intervals)
+        {
+          setme[got++] = b;
+        }
+      /* if intervals are requested two array entries are necessarry:
+         one for the interval's starting block and one for its end block */
+      else if (got && setme[2 * got - 1] == b - 1 && b != first)
+        {
+          /* expand the last interval */
+          ++setme[2 * got - 1];
+        }
+      else
+        {
+          /* begin a new interval */
+          setme[2 * got] = setme[2 * got + 1] = b;
+          ++got;
+        }
+
+      /* update our own tables */
+      requestListAdd (s, b, peer);
+      ++p->requestCount;
+    }
+
+  tr_ptrArrayDestruct (&peerArr, NULL);
+  return got;
+}
+
+/* find the bucketed piece that `peer' has with the highest priority
+   and the lowest replication count by walking its bitfield. This is
+   faster than walking the buckets when the peer has few pieces. */
+static tr_piece_index_t
+findBucketedPieceInBitfield (const tr_swarm * s, const tr_bitfield * have)
+{
+  size_t i;
+  int bestPriority = TR_PRI_LOW - 1;
+  int bestKey = INT_MAX;
+  tr_piece_index_t best = NO_PIECE;
+  const tr_torrent * tor = s->tor;
+  const size_t n = MIN (tor->info.pieceCount, have->alloc_count * 8);
+
+  for (i=0; i<n; ++i)
+    {
+      const struct piece_node * node;
+
+      if (((i & 7) == 0) && (have->bits[i >> 3] == 0))
+        {
+          i += 7;
+          continue;
+        }
+
+      node = &s->pieceNodes[i];
+      if ((node->state == PIECE_BUCKETED) && tr_bitfieldHas (have, i))
+        {
+          const int priority = tor->info.pieces[i].priority;
+
+          if ((priority > bestPriority) || ((priority == bestPriority) && (node->key < bestKey)))
+            {
+              best = i;
+              bestPriority = priority;
+              bestKey = node->key;
+            }
+        }
+    }
+
+  return best;
+}
+
+/* find the first bucketed piece that `peer' has */
+static tr_piece_index_t
+findFirstBucketedPiece (tr_swarm * s, const tr_bitfield * have)
+{
+  tr_piece_index_t i;
+  const tr_piece_index_t n = s->tor->info.pieceCount;
+
+  while ((s->firstBucketedPiece < n) && (s->pieceNodes[s->firstBucketedPiece].state != PIECE_BUCKETED))
+    ++s->firstBucketedPiece;
+
+  for (i=s->firstBucketedPiece; i<n; ++i)
+    if ((s->pieceNodes[i].state == PIECE_BUCKETED) && tr_bitfieldHas (have, i))
+      return i;
+
+  return NO_PIECE;
+}
+
+/* start on unstarted pieces that `peer' has: in order for sequential
+   downloads, otherwise highest priority and rarest first.
+   Returns the new `got' */
+static int
+requestBlocksFromBuckets (tr_swarm          * s,
+                          tr_peer           * peer,
+                          int                 numwant,
+                          tr_block_index_t  * setme,
+                          int                 got,
+                          bool                get_intervals)
+{
+  const tr_bitfield * const have = &peer->have;
+
+  if (s->tor->sequentialDownload)
+    {
+      tr_piece_index_t index;
+
+      while ((got < numwant) && ((index = findFirstBucketedPiece (s, have)) != NO_PIECE))
+        got = requestBlocksFromPiece (s, peer, pieceListActivate (s, index),
+                                      numwant, setme, got, get_intervals, false);
+    }
+  else if (!tr_bitfieldHasAll (have) && (tr_bitfieldCountTrueBits (have) * 4 < (size_t)s->bucketedCount))
+    {
+      tr_piece_index_t index;
+
+      while ((got < numwant) && ((index = findBucketedPieceInBitfield (s, have)) != NO_PIECE))
+        got = requestBlocksFromPiece (s, peer, pieceListActivate (s, index),
+                                      numwant, setme, got, get_intervals, false);
+    }
+  else
+    {
+      int i;
+
+      for (i=PRIORITY_COUNT-1; i>=0 && got<numwant; --i)
+        {
+          int key;
+          const struct piece_bucket * bucket = &s->buckets[i];
+
+          for (key=0; key<bucket->count && got<numwant; ++key)
+            {
+              tr_piece_index_t index = bucket->heads[key];
+
+              while ((index != NO_PIECE) && (got < numwant))
+                {
+                  const tr_piece_index_t next = s->pieceNodes[index].next;
+
+                  if (tr_bitfieldHas (have, index))
+                    got = requestBlocksFromPiece (s, peer, pieceListActivate (s, index),
+                                                  numwant, setme, got, get_intervals, false);
+
+                  index = next;
+                }
+            }
+        }
+    }
+
+  return got;
+}
+
+/* request the pieces in the streaming window, nearest first.
+   The nearest piece is due STREAMING_GRACE_MSEC after the window
+   moved, and each one after it is due as much later as it'd take
+   to download at the torrent's current speed. Returns the new `got' */
+static int
+requestBlocksFromStreamingWindow (tr_swarm          * s,
+                                  tr_peer           * peer,
+                                  int                 numwant,
+                                  tr_block_index_t  * setme,
+                                  int                 got,
+                                  bool                get_intervals)
+{
+  unsigned int Bps;
+  uint64_t deadline;
+  uint64_t pieceMsec;
+  tr_piece_index_t i, first, last;
+  const tr_torrent * tor = s->tor;
+  const tr_info * inf = &tor->info;
+  const uint64_t now = tr_time_msec ();
+
+  if ((tor->streamingWindow == 0) || (tor->streamingPosition >= inf->totalSize))
+    return got;
+
+  first = tor->streamingPosition / inf->pieceSize;
+  last = (MIN (inf->totalSize, tor->streamingPosition + tor->streamingWindow) - 1) / inf->pieceSize;
+
+  Bps = tr_bandwidthGetPieceSpeed_Bps (&tor->bandwidth, now, TR_DOWN);
+  pieceMsec = Bps ? ((uint64_t)inf->pieceSize * 1000) / Bps : 0;
+  deadline = tor->streamingMovedAt + STREAMING_GRACE_MSEC;
+
+  for (i=first; i<=last && got<numwant; ++i, deadline+=pieceMsec)
+    {
+      struct weighted_piece * p;
+
+      if (inf->pieces[i].dnd || !tr_bitfieldHas (&peer->have, i))
+        continue;
+
+      if (s->pieceNodes[i].state == PIECE_BUCKETED)
+        p = pieceListActivate (s, i);
+      else if ((p = pieceListLookup (s, i)) == NULL) /* we have it */
+        continue;
+
+      got = requestBlocksFromPiece (s, peer, p, numwant, setme, got, get_intervals, now > deadline);
+    }
+
+  return got;
+}
+
 void
 tr_peerMgrGetNextRequests (tr_torrent           * tor,
                            tr_peer              * peer,
@@ -1332,7 +2205,6 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
   int i;
   int got;
   tr_swarm * s;
-  struct weighted_piece * pieces;
   const tr_bitfield * const have = &peer->have;
 
   /* sanity clause */
@@ -1344,9 +2216,15 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
   s = tor->swarm;
 
   /* prep the pieces list */
-  if (s->pieces == NULL)
+  if (s->pieceNodes == NULL)
     pieceListRebuild (s);
 
+  if (s->pieceNodes == NULL)
+    {
+      *numgot = 0;
+      return;
+    }
+
   if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
     pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
 
@@ -1354,91 +2232,46 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
   assertWeightedPiecesAreSorted (s);
 
   updateEndgame (s);
-  pieces = s->pieces;
-  for (i=0; i<s->pieceCount && got<numwant; ++i)
+
+  /* first, the pieces that we're streaming... */
+  if (tor->streamingWindow > 0)
     {
-      struct weighted_piece * p = pieces + i;
+      got = requestBlocksFromStreamingWindow (s, peer, numwant, setme, got, get_intervals);
 
-      /* if the peer has this piece that we want... */
-      if (tr_bitfieldHas (have, p->index))
-        {
-          tr_block_index_t b;
-          tr_block_index_t first;
-          tr_block_index_t last;
-          tr_ptrArray peerArr = TR_PTR_ARRAY_INIT;
+      if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
+        pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
+    }
 
-          tr_torGetPieceBlockRange (tor, p->index, &first, &last);
+  /* then finish the pieces that we've started on... */
+  for (i=0; i<s->pieceCount && got<numwant; ++i)
+    {
+      struct weighted_piece * p = &s->pieces[i];
+      const int missing = tr_torrentMissingBlocksInPiece (tor, p->index);
 
-          for (b=first; b<=last && (got<numwant || (get_intervals && setme[2*got-1] == b-1)); ++b)
-            {
-              int peerCount;
-              tr_peer ** peers;
-
-              /* don't request blocks we've already got */
-              if (tr_torrentBlockIsComplete (tor, b))
-                continue;
-
-              /* always add peer if this block has no peers yet */
-              tr_ptrArrayClear (&peerArr);
-              getBlockRequestPeers (s, b, &peerArr);
-              peers = (tr_peer **) tr_ptrArrayPeek (&peerArr, &peerCount);
-              if (peerCount != 0)
-                {
-                  /* don't make a second block request until the endgame */
-                  if (!s->endgame)
-                    continue;
-
-                  /* don't have more than two peers requesting this block */
-                  if (peerCount > 1)
-                    continue;
-
-                  /* don't send the same request to the same peer twice */
-                  if (peer == peers[0])
-                    continue;
-
-                  /* in the endgame allow an additional peer to download a
-                     block but only if the peer seems to be handling requests
-                     relatively fast */
-                  if (peer->pendingReqsToPeer + numwant - got < s->endgame)
-                    continue;
-                }
+      /* the rest have had all their blocks requested */
+      if (missing <= p->requestCount)
+        break;
 
-              /* update the caller's table */
-              if (!get_intervals)
-                {
-                  setme[got++] = b;
-                }
-              /* if intervals are requested two array entries are necessarry:
-                 one for the interval's starting block and one for its end block */
-              else if (got && setme[2 * got - 1] == b - 1 && b != first)
-                {
-                  /* expand the last interval */
-                  ++setme[2 * got - 1];
-                }
-              else
-                {
-                  /* begin a new interval */
-                  setme[2 * got] = setme[2 * got + 1] = b;
-                  ++got;
-                }
+      if (tr_bitfieldHas (have, p->index))
+        got = requestBlocksFromPiece (s, peer, p, numwant, setme, got, get_intervals, false);
+    }
 
-              /* update our own tables */
-              requestListAdd (s, b, peer);
-              ++p->requestCount;
-            }
+  /* then start on new ones... */
+  if (got < numwant)
+    got = requestBlocksFromBuckets (s, peer, numwant, setme, got, get_intervals);
 
-          tr_ptrArrayDestruct (&peerArr, NULL);
-        }
-    }
+  /* and in the endgame, ask for blocks that have already been requested */
+  if (s->endgame)
+    for (i=0; i<s->pieceCount && got<numwant; ++i)
+      if (tr_bitfieldHas (have, s->pieces[i].index))
+        got = requestBlocksFromPiece (s, peer, &s->pieces[i], numwant, setme, got, get_intervals, false);
 
   /* In most cases we've just changed the weights of a small number of pieces.
    * So rather than qsort ()ing the entire array, it's faster to apply an
    * adaptive insertion sort algorithm. */
   if (got > 0)
     {
-      /* not enough requests || last piece modified */
-      if (i == s->pieceCount)
-        --i;
+      i = s->pieceCount;
 
       setComparePieceByWeightTorrent (s);
       while (--i >= 0)
@@ -1459,6 +2292,8 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
               s->pieces[i + newpos] = piece;
             }
         }
+
+      s->pieceSortState = PIECES_SORTED_BY_WEIGHT;
     }
 
   assertWeightedPiecesAreSorted (t);
@@ -1475,78 +2310,60 @@ tr_peerMgrDidPeerRequest (const tr_torrent  * tor,
 
 /* cancel requests that are too old */
 static void
-refillUpkeep (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
+refillUpkeepSwarm (tr_swarm * s)
 {
-    time_t now;
-    time_t too_old;
-    tr_torrent * tor;
-    int cancel_buflen = 0;
-    struct block_request * cancel = NULL;
-    tr_peerMgr * mgr = vmgr;
-    managerLock (mgr);
-
-    now = tr_time ();
-    too_old = now - REQUEST_TTL_SECS;
-
-    /* alloc the temporary "cancel" buffer */
-    tor = NULL;
-    while ((tor = tr_torrentNext (mgr->session, tor)))
-        cancel_buflen = MAX (cancel_buflen, tor->swarm->requestCount);
-    if (cancel_buflen > 0)
-        cancel = tr_new (struct block_request, cancel_buflen);
-
-    /* prune requests that are too old */
-    tor = NULL;
-    while ((tor = tr_torrentNext (mgr->session, tor)))
-    {
-        tr_swarm * s = tor->swarm;
-        const int n = s->requestCount;
-        if (n > 0)
-        {
-            int keepCount = 0;
-            int cancelCount = 0;
-            const struct block_request * it;
-            const struct block_request * end;
+  int cancelCount = 0;
+  struct block_request * cancel;
+  const struct block_request * it;
+  const struct block_request * end;
+  const time_t now = tr_time ();
+  const time_t too_old = now - REQUEST_TTL_SECS;
 
-            for (it=s->requests, end=it+n; it!=end; ++it)
-            {
-                tr_peerMsgs * msgs = PEER_MSGS(it->peer);
+  if ((s->oldestRequest == NULL) || (s->oldestRequest->sentAt > too_old))
+    return;
 
-                if ((msgs !=NULL) && (it->sentAt <= too_old) && !tr_peerMsgsIsReadingBlock (msgs, it->block))
-                    cancel[cancelCount++] = *it;
-                else
-                {
-                    if (it != &s->requests[keepCount])
-                        s->requests[keepCount] = *it;
-                    keepCount++;
-                }
-            }
+  cancel = tr_new (struct block_request, s->requestCount);
 
-            /* prune out the ones we aren't keeping */
-            s->requestCount = keepCount;
+  /* the requests are oldest first, so stop at the first young one */
+  for (it=s->oldestRequest; it!=NULL && it->sentAt<=too_old; it=it->next)
+    {
+      tr_peerMsgs * msgs = PEER_MSGS(it->peer);
 
-            /* send cancel messages for all the "cancel" ones */
-            for (it=cancel, end=it+cancelCount; it!=end; ++it)
-            {
-              tr_peerMsgs * msgs = PEER_MSGS(it->peer);
+      if ((msgs != NULL) && !tr_peerMsgsIsReadingBlock (msgs, it->block))
+        cancel[cancelCount++] = *it;
+    }
 
-              if (msgs != NULL)
-                {
-                  tr_historyAdd (&it->peer->cancelsSentToPeer, now, 1);
-                  tr_peerMsgsCancel (msgs, it->block);
-                  decrementPendingReqCount (it);
-                }
-            }
+  /* send cancel messages for all the "cancel" ones */
+  for (it=cancel, end=it+cancelCount; it!=end; ++it)
+    {
+      tr_peerMsgs * msgs = PEER_MSGS(it->peer);
 
-            /* decrement the pending request counts for the timed-out blocks */
-            for (it=cancel, end=it+cancelCount; it!=end; ++it)
-                pieceListRemoveRequest (s, it->block);
-        }
+      requestListRemove (s, it->block, it->peer);
+      tr_historyAdd (&it->peer->cancelsSentToPeer, now, 1);
+      tr_peerMsgsCancel (msgs, it->block);
     }
 
-    tr_free (cancel);
+  /* decrement the pending request counts for the timed-out blocks */
+  for (it=cancel, end=it+cancelCount; it!=end; ++it)
+    pieceListRemoveRequest (s, it->block);
+
+  tr_free (cancel);
+}
+
+static bool runSwarmPass (tr_peerMgr *, int * lastId, void (*func)(tr_swarm*));
+
+static void
+refillUpkeep (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
+{
+  tr_peerMgr * mgr = vmgr;
+  managerLock (mgr);
+
+  if (runSwarmPass (mgr, &mgr->refillUpkeepPassId, refillUpkeepSwarm))
     tr_timerAddMsec (mgr->refillUpkeepTimer, REFILL_UPKEEP_PERIOD_MSEC);
-    managerUnlock (mgr);
+  else
+    tr_timerAddMsec (mgr->refillUpkeepTimer, PASS_SLICE_INTERVAL_MSEC);
+
+  managerUnlock (mgr);
 }
 
 static void
@@ -1626,17 +2443,8 @@ removeRequestFromTables (tr_swarm * s, tr_block_index_t block, const tr_peer * p
 static void
 peerDeclinedAllRequests (tr_swarm * s, const tr_peer * peer)
 {
-  int i, n;
-  tr_block_index_t * blocks = tr_new (tr_block_index_t, s->requestCount);
-
-  for (i=n=0; i<s->requestCount; ++i)
-    if (peer == s->requests[i].peer)
-      blocks[n++] = s->requests[i].block;
-
-  for (i=0; i<n; ++i)
-    removeRequestFromTables (s, blocks[i], peer);
-
-  tr_free (blocks);
+  while (peer->requests != NULL)
+    removeRequestFromTables (s, peer->requests->block, peer);
 }
 
 static void
@@ -1805,8 +2613,8 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vs)
           const tr_block_index_t block = _tr_block (tor, p, e->offset);
           cancelAllRequestsForBlock (s, block, peer);
           tr_historyAdd (&peer->blocksSentToClient, tr_time(), 1);
-          pieceListResortPiece (s, pieceListLookup (s, p));
           tr_torrentGotBlock (tor, block);
+          pieceListGotBlock (s, p);
           break;
         }
 
@@ -1868,14 +2676,15 @@ ensureAtomExists (tr_swarm          * s,
     {
       const int jitter = tr_cryptoWeakRandInt (60*10);
       a = tr_new0 (struct peer_atom, 1);
-      a->addr = *addr;
+      a->host = hostRef (s->manager, addr);
       a->port = port;
-      a->flags = flags;
+      a->flags = flags & ~ADDED_F_UTP_FLAGS;
       a->fromFirst = from;
       a->fromBest = from;
       a->shelf_date = tr_time () + getDefaultShelfLife (from) + jitter;
-      a->blocklisted = -1;
       atomSetSeedProbability (a, seedProbability);
+      a->swarm = s;
+      a->heapPos = -1;
       tr_ptrArrayInsertSorted (&s->pool, a, compareAtomsByAddress);
 
       tordbg (s, "got a new atom: %s", tr_atomAddrStr (a));
@@ -1888,8 +2697,15 @@ ensureAtomExists (tr_swarm          * s,
       if (a->seedProbability == -1)
         atomSetSeedProbability (a, seedProbability);
 
-      a->flags |= flags;
+      a->flags |= flags & ~ADDED_F_UTP_FLAGS;
     }
+
+  if (flags & ADDED_F_UTP_FLAGS)
+    a->host->utp_supported = true;
+
+  /* a new atom is ready to try, and a ready one may have a new score */
+  if (s->isRunning && (a->queue != ATOM_ASLEEP))
+    candidateSetReady (a);
 }
 
 static int
@@ -1986,8 +2802,10 @@ myHandshakeDoneCB (tr_handshake  * handshake,
               if (!readAnythingFromPeer)
                 {
                   tordbg (s, "marking peer %s as unreachable... numFails is %d", tr_atomAddrStr (atom), (int)atom->numFails);
-                  atom->flags2 |= MYFLAG_UNREACHABLE;
+                  atom->host->unreachable = true;
                 }
+
+              candidateRequeue (atom);
             }
         }
     }
@@ -1999,18 +2817,18 @@ myHandshakeDoneCB (tr_handshake  * handshake,
       atom = getExistingAtom (s, addr);
       atom->time = tr_time ();
       atom->piece_data_time = 0;
-      atom->lastConnectionAt = tr_time ();
+      atom->host->lastConnectionAt = tr_time ();
 
       if (!tr_peerIoIsIncoming (io))
         {
           atom->flags |= ADDED_F_CONNECTABLE;
-          atom->flags2 &= ~MYFLAG_UNREACHABLE;
+          atom->host->unreachable = false;
         }
 
       /* In principle, this flag specifies whether the peer groks uTP,
          not whether it's currently connected over uTP. */
       if (io->utp_socket)
-        atom->flags |= ADDED_F_UTP_FLAGS;
+        atom->host->utp_supported = true;
 
       if (atom->flags2 & MYFLAG_BANNED)
         {
@@ -2046,6 +2864,8 @@ myHandshakeDoneCB (tr_handshake  * handshake,
               success = true;
             }
         }
+
+      candidateRequeue (atom);
     }
 
   if (s != NULL)
@@ -2214,6 +3034,7 @@ tr_peerMgrGotBadPiece (tr_torrent * tor, tr_piece_index_t pieceIndex)
 {
   int i;
   int n;
+  struct weighted_piece * p;
   tr_swarm * s = tor->swarm;
   const uint32_t byteCount = tr_torPieceCountBytes (tor, pieceIndex);
 
@@ -2229,6 +3050,9 @@ tr_peerMgrGotBadPiece (tr_torrent * tor, tr_piece_index_t pieceIndex)
         }
     }
 
+  /* the piece's blocks were thrown out, so it goes back to its bucket */
+  if ((p = pieceListLookup (s, pieceIndex)))
+    pieceListDeactivate (s, p);
 
   tr_announcerAddBytes (tor, TR_ANN_CORRUPT, byteCount);
 }
@@ -2349,12 +3173,14 @@ tr_peerMgrGetPeers (tr_torrent   * tor,
   for (i=0; i<atomCount && count<n; ++i)
     {
       const struct peer_atom * atom = atoms[i];
-      if (atom->addr.type == af)
+      if (atom->host->addr.type == af)
         {
-          assert (tr_address_is_valid (&atom->addr));
-          walk->addr = atom->addr;
+          assert (tr_address_is_valid (&atom->host->addr));
+          walk->addr = atom->host->addr;
           walk->port = atom->port;
           walk->flags = atom->flags;
+          if (atom->host->utp_supported)
+            walk->flags |= ADDED_F_UTP_FLAGS;
           ++count;
           ++walk;
         }
@@ -2375,6 +3201,7 @@ static void atomPulse      (evutil_socket_t, short, void *);
 static void bandwidthPulse (evutil_socket_t, short, void *);
 static void rechokePulse   (evutil_socket_t, short, void *);
 static void reconnectPulse (evutil_socket_t, short, void *);
+static void rechokeSwarm   (tr_swarm *);
 
 static struct event *
 createTimer (tr_session * session, int msec, event_callback_fn callback, void * cbdata)
@@ -2415,7 +3242,8 @@ tr_peerMgrStartTorrent (tr_torrent * tor)
   s->maxPeers = tor->maxConnectedPeers;
   s->pieceSortState = PIECES_UNSORTED;
 
-  rechokePulse (0, 0, s->manager);
+  candidatesStart (s);
+  rechokeSwarm (s);
 }
 
 static void removeAllPeers (tr_swarm *);
@@ -2424,6 +3252,9 @@ static void
 stopSwarm (tr_swarm * swarm)
 {
   swarm->isRunning = false;
+  swarm->uploadSlots = 0;
+  swarm->uploadSlotsUsed = 0;
+  candidatesStop (swarm);
 
   replicationFree (swarm);
   invalidatePieceSorting (swarm);
@@ -2709,7 +3540,7 @@ tr_peerMgrPeerStats (const tr_torrent * tor, int * setmeCount)
       const struct peer_atom * atom = peer->atom;
       tr_peer_stat *           stat = ret + i;
 
-      tr_address_to_string_with_buf (&atom->addr, stat->addr, sizeof (stat->addr));
+      tr_address_to_string_with_buf (&atom->host->addr, stat->addr, sizeof (stat->addr));
       tr_strlcpy (stat->client, tr_quark_get_string(peer->client,NULL), sizeof (stat->client));
       stat->port                = ntohs (peer->atom->port);
       stat->from                = atom->fromFirst;
@@ -2980,6 +3811,7 @@ struct ChokeData
   bool          wasChoked;
   bool          isChoked;
   int           rate;
+  int           uploadRate; /* ours to the peer, whatever `rate' ranks by */
   int           salt;
   tr_peerMsgs * msgs;
 };
@@ -3048,16 +3880,97 @@ isBandwidthMaxedOut (const tr_bandwidth * b,
     }
 }
 
+/* how much of the tightest upload limit that applies to the torrent,
+   its own or that of a group or session above it, is being used */
+static int
+getUploadLoadPercent (const tr_bandwidth * b, const uint64_t now_msec)
+{
+  int load = 0;
+  bool honorGrandparent = true;
+
+  for (; b != NULL; b = b->parent)
+    {
+      if (tr_bandwidthIsLimited (b, TR_UP))
+        {
+          const uint64_t got = tr_bandwidthGetPieceSpeed_Bps (b, now_msec, TR_UP);
+          const uint64_t want = tr_bandwidthGetDesiredSpeed_Bps (b, TR_UP);
+
+          load = want ? MAX (load, (int) MIN (got * 100 / want, 100))
+                      : 100;
+        }
+
+      if (!tr_bandwidthAreParentLimitsHonored (b, TR_UP) || !honorGrandparent)
+        break;
+
+      honorGrandparent = tr_bandwidthAreGrandparentLimitsHonored (b, TR_UP);
+    }
+
+  return load;
+}
+
+static int
+getUploadSlots (const tr_swarm * s)
+{
+  const tr_session * session = s->manager->session;
+
+  if (session->uploadSlotsAdaptive && (s->uploadSlots > 0))
+    return s->uploadSlots;
+
+  return session->uploadSlotsPerTorrent;
+}
+
+/**
+ * Adaptive upload slots, loosely after libtorrent's rate-based choker.
+ *
+ * `slowestRate' is how fast we're uploading to the slowest unchoked peer.
+ *
+ * If the upload is saturated, another slot would only split the same
+ * bandwidth more thinly, so none is opened; and a slot whose peer gets
+ * less than half of its share of the torrent's upload isn't paying off,
+ * so it's closed. If the upload has room to spare, every slot is in use,
+ * and the slowest peer is still getting a fair amount, the marginal slot
+ * is paying off, so open another. If it isn't, drift back towards
+ * upload-slots-per-torrent. In between, hold steady, so that a shared
+ * limit hovering around saturation doesn't swing the counts up and down.
+ */
+static void
+adjustUploadSlots (tr_swarm * s, int slots, int used, int slowestRate, const uint64_t now)
+{
+  const int base = s->manager->session->uploadSlotsPerTorrent;
+  const int lo = MIN (base, MIN_ADAPTIVE_UPLOAD_SLOTS);
+  const int hi = base * MAX_ADAPTIVE_UPLOAD_SLOTS_MULTIPLIER;
+  const int load = getUploadLoadPercent (&s->tor->bandwidth, now);
+
+  if (load >= UPLOAD_SATURATED_PERCENT)
+    {
+      const uint64_t share = tr_bandwidthGetPieceSpeed_Bps (&s->tor->bandwidth, now, TR_UP) / MAX (used, 1);
+
+      if ((used >= slots) && ((uint64_t)slowestRate * 2 < share))
+        --slots;
+    }
+  else if (load < UPLOAD_HEADROOM_PERCENT)
+    {
+      if ((used >= slots) && (slowestRate >= slots * ADAPTIVE_UPLOAD_SLOT_STEP_Bps))
+        ++slots;
+      else if (slots > base)
+        --slots;
+    }
+
+  s->uploadSlots = MAX (lo, MIN (slots, hi));
+}
+
 static void
 rechokeUploads (tr_swarm * s, const uint64_t now)
 {
   int i, size, unchokedInterested;
+  int slowestRate = 0;
   const int peerCount = tr_ptrArraySize (&s->peers);
   tr_peer ** peers = (tr_peer**) tr_ptrArrayBase (&s->peers);
   struct ChokeData * choke = tr_new0 (struct ChokeData, peerCount);
   const tr_session * session = s->manager->session;
   const int chokeAll = !tr_torrentIsPieceTransferAllowed (s->tor, TR_CLIENT_TO_PEER);
   const bool isMaxedOut = isBandwidthMaxedOut (&s->tor->bandwidth, now, TR_UP);
+  const int slots = getUploadSlots (s);
 
   assert (swarmIsLocked (s));
 
@@ -3091,6 +4004,7 @@ rechokeUploads (tr_swarm * s, const uint64_t now)
           n->isInterested = tr_peerMsgsIsPeerInterested (msgs);
           n->wasChoked    = tr_peerMsgsIsPeerChoked (msgs);
           n->rate         = getRate (s->tor, atom, now);
+          n->uploadRate   = tr_peerGetPieceSpeed_Bps (peer, now, TR_CLIENT_TO_PEER);
           n->salt         = tr_cryptoWeakRandInt (INT_MAX);
           n->isChoked     = true;
         }
@@ -3114,13 +4028,21 @@ rechokeUploads (tr_swarm * s, const uint64_t now)
    * If our bandwidth is maxed out, don't unchoke any more peers.
    */
   unchokedInterested = 0;
-  for (i=0; i<size && unchokedInterested<session->uploadSlotsPerTorrent; ++i)
+  for (i=0; i<size && unchokedInterested<slots; ++i)
     {
       choke[i].isChoked = isMaxedOut ? choke[i].wasChoked : false;
       if (choke[i].isInterested)
-        ++unchokedInterested;
+        {
+          if (!unchokedInterested || (choke[i].uploadRate < slowestRate))
+            slowestRate = choke[i].uploadRate;
+          ++unchokedInterested;
+        }
     }
 
+  s->uploadSlotsUsed = unchokedInterested;
+  if (session->uploadSlotsAdaptive && !chokeAll)
+    adjustUploadSlots (s, slots, unchokedInterested, slowestRate, now);
+
   /* optimistic unchoke */
   if (!s->optimistic && !isMaxedOut && (i<size))
     {
@@ -3154,35 +4076,90 @@ rechokeUploads (tr_swarm * s, const uint64_t now)
   for (i=0; i<size; ++i)
     tr_peerMsgsSetChoke (choke[i].msgs, choke[i].isChoked);
 
-  /* cleanup */
-  tr_free (choke);
+  /* cleanup */
+  tr_free (choke);
+}
+
+/**
+ * Call `func' on each torrent's swarm, starting after the one whose
+ * uniqueId is `*lastId'. If that takes longer than MAX_PASS_SLICE_MSEC,
+ * stop early and remember in `*lastId' where to resume. Since the
+ * session's torrents are kept in the order they were added, this works
+ * even if torrents are added or removed between calls.
+ *
+ * Returns true if the pass is finished.
+ */
+static bool
+runSwarmPass (tr_peerMgr * mgr, int * lastId, void (*func)(tr_swarm*))
+{
+  tr_torrent * tor = NULL;
+  const uint64_t deadline = tr_time_msec () + MAX_PASS_SLICE_MSEC;
+
+  while (((tor = tr_torrentNext (mgr->session, tor))) && (tor->uniqueId <= *lastId))
+    ;
+
+  while (tor != NULL)
+    {
+      func (tor->swarm);
+      *lastId = tor->uniqueId;
+
+      tor = tr_torrentNext (mgr->session, tor);
+      if ((tor != NULL) && (tr_time_msec () >= deadline))
+        return false;
+    }
+
+  *lastId = 0;
+  return true;
+}
+
+static void
+rechokeSwarm (tr_swarm * s)
+{
+  if (s->tor->isRunning && (s->stats.peerCount > 0))
+    {
+      rechokeUploads (s, tr_time_msec ());
+      rechokeDownloads (s);
+    }
 }
 
 static void
 rechokePulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
 {
-  tr_torrent * tor = NULL;
   tr_peerMgr * mgr = vmgr;
-  const uint64_t now = tr_time_msec ();
+  managerLock (mgr);
+
+  if (runSwarmPass (mgr, &mgr->rechokePassId, rechokeSwarm))
+    tr_timerAddMsec (mgr->rechokeTimer, RECHOKE_PERIOD_MSEC);
+  else
+    tr_timerAddMsec (mgr->rechokeTimer, PASS_SLICE_INTERVAL_MSEC);
+
+  managerUnlock (mgr);
+}
+
+void
+tr_peerMgrGetUploadSlotStats (tr_peerMgr * mgr, int * setme_slots, int * setme_used)
+{
+  int slots = 0;
+  int used = 0;
+  tr_torrent * tor = NULL;
 
   managerLock (mgr);
 
   while ((tor = tr_torrentNext (mgr->session, tor)))
     {
-      if (tor->isRunning)
-        {
-          tr_swarm * s = tor->swarm;
+      const tr_swarm * s = tor->swarm;
 
-          if (s->stats.peerCount > 0)
-            {
-              rechokeUploads (s, now);
-              rechokeDownloads (s);
-            }
+      if (s->isRunning)
+        {
+          slots += getUploadSlots (s);
+          used += s->uploadSlotsUsed;
         }
     }
 
-  tr_timerAddMsec (mgr->rechokeTimer, RECHOKE_PERIOD_MSEC);
   managerUnlock (mgr);
+
+  *setme_slots = slots;
+  *setme_used = used;
 }
 
 /***
@@ -3264,7 +4241,7 @@ static int
 getReconnectIntervalSecs (const struct peer_atom * atom, const time_t now)
 {
   int sec;
-  const bool unreachable = (atom->flags2 & MYFLAG_UNREACHABLE) != 0;
+  const bool unreachable = atom->host->unreachable;
 
   /* if we were recently connected to this peer and transferring piece
    * data, try to reconnect to them sooner rather that later -- we don't
@@ -3319,6 +4296,8 @@ removePeer (tr_swarm * s, tr_peer * peer)
   assert (s->stats.peerFromCount[atom->fromFirst] >= 0);
 
   tr_peerFree (peer);
+
+  candidateRequeue (atom);
 }
 
 static void
@@ -3607,19 +4586,10 @@ queuePulse (tr_session * session, tr_direction dir)
 }
 
 static void
-bandwidthPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
+bandwidthUpkeep (tr_peerMgr * mgr)
 {
   tr_torrent * tor;
-  tr_peerMgr * mgr = vmgr;
   tr_session * session = mgr->session;
-  managerLock (mgr);
-
-  /* FIXME: this next line probably isn't necessary... */
-  pumpAllPeers (mgr);
-
-  /* allocate bandwidth to the peers */
-  tr_bandwidthAllocate (&session->bandwidth, TR_UP, BANDWIDTH_PERIOD_MSEC);
-  tr_bandwidthAllocate (&session->bandwidth, TR_DOWN, BANDWIDTH_PERIOD_MSEC);
 
   /* torrent upkeep */
   tor = NULL;
@@ -3648,177 +4618,539 @@ bandwidthPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
   queuePulse (session, TR_UP);
   queuePulse (session, TR_DOWN);
 
-  reconnectPulse (0, 0, mgr);
+  reconnectPulse (0, 0, mgr);
+}
+
+static void
+bandwidthPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
+{
+  tr_peerMgr * mgr = vmgr;
+  tr_session * session = mgr->session;
+  const unsigned int tick_msec = tr_sessionGetBandwidthTickMsec (session);
+  const uint64_t now = tr_time_msec ();
+  unsigned int period_msec;
+  managerLock (mgr);
+
+  /* FIXME: this next line probably isn't necessary... */
+  pumpAllPeers (mgr);
+
+  /* allocate bandwidth to the peers for the time that's actually passed,
+     since timers can run late */
+  if ((mgr->bandwidthAllocatedAt == 0) || (now <= mgr->bandwidthAllocatedAt))
+    period_msec = tick_msec;
+  else
+    period_msec = MIN (now - mgr->bandwidthAllocatedAt, tick_msec * 2u);
+  mgr->bandwidthAllocatedAt = now;
+  tr_bandwidthAllocate (&session->bandwidth, TR_UP, period_msec);
+  tr_bandwidthAllocate (&session->bandwidth, TR_DOWN, period_msec);
+
+  if (mgr->bandwidthUpkeepAt + BANDWIDTH_PERIOD_MSEC <= now + tick_msec / 2)
+    {
+      mgr->bandwidthUpkeepAt = now;
+      bandwidthUpkeep (mgr);
+    }
+
+  tr_timerAddMsec (mgr->bandwidthTimer, tick_msec);
+  managerUnlock (mgr);
+}
+
+/***
+****
+***/
+
+/* best come first, worst go last */
+static int
+compareAtomPtrsByShelfDate (const void * va, const void *vb)
+{
+  time_t atime;
+  time_t btime;
+  const struct peer_atom * a = * (const struct peer_atom**) va;
+  const struct peer_atom * b = * (const struct peer_atom**) vb;
+  const int data_time_cutoff_secs = 60 * 60;
+  const time_t tr_now = tr_time ();
+
+  assert (tr_isAtom (a));
+  assert (tr_isAtom (b));
+
+  /* primary key: the last piece data time *if* it was within the last hour */
+  atime = a->piece_data_time; if (atime + data_time_cutoff_secs < tr_now) atime = 0;
+  btime = b->piece_data_time; if (btime + data_time_cutoff_secs < tr_now) btime = 0;
+  if (atime != btime)
+    return atime > btime ? -1 : 1;
+
+  /* secondary key: shelf date. */
+  if (a->shelf_date != b->shelf_date)
+    return a->shelf_date > b->shelf_date ? -1 : 1;
+
+  return 0;
+}
+
+static int
+getMaxAtomCount (const tr_torrent * tor)
+{
+  return MIN (50, tor->maxConnectedPeers * 3);
+}
+
+static void
+atomPulseSwarm (tr_swarm * s)
+{
+  int atomCount;
+  const int maxAtomCount = getMaxAtomCount (s->tor);
+  struct peer_atom ** atoms = (struct peer_atom**) tr_ptrArrayPeek (&s->pool, &atomCount);
+
+  if (atomCount > maxAtomCount) /* we've got too many atoms... time to prune */
+    {
+      int i;
+      int keepCount = 0;
+      int testCount = 0;
+      struct peer_atom ** keep = tr_new (struct peer_atom*, atomCount);
+      struct peer_atom ** test = tr_new (struct peer_atom*, atomCount);
+
+      /* keep the ones that are in use */
+      for (i=0; i<atomCount; ++i)
+        {
+          struct peer_atom * atom = atoms[i];
+          if (peerIsInUse (s, atom))
+            keep[keepCount++] = atom;
+          else
+            test[testCount++] = atom;
+        }
+
+      /* if there's room, keep the best of what's left */
+      i = 0;
+      if (keepCount < maxAtomCount)
+        {
+          qsort (test, testCount, sizeof (struct peer_atom *), compareAtomPtrsByShelfDate);
+          while (i<testCount && keepCount<maxAtomCount)
+            keep[keepCount++] = test[i++];
+        }
+
+      /* mark the culled atoms */
+      while (i<testCount)
+        test[i++]->flags2 |= MYFLAG_CULLED;
+
+      /* squeeze them out of Torrent.pool, which stays sorted by address */
+      keepCount = 0;
+      for (i=0; i<atomCount; ++i)
+        {
+          struct peer_atom * atom = atoms[i];
+          if (atom->flags2 & MYFLAG_CULLED)
+            atomFree (s->manager, atom);
+          else
+            atoms[keepCount++] = atom;
+        }
+      tr_ptrArrayErase (&s->pool, keepCount, atomCount);
+
+      tordbg (s, "max atom count is %d... pruned from %d to %d\n", maxAtomCount, atomCount, keepCount);
+
+      /* cleanup */
+      tr_free (test);
+      tr_free (keep);
+    }
+
+  if (s->isRunning)
+    candidatesRescore (s);
+}
+
+static void
+atomPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
+{
+  tr_peerMgr * mgr = vmgr;
+  managerLock (mgr);
+
+  if (runSwarmPass (mgr, &mgr->atomPassId, atomPulseSwarm))
+    tr_timerAddMsec (mgr->atomTimer, ATOM_PERIOD_MSEC);
+  else
+    tr_timerAddMsec (mgr->atomTimer, PASS_SLICE_INTERVAL_MSEC);
+
+  managerUnlock (mgr);
+}
+
+/***
+****
+****
+****
+***/
+
+/* is this atom someone that we'd want to initiate a connection to? */
+static bool
+isPeerCandidate (const tr_torrent * tor, struct peer_atom * atom, const time_t now)
+{
+  /* not if we're both seeds */
+  if (tr_torrentIsSeed (tor) && atomIsSeed (atom))
+    return false;
+
+  /* not if we've already got a connection to them... */
+  if (peerIsInUse (tor->swarm, atom))
+    return false;
+
+  /* not if we just tried them already */
+  if ((now - atom->time) < getReconnectIntervalSecs (atom, now))
+    return false;
+
+  /* not if they're blocklisted */
+  if (isAtomBlocklisted (tor->session, atom))
+    return false;
+
+  /* not if they're banned... */
+  if (atom->flags2 & MYFLAG_BANNED)
+    return false;
+
+  return true;
+}
+
+static bool
+torrentWasRecentlyStarted (const tr_torrent * tor)
+{
+  return difftime (tr_time (), tor->startDate) < 120;
+}
+
+static inline uint64_t
+addValToKey (uint64_t value, int width, uint64_t addme)
+{
+  value = (value << (uint64_t)width);
+  value |= addme;
+  return value;
+}
+
+static uint64_t getPeerCandidateScore (const tr_torrent *, const struct peer_atom *, uint8_t);
+
+/**
+*** struct candidate_heap
+**/
+
+static void
+heapPlace (struct candidate_heap * h, int pos, void * item)
+{
+  h->items[pos] = item;
+  *h->position (item) = pos;
+}
+
+static void
+heapSiftUp (struct candidate_heap * h, int pos)
+{
+  void * item = h->items[pos];
+
+  while (pos > 0)
+    {
+      const int parent = (pos - 1) / 2;
+
+      if (!h->before (item, h->items[parent]))
+        break;
+
+      heapPlace (h, pos, h->items[parent]);
+      pos = parent;
+    }
+
+  heapPlace (h, pos, item);
+}
+
+static void
+heapSiftDown (struct candidate_heap * h, int pos)
+{
+  void * item = h->items[pos];
+
+  for (;;)
+    {
+      int child = pos * 2 + 1;
+
+      if (child >= h->count)
+        break;
+
+      if ((child + 1 < h->count) && h->before (h->items[child + 1], h->items[child]))
+        ++child;
+
+      if (!h->before (h->items[child], item))
+        break;
+
+      heapPlace (h, pos, h->items[child]);
+      pos = child;
+    }
+
+  heapPlace (h, pos, item);
+}
+
+static inline void *
+heapPeek (const struct candidate_heap * h)
+{
+  return h->count > 0 ? h->items[0] : NULL;
+}
+
+static void
+heapInsert (struct candidate_heap * h, void * item)
+{
+  if (h->count == h->alloc)
+    {
+      h->alloc = h->alloc ? h->alloc * 2 : 16;
+      h->items = tr_renew (void*, h->items, h->alloc);
+    }
+
+  h->items[h->count] = item;
+  heapSiftUp (h, h->count++);
+}
+
+static void
+heapRemove (struct candidate_heap * h, void * item)
+{
+  const int pos = *h->position (item);
+  void * last;
+
+  assert (0 <= pos && pos < h->count && h->items[pos] == item);
+
+  last = h->items[--h->count];
+  if (pos < h->count)
+    {
+      heapPlace (h, pos, last);
+      heapSiftUp (h, pos);
+      heapSiftDown (h, *h->position (last));
+    }
+
+  *h->position (item) = -1;
+}
+
+/* call this when an item's key changes */
+static void
+heapUpdate (struct candidate_heap * h, void * item)
+{
+  heapSiftUp (h, *h->position (item));
+  heapSiftDown (h, *h->position (item));
+}
+
+/* call this when many items' keys have changed */
+static void
+heapRebuild (struct candidate_heap * h)
+{
+  int pos;
+
+  for (pos=h->count/2-1; pos>=0; --pos)
+    heapSiftDown (h, pos);
+}
+
+/**
+*** The candidate queue.
+***
+*** Rather than scoring every atom in the session each time we want to make
+*** new connections, atoms are kept in two kinds of heaps. A running swarm's
+*** atoms that are ready to be tried sit in its readyAtoms heap, best score
+*** first, and the swarms themselves sit in tr_peerMgr.candidateSwarms, sorted
+*** by their best atom. Atoms that aren't ready -- because of their reconnect
+*** interval, or because they're in use -- sleep in tr_peerMgr.sleepingAtoms
+*** until their wakeAt time. An atom is re-queued when its state changes;
+*** the parts of its score that depend on its torrent are refreshed by the
+*** atom pass.
+**/
+
+static bool
+atomIsReadyBefore (const void * va, const void * vb)
+{
+  const struct peer_atom * a = va;
+  const struct peer_atom * b = vb;
+
+  return a->score < b->score;
+}
+
+static bool
+atomWakesBefore (const void * va, const void * vb)
+{
+  const struct peer_atom * a = va;
+  const struct peer_atom * b = vb;
+
+  return a->wakeAt < b->wakeAt;
+}
 
-  tr_timerAddMsec (mgr->bandwidthTimer, BANDWIDTH_PERIOD_MSEC);
-  managerUnlock (mgr);
+static int *
+atomHeapPosition (void * vatom)
+{
+  return &((struct peer_atom*)vatom)->heapPos;
 }
 
-/***
-****
-***/
+static bool
+swarmIsReadyBefore (const void * va, const void * vb)
+{
+  const tr_swarm * a = va;
+  const tr_swarm * b = vb;
 
-static int
-compareAtomPtrsByAddress (const void * va, const void *vb)
+  return atomIsReadyBefore (heapPeek (&a->readyAtoms), heapPeek (&b->readyAtoms));
+}
+
+static int *
+swarmHeapPosition (void * vswarm)
 {
-  const struct peer_atom * a = * (const struct peer_atom**) va;
-  const struct peer_atom * b = * (const struct peer_atom**) vb;
+  return &((tr_swarm*)vswarm)->candidatePos;
+}
 
-  assert (tr_isAtom (a));
-  assert (tr_isAtom (b));
+static void
+atomUpdateScore (struct peer_atom * atom)
+{
+  const uint8_t salt = tr_cryptoWeakRandInt (1024);
 
-  return tr_address_compare (&a->addr, &b->addr);
+  atom->score = getPeerCandidateScore (atom->swarm->tor, atom, salt);
 }
 
-/* best come first, worst go last */
-static int
-compareAtomPtrsByShelfDate (const void * va, const void *vb)
+/* call this after the swarm's best ready atom may have changed */
+static void
+candidateSwarmUpdate (tr_swarm * s)
 {
-  time_t atime;
-  time_t btime;
-  const struct peer_atom * a = * (const struct peer_atom**) va;
-  const struct peer_atom * b = * (const struct peer_atom**) vb;
-  const int data_time_cutoff_secs = 60 * 60;
-  const time_t tr_now = tr_time ();
+  struct candidate_heap * swarms = &s->manager->candidateSwarms;
+  const bool wanted = s->isRunning && (s->readyAtoms.count > 0);
 
-  assert (tr_isAtom (a));
-  assert (tr_isAtom (b));
+  if (s->candidatePos >= 0)
+    {
+      if (wanted)
+        heapUpdate (swarms, s);
+      else
+        heapRemove (swarms, s);
+    }
+  else if (wanted)
+    {
+      heapInsert (swarms, s);
+    }
+}
 
-  /* primary key: the last piece data time *if* it was within the last hour */
-  atime = a->piece_data_time; if (atime + data_time_cutoff_secs < tr_now) atime = 0;
-  btime = b->piece_data_time; if (btime + data_time_cutoff_secs < tr_now) btime = 0;
-  if (atime != btime)
-    return atime > btime ? -1 : 1;
+static void
+candidateRemove (struct peer_atom * atom)
+{
+  tr_swarm * s = atom->swarm;
 
-  /* secondary key: shelf date. */
-  if (a->shelf_date != b->shelf_date)
-    return a->shelf_date > b->shelf_date ? -1 : 1;
+  if (atom->queue == ATOM_READY)
+    {
+      heapRemove (&s->readyAtoms, atom);
+      candidateSwarmUpdate (s);
+    }
+  else if (atom->queue == ATOM_ASLEEP)
+    {
+      heapRemove (&s->manager->sleepingAtoms, atom);
+    }
 
-  return 0;
+  atom->queue = ATOM_UNQUEUED;
 }
 
-static int
-getMaxAtomCount (const tr_torrent * tor)
+static void
+candidateSetReady (struct peer_atom * atom)
 {
-  return MIN (50, tor->maxConnectedPeers * 3);
+  tr_swarm * s = atom->swarm;
+
+  atomUpdateScore (atom);
+
+  if (atom->queue == ATOM_READY)
+    {
+      heapUpdate (&s->readyAtoms, atom);
+    }
+  else
+    {
+      candidateRemove (atom);
+      heapInsert (&s->readyAtoms, atom);
+      atom->queue = ATOM_READY;
+    }
+
+  candidateSwarmUpdate (s);
 }
 
 static void
-atomPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
+candidateSleep (struct peer_atom * atom, time_t wakeAt)
 {
-  tr_torrent * tor = NULL;
-  tr_peerMgr * mgr = vmgr;
-  managerLock (mgr);
+  struct candidate_heap * sleeping = &atom->swarm->manager->sleepingAtoms;
 
-  while ((tor = tr_torrentNext (mgr->session, tor)))
+  atom->wakeAt = wakeAt;
+
+  if (atom->queue == ATOM_ASLEEP)
     {
-      int atomCount;
-      tr_swarm * s = tor->swarm;
-      const int maxAtomCount = getMaxAtomCount (tor);
-      struct peer_atom ** atoms = (struct peer_atom**) tr_ptrArrayPeek (&s->pool, &atomCount);
+      heapUpdate (sleeping, atom);
+    }
+  else
+    {
+      candidateRemove (atom);
+      heapInsert (sleeping, atom);
+      atom->queue = ATOM_ASLEEP;
+    }
+}
 
-      if (atomCount > maxAtomCount) /* we've got too many atoms... time to prune */
-        {
-          int i;
-          int keepCount = 0;
-          int testCount = 0;
-          struct peer_atom ** keep = tr_new (struct peer_atom*, atomCount);
-          struct peer_atom ** test = tr_new (struct peer_atom*, atomCount);
+/* put an atom that isn't a candidate right now to sleep until
+   its reconnect interval's up, or until it's worth checking again */
+static void
+candidateDefer (struct peer_atom * atom, const time_t now)
+{
+  const time_t wakeAt = atom->time + getReconnectIntervalSecs (atom, now);
 
-          /* keep the ones that are in use */
-          for (i=0; i<atomCount; ++i)
-            {
-              struct peer_atom * atom = atoms[i];
-              if (peerIsInUse (s, atom))
-                keep[keepCount++] = atom;
-              else
-                test[testCount++] = atom;
-            }
+  candidateSleep (atom, wakeAt > now ? wakeAt : now + CANDIDATE_RECHECK_SECS);
+}
 
-          /* if there's room, keep the best of what's left */
-          i = 0;
-          if (keepCount < maxAtomCount)
-            {
-              qsort (test, testCount, sizeof (struct peer_atom *), compareAtomPtrsByShelfDate);
-              while (i<testCount && keepCount<maxAtomCount)
-                keep[keepCount++] = test[i++];
-            }
+/* call this when an atom's connection state or score has changed */
+static void
+candidateRequeue (struct peer_atom * atom)
+{
+  if (!atom->swarm->isRunning)
+    return;
 
-          /* free the culled atoms */
-          while (i<testCount)
-            tr_free (test[i++]);
+  if (atom->queue == ATOM_ASLEEP)
+    {
+      const time_t now = tr_time ();
+      candidateSleep (atom, atom->time + getReconnectIntervalSecs (atom, now));
+    }
+  else
+    {
+      candidateSetReady (atom);
+    }
+}
 
-          /* rebuild Torrent.pool with what's left */
-          tr_ptrArrayDestruct (&s->pool, NULL);
-          s->pool = TR_PTR_ARRAY_INIT;
-          qsort (keep, keepCount, sizeof (struct peer_atom *), compareAtomPtrsByAddress);
-          for (i=0; i<keepCount; ++i)
-            tr_ptrArrayAppend (&s->pool, keep[i]);
+/* called when a swarm starts */
+static void
+candidatesStart (tr_swarm * s)
+{
+  int i;
+  const int n = tr_ptrArraySize (&s->pool);
 
-          tordbg (s, "max atom count is %d... pruned from %d to %d\n", maxAtomCount, atomCount, keepCount);
+  for (i=0; i<n; ++i)
+    {
+      struct peer_atom * atom = tr_ptrArrayNth (&s->pool, i);
 
-          /* cleanup */
-          tr_free (test);
-          tr_free (keep);
+      if (atom->queue == ATOM_UNQUEUED)
+        {
+          atomUpdateScore (atom);
+          heapInsert (&s->readyAtoms, atom);
+          atom->queue = ATOM_READY;
         }
     }
 
-  tr_timerAddMsec (mgr->atomTimer, ATOM_PERIOD_MSEC);
-  managerUnlock (mgr);
+  candidateSwarmUpdate (s);
 }
 
-/***
-****
-****
-****
-***/
-
-/* is this atom someone that we'd want to initiate a connection to? */
-static bool
-isPeerCandidate (const tr_torrent * tor, struct peer_atom * atom, const time_t now)
+/* called when a swarm stops */
+static void
+candidatesStop (tr_swarm * s)
 {
-  /* not if we're both seeds */
-  if (tr_torrentIsSeed (tor) && atomIsSeed (atom))
-    return false;
+  int i;
+  const int n = tr_ptrArraySize (&s->pool);
 
-  /* not if we've already got a connection to them... */
-  if (peerIsInUse (tor->swarm, atom))
-    return false;
+  for (i=0; i<n; ++i)
+    candidateRemove (tr_ptrArrayNth (&s->pool, i));
 
-  /* not if we just tried them already */
-  if ((now - atom->time) < getReconnectIntervalSecs (atom, now))
-    return false;
+  assert (s->readyAtoms.count == 0);
+  assert (s->candidatePos < 0);
+}
 
-  /* not if they're blocklisted */
-  if (isAtomBlocklisted (tor->session, atom))
-    return false;
+/* refresh the parts of the ready atoms' scores that depend on the torrent,
+   such as its priority and whether it was recently started */
+static void
+candidatesRescore (tr_swarm * s)
+{
+  int i;
 
-  /* not if they're banned... */
-  if (atom->flags2 & MYFLAG_BANNED)
-    return false;
+  for (i=0; i<s->readyAtoms.count; ++i)
+    atomUpdateScore (s->readyAtoms.items[i]);
 
-  return true;
+  heapRebuild (&s->readyAtoms);
+  candidateSwarmUpdate (s);
 }
 
-struct peer_candidate
+/* move the atoms whose wakeAt has come into their swarms' ready heaps */
+static void
+candidatesWake (tr_peerMgr * mgr, const time_t now)
 {
-  uint64_t score;
-  tr_torrent * tor;
   struct peer_atom * atom;
-};
-
-static bool
-torrentWasRecentlyStarted (const tr_torrent * tor)
-{
-  return difftime (tr_time (), tor->startDate) < 120;
-}
 
-static inline uint64_t
-addValToKey (uint64_t value, int width, uint64_t addme)
-{
-  value = (value << (uint64_t)width);
-  value |= addme;
-  return value;
+  while (((atom = heapPeek (&mgr->sleepingAtoms))) && (atom->wakeAt <= now))
+    candidateSetReady (atom);
 }
 
 /* smaller value is better */
@@ -3827,14 +5159,14 @@ getPeerCandidateScore (const tr_torrent * tor, const struct peer_atom * atom, ui
 {
   uint64_t i;
   uint64_t score = 0;
-  const bool failed = atom->lastConnectionAt < atom->lastConnectionAttemptAt;
+  const bool failed = atom->host->lastConnectionAt < atom->host->lastConnectionAttemptAt;
 
   /* prefer peers we've connected to, or never tried, over peers we failed to connect to. */
   i = failed ? 1 : 0;
   score = addValToKey (score, 1, i);
 
   /* prefer the one we attempted least recently (to cycle through all peers) */
-  i = atom->lastConnectionAttemptAt;
+  i = atom->host->lastConnectionAttemptAt;
   score = addValToKey (score, 32, i);
 
   /* prefer peers belonging to a torrent of a higher priority */
@@ -3875,152 +5207,25 @@ getPeerCandidateScore (const tr_torrent * tor, const struct peer_atom * atom, ui
   return score;
 }
 
-static int
-comparePeerCandidates (const void * va, const void * vb)
-{
-  int ret;
-  const struct peer_candidate * a = va;
-  const struct peer_candidate * b = vb;
-
-  if (a->score < b->score)
-    ret = -1;
-  else if (a->score > b->score)
-    ret = 1;
-  else
-    ret = 0;
-
-  return ret;
-}
-
-/* Partial sorting -- selecting the k best candidates
-   Adapted from http://en.wikipedia.org/wiki/Selection_algorithm */
-static void
-selectPeerCandidates (struct peer_candidate * candidates, int candidate_count, int select_count)
-{
-  tr_quickfindFirstK (candidates,
-                      candidate_count,
-                      sizeof(struct peer_candidate),
-                      comparePeerCandidates,
-                      select_count);
-}
-
-#ifndef NDEBUG
-static bool
-checkBestScoresComeFirst (const struct peer_candidate * candidates, int n, int k)
-{
-  int i;
-  uint64_t worstFirstScore = 0;
-  const int x = MIN (n, k) - 1;
-
-  for (i=0; i<x; i++)
-    if (worstFirstScore < candidates[i].score)
-      worstFirstScore = candidates[i].score;
-
-  for (i=0; i<x; i++)
-    assert (candidates[i].score <= worstFirstScore);
-
-  for (i=x+1; i<n; i++)
-    assert (candidates[i].score >= worstFirstScore);
-
-  return true;
-}
-#endif /* NDEBUG */
-
-/** @return an array of all the atoms we might want to connect to */
-static struct peer_candidate*
-getPeerCandidates (tr_session * session, int * candidateCount, int max)
-{
-  int atomCount;
-  int peerCount;
-  tr_torrent * tor;
-  struct peer_candidate * candidates;
-  struct peer_candidate * walk;
-  const time_t now = tr_time ();
-  const uint64_t now_msec = tr_time_msec ();
-  /* leave 5% of connection slots for incoming connections -- ticket #2609 */
-  const int maxCandidates = tr_sessionGetPeerLimit (session) * 0.95;
-
-  /* count how many peers and atoms we've got */
-  tor= NULL;
-  atomCount = 0;
-  peerCount = 0;
-  while ((tor = tr_torrentNext (session, tor)))
-    {
-      atomCount += tr_ptrArraySize (&tor->swarm->pool);
-      peerCount += tr_ptrArraySize (&tor->swarm->peers);
-    }
-
-  /* don't start any new handshakes if we're full up */
-  if (maxCandidates <= peerCount)
-    {
-      *candidateCount = 0;
-      return NULL;
-    }
-
-  /* allocate an array of candidates */
-  walk = candidates = tr_new (struct peer_candidate, atomCount);
-
-  /* populate the candidate array */
-  tor = NULL;
-  while ((tor = tr_torrentNext (session, tor)))
-    {
-      int i, nAtoms;
-      struct peer_atom ** atoms;
-
-      if (!tor->swarm->isRunning)
-        continue;
-
-      /* if we've already got enough peers in this torrent... */
-      if (tr_torrentGetPeerLimit (tor) <= tr_ptrArraySize (&tor->swarm->peers))
-        continue;
-
-      /* if we've already got enough speed in this torrent... */
-      if (tr_torrentIsSeed (tor) && isBandwidthMaxedOut (&tor->bandwidth, now_msec, TR_UP))
-        continue;
-
-      atoms = (struct peer_atom**) tr_ptrArrayPeek (&tor->swarm->pool, &nAtoms);
-      for (i=0; i<nAtoms; ++i)
-        {
-          struct peer_atom * atom = atoms[i];
-
-          if (isPeerCandidate (tor, atom, now))
-            {
-              const uint8_t salt = tr_cryptoWeakRandInt (1024);
-              walk->tor = tor;
-              walk->atom = atom;
-              walk->score = getPeerCandidateScore (tor, atom, salt);
-              ++walk;
-            }
-        }
-    }
-
-  *candidateCount = walk - candidates;
-  if (walk != candidates)
-    selectPeerCandidates (candidates, walk-candidates, max);
-
-  assert (checkBestScoresComeFirst (candidates, *candidateCount, max));
-  return candidates;
-}
-
 static void
 initiateConnection (tr_peerMgr * mgr, tr_swarm * s, struct peer_atom * atom)
 {
   tr_peerIo * io;
   const time_t now = tr_time ();
-  bool utp = tr_sessionIsUTPEnabled (mgr->session) && !atom->utp_failed;
+  bool utp = tr_sessionIsUTPEnabled (mgr->session) && !atom->host->utp_failed;
 
   if (atom->fromFirst == TR_PEER_FROM_PEX)
     /* PEX has explicit signalling for uTP support.  If an atom
        originally came from PEX and doesn't have the uTP flag, skip the
        uTP connection attempt.  Are we being optimistic here? */
-    utp = utp && (atom->flags & ADDED_F_UTP_FLAGS);
+    utp = utp && atom->host->utp_supported;
 
   tordbg (s, "Starting an OUTGOING%s connection with %s",
           utp ? " µTP" : "", tr_atomAddrStr (atom));
 
   io = tr_peerIoNewOutgoing (mgr->session,
                              &mgr->session->bandwidth,
-                             &atom->addr,
+                             &atom->host->addr,
                              atom->port,
                              s->tor->info.hash,
                              s->tor->completeness == TR_SEED,
@@ -4029,7 +5234,7 @@ initiateConnection (tr_peerMgr * mgr, tr_swarm * s, struct peer_atom * atom)
   if (io == NULL)
     {
       tordbg (s, "peerIo not created; marking peer %s as unreachable", tr_atomAddrStr (atom));
-      atom->flags2 |= MYFLAG_UNREACHABLE;
+      atom->host->unreachable = true;
       atom->numFails++;
     }
   else
@@ -4048,35 +5253,81 @@ initiateConnection (tr_peerMgr * mgr, tr_swarm * s, struct peer_atom * atom)
                                handshakeCompare);
     }
 
-  atom->lastConnectionAttemptAt = now;
+  atom->host->lastConnectionAttemptAt = now;
   atom->time = now;
 }
 
-static void
-initiateCandidateConnection (tr_peerMgr * mgr, struct peer_candidate * c)
+/* should we make new connections for this swarm? */
+static bool
+swarmWantsPeers (tr_swarm * s, const uint64_t now_msec)
 {
-#if 0
-  fprintf (stderr, "Starting an OUTGOING connection with %s - [%s] seedProbability==%d; %s, %s\n",
-           tr_atomAddrStr (c->atom),
-           tr_torrentName (c->tor),
-           (int)c->atom->seedProbability,
-           tr_torrentIsPrivate (c->tor) ? "private" : "public",
-           tr_torrentIsSeed (c->tor) ? "seed" : "downloader");
-#endif
+  tr_torrent * tor = s->tor;
+
+  /* if we've already got enough peers in this torrent... */
+  if (tr_torrentGetPeerLimit (tor) <= tr_ptrArraySize (&s->peers))
+    return false;
+
+  /* if we've already got enough speed in this torrent... */
+  if (tr_torrentIsSeed (tor) && isBandwidthMaxedOut (&tor->bandwidth, now_msec, TR_UP))
+    return false;
 
-  initiateConnection (mgr, c->tor->swarm, c->atom);
+  return true;
 }
 
 static void
 makeNewPeerConnections (struct tr_peerMgr * mgr, const int max)
 {
-  int i, n;
-  struct peer_candidate * candidates;
+  int i;
+  int peerCount;
+  int count = 0;
+  tr_torrent * tor;
+  tr_ptrArray skipped = TR_PTR_ARRAY_INIT;
+  const time_t now = tr_time ();
+  const uint64_t now_msec = tr_time_msec ();
+  /* leave 5% of connection slots for incoming connections -- ticket #2609 */
+  const int maxCandidates = tr_sessionGetPeerLimit (mgr->session) * 0.95;
+
+  candidatesWake (mgr, now);
+
+  /* don't start any new handshakes if we're full up */
+  tor = NULL;
+  peerCount = 0;
+  while ((tor = tr_torrentNext (mgr->session, tor)))
+    peerCount += tr_ptrArraySize (&tor->swarm->peers);
+  if (maxCandidates <= peerCount)
+    return;
 
-  candidates = getPeerCandidates (mgr->session, &n, max);
+  while (count < max)
+    {
+      struct peer_atom * atom;
+      tr_swarm * s = heapPeek (&mgr->candidateSwarms);
+
+      if (s == NULL)
+        break;
+
+      /* set aside the swarms that don't want more peers right now */
+      if (!swarmWantsPeers (s, now_msec))
+        {
+          heapRemove (&mgr->candidateSwarms, s);
+          tr_ptrArrayAppend (&skipped, s);
+          continue;
+        }
 
-  for (i=0; i<n && i<max; ++i)
-    initiateCandidateConnection (mgr, &candidates[i]);
+      atom = heapPeek (&s->readyAtoms);
+
+      if (isPeerCandidate (s->tor, atom, now))
+        {
+          initiateConnection (mgr, s, atom);
+          candidateSleep (atom, now + CANDIDATE_RECHECK_SECS);
+          ++count;
+        }
+      else
+        {
+          candidateDefer (atom, now);
+        }
+    }
 
-  tr_free (candidates);
+  for (i=0; i<tr_ptrArraySize (&skipped); ++i)
+    candidateSwarmUpdate (tr_ptrArrayNth (&skipped, i));
+  tr_ptrArrayDestruct (&skipped, NULL);
 }
@@ -181,6 +181,12 @@ unsigned int tr_peerGetPieceSpeed_Bps       (const tr_peer      * peer,
 
 void         tr_peerMgrClearInterest        (tr_torrent         * tor);
 
+/** @brief Sum up the running torrents' upload slots, and how many of
+           them were given to interested peers at the last rechoke */
+void         tr_peerMgrGetUploadSlotStats   (tr_peerMgr         * manager,
+                                             int                * setme_slots,
+                                             int                * setme_used);
+
 void         tr_peerMgrGotBadPiece          (tr_torrent         * tor,
                                              tr_piece_index_t     pieceIndex);
 
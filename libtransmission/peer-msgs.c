@@ -24,6 +24,9 @@
 #include "cache.h"
 #include "completion.h"
 #include "crypto.h" /* tr_sha1 () */
+#include "disk-io.h"
+#include "inout.h" /* tr_ioRequestNew () */
+#include "list.h"
 #include "log.h"
 #include "peer-io.h"
 #include "peer-mgr.h"
@@ -198,6 +201,9 @@ struct tr_peerMsgs
 
   int prefetchCount;
 
+  /* struct block_read: blocks being read from disk in the background */
+  tr_list * blockReads;
+
   int is_active[2];
 
   /* how long the outMessages batch should be allowed to grow before
@@ -1900,6 +1906,109 @@ updateBlockRequests (tr_peerMsgs * msgs)
     }
 }
 
+/**
+***  Data blocks read in the background
+**/
+
+struct block_read
+{
+  tr_peerMsgs * msgs; /* NULL if the peer went away */
+  struct peer_request req;
+  tr_io_request * io_req;
+
+  /* the piece message, with space reserved for the block
+     so that it can be read straight into the message */
+  struct evbuffer * out;
+  struct evbuffer_iovec vec[1];
+  int err;
+};
+
+static void
+blockReadFunc (void * vread)
+{
+  struct block_read * r = vread;
+
+  r->err = tr_ioRequestRunv (r->io_req, r->vec, 1, NULL);
+}
+
+static void
+blockReadDone (tr_session * session, void * vread)
+{
+  struct block_read * r = vread;
+  tr_peerMsgs * msgs = r->msgs;
+
+  if (msgs != NULL)
+    {
+      tr_list_remove_data (&msgs->blockReads, r);
+
+      if (r->err)
+        {
+          tr_logAddTorErr (msgs->torrent, "read failed for piece %u: %s", r->req.index, tr_strerror (r->err));
+
+          if (tr_peerIoSupportsFEXT (msgs->io))
+            protocolSendReject (msgs, &r->req);
+        }
+      else
+        {
+          tr_cacheAddReadBlock (session->cache, msgs->torrent, r->req.index, r->req.offset, r->req.length, r->vec[0].iov_base);
+
+          r->vec[0].iov_len = r->req.length;
+          evbuffer_commit_space (r->out, r->vec, 1);
+
+          dbgmsg (msgs, "sending block %u:%u->%u", r->req.index, r->req.offset, r->req.length);
+          tr_peerIoWriteBuf (msgs->io, r->out, true);
+          msgs->clientSentAnythingAt = tr_time ();
+          tr_historyAdd (&msgs->peer.blocksSentToPeer, tr_time (), 1);
+        }
+    }
+
+  tr_ioRequestFree (r->io_req);
+  evbuffer_free (r->out);
+  tr_free (r);
+}
+
+/* Blocks that would be read with a plain copy go to the disk I/O pool,
+ * so that the libevent thread doesn't have to wait on the disk.
+ * Returns false if the caller should read the block itself. */
+static bool
+startBlockRead (tr_peerMsgs * msgs, const struct peer_request * req)
+{
+  int err;
+  struct block_read * r;
+  tr_io_request * io_req;
+  tr_session * session = getSession (msgs);
+  const bool isPlain = !tr_peerIoIsEncrypted (msgs->io);
+
+  if (!tr_diskIoIsEnabled (session->diskIo))
+    return false;
+
+  /* these are cheaper to do in place */
+  if (isPlain && (session->isMmapEnabled || (session->isSendfileEnabled && tr_peerIoCanSendfile (msgs->io))))
+    return false;
+  if (tr_cacheHasBlock (session->cache, msgs->torrent, req->index, req->offset, req->length))
+    return false;
+  if (tr_torrentPieceNeedsCheck (msgs->torrent, req->index))
+    return false;
+
+  if ((io_req = tr_ioRequestNew (msgs->torrent, false, req->index, req->offset, req->length, &err)) == NULL)
+    return false;
+
+  r = tr_new0 (struct block_read, 1);
+  r->msgs = msgs;
+  r->req = *req;
+  r->io_req = io_req;
+  r->out = evbuffer_new ();
+  evbuffer_expand (r->out, 4 + 1 + 4 + 4 + req->length);
+  evbuffer_add_uint32 (r->out, sizeof (uint8_t) + 2 * sizeof (uint32_t) + req->length);
+  evbuffer_add_uint8 (r->out, BT_PIECE);
+  evbuffer_add_uint32 (r->out, req->index);
+  evbuffer_add_uint32 (r->out, req->offset);
+  evbuffer_reserve_space (r->out, req->length, r->vec, 1);
+  tr_list_append (&msgs->blockReads, r);
+  tr_diskIoAdd (session->diskIo, 0, blockReadFunc, blockReadDone, r);
+  return true;
+}
+
 static size_t
 fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
 {
@@ -2000,13 +2109,23 @@ fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
     ***  Data Blocks
     **/
 
-    if ((tr_peerIoGetWriteBufferSpace (msgs->io, now) >= msgs->torrent->blockSize)
+    /* leave room for the blocks that are still being read */
+    if ((tr_peerIoGetWriteBufferSpace (msgs->io, now) >= msgs->torrent->blockSize * (1 + tr_list_size (msgs->blockReads)))
         && popNextRequest (msgs, &req))
     {
         --msgs->prefetchCount;
 
-        if (requestIsValid (msgs, &req)
-            && tr_torrentPieceIsComplete (msgs->torrent, req.index))
+        if (!requestIsValid (msgs, &req)
+            || !tr_torrentPieceIsComplete (msgs->torrent, req.index))
+        {
+            if (fext) /* peer needs a reject message */
+                protocolSendReject (msgs, &req);
+        }
+        else if (startBlockRead (msgs, &req))
+        {
+            /* blockReadDone () will send it */
+        }
+        else
         {
             int err;
             const uint32_t msglen = 4 + 1 + 4 + 4 + req.length;
@@ -2021,10 +2140,20 @@ fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
             evbuffer_add_uint32 (out, req.index);
             evbuffer_add_uint32 (out, req.offset);
 
-            evbuffer_reserve_space (out, req.length, iovec, 1);
-            err = tr_cacheReadBlock (getSession (msgs)->cache, msgs->torrent, req.index, req.offset, req.length, iovec[0].iov_base);
-            iovec[0].iov_len = req.length;
-            evbuffer_commit_space (out, iovec, 1);
+            /* encryption happens in-place, so encrypted peers get a copy
+               of the block instead of a reference to the mapped file */
+            if (!tr_peerIoIsEncrypted (msgs->io))
+              {
+                const bool allowSendfile = tr_peerIoCanSendfile (msgs->io);
+                err = tr_cacheReadBlockToBuffer (getSession (msgs)->cache, msgs->torrent, req.index, req.offset, req.length, out, allowSendfile);
+              }
+            else
+              {
+                evbuffer_reserve_space (out, req.length, iovec, 1);
+                err = tr_cacheReadBlock (getSession (msgs)->cache, msgs->torrent, req.index, req.offset, req.length, iovec[0].iov_base);
+                iovec[0].iov_len = req.length;
+                evbuffer_commit_space (out, iovec, 1);
+              }
 
             /* check the piece if it needs checking... */
             if (!err && tr_torrentPieceNeedsCheck (msgs->torrent, req.index))
@@ -2055,10 +2184,6 @@ fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
                 msgs = NULL;
             }
         }
-        else if (fext) /* peer needs a reject message */
-        {
-            protocolSendReject (msgs, &req);
-        }
 
         if (msgs != NULL)
             prefetchPieces (msgs);
@@ -2482,10 +2607,16 @@ peermsgs_is_transferring_pieces (const struct tr_peer * peer,
 static void
 peermsgs_destruct (tr_peer * peer)
 {
+  tr_list * l;
   tr_peerMsgs * msgs = PEER_MSGS (peer);
 
   assert (msgs != NULL);
 
+  /* the reads finish without us */
+  for (l=msgs->blockReads; l!=NULL; l=l->next)
+    ((struct block_read*)l->data)->msgs = NULL;
+  tr_list_free (&msgs->blockReads, NULL);
+
   tr_peerMsgsSetActive (msgs, TR_UP, false);
   tr_peerMsgsSetActive (msgs, TR_DOWN, false);
 
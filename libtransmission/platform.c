@@ -218,6 +218,80 @@ tr_lockUnlock (tr_lock * l)
 #endif
 }
 
+/***
+****  CONDITION VARIABLES
+***/
+
+/** @brief portability wrapper around OS-dependent condition variables */
+struct tr_cond
+{
+#ifdef WIN32
+  CONDITION_VARIABLE  cond;
+#else
+  pthread_cond_t      cond;
+#endif
+};
+
+tr_cond*
+tr_condNew (void)
+{
+  tr_cond * c = tr_new0 (tr_cond, 1);
+
+#ifdef WIN32
+  InitializeConditionVariable (&c->cond);
+#else
+  pthread_cond_init (&c->cond, NULL);
+#endif
+
+  return c;
+}
+
+void
+tr_condFree (tr_cond * c)
+{
+#ifndef WIN32
+  pthread_cond_destroy (&c->cond);
+#endif
+  tr_free (c);
+}
+
+void
+tr_condWait (tr_cond * c, tr_lock * l)
+{
+  /* the OS only releases the lock once, so recursive holds would deadlock */
+  assert (l->depth == 1);
+  assert (tr_areThreadsEqual (l->lockThread, tr_getCurrentThread ()));
+
+  l->depth = 0;
+#ifdef WIN32
+  SleepConditionVariableCS (&c->cond, &l->lock, INFINITE);
+#else
+  pthread_cond_wait (&c->cond, &l->lock);
+#endif
+  l->lockThread = tr_getCurrentThread ();
+  l->depth = 1;
+}
+
+void
+tr_condSignal (tr_cond * c)
+{
+#ifdef WIN32
+  WakeConditionVariable (&c->cond);
+#else
+  pthread_cond_signal (&c->cond);
+#endif
+}
+
+void
+tr_condBroadcast (tr_cond * c)
+{
+#ifdef WIN32
+  WakeAllConditionVariable (&c->cond);
+#else
+  pthread_cond_broadcast (&c->cond);
+#endif
+}
+
 /***
 ****  PATHS
 ***/
@@ -80,6 +80,28 @@ void tr_lockUnlock (tr_lock *);
 /** @brief return nonzero if the specified lock is locked */
 int tr_lockHave (const tr_lock *);
 
+/***
+****
+***/
+
+typedef struct tr_cond tr_cond;
+
+/** @brief Create a new condition variable object */
+tr_cond * tr_condNew (void);
+
+/** @brief Destroy a condition variable object */
+void tr_condFree (tr_cond *);
+
+/** @brief Unlock `lock', wait for `cond' to be signalled, and relock `lock'
+    @param lock a lock that the calling thread holds exactly once */
+void tr_condWait (tr_cond * cond, tr_lock * lock);
+
+/** @brief Wake up one of the threads waiting on a condition variable */
+void tr_condSignal (tr_cond *);
+
+/** @brief Wake up all of the threads waiting on a condition variable */
+void tr_condBroadcast (tr_cond *);
+
 #ifdef WIN32
 void * mmap (void *ptr, long  size, long  prot, long  type, long  handle, long  arg);
 
@@ -37,7 +37,9 @@ static const struct tr_key_struct my_static[] =
   { "announce-list", 13 },
   { "announceState", 13 },
   { "arguments", 9 },
+  { "bandwidth-groups", 16 },
   { "bandwidth-priority", 18 },
+  { "bandwidth-tick-msec", 19 },
   { "bandwidthPriority", 17 },
   { "bind-address-ipv4", 17 },
   { "bind-address-ipv6", 17 },
@@ -73,6 +75,7 @@ static const struct tr_key_struct my_static[] =
   { "desiredAvailable", 16 },
   { "destination", 11 },
   { "dht-enabled", 11 },
+  { "disk-io-threads", 15 },
   { "display-name", 12 },
   { "dnd", 3 },
   { "done-date", 9 },
@@ -102,6 +105,7 @@ static const struct tr_key_struct my_static[] =
   { "eta", 3 },
   { "etaIdle", 7 },
   { "failure reason", 14 },
+  { "fast-verify-enabled", 19 },
   { "fields", 6 },
   { "fileStats", 9 },
   { "filename", 8 },
@@ -113,6 +117,7 @@ static const struct tr_key_struct my_static[] =
   { "filter-mode", 11 },
   { "filter-text", 11 },
   { "filter-trackers", 15 },
+  { "fingerprints", 12 },
   { "flagStr", 7 },
   { "flags", 5 },
   { "fromCache", 9 },
@@ -122,6 +127,7 @@ static const struct tr_key_struct my_static[] =
   { "fromLtep", 8 },
   { "fromPex", 7 },
   { "fromTracker", 11 },
+  { "group", 5 },
   { "hasAnnounced", 12 },
   { "hasScraped", 10 },
   { "hashString", 10 },
@@ -192,6 +198,7 @@ static const struct tr_key_struct my_static[] =
   { "method", 6 },
   { "min interval", 12 },
   { "min_request_interval", 20 },
+  { "mmap-enabled", 12 },
   { "move", 4 },
   { "msg_type", 8 },
   { "mtimes", 6 },
@@ -209,6 +216,7 @@ static const struct tr_key_struct my_static[] =
   { "pausedTorrentCount", 18 },
   { "peer-congestion-algorithm", 25 },
   { "peer-id-ttl-hours", 17 },
+  { "peer-io-threads", 15 },
   { "peer-limit", 10 },
   { "peer-limit-global", 17 },
   { "peer-limit-per-torrent", 22 },
@@ -262,6 +270,9 @@ static const struct tr_key_struct my_static[] =
   { "ratio-limit", 11 },
   { "ratio-limit-enabled", 19 },
   { "ratio-mode", 10 },
+  { "read-cache-size-mb", 18 },
+  { "readCacheHits", 13 },
+  { "readCacheMisses", 15 },
   { "recent-download-dir-1", 21 },
   { "recent-download-dir-2", 21 },
   { "recent-download-dir-3", 21 },
@@ -306,6 +317,9 @@ static const struct tr_key_struct my_static[] =
   { "seedRatioMode", 13 },
   { "seederCount", 11 },
   { "seeding-time-seconds", 20 },
+  { "sendfile-enabled", 16 },
+  { "sequentialDownload", 18 },
+  { "sequential_download", 19 },
   { "session-count", 13 },
   { "sessionCount", 12 },
   { "show-backup-trackers", 20 },
@@ -328,12 +342,16 @@ static const struct tr_key_struct my_static[] =
   { "speed-limit-down-enabled", 24 },
   { "speed-limit-up", 14 },
   { "speed-limit-up-enabled", 22 },
+  { "speed-time-constant-msec", 24 },
   { "speed-units", 11 },
   { "start-added-torrents", 20 },
   { "start-minimized", 15 },
   { "startDate", 9 },
   { "status", 6 },
   { "statusbar-stats", 15 },
+  { "streamingPosition", 17 },
+  { "streamingWindow", 15 },
+  { "streaming_window", 16 },
   { "tag", 3 },
   { "tier", 4 },
   { "time-checked", 12 },
@@ -361,12 +379,16 @@ static const struct tr_key_struct my_static[] =
   { "trackers", 8 },
   { "trash-can-enabled", 17 },
   { "trash-original-torrent-files", 28 },
+  { "udp-sockets", 11 },
   { "umask", 5 },
   { "units", 5 },
+  { "upload-slots-adaptive", 21 },
   { "upload-slots-per-torrent", 24 },
   { "uploadLimit", 11 },
   { "uploadLimited", 13 },
   { "uploadRatio", 11 },
+  { "uploadSlots", 11 },
+  { "uploadSlotsUsed", 15 },
   { "uploadSpeed", 11 },
   { "upload_only", 11 },
   { "uploaded", 8 },
@@ -384,6 +406,9 @@ static const struct tr_key_struct my_static[] =
   { "ut_recommend", 12 },
   { "utp-enabled", 11 },
   { "v", 1 },
+  { "verified-date", 13 },
+  { "verify-queue-size", 17 },
+  { "verify-threads", 14 },
   { "version", 7 },
   { "wanted", 6 },
   { "warning message", 15 },
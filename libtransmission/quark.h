@@ -47,7 +47,9 @@ enum
   TR_KEY_announce_list, /* metainfo */
   TR_KEY_announceState, /* rpc */
   TR_KEY_arguments, /* rpc */
+  TR_KEY_bandwidth_groups,
   TR_KEY_bandwidth_priority,
+  TR_KEY_bandwidth_tick_msec,
   TR_KEY_bandwidthPriority,
   TR_KEY_bind_address_ipv4,
   TR_KEY_bind_address_ipv6,
@@ -83,6 +85,7 @@ enum
   TR_KEY_desiredAvailable,
   TR_KEY_destination,
   TR_KEY_dht_enabled,
+  TR_KEY_disk_io_threads,
   TR_KEY_display_name,
   TR_KEY_dnd,
   TR_KEY_done_date,
@@ -112,6 +115,7 @@ enum
   TR_KEY_eta,
   TR_KEY_etaIdle,
   TR_KEY_failure_reason,
+  TR_KEY_fast_verify_enabled,
   TR_KEY_fields,
   TR_KEY_fileStats,
   TR_KEY_filename,
@@ -123,6 +127,7 @@ enum
   TR_KEY_filter_mode,
   TR_KEY_filter_text,
   TR_KEY_filter_trackers,
+  TR_KEY_fingerprints,
   TR_KEY_flagStr,
   TR_KEY_flags,
   TR_KEY_fromCache,
@@ -132,6 +137,7 @@ enum
   TR_KEY_fromLtep,
   TR_KEY_fromPex,
   TR_KEY_fromTracker,
+  TR_KEY_group,
   TR_KEY_hasAnnounced,
   TR_KEY_hasScraped,
   TR_KEY_hashString,
@@ -202,6 +208,7 @@ enum
   TR_KEY_method,
   TR_KEY_min_interval,
   TR_KEY_min_request_interval,
+  TR_KEY_mmap_enabled,
   TR_KEY_move,
   TR_KEY_msg_type,
   TR_KEY_mtimes,
@@ -219,6 +226,7 @@ enum
   TR_KEY_pausedTorrentCount,
   TR_KEY_peer_congestion_algorithm,
   TR_KEY_peer_id_ttl_hours,
+  TR_KEY_peer_io_threads,
   TR_KEY_peer_limit,
   TR_KEY_peer_limit_global,
   TR_KEY_peer_limit_per_torrent,
@@ -272,6 +280,9 @@ enum
   TR_KEY_ratio_limit,
   TR_KEY_ratio_limit_enabled,
   TR_KEY_ratio_mode,
+  TR_KEY_read_cache_size_mb,
+  TR_KEY_readCacheHits,
+  TR_KEY_readCacheMisses,
   TR_KEY_recent_download_dir_1,
   TR_KEY_recent_download_dir_2,
   TR_KEY_recent_download_dir_3,
@@ -316,6 +327,9 @@ enum
   TR_KEY_seedRatioMode,
   TR_KEY_seederCount,
   TR_KEY_seeding_time_seconds,
+  TR_KEY_sendfile_enabled,
+  TR_KEY_sequentialDownload,
+  TR_KEY_sequential_download,
   TR_KEY_session_count,
   TR_KEY_sessionCount,
   TR_KEY_show_backup_trackers,
@@ -338,12 +352,16 @@ enum
   TR_KEY_speed_limit_down_enabled,
   TR_KEY_speed_limit_up,
   TR_KEY_speed_limit_up_enabled,
+  TR_KEY_speed_time_constant_msec,
   TR_KEY_speed_units,
   TR_KEY_start_added_torrents,
   TR_KEY_start_minimized,
   TR_KEY_startDate,
   TR_KEY_status,
   TR_KEY_statusbar_stats,
+  TR_KEY_streamingPosition,
+  TR_KEY_streamingWindow,
+  TR_KEY_streaming_window,
   TR_KEY_tag,
   TR_KEY_tier,
   TR_KEY_time_checked,
@@ -371,12 +389,16 @@ enum
   TR_KEY_trackers,
   TR_KEY_trash_can_enabled,
   TR_KEY_trash_original_torrent_files,
+  TR_KEY_udp_sockets,
   TR_KEY_umask,
   TR_KEY_units,
+  TR_KEY_upload_slots_adaptive,
   TR_KEY_upload_slots_per_torrent,
   TR_KEY_uploadLimit,
   TR_KEY_uploadLimited,
   TR_KEY_uploadRatio,
+  TR_KEY_uploadSlots,
+  TR_KEY_uploadSlotsUsed,
   TR_KEY_uploadSpeed,
   TR_KEY_upload_only,
   TR_KEY_uploaded,
@@ -394,6 +416,9 @@ enum
   TR_KEY_ut_recommend,
   TR_KEY_utp_enabled,
   TR_KEY_v,
+  TR_KEY_verified_date,
+  TR_KEY_verify_queue_size,
+  TR_KEY_verify_threads,
   TR_KEY_version,
   TR_KEY_wanted,
   TR_KEY_warning_message,
@@ -0,0 +1,343 @@
+#include <string.h> /* memcmp(), memset() */
+#include <time.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h> /* BEV_EVENT_ */
+#include <event2/util.h>
+
+#include "transmission.h"
+#include "fdlimit.h" /* tr_fdSocketAccept() */
+#include "inout.h"
+#include "net.h" /* send(), recv() */
+#include "peer-io.h"
+#include "platform.h" /* tr_lock */
+#include "reactor.h"
+#include "session.h"
+#include "torrent.h"
+#include "trevent.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+/***
+****
+***/
+
+#define PAYLOAD_SIZE (1024 * 1024)
+
+struct conn_data
+{
+  tr_session * session;
+  tr_lock * lock;
+  evutil_socket_t fds[2];
+  tr_reactor_conn * conn;
+  struct evbuffer * in;
+  struct evbuffer * out;
+  short what;
+  bool inEventThread;
+  bool done;
+};
+
+static void
+reactorFunc (tr_reactor_conn * conn, short what, void * vdata)
+{
+  struct conn_data * data = vdata;
+
+  tr_lockLock (data->lock);
+  data->inEventThread = tr_amInEventThread (data->session);
+  data->what |= what;
+  tr_reactorRead (conn, data->in, SIZE_MAX);
+  tr_lockUnlock (data->lock);
+
+  /* keep reading */
+  tr_reactorSetReadLimit (conn, PAYLOAD_SIZE);
+
+  /* and keep writing */
+  if (what & BEV_EVENT_WRITING)
+    {
+      tr_reactorWrite (conn, data->out, SIZE_MAX);
+      tr_reactorSetWriteWanted (conn, evbuffer_get_length (data->out) > 0);
+    }
+}
+
+static void
+attachFunc (void * vdata)
+{
+  struct conn_data * data = vdata;
+
+  data->conn = tr_reactorAttach (data->session->reactors, data->fds[0], reactorFunc, data);
+  if (data->conn != NULL)
+    {
+      tr_reactorSetReadLimit (data->conn, PAYLOAD_SIZE);
+      tr_reactorSetWriteWanted (data->conn, true);
+    }
+  data->done = true;
+}
+
+static void
+detachFunc (void * vdata)
+{
+  struct conn_data * data = vdata;
+
+  tr_reactorDetach (data->conn);
+  data->conn = NULL;
+  data->done = true;
+}
+
+static void
+runAndWait (struct conn_data * data, void (*func)(void*))
+{
+  data->done = false;
+  tr_runInEventThread (data->session, func, data);
+  do { tr_wait_msec (10); } while (!data->done);
+}
+
+static size_t
+getInputLength (struct conn_data * data)
+{
+  size_t len;
+
+  tr_lockLock (data->lock);
+  len = evbuffer_get_length (data->in);
+  tr_lockUnlock (data->lock);
+
+  return len;
+}
+
+static int
+test_reactor_io (void)
+{
+  size_t i;
+  size_t n;
+  uint8_t * payload;
+  uint8_t * readback;
+  tr_session * session;
+  tr_variant settings;
+  struct conn_data data;
+  time_t deadline;
+
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddInt (&settings, TR_KEY_peer_io_threads, 2);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+  check_int_eq (2, tr_sessionGetPeerIoThreads (session));
+  check_int_eq (2, tr_reactorsGetThreadCount (session->reactors));
+
+  payload = tr_new (uint8_t, PAYLOAD_SIZE);
+  readback = tr_new (uint8_t, PAYLOAD_SIZE);
+  for (i=0; i<PAYLOAD_SIZE; ++i)
+    payload[i] = (uint8_t)(i * 7);
+
+  memset (&data, 0, sizeof (data));
+  data.session = session;
+  data.lock = tr_lockNew ();
+  data.in = evbuffer_new ();
+  data.out = evbuffer_new ();
+  evbuffer_add (data.out, payload, PAYLOAD_SIZE);
+  check (evutil_socketpair (AF_UNIX, SOCK_STREAM, 0, data.fds) == 0);
+  evutil_make_socket_nonblocking (data.fds[0]);
+  runAndWait (&data, attachFunc);
+  check (data.conn != NULL);
+
+  /* dropping the loops leaves them running until they're empty */
+  tr_sessionSetPeerIoThreads (session, 0);
+  check_int_eq (0, tr_sessionGetPeerIoThreads (session));
+
+  /* everything handed to the loop comes out the other end... */
+  deadline = time (NULL) + 10;
+  for (n=0; n<PAYLOAD_SIZE && time (NULL)<=deadline; )
+    {
+      const int res = recv (data.fds[1], readback + n, PAYLOAD_SIZE - n, 0);
+      if (res > 0)
+        n += res;
+    }
+  check_int_eq (PAYLOAD_SIZE, n);
+  check (!memcmp (payload, readback, PAYLOAD_SIZE));
+  check (data.what & BEV_EVENT_WRITING);
+
+  /* ...and everything sent to it is read, in the libevent thread */
+  for (n=0; n<PAYLOAD_SIZE && time (NULL)<=deadline; )
+    {
+      const int res = send (data.fds[1], payload + n, PAYLOAD_SIZE - n, 0);
+      if (res > 0)
+        n += res;
+    }
+  while ((getInputLength (&data) < PAYLOAD_SIZE) && (time (NULL) <= deadline))
+    tr_wait_msec (10);
+  check_int_eq (PAYLOAD_SIZE, getInputLength (&data));
+  evbuffer_remove (data.in, readback, PAYLOAD_SIZE);
+  check (!memcmp (payload, readback, PAYLOAD_SIZE));
+  check (data.inEventThread);
+
+  /* closing the far end is passed along */
+  evutil_closesocket (data.fds[1]);
+  while (!(data.what & BEV_EVENT_EOF) && (time (NULL) <= deadline))
+    tr_wait_msec (10);
+  check (data.what & BEV_EVENT_EOF);
+  check (data.what & BEV_EVENT_READING);
+
+  runAndWait (&data, detachFunc);
+  check_int_eq (0, tr_reactorsGetThreadCount (session->reactors));
+  evutil_closesocket (data.fds[0]);
+
+  evbuffer_free (data.out);
+  evbuffer_free (data.in);
+  tr_lockFree (data.lock);
+  tr_free (readback);
+  tr_free (payload);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+struct block_data
+{
+  tr_session * session;
+  tr_torrent * tor;
+  evutil_socket_t fds[2];
+  tr_address addr;
+  tr_port port;
+  tr_peerIo * io;
+  uint32_t len;
+  bool canSendfile;
+  int err;
+  bool done;
+};
+
+/* queue the block the way peer-msgs does when a peer asks for it */
+static void
+sendBlockFunc (void * vdata)
+{
+  struct evbuffer * buf = evbuffer_new ();
+  struct block_data * data = vdata;
+
+  data->io = tr_peerIoNewIncoming (data->session, &data->session->bandwidth,
+                                   &data->addr, data->port, data->fds[0], NULL);
+  data->canSendfile = tr_peerIoCanSendfile (data->io);
+  data->err = tr_ioReadToBuffer (data->tor, 0, 0, data->len, buf, data->canSendfile);
+  if (!data->err)
+    tr_peerIoWriteBuf (data->io, buf, true);
+
+  evbuffer_free (buf);
+  data->done = true;
+}
+
+static void
+unrefIoFunc (void * vdata)
+{
+  struct block_data * data = vdata;
+
+  tr_peerIoUnref (data->io);
+  data->io = NULL;
+  data->done = true;
+}
+
+static void
+runBlockAndWait (struct block_data * data, void (*func)(void*))
+{
+  data->done = false;
+  tr_runInEventThread (data->session, func, data);
+  do { tr_wait_msec (10); } while (!data->done);
+}
+
+/* connect over loopback, so that the peer's socket is counted
+   like an incoming one and fds[0] can be handed to a tr_peerIo */
+static int
+connectLoopback (struct block_data * data)
+{
+  struct sockaddr_in sin;
+  socklen_t len = sizeof (sin);
+  const int listener = socket (AF_INET, SOCK_STREAM, 0);
+
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  check (listener >= 0);
+  check (bind (listener, (struct sockaddr *) &sin, sizeof (sin)) == 0);
+  check (listen (listener, 1) == 0);
+  check (getsockname (listener, (struct sockaddr *) &sin, &len) == 0);
+
+  data->fds[1] = socket (AF_INET, SOCK_STREAM, 0);
+  check (connect (data->fds[1], (struct sockaddr *) &sin, sizeof (sin)) == 0);
+  data->fds[0] = tr_fdSocketAccept (data->session, listener, &data->addr, &data->port);
+  check (data->fds[0] >= 0);
+
+  evutil_closesocket (listener);
+  return 0;
+}
+
+/* a block that could be sent straight from the file is written
+   through a reactor thread intact */
+static int
+test_reactor_sendfile_block (void)
+{
+  size_t n;
+  uint8_t * expected;
+  uint8_t * readback;
+  tr_session * session;
+  tr_variant settings;
+  struct block_data data;
+  time_t deadline;
+
+  tr_variantInitDict (&settings, 2);
+  tr_variantDictAddInt (&settings, TR_KEY_peer_io_threads, 2);
+  tr_variantDictAddBool (&settings, TR_KEY_sendfile_enabled, true);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+
+  memset (&data, 0, sizeof (data));
+  data.session = session;
+  data.tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (data.tor, true);
+  libttest_blockingTorrentVerify (data.tor);
+  data.len = tr_torPieceCountBytes (data.tor, 0);
+
+  expected = tr_new (uint8_t, data.len);
+  readback = tr_new (uint8_t, data.len);
+  check_int_eq (0, tr_ioRead (data.tor, 0, 0, data.len, expected));
+
+  if (connectLoopback (&data))
+    return 1;
+  evutil_make_socket_nonblocking (data.fds[0]);
+  runBlockAndWait (&data, sendBlockFunc);
+  check (data.io->reactor != NULL);
+  check (!data.canSendfile);
+  check_int_eq (0, data.err);
+
+  deadline = time (NULL) + 10;
+  for (n=0; n<data.len && time (NULL)<=deadline; )
+    {
+      const int res = recv (data.fds[1], readback + n, data.len - n, MSG_DONTWAIT);
+      if (res > 0)
+        n += res;
+      else
+        tr_wait_msec (10);
+    }
+  check_int_eq (data.len, n);
+  check (!memcmp (expected, readback, data.len));
+
+  runBlockAndWait (&data, unrefIoFunc);
+  evutil_closesocket (data.fds[1]);
+
+  tr_free (readback);
+  tr_free (expected);
+  tr_torrentRemove (data.tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_reactor_io,
+                             test_reactor_sendfile_block };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
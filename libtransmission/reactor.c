@@ -0,0 +1,886 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <errno.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h> /* BEV_EVENT_ */
+#include <event2/event.h>
+
+#include "transmission.h"
+#include "log.h"
+#include "net.h" /* send (), recv () */
+#include "platform.h" /* tr_lock, tr_cond, tr_threadNew () */
+#include "ptrarray.h"
+#include "reactor.h"
+#include "session.h"
+#include "trevent.h" /* tr_amInEventThread () */
+#include "utils.h"
+
+#ifdef WIN32
+ #define EAGAIN       WSAEWOULDBLOCK
+ #define EINTR        WSAEINTR
+ #define EINPROGRESS  WSAEINPROGRESS
+#endif
+
+#define MY_NAME "Reactor"
+
+#define dbgmsg(...) \
+  do \
+    { \
+      if (tr_logGetDeepEnabled ()) \
+        tr_logAddDeep (__FILE__, __LINE__, MY_NAME, __VA_ARGS__); \
+    } \
+  while (0)
+
+enum
+{
+  /* the most a loop reads from a socket at a time */
+  MAX_READ_SIZE = (256 * 1024),
+
+  /* the most output a connection can have waiting to be written */
+  MAX_OUTPUT_SIZE = (256 * 1024),
+
+  /* ask for more output when there's less than this much waiting */
+  OUTPUT_LOW_WATER = (64 * 1024)
+};
+
+/***
+****
+***/
+
+struct tr_reactor;
+
+struct tr_reactor_conn
+{
+  struct tr_reactor * reactor;
+  evutil_socket_t socket;
+  tr_reactor_func func;
+  void * user_data;
+
+  /* guarded by reactor->lock */
+  struct evbuffer * input;  /* read, but not taken by the libevent thread yet */
+  struct evbuffer * output; /* handed over, but not picked up by the loop yet */
+  size_t outputLength;      /* `output' plus `writing' */
+  size_t readLimit;
+  bool writeWanted;
+  short errorWhat;
+  int error;
+  bool isDetaching;
+  bool isDetached;
+  bool isDirty;
+  struct tr_reactor_conn * nextDirty;
+
+  /* only touched by the loop */
+  struct evbuffer * writing; /* picked up from `output', but not written yet */
+  struct event * readEvent;
+  struct event * writeEvent;
+  bool isReading;
+  bool isWriting;
+
+  /* guarded by reactors->lock */
+  short pendingWhat;
+  bool isQueued;
+  struct tr_reactor_conn * nextReady;
+};
+
+struct tr_reactor
+{
+  tr_reactors * pool;
+
+  tr_lock * lock;
+  tr_cond * cond; /* signalled when a connection is let go, or the loop exits */
+
+  struct event_base * base;
+  struct event * wakeEvent;
+  evutil_socket_t wake[2];
+
+  /* reads land here before they're handed over; only touched by the loop */
+  struct evbuffer * scratch;
+
+  /* connections whose events need to be added or deleted */
+  struct tr_reactor_conn * dirty;
+
+  bool isRunning;
+  bool die;
+
+  /* only touched by the libevent thread */
+  int connCount;
+  bool isRetiring;
+};
+
+struct tr_reactors
+{
+  tr_session * session;
+
+  /* struct tr_reactor, in the order they were started */
+  tr_ptrArray reactors;
+
+  /* connections that need attention from the libevent thread, oldest first */
+  tr_lock * lock;
+  struct tr_reactor_conn * readyHead;
+  struct tr_reactor_conn * readyTail;
+  int readyCount;
+
+  evutil_socket_t wake[2];
+  struct event * wakeEvent;
+};
+
+static bool
+isRetriable (int e)
+{
+  return (e == 0) || (e == EAGAIN) || (e == EINTR) || (e == EINPROGRESS);
+}
+
+static void
+wakeUp (evutil_socket_t s)
+{
+  const char ch = 'w';
+
+  /* if the socket's full, the reader has a wakeup pending anyway */
+  send (s, &ch, 1, 0);
+}
+
+static void
+drainWakeups (evutil_socket_t s)
+{
+  char buf[64];
+
+  while (recv (s, buf, sizeof (buf), 0) > 0)
+    ;
+}
+
+static bool
+newWakeSockets (evutil_socket_t wake[2])
+{
+  wake[0] = wake[1] = -1;
+
+  if (evutil_socketpair (AF_UNIX, SOCK_STREAM, 0, wake) < 0)
+    {
+      tr_logAddNamedError (MY_NAME, "Couldn't create wakeup socket: %s", tr_strerror (errno));
+      return false;
+    }
+
+  evutil_make_socket_nonblocking (wake[0]);
+  evutil_make_socket_nonblocking (wake[1]);
+  return true;
+}
+
+/***
+****  Handing connections to the libevent thread
+***/
+
+/* called with conn->reactor->lock held, in either thread */
+static void
+notify (struct tr_reactor_conn * conn, short what)
+{
+  bool wasEmpty = false;
+  tr_reactors * pool = conn->reactor->pool;
+
+  tr_lockLock (pool->lock);
+
+  conn->pendingWhat |= what;
+
+  if (!conn->isQueued)
+    {
+      conn->isQueued = true;
+      conn->nextReady = NULL;
+      wasEmpty = pool->readyHead == NULL;
+      if (pool->readyTail != NULL)
+        pool->readyTail->nextReady = conn;
+      else
+        pool->readyHead = conn;
+      pool->readyTail = conn;
+      ++pool->readyCount;
+    }
+
+  tr_lockUnlock (pool->lock);
+
+  if (wasEmpty)
+    wakeUp (pool->wake[1]);
+}
+
+static void
+unqueue (tr_reactors * pool, struct tr_reactor_conn * conn)
+{
+  struct tr_reactor_conn * prev = NULL;
+  struct tr_reactor_conn * walk;
+
+  tr_lockLock (pool->lock);
+
+  for (walk=pool->readyHead; walk!=NULL; prev=walk, walk=walk->nextReady)
+    {
+      if (walk == conn)
+        {
+          if (prev != NULL)
+            prev->nextReady = conn->nextReady;
+          else
+            pool->readyHead = conn->nextReady;
+          if (pool->readyTail == conn)
+            pool->readyTail = prev;
+          --pool->readyCount;
+          conn->isQueued = false;
+          break;
+        }
+    }
+
+  tr_lockUnlock (pool->lock);
+}
+
+static void
+onReady (evutil_socket_t s, short type UNUSED, void * vpool)
+{
+  int n;
+  tr_reactors * pool = vpool;
+
+  drainWakeups (s);
+
+  /* only take the connections that are queued now,
+     so that busy ones can't starve the rest of the libevent thread */
+  tr_lockLock (pool->lock);
+  n = pool->readyCount;
+  tr_lockUnlock (pool->lock);
+
+  while (n-- > 0)
+    {
+      short what;
+      struct tr_reactor_conn * conn;
+
+      tr_lockLock (pool->lock);
+      if ((conn = pool->readyHead) != NULL)
+        {
+          pool->readyHead = conn->nextReady;
+          if (pool->readyHead == NULL)
+            pool->readyTail = NULL;
+          --pool->readyCount;
+          conn->isQueued = false;
+        }
+      what = conn ? conn->pendingWhat : 0;
+      if (conn != NULL)
+        conn->pendingWhat = 0;
+      tr_lockUnlock (pool->lock);
+
+      if (conn == NULL)
+        break;
+
+      /* this may detach conn */
+      conn->func (conn, what, conn->user_data);
+    }
+
+  /* leave the rest for the next time around */
+  tr_lockLock (pool->lock);
+  if (pool->readyHead != NULL)
+    wakeUp (pool->wake[1]);
+  tr_lockUnlock (pool->lock);
+}
+
+/***
+****  The loops
+***/
+
+static void onReadable (evutil_socket_t, short, void *);
+static void onWritable (evutil_socket_t, short, void *);
+
+/* called in the loop, with reactor->lock held */
+static void
+unlinkDirty (struct tr_reactor * r, struct tr_reactor_conn * conn)
+{
+  struct tr_reactor_conn ** walk;
+
+  for (walk=&r->dirty; *walk!=NULL; walk=&(*walk)->nextDirty)
+    {
+      if (*walk == conn)
+        {
+          *walk = conn->nextDirty;
+          conn->isDirty = false;
+          break;
+        }
+    }
+}
+
+/* make the loop's events match what the connection wants.
+   called in the loop, with reactor->lock held */
+static void
+syncConn (struct tr_reactor_conn * conn)
+{
+  struct tr_reactor * r = conn->reactor;
+  bool wantRead;
+  bool wantWrite;
+
+  if (conn->isDetaching)
+    {
+      if (conn->readEvent != NULL)
+        event_free (conn->readEvent);
+      if (conn->writeEvent != NULL)
+        event_free (conn->writeEvent);
+      conn->readEvent = conn->writeEvent = NULL;
+      conn->isReading = conn->isWriting = false;
+
+      /* the loop won't touch conn again */
+      unlinkDirty (r, conn);
+      conn->isDetached = true;
+      tr_condBroadcast (r->cond);
+      return;
+    }
+
+  wantRead = !conn->errorWhat && (conn->readLimit > 0);
+  wantWrite = !conn->errorWhat && (conn->outputLength > 0);
+
+  if (conn->readEvent == NULL)
+    {
+      conn->readEvent = event_new (r->base, conn->socket, EV_READ | EV_PERSIST, onReadable, conn);
+      conn->writeEvent = event_new (r->base, conn->socket, EV_WRITE | EV_PERSIST, onWritable, conn);
+    }
+
+  if (wantRead != conn->isReading)
+    {
+      if (wantRead)
+        event_add (conn->readEvent, NULL);
+      else
+        event_del (conn->readEvent);
+      conn->isReading = wantRead;
+    }
+
+  if (wantWrite != conn->isWriting)
+    {
+      if (wantWrite)
+        event_add (conn->writeEvent, NULL);
+      else
+        event_del (conn->writeEvent);
+      conn->isWriting = wantWrite;
+    }
+}
+
+/* called with reactor->lock held */
+static void
+setError (struct tr_reactor_conn * conn, short what, int e)
+{
+  if (!conn->errorWhat)
+    {
+      conn->errorWhat = what;
+      conn->error = e;
+      notify (conn, what);
+    }
+}
+
+static void
+onReadable (evutil_socket_t s, short type UNUSED, void * vconn)
+{
+  int e;
+  int res;
+  size_t howmuch;
+  struct tr_reactor_conn * conn = vconn;
+  struct tr_reactor * r = conn->reactor;
+
+  tr_lockLock (r->lock);
+  howmuch = MIN (conn->readLimit, MAX_READ_SIZE);
+  tr_lockUnlock (r->lock);
+
+  if (howmuch < 1)
+    res = e = 0;
+  else
+    {
+      /* the socket is ours until we ask for the lock again */
+      EVUTIL_SET_SOCKET_ERROR (0);
+      res = evbuffer_read (r->scratch, s, (int)howmuch);
+      e = EVUTIL_SOCKET_ERROR ();
+    }
+
+  tr_lockLock (r->lock);
+
+  if (conn->isDetaching)
+    {
+      evbuffer_drain (r->scratch, evbuffer_get_length (r->scratch));
+    }
+  else if (res > 0)
+    {
+      evbuffer_add_buffer (conn->input, r->scratch);
+      conn->readLimit -= MIN ((size_t)res, conn->readLimit);
+      notify (conn, BEV_EVENT_READING);
+    }
+  else if ((res == 0) && (howmuch > 0))
+    {
+      setError (conn, BEV_EVENT_READING | BEV_EVENT_EOF, 0);
+    }
+  else if ((res < 0) && !isRetriable (e))
+    {
+      setError (conn, BEV_EVENT_READING | BEV_EVENT_ERROR, e);
+    }
+
+  syncConn (conn);
+
+  tr_lockUnlock (r->lock);
+}
+
+static void
+onWritable (evutil_socket_t s, short type UNUSED, void * vconn)
+{
+  int e;
+  int res;
+  struct tr_reactor_conn * conn = vconn;
+  struct tr_reactor * r = conn->reactor;
+
+  tr_lockLock (r->lock);
+  evbuffer_add_buffer (conn->writing, conn->output);
+  tr_lockUnlock (r->lock);
+
+  /* the socket is ours until we ask for the lock again */
+  EVUTIL_SET_SOCKET_ERROR (0);
+  res = evbuffer_write (conn->writing, s);
+  e = EVUTIL_SOCKET_ERROR ();
+
+  tr_lockLock (r->lock);
+
+  if (conn->isDetaching)
+    {
+      /* nothing */
+    }
+  else if (res > 0)
+    {
+      conn->outputLength -= res;
+
+      if (conn->writeWanted && (conn->outputLength < OUTPUT_LOW_WATER))
+        notify (conn, BEV_EVENT_WRITING);
+    }
+  else if (res == 0)
+    {
+      if (evbuffer_get_length (conn->writing) > 0)
+        setError (conn, BEV_EVENT_WRITING | BEV_EVENT_EOF, 0);
+    }
+  else if (!isRetriable (e))
+    {
+      setError (conn, BEV_EVENT_WRITING | BEV_EVENT_ERROR, e);
+    }
+
+  syncConn (conn);
+
+  tr_lockUnlock (r->lock);
+}
+
+static void
+onWake (evutil_socket_t s, short type UNUSED, void * vr)
+{
+  struct tr_reactor * r = vr;
+
+  drainWakeups (s);
+
+  tr_lockLock (r->lock);
+
+  while (r->dirty != NULL)
+    {
+      struct tr_reactor_conn * conn = r->dirty;
+      r->dirty = conn->nextDirty;
+      conn->isDirty = false;
+      syncConn (conn);
+    }
+
+  if (r->die)
+    event_base_loopbreak (r->base);
+
+  tr_lockUnlock (r->lock);
+}
+
+static void
+reactorThreadFunc (void * vr)
+{
+  struct tr_reactor * r = vr;
+
+  dbgmsg ("loop %p starting", (void*)r);
+  event_base_dispatch (r->base);
+
+  tr_lockLock (r->lock);
+  r->isRunning = false;
+  tr_condBroadcast (r->cond);
+  tr_lockUnlock (r->lock);
+}
+
+/* called with reactor->lock held */
+static void
+markDirty (struct tr_reactor_conn * conn)
+{
+  struct tr_reactor * r = conn->reactor;
+
+  if (!conn->isDirty)
+    {
+      const bool wasEmpty = r->dirty == NULL;
+
+      conn->isDirty = true;
+      conn->nextDirty = r->dirty;
+      r->dirty = conn;
+
+      if (wasEmpty)
+        wakeUp (r->wake[1]);
+    }
+}
+
+static struct tr_reactor *
+reactorNew (tr_reactors * pool)
+{
+  struct tr_reactor * r;
+  evutil_socket_t wake[2];
+
+  if (!newWakeSockets (wake))
+    return NULL;
+
+  r = tr_new0 (struct tr_reactor, 1);
+  r->pool = pool;
+  r->lock = tr_lockNew ();
+  r->cond = tr_condNew ();
+  r->base = event_base_new ();
+  r->wake[0] = wake[0];
+  r->wake[1] = wake[1];
+  r->scratch = evbuffer_new ();
+  r->wakeEvent = event_new (r->base, r->wake[0], EV_READ | EV_PERSIST, onWake, r);
+  event_add (r->wakeEvent, NULL);
+
+  r->isRunning = true;
+  tr_threadNew (reactorThreadFunc, r);
+
+  return r;
+}
+
+static void
+reactorFree (struct tr_reactor * r)
+{
+  assert (r->connCount == 0);
+
+  tr_lockLock (r->lock);
+  r->die = true;
+  wakeUp (r->wake[1]);
+  while (r->isRunning)
+    tr_condWait (r->cond, r->lock);
+  tr_lockUnlock (r->lock);
+
+  event_free (r->wakeEvent);
+  evutil_closesocket (r->wake[0]);
+  evutil_closesocket (r->wake[1]);
+  evbuffer_free (r->scratch);
+  event_base_free (r->base);
+  tr_condFree (r->cond);
+  tr_lockFree (r->lock);
+  tr_free (r);
+}
+
+/***
+****  The pool
+***/
+
+tr_reactors *
+tr_reactorsNew (tr_session * session)
+{
+  tr_reactors * pool;
+
+  assert (tr_amInEventThread (session));
+
+  pool = tr_new0 (tr_reactors, 1);
+  pool->session = session;
+  pool->reactors = TR_PTR_ARRAY_INIT;
+  pool->lock = tr_lockNew ();
+
+  if (newWakeSockets (pool->wake))
+    {
+      pool->wakeEvent = event_new (session->event_base, pool->wake[0],
+                                   EV_READ | EV_PERSIST, onReady, pool);
+      event_add (pool->wakeEvent, NULL);
+    }
+
+  return pool;
+}
+
+void
+tr_reactorsFree (tr_reactors * pool)
+{
+  assert (tr_amInEventThread (pool->session));
+
+  tr_reactorsSetThreadCount (pool, 0);
+  assert (tr_ptrArrayEmpty (&pool->reactors));
+  tr_ptrArrayDestruct (&pool->reactors, NULL);
+
+  if (pool->wakeEvent != NULL)
+    {
+      event_free (pool->wakeEvent);
+      evutil_closesocket (pool->wake[0]);
+      evutil_closesocket (pool->wake[1]);
+    }
+
+  tr_lockFree (pool->lock);
+  tr_free (pool);
+}
+
+void
+tr_reactorsSetThreadCount (tr_reactors * pool, int threadCount)
+{
+  int i;
+  int n;
+  int active = 0;
+  struct tr_reactor ** reactors;
+
+  assert (tr_amInEventThread (pool->session));
+
+  threadCount = pool->wakeEvent != NULL ? MAX (0, threadCount) : 0;
+
+  reactors = (struct tr_reactor**) tr_ptrArrayPeek (&pool->reactors, &n);
+  for (i=0; i<n; ++i)
+    if (!reactors[i]->isRetiring)
+      ++active;
+
+  /* put retiring loops back to work before starting new ones */
+  for (i=0; i<n && active<threadCount; ++i)
+    {
+      if (reactors[i]->isRetiring)
+        {
+          reactors[i]->isRetiring = false;
+          ++active;
+        }
+    }
+
+  while (active < threadCount)
+    {
+      struct tr_reactor * r = reactorNew (pool);
+      if (r == NULL)
+        break;
+      tr_ptrArrayAppend (&pool->reactors, r);
+      ++active;
+    }
+
+  /* retire the newest loops first; they go when they're empty */
+  for (i=tr_ptrArraySize (&pool->reactors)-1; i>=0 && active>threadCount; --i)
+    {
+      struct tr_reactor * r = tr_ptrArrayNth (&pool->reactors, i);
+
+      if (r->isRetiring)
+        continue;
+
+      r->isRetiring = true;
+      --active;
+
+      if (r->connCount == 0)
+        {
+          tr_ptrArrayRemove (&pool->reactors, i);
+          reactorFree (r);
+        }
+    }
+
+  dbgmsg ("%d loops running, %d of them taking new connections",
+          tr_ptrArraySize (&pool->reactors), active);
+}
+
+int
+tr_reactorsGetThreadCount (const tr_reactors * pool)
+{
+  int i;
+  int active = 0;
+
+  for (i=0; i<tr_ptrArraySize (&pool->reactors); ++i)
+    if (!((const struct tr_reactor*)tr_ptrArrayNth ((tr_ptrArray*)&pool->reactors, i))->isRetiring)
+      ++active;
+
+  return active;
+}
+
+/***
+****  Connections
+***/
+
+tr_reactor_conn *
+tr_reactorAttach (tr_reactors     * pool,
+                  evutil_socket_t   socket,
+                  tr_reactor_func   func,
+                  void            * user_data)
+{
+  int i;
+  struct tr_reactor * best = NULL;
+  struct tr_reactor_conn * conn;
+
+  assert (tr_amInEventThread (pool->session));
+  assert (socket >= 0);
+  assert (func != NULL);
+
+  /* shard by connection: use the loop with the fewest */
+  for (i=0; i<tr_ptrArraySize (&pool->reactors); ++i)
+    {
+      struct tr_reactor * r = tr_ptrArrayNth (&pool->reactors, i);
+
+      if (!r->isRetiring && ((best == NULL) || (r->connCount < best->connCount)))
+        best = r;
+    }
+
+  if (best == NULL)
+    return NULL;
+
+  conn = tr_new0 (struct tr_reactor_conn, 1);
+  conn->reactor = best;
+  conn->socket = socket;
+  conn->func = func;
+  conn->user_data = user_data;
+  conn->input = evbuffer_new ();
+  conn->output = evbuffer_new ();
+  conn->writing = evbuffer_new ();
+  ++best->connCount;
+
+  return conn;
+}
+
+void
+tr_reactorDetach (tr_reactor_conn * conn)
+{
+  struct tr_reactor * r = conn->reactor;
+  tr_reactors * pool = r->pool;
+
+  assert (tr_amInEventThread (pool->session));
+
+  tr_lockLock (r->lock);
+  conn->isDetaching = true;
+  if (r->isRunning)
+    {
+      markDirty (conn);
+      while (!conn->isDetached && r->isRunning)
+        tr_condWait (r->cond, r->lock);
+    }
+  tr_lockUnlock (r->lock);
+
+  /* if the loop's gone, clean up after it */
+  if (!conn->isDetached)
+    {
+      if (conn->readEvent != NULL)
+        event_free (conn->readEvent);
+      if (conn->writeEvent != NULL)
+        event_free (conn->writeEvent);
+    }
+
+  unqueue (pool, conn);
+
+  evbuffer_free (conn->writing);
+  evbuffer_free (conn->output);
+  evbuffer_free (conn->input);
+  tr_free (conn);
+
+  if (!--r->connCount && r->isRetiring)
+    {
+      int i;
+
+      for (i=0; i<tr_ptrArraySize (&pool->reactors); ++i)
+        if (tr_ptrArrayNth (&pool->reactors, i) == r)
+          tr_ptrArrayRemove (&pool->reactors, i);
+
+      reactorFree (r);
+    }
+}
+
+void
+tr_reactorSetReadLimit (tr_reactor_conn * conn, size_t byteCount)
+{
+  struct tr_reactor * r = conn->reactor;
+
+  tr_lockLock (r->lock);
+
+  if ((conn->readLimit > 0) != (byteCount > 0))
+    markDirty (conn);
+
+  conn->readLimit = byteCount;
+
+  tr_lockUnlock (r->lock);
+}
+
+size_t
+tr_reactorGetInputLength (tr_reactor_conn * conn)
+{
+  size_t len;
+
+  tr_lockLock (conn->reactor->lock);
+  len = evbuffer_get_length (conn->input);
+  tr_lockUnlock (conn->reactor->lock);
+
+  return len;
+}
+
+size_t
+tr_reactorRead (tr_reactor_conn * conn, struct evbuffer * buf, size_t byteCount)
+{
+  tr_lockLock (conn->reactor->lock);
+  byteCount = MIN (byteCount, evbuffer_get_length (conn->input));
+  if (byteCount > 0)
+    evbuffer_remove_buffer (conn->input, buf, byteCount);
+  tr_lockUnlock (conn->reactor->lock);
+
+  return byteCount;
+}
+
+/* called with reactor->lock held */
+static size_t
+getOutputSpace (const tr_reactor_conn * conn)
+{
+  if (conn->errorWhat || (conn->outputLength >= MAX_OUTPUT_SIZE))
+    return 0;
+
+  return MAX_OUTPUT_SIZE - conn->outputLength;
+}
+
+size_t
+tr_reactorWrite (tr_reactor_conn * conn, struct evbuffer * buf, size_t byteCount)
+{
+  tr_lockLock (conn->reactor->lock);
+
+  byteCount = MIN (byteCount, getOutputSpace (conn));
+  byteCount = MIN (byteCount, evbuffer_get_length (buf));
+
+  if (byteCount > 0)
+    {
+      evbuffer_remove_buffer (buf, conn->output, byteCount);
+      if (conn->outputLength == 0)
+        markDirty (conn);
+      conn->outputLength += byteCount;
+    }
+
+  tr_lockUnlock (conn->reactor->lock);
+
+  return byteCount;
+}
+
+size_t
+tr_reactorGetOutputSpace (tr_reactor_conn * conn)
+{
+  size_t space;
+
+  tr_lockLock (conn->reactor->lock);
+  space = getOutputSpace (conn);
+  tr_lockUnlock (conn->reactor->lock);
+
+  return space;
+}
+
+void
+tr_reactorSetWriteWanted (tr_reactor_conn * conn, bool wanted)
+{
+  tr_lockLock (conn->reactor->lock);
+
+  conn->writeWanted = wanted;
+
+  /* if there's already room, say so the next time around */
+  if (wanted && !conn->errorWhat && (conn->outputLength < OUTPUT_LOW_WATER))
+    notify (conn, BEV_EVENT_WRITING);
+
+  tr_lockUnlock (conn->reactor->lock);
+}
+
+int
+tr_reactorGetError (tr_reactor_conn * conn)
+{
+  int e;
+
+  tr_lockLock (conn->reactor->lock);
+  e = conn->error;
+  tr_lockUnlock (conn->reactor->lock);
+
+  return e;
+}
@@ -0,0 +1,112 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_REACTOR_H
+#define TR_REACTOR_H
+
+#include <event2/util.h> /* evutil_socket_t */
+
+struct evbuffer;
+
+/**
+ * @addtogroup networked_io Networked IO
+ * @{
+ */
+
+/**
+ * A pool of extra event loops, each in a thread of its own,
+ * that do the socket reads and writes for TCP peer connections.
+ *
+ * Connections are spread across the loops as they're attached.
+ * The loops only move bytes between a socket and its buffers:
+ * bandwidth, encryption, and the peer protocol all stay in the
+ * libevent thread, which is told through a tr_reactor_func when
+ * a connection has something for it.
+ *
+ * Except where noted, these functions must be called in the
+ * libevent thread.
+ */
+typedef struct tr_reactors tr_reactors;
+
+typedef struct tr_reactor_conn tr_reactor_conn;
+
+/**
+ * @brief called in the libevent thread when a connection needs attention.
+ *
+ * `what' is a mask of BEV_EVENT_READING, if input has arrived,
+ * and BEV_EVENT_WRITING, if there's room to write and
+ * tr_reactorSetWriteWanted () was set. If the socket failed
+ * BEV_EVENT_ERROR or BEV_EVENT_EOF is added as well, and the
+ * loop stops using the socket.
+ *
+ * It's safe to detach `conn' from inside this callback.
+ */
+typedef void (*tr_reactor_func)(tr_reactor_conn * conn,
+                                short             what,
+                                void            * user_data);
+
+tr_reactors * tr_reactorsNew (tr_session * session);
+
+/** @brief Stop the threads. Every connection must be detached first. */
+void tr_reactorsFree (tr_reactors * reactors);
+
+/** @brief Set how many loops to run. 0 disables the pool.
+    Loops that are dropped keep serving their connections
+    until the last of them is detached. */
+void tr_reactorsSetThreadCount (tr_reactors * reactors, int threadCount);
+
+int tr_reactorsGetThreadCount (const tr_reactors * reactors);
+
+/** @brief Hand a nonblocking socket to the least busy loop.
+    @return the new connection, or NULL if the pool is disabled */
+tr_reactor_conn * tr_reactorAttach (tr_reactors     * reactors,
+                                    evutil_socket_t   socket,
+                                    tr_reactor_func   func,
+                                    void            * user_data);
+
+/** @brief Take the socket back from its loop. This waits until the loop
+    is done with it, so the caller can close it as soon as it returns.
+    Output that hasn't been written yet is discarded. */
+void tr_reactorDetach (tr_reactor_conn * conn);
+
+/** @brief Let the loop read up to `byteCount' more bytes. 0 stops reading.
+    This replaces the previous limit rather than adding to it. */
+void tr_reactorSetReadLimit (tr_reactor_conn * conn, size_t byteCount);
+
+/** @brief Returns how many bytes have been read but not taken yet. */
+size_t tr_reactorGetInputLength (tr_reactor_conn * conn);
+
+/** @brief Move up to `byteCount' bytes of input into `buf'.
+    @return the number of bytes moved */
+size_t tr_reactorRead (tr_reactor_conn * conn, struct evbuffer * buf, size_t byteCount);
+
+/** @brief Move up to `byteCount' bytes from the front of `buf'
+           to the connection's output, as far as there's room.
+    @return the number of bytes moved */
+size_t tr_reactorWrite (tr_reactor_conn * conn, struct evbuffer * buf, size_t byteCount);
+
+/** @brief Returns how many more bytes tr_reactorWrite () would take. */
+size_t tr_reactorGetOutputSpace (tr_reactor_conn * conn);
+
+/** @brief Ask for a BEV_EVENT_WRITING callback when there's room to write. */
+void tr_reactorSetWriteWanted (tr_reactor_conn * conn, bool wanted);
+
+/** @brief Returns the errno of the error that stopped the connection, or 0. */
+int tr_reactorGetError (tr_reactor_conn * conn);
+
+/* @} */
+
+#endif
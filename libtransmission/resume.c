@@ -336,6 +336,67 @@ loadIdleLimits (tr_variant * dict, tr_torrent * tor)
 ****
 ***/
 
+static void
+saveStreaming (tr_variant * dict, const tr_torrent * tor)
+{
+  tr_variantDictAddBool (dict, TR_KEY_sequential_download, tr_torrentGetSequentialDownload (tor));
+  tr_variantDictAddInt (dict, TR_KEY_streaming_window, tr_torrentGetStreamingWindow (tor));
+}
+
+static uint64_t
+loadStreaming (tr_variant * dict, tr_torrent * tor)
+{
+  int64_t i;
+  bool boolVal;
+  uint64_t ret = 0;
+
+  if (tr_variantDictFindBool (dict, TR_KEY_sequential_download, &boolVal))
+    {
+      tr_torrentSetSequentialDownload (tor, boolVal);
+      ret = TR_FR_STREAMING;
+    }
+
+  if (tr_variantDictFindInt (dict, TR_KEY_streaming_window, &i) && (i >= 0))
+    {
+      tr_torrentSetStreamingWindow (tor, i);
+      ret = TR_FR_STREAMING;
+    }
+
+  return ret;
+}
+
+/***
+****
+***/
+
+static void
+saveGroup (tr_variant * dict, const tr_torrent * tor)
+{
+  const char * name = tr_torrentGetBandwidthGroup (tor);
+
+  if (name != NULL)
+    tr_variantDictAddStr (dict, TR_KEY_group, name);
+}
+
+static uint64_t
+loadGroup (tr_variant * dict, tr_torrent * tor)
+{
+  const char * name;
+  uint64_t ret = 0;
+
+  if (tr_variantDictFindStr (dict, TR_KEY_group, &name, NULL))
+    {
+      tr_torrentSetBandwidthGroup (tor, name);
+      ret = TR_FR_GROUP;
+    }
+
+  return ret;
+}
+
+/***
+****
+***/
+
 static void
 saveName (tr_variant * dict, const tr_torrent * tor)
 {
@@ -451,7 +512,7 @@ saveProgress (tr_variant * dict, tr_torrent * tor)
   const tr_info * inf = tr_torrentInfo (tor);
   const time_t now = tr_time ();
 
-  prog = tr_variantDictAddDict (dict, TR_KEY_progress, 3);
+  prog = tr_variantDictAddDict (dict, TR_KEY_progress, 5);
 
   /* add the file/piece check timestamps... */
   l = tr_variantDictAddList (prog, TR_KEY_time_checked, inf->fileCount);
@@ -504,6 +565,21 @@ saveProgress (tr_variant * dict, tr_torrent * tor)
         }
     }
 
+  /* add what the files looked like when they were last verified */
+  if (tor->fingerprints != NULL)
+    {
+      l = tr_variantDictAddList (prog, TR_KEY_fingerprints, inf->fileCount);
+      for (fi=0; fi<inf->fileCount; ++fi)
+        {
+          const tr_file_fingerprint * fp = &tor->fingerprints[fi];
+          tr_variant * ll = tr_variantListAddList (l, 3);
+          tr_variantListAddInt (ll, fp->size);
+          tr_variantListAddInt (ll, fp->mtime);
+          tr_variantListAddInt (ll, fp->inode);
+        }
+      tr_variantDictAddInt (prog, TR_KEY_verified_date, tor->verifiedDate);
+    }
+
   /* add the progress */
   if (tor->completeness == TR_SEED)
     tr_variantDictAddStr (prog, TR_KEY_have, "all");
@@ -605,6 +681,34 @@ loadProgress (tr_variant * dict, tr_torrent * tor)
             }
         }
 
+      /* fingerprints were added in 2.83 for fast verification */
+      if (tr_variantDictFindList (prog, TR_KEY_fingerprints, &l)
+          && (tr_variantListSize (l) == inf->fileCount)
+          && (inf->fileCount > 0))
+        {
+          tr_file_index_t fi;
+          int64_t t = 0;
+
+          tr_free (tor->fingerprints);
+          tor->fingerprints = tr_new0 (tr_file_fingerprint, inf->fileCount);
+
+          for (fi=0; fi<inf->fileCount; ++fi)
+            {
+              int64_t size = 0, mtime = 0, inode = 0;
+              tr_variant * fp = tr_variantListChild (l, fi);
+
+              tr_variantGetInt (tr_variantListChild (fp, 0), &size);
+              tr_variantGetInt (tr_variantListChild (fp, 1), &mtime);
+              tr_variantGetInt (tr_variantListChild (fp, 2), &inode);
+              tor->fingerprints[fi].size = size;
+              tor->fingerprints[fi].mtime = mtime;
+              tor->fingerprints[fi].inode = inode;
+            }
+
+          tr_variantDictFindInt (prog, TR_KEY_verified_date, &t);
+          tor->verifiedDate = t;
+        }
+
       err = NULL;
       tr_bitfieldConstruct (&blocks, tor->blockCount);
 
@@ -686,6 +790,8 @@ tr_torrentSaveResume (tr_torrent * tor)
   saveSpeedLimits (&top, tor);
   saveRatioLimits (&top, tor);
   saveIdleLimits (&top, tor);
+  saveStreaming (&top, tor);
+  saveGroup (&top, tor);
   saveFilenames (&top, tor);
   saveName (&top, tor);
 
@@ -846,6 +952,12 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
   if (fieldsToLoad & TR_FR_IDLELIMIT)
     fieldsLoaded |= loadIdleLimits (&top, tor);
 
+  if (fieldsToLoad & TR_FR_STREAMING)
+    fieldsLoaded |= loadStreaming (&top, tor);
+
+  if (fieldsToLoad & TR_FR_GROUP)
+    fieldsLoaded |= loadGroup (&top, tor);
+
   if (fieldsToLoad & TR_FR_FILENAMES)
     fieldsLoaded |= loadFilenames (&top, tor);
 
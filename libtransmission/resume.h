@@ -41,6 +41,8 @@ enum
   TR_FR_TIME_DOWNLOADING    = (1 << 19),
   TR_FR_FILENAMES           = (1 << 20),
   TR_FR_NAME                = (1 << 21),
+  TR_FR_STREAMING           = (1 << 22),
+  TR_FR_GROUP               = (1 << 23),
 };
 
 /**
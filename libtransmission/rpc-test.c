@@ -4,6 +4,8 @@
 
 #include "transmission.h"
 #include "rpcimpl.h"
+#include "session.h"
+#include "torrent.h"
 #include "utils.h"
 #include "variant.h"
 
@@ -139,10 +141,177 @@ test_session_get_and_set (void)
   check (tr_variantDictFind (args, TR_KEY_start_added_torrents) != NULL);
   check (tr_variantDictFind (args, TR_KEY_trash_original_torrent_files) != NULL);
   check (tr_variantDictFind (args, TR_KEY_units) != NULL);
+  check (tr_variantDictFind (args, TR_KEY_upload_slots_adaptive) != NULL);
   check (tr_variantDictFind (args, TR_KEY_utp_enabled) != NULL);
   check (tr_variantDictFind (args, TR_KEY_version) != NULL);
   tr_variantFree (&response);
 
+  json = "{\"method\":\"session-set\",\"arguments\":{\"upload-slots-adaptive\":true}}";
+  tr_rpc_request_exec_json (session, json, strlen(json), rpc_response_func, &response);
+  tr_variantFree (&response);
+  check (tr_sessionIsUploadSlotsAdaptive (session));
+
+  json = "{\"method\":\"session-stats\"}";
+  tr_rpc_request_exec_json (session, json, strlen(json), rpc_response_func, &response);
+  check (tr_variantDictFindDict (&response, TR_KEY_arguments, &args));
+  check (tr_variantDictFind (args, TR_KEY_uploadSlots) != NULL);
+  check (tr_variantDictFind (args, TR_KEY_uploadSlotsUsed) != NULL);
+  tr_variantFree (&response);
+
+  /* cleanup */
+  tr_torrentRemove (tor, false, NULL);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+static int
+test_torrent_streaming (void)
+{
+  char * json;
+  tr_session * session;
+  tr_variant response;
+  tr_variant * args;
+  tr_variant * torrents;
+  tr_variant * t;
+  tr_torrent * tor;
+  bool boolVal;
+  int64_t i;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  check (tor != NULL);
+  check (!tr_torrentGetSequentialDownload (tor));
+  check_int_eq (0, tr_torrentGetStreamingWindow (tor));
+
+  json = tr_strdup_printf ("{\"method\":\"torrent-set\",\"arguments\":{\"ids\":[%d],"
+                           "\"sequentialDownload\":true,"
+                           "\"streamingWindow\":65536,"
+                           "\"streamingPosition\":32768}}", tr_torrentId (tor));
+  tr_rpc_request_exec_json (session, json, strlen(json), rpc_response_func, &response);
+  tr_variantFree (&response);
+  tr_free (json);
+
+  check (tr_torrentGetSequentialDownload (tor));
+  check_int_eq (65536, tr_torrentGetStreamingWindow (tor));
+  check_int_eq (32768, tr_torrentGetStreamingPosition (tor));
+
+  json = tr_strdup_printf ("{\"method\":\"torrent-get\",\"arguments\":{\"ids\":[%d],"
+                           "\"fields\":[\"sequentialDownload\",\"streamingWindow\",\"streamingPosition\"]}}",
+                           tr_torrentId (tor));
+  tr_rpc_request_exec_json (session, json, strlen(json), rpc_response_func, &response);
+  tr_free (json);
+
+  check (tr_variantDictFindDict (&response, TR_KEY_arguments, &args));
+  check (tr_variantDictFindList (args, TR_KEY_torrents, &torrents));
+  check ((t = tr_variantListChild (torrents, 0)) != NULL);
+  check (tr_variantDictFindBool (t, TR_KEY_sequentialDownload, &boolVal));
+  check (boolVal);
+  check (tr_variantDictFindInt (t, TR_KEY_streamingWindow, &i));
+  check_int_eq (65536, i);
+  check (tr_variantDictFindInt (t, TR_KEY_streamingPosition, &i));
+  check_int_eq (32768, i);
+  tr_variantFree (&response);
+
+  /* cleanup */
+  tr_torrentRemove (tor, false, NULL);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+static int
+test_bandwidth_groups (void)
+{
+  char * json;
+  tr_session * session;
+  tr_variant response;
+  tr_variant * args;
+  tr_variant * groups;
+  tr_variant * g;
+  tr_torrent * tor;
+  tr_bandwidth_group * group;
+  const char * str;
+  bool boolVal;
+  int64_t i;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  check (tor != NULL);
+  check (tr_torrentGetBandwidthGroup (tor) == NULL);
+
+  json = tr_strdup ("{\"method\":\"group-set\",\"arguments\":{\"name\":\"slow\","
+                    "\"speed-limit-up\":10,\"speed-limit-up-enabled\":true,"
+                    "\"honorsSessionLimits\":false}}");
+  tr_rpc_request_exec_json (session, json, strlen(json), rpc_response_func, &response);
+  tr_variantFree (&response);
+  tr_free (json);
+
+  group = tr_sessionFindBandwidthGroup (session, "slow");
+  check (group != NULL);
+  check_int_eq (10, tr_bandwidthGroupGetSpeedLimit_KBps (group, TR_UP));
+  check (tr_bandwidthGroupIsSpeedLimited (group, TR_UP));
+  check (!tr_bandwidthGroupIsSpeedLimited (group, TR_DOWN));
+  check (!tr_bandwidthGroupUsesSessionLimits (group));
+
+  /* joining a group makes it the torrent's parent */
+  json = tr_strdup_printf ("{\"method\":\"torrent-set\",\"arguments\":{\"ids\":[%d],"
+                           "\"group\":\"slow\"}}", tr_torrentId (tor));
+  tr_rpc_request_exec_json (session, json, strlen(json), rpc_response_func, &response);
+  tr_variantFree (&response);
+  tr_free (json);
+  check_streq ("slow", tr_torrentGetBandwidthGroup (tor));
+  check (tor->bandwidth.parent == &group->bandwidth);
+
+  json = tr_strdup ("{\"method\":\"group-get\",\"arguments\":{\"group\":[\"slow\",\"missing\"]}}");
+  tr_rpc_request_exec_json (session, json, strlen(json), rpc_response_func, &response);
+  tr_free (json);
+  check (tr_variantDictFindDict (&response, TR_KEY_arguments, &args));
+  check (tr_variantDictFindList (args, TR_KEY_group, &groups));
+  check_int_eq (1, tr_variantListSize (groups));
+  check ((g = tr_variantListChild (groups, 0)) != NULL);
+  check (tr_variantDictFindStr (g, TR_KEY_name, &str, NULL));
+  check_streq ("slow", str);
+  check (tr_variantDictFindInt (g, TR_KEY_speed_limit_up, &i));
+  check_int_eq (10, i);
+  check (tr_variantDictFindBool (g, TR_KEY_honorsSessionLimits, &boolVal));
+  check (!boolVal);
+  check (tr_variantDictFindInt (g, TR_KEY_rateUpload, &i));
+  tr_variantFree (&response);
+
+  /* a torrent that ignores the session's limits still honors its group's */
+  json = tr_strdup_printf ("{\"method\":\"torrent-set\",\"arguments\":{\"ids\":[%d],"
+                           "\"honorsSessionLimits\":false}}", tr_torrentId (tor));
+  tr_rpc_request_exec_json (session, json, strlen(json), rpc_response_func, &response);
+  tr_variantFree (&response);
+  tr_free (json);
+  check (!tr_torrentUsesSessionLimits (tor));
+  check (tr_bandwidthAreParentLimitsHonored (&tor->bandwidth, TR_UP));
+  check (tr_torrentIsPieceTransferAllowed (tor, TR_UP));
+  tr_bandwidthGroupSetSpeedLimit_KBps (group, TR_UP, 0);
+  check (!tr_torrentIsPieceTransferAllowed (tor, TR_UP));
+  tr_bandwidthGroupSetSpeedLimit_KBps (group, TR_UP, 10);
+
+  /* and it's up to the torrent whether to go past the group to the session */
+  tr_bandwidthGroupUseSessionLimits (group, true);
+  tr_sessionSetSpeedLimit_KBps (session, TR_UP, 0);
+  tr_sessionLimitSpeed (session, TR_UP, true);
+  check (tr_torrentIsPieceTransferAllowed (tor, TR_UP));
+  tr_torrentUseSessionLimits (tor, true);
+  check (!tr_torrentIsPieceTransferAllowed (tor, TR_UP));
+  tr_sessionLimitSpeed (session, TR_UP, false);
+
+  /* leaving it puts the torrent back under the session */
+  tr_torrentSetBandwidthGroup (tor, "");
+  check (tr_torrentGetBandwidthGroup (tor) == NULL);
+  check (tor->bandwidth.parent == &session->bandwidth);
+
   /* cleanup */
   tr_torrentRemove (tor, false, NULL);
   libttest_session_close (session);
@@ -157,7 +326,9 @@ int
 main (void)
 {
   const testFunc tests[] = { test_list,
-                             test_session_get_and_set };
+                             test_session_get_and_set,
+                             test_torrent_streaming,
+                             test_bandwidth_groups };
 
   return runTests (tests, NUM_TESTS (tests));
 }
@@ -657,6 +657,13 @@ addField (tr_torrent       * const tor,
         addFileStats (tor, tr_variantDictAddList (d, key, inf->fileCount));
         break;
 
+      case TR_KEY_group:
+        {
+          const char * name = tr_torrentGetBandwidthGroup (tor);
+          tr_variantDictAddStr (d, key, name ? name : "");
+          break;
+        }
+
       case TR_KEY_hashString:
         tr_variantDictAddStr (d, key, tor->info.hashString);
         break;
@@ -822,6 +829,10 @@ addField (tr_torrent       * const tor,
         tr_variantDictAddInt (d, key, tr_torrentGetRatioMode (tor));
         break;
 
+      case TR_KEY_sequentialDownload:
+        tr_variantDictAddBool (d, key, tr_torrentGetSequentialDownload (tor));
+        break;
+
       case TR_KEY_sizeWhenDone:
         tr_variantDictAddInt (d, key, st->sizeWhenDone);
         break;
@@ -830,6 +841,14 @@ addField (tr_torrent       * const tor,
         tr_variantDictAddInt (d, key, st->startDate);
         break;
 
+      case TR_KEY_streamingPosition:
+        tr_variantDictAddInt (d, key, tr_torrentGetStreamingPosition (tor));
+        break;
+
+      case TR_KEY_streamingWindow:
+        tr_variantDictAddInt (d, key, tr_torrentGetStreamingWindow (tor));
+        break;
+
       case TR_KEY_status:
         tr_variantDictAddInt (d, key, st->activity);
         break;
@@ -1263,6 +1282,7 @@ torrentSet (tr_session               * session,
       tr_variant * files;
       tr_variant * trackers;
       bool boolVal;
+      const char * str;
       tr_torrent * tor;
 
       tor = torrents[i];
@@ -1298,6 +1318,9 @@ torrentSet (tr_session               * session,
       if (tr_variantDictFindBool (args_in, TR_KEY_honorsSessionLimits, &boolVal))
         tr_torrentUseSessionLimits (tor, boolVal);
 
+      if (tr_variantDictFindStr (args_in, TR_KEY_group, &str, NULL))
+        tr_torrentSetBandwidthGroup (tor, str);
+
       if (tr_variantDictFindInt (args_in, TR_KEY_uploadLimit, &tmp))
         tr_torrentSetSpeedLimit_KBps (tor, TR_UP, tmp);
 
@@ -1319,6 +1342,15 @@ torrentSet (tr_session               * session,
       if (tr_variantDictFindInt (args_in, TR_KEY_queuePosition, &tmp))
         tr_torrentSetQueuePosition (tor, tmp);
 
+      if (tr_variantDictFindBool (args_in, TR_KEY_sequentialDownload, &boolVal))
+        tr_torrentSetSequentialDownload (tor, boolVal);
+
+      if (tr_variantDictFindInt (args_in, TR_KEY_streamingWindow, &tmp) && (tmp >= 0))
+        tr_torrentSetStreamingWindow (tor, tmp);
+
+      if (tr_variantDictFindInt (args_in, TR_KEY_streamingPosition, &tmp) && (tmp >= 0))
+        tr_torrentSetStreamingPosition (tor, tmp);
+
       if (!errmsg && tr_variantDictFindList (args_in, TR_KEY_trackerAdd, &trackers))
         errmsg = addTrackerUrls (tor, trackers);
 
@@ -1834,6 +1866,18 @@ sessionSet (tr_session               * session,
   if (tr_variantDictFindInt (args_in, TR_KEY_cache_size_mb, &i))
     tr_sessionSetCacheLimit_MB (session, i);
 
+  if (tr_variantDictFindInt (args_in, TR_KEY_read_cache_size_mb, &i))
+    tr_sessionSetReadCacheLimit_MB (session, i);
+
+  if (tr_variantDictFindInt (args_in, TR_KEY_bandwidth_tick_msec, &i))
+    tr_sessionSetBandwidthTickMsec (session, i);
+
+  if (tr_variantDictFindInt (args_in, TR_KEY_speed_time_constant_msec, &i))
+    tr_sessionSetSpeedTimeConstantMsec (session, i);
+
+  if (tr_variantDictFindBool (args_in, TR_KEY_upload_slots_adaptive, &boolVal))
+    tr_sessionSetUploadSlotsAdaptive (session, boolVal);
+
   if (tr_variantDictFindInt (args_in, TR_KEY_alt_speed_up, &i))
     tr_sessionSetAltSpeed_KBps (session, TR_UP, i);
 
@@ -1980,6 +2024,10 @@ sessionStats (tr_session               * session,
   tr_variant * d;
   tr_session_stats currentStats = { 0.0f, 0, 0, 0, 0, 0 };
   tr_session_stats cumulativeStats = { 0.0f, 0, 0, 0, 0, 0 };
+  uint64_t readCacheHits;
+  uint64_t readCacheMisses;
+  int uploadSlots;
+  int uploadSlotsUsed;
   tr_torrent * tor = NULL;
 
   assert (idle_data == NULL);
@@ -1994,11 +2042,17 @@ sessionStats (tr_session               * session,
 
   tr_sessionGetStats (session, &currentStats);
   tr_sessionGetCumulativeStats (session, &cumulativeStats);
+  tr_sessionGetReadCacheStats (session, &readCacheHits, &readCacheMisses);
+  tr_sessionGetUploadSlotStats (session, &uploadSlots, &uploadSlotsUsed);
 
   tr_variantDictAddInt  (args_out, TR_KEY_activeTorrentCount, running);
   tr_variantDictAddReal (args_out, TR_KEY_downloadSpeed, tr_sessionGetPieceSpeed_Bps (session, TR_DOWN));
   tr_variantDictAddInt  (args_out, TR_KEY_pausedTorrentCount, total - running);
+  tr_variantDictAddInt  (args_out, TR_KEY_readCacheHits, readCacheHits);
+  tr_variantDictAddInt  (args_out, TR_KEY_readCacheMisses, readCacheMisses);
   tr_variantDictAddInt  (args_out, TR_KEY_torrentCount, total);
+  tr_variantDictAddInt  (args_out, TR_KEY_uploadSlots, uploadSlots);
+  tr_variantDictAddInt  (args_out, TR_KEY_uploadSlotsUsed, uploadSlotsUsed);
   tr_variantDictAddReal (args_out, TR_KEY_uploadSpeed, tr_sessionGetPieceSpeed_Bps (session, TR_UP));
 
   d = tr_variantDictAddDict (args_out, TR_KEY_cumulative_stats, 5);
@@ -2035,9 +2089,11 @@ sessionGet (tr_session               * s,
   tr_variantDictAddInt  (d, TR_KEY_alt_speed_time_end,tr_sessionGetAltSpeedEnd (s));
   tr_variantDictAddInt  (d, TR_KEY_alt_speed_time_day,tr_sessionGetAltSpeedDay (s));
   tr_variantDictAddBool (d, TR_KEY_alt_speed_time_enabled, tr_sessionUsesAltSpeedTime (s));
+  tr_variantDictAddInt  (d, TR_KEY_bandwidth_tick_msec, tr_sessionGetBandwidthTickMsec (s));
   tr_variantDictAddBool (d, TR_KEY_blocklist_enabled, tr_blocklistIsEnabled (s));
   tr_variantDictAddStr  (d, TR_KEY_blocklist_url, tr_blocklistGetURL (s));
   tr_variantDictAddInt  (d, TR_KEY_cache_size_mb, tr_sessionGetCacheLimit_MB (s));
+  tr_variantDictAddInt  (d, TR_KEY_read_cache_size_mb, tr_sessionGetReadCacheLimit_MB (s));
   tr_variantDictAddInt  (d, TR_KEY_blocklist_size, tr_blocklistGetRuleCount (s));
   tr_variantDictAddStr  (d, TR_KEY_config_dir, tr_sessionGetConfigDir (s));
   tr_variantDictAddStr  (d, TR_KEY_download_dir, tr_sessionGetDownloadDir (s));
@@ -2070,6 +2126,8 @@ sessionGet (tr_session               * s,
   tr_variantDictAddBool (d, TR_KEY_speed_limit_up_enabled, tr_sessionIsSpeedLimited (s, TR_UP));
   tr_variantDictAddInt  (d, TR_KEY_speed_limit_down, tr_sessionGetSpeedLimit_KBps (s, TR_DOWN));
   tr_variantDictAddBool (d, TR_KEY_speed_limit_down_enabled, tr_sessionIsSpeedLimited (s, TR_DOWN));
+  tr_variantDictAddInt  (d, TR_KEY_speed_time_constant_msec, tr_sessionGetSpeedTimeConstantMsec (s));
+  tr_variantDictAddBool (d, TR_KEY_upload_slots_adaptive, tr_sessionIsUploadSlotsAdaptive (s));
   tr_variantDictAddStr  (d, TR_KEY_script_torrent_done_filename, tr_sessionGetTorrentDoneScript (s));
   tr_variantDictAddBool (d, TR_KEY_script_torrent_done_enabled, tr_sessionIsTorrentDoneScriptEnabled (s));
   tr_variantDictAddBool (d, TR_KEY_queue_stalled_enabled, tr_sessionGetQueueStalledEnabled (s));
@@ -2118,6 +2176,109 @@ freeSpace (tr_session               * session,
 ****
 ***/
 
+static void
+addBandwidthGroup (tr_variant * list, const tr_bandwidth_group * group)
+{
+  tr_variant * d = tr_variantListAddDict (list, 8);
+
+  tr_variantDictAddStr  (d, TR_KEY_name, tr_bandwidthGroupGetName (group));
+  tr_variantDictAddBool (d, TR_KEY_honorsSessionLimits, tr_bandwidthGroupUsesSessionLimits (group));
+  tr_variantDictAddInt  (d, TR_KEY_rateDownload, tr_bandwidthGroupGetPieceSpeed_Bps (group, TR_DOWN));
+  tr_variantDictAddInt  (d, TR_KEY_rateUpload, tr_bandwidthGroupGetPieceSpeed_Bps (group, TR_UP));
+  tr_variantDictAddInt  (d, TR_KEY_speed_limit_down, tr_bandwidthGroupGetSpeedLimit_KBps (group, TR_DOWN));
+  tr_variantDictAddBool (d, TR_KEY_speed_limit_down_enabled, tr_bandwidthGroupIsSpeedLimited (group, TR_DOWN));
+  tr_variantDictAddInt  (d, TR_KEY_speed_limit_up, tr_bandwidthGroupGetSpeedLimit_KBps (group, TR_UP));
+  tr_variantDictAddBool (d, TR_KEY_speed_limit_up_enabled, tr_bandwidthGroupIsSpeedLimited (group, TR_UP));
+}
+
+static const char*
+groupGet (tr_session               * session,
+          tr_variant               * args_in,
+          tr_variant               * args_out,
+          struct tr_rpc_idle_data  * idle_data UNUSED)
+{
+  const char * str;
+  tr_variant * names;
+  tr_variant * list;
+
+  assert (idle_data == NULL);
+
+  if (tr_variantDictFindStr (args_in, TR_KEY_group, &str, NULL))
+    {
+      const tr_bandwidth_group * group = tr_sessionFindBandwidthGroup (session, str);
+
+      list = tr_variantDictAddList (args_out, TR_KEY_group, 1);
+      if (group != NULL)
+        addBandwidthGroup (list, group);
+    }
+  else if (tr_variantDictFindList (args_in, TR_KEY_group, &names))
+    {
+      size_t i;
+      const size_t n = tr_variantListSize (names);
+
+      list = tr_variantDictAddList (args_out, TR_KEY_group, n);
+      for (i=0; i<n; ++i)
+        {
+          const tr_bandwidth_group * group;
+
+          if (tr_variantGetStr (tr_variantListChild (names, i), &str, NULL))
+            if ((group = tr_sessionFindBandwidthGroup (session, str)))
+              addBandwidthGroup (list, group);
+        }
+    }
+  else
+    {
+      int i;
+      int n;
+      tr_bandwidth_group ** groups = tr_sessionGetBandwidthGroups (session, &n);
+
+      list = tr_variantDictAddList (args_out, TR_KEY_group, n);
+      for (i=0; i<n; ++i)
+        addBandwidthGroup (list, groups[i]);
+
+      tr_free (groups);
+    }
+
+  return NULL;
+}
+
+static const char*
+groupSet (tr_session               * session,
+          tr_variant               * args_in,
+          tr_variant               * args_out UNUSED,
+          struct tr_rpc_idle_data  * idle_data UNUSED)
+{
+  bool boolVal;
+  int64_t i;
+  const char * name;
+  tr_bandwidth_group * group;
+
+  assert (idle_data == NULL);
+
+  if (!tr_variantDictFindStr (args_in, TR_KEY_name, &name, NULL) || !*name)
+    return "no group name specified";
+
+  group = tr_sessionGetBandwidthGroup (session, name);
+
+  if (tr_variantDictFindBool (args_in, TR_KEY_honorsSessionLimits, &boolVal))
+    tr_bandwidthGroupUseSessionLimits (group, boolVal);
+  if (tr_variantDictFindInt (args_in, TR_KEY_speed_limit_down, &i))
+    tr_bandwidthGroupSetSpeedLimit_KBps (group, TR_DOWN, i);
+  if (tr_variantDictFindBool (args_in, TR_KEY_speed_limit_down_enabled, &boolVal))
+    tr_bandwidthGroupLimitSpeed (group, TR_DOWN, boolVal);
+  if (tr_variantDictFindInt (args_in, TR_KEY_speed_limit_up, &i))
+    tr_bandwidthGroupSetSpeedLimit_KBps (group, TR_UP, i);
+  if (tr_variantDictFindBool (args_in, TR_KEY_speed_limit_up_enabled, &boolVal))
+    tr_bandwidthGroupLimitSpeed (group, TR_UP, boolVal);
+
+  notify (session, TR_RPC_SESSION_CHANGED, NULL);
+  return NULL;
+}
+
+/***
+****
+***/
+
 static const char*
 sessionClose (tr_session               * session,
               tr_variant               * args_in UNUSED,
@@ -2145,6 +2306,8 @@ methods[] =
   { "port-test",             false, portTest            },
   { "blocklist-update",      false, blocklistUpdate     },
   { "free-space",            true,  freeSpace           },
+  { "group-get",             true,  groupGet            },
+  { "group-set",             true,  groupSet            },
   { "session-close",         true,  sessionClose        },
   { "session-get",           true,  sessionGet          },
   { "session-set",           true,  sessionSet          },
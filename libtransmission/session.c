@@ -34,6 +34,7 @@
 #include "blocklist.h"
 #include "cache.h"
 #include "crypto.h"
+#include "disk-io.h"
 #include "fdlimit.h"
 #include "list.h"
 #include "log.h"
@@ -43,6 +44,7 @@
 #include "platform.h" /* tr_lock, tr_getTorrentDir () */
 #include "platform-quota.h" /* tr_device_info_free() */
 #include "port-forwarding.h"
+#include "reactor.h"
 #include "rpc-server.h"
 #include "session.h"
 #include "stats.h"
@@ -62,11 +64,29 @@ enum
 {
 #ifdef TR_LIGHTWEIGHT
   DEFAULT_CACHE_SIZE_MB = 2,
+  DEFAULT_READ_CACHE_SIZE_MB = 0,
   DEFAULT_PREFETCH_ENABLED = false,
 #else
   DEFAULT_CACHE_SIZE_MB = 4,
+  DEFAULT_READ_CACHE_SIZE_MB = 4,
   DEFAULT_PREFETCH_ENABLED = true,
 #endif
+  DEFAULT_VERIFY_THREADS = 1,
+  MAX_VERIFY_THREADS = 64,
+  DEFAULT_VERIFY_QUEUE_SIZE = 1,
+  DEFAULT_FAST_VERIFY_ENABLED = false,
+  DEFAULT_MMAP_ENABLED = false,
+  DEFAULT_SENDFILE_ENABLED = false,
+  DEFAULT_DISK_IO_THREADS = 2,
+  MAX_DISK_IO_THREADS = 32,
+  DEFAULT_UDP_SOCKETS = 1,
+  MAX_UDP_SOCKETS = 32,
+  MAX_PEER_IO_THREADS = 32,
+  DEFAULT_BANDWIDTH_TICK_MSEC = 500,
+  MIN_BANDWIDTH_TICK_MSEC = 10,
+  MAX_BANDWIDTH_TICK_MSEC = 1000,
+  MIN_SPEED_TIME_CONSTANT_MSEC = 100,
+  MAX_SPEED_TIME_CONSTANT_MSEC = 10000,
   SAVE_INTERVAL_SECS = 360
 };
 
@@ -311,27 +331,221 @@ format_tos (int value)
     }
 }
 
+/***
+****  Bandwidth groups
+***/
+
+static int
+compareBandwidthGroups (const void * va, const void * vb)
+{
+  const tr_bandwidth_group * a = va;
+  const tr_bandwidth_group * b = vb;
+
+  return strcmp (a->name, b->name);
+}
+
+static int
+compareBandwidthGroupToName (const void * va, const void * vb)
+{
+  const tr_bandwidth_group * a = va;
+
+  return strcmp (a->name, vb);
+}
+
+static void
+bandwidthGroupFree (tr_bandwidth_group * group)
+{
+  tr_bandwidthDestruct (&group->bandwidth);
+  tr_free (group->name);
+  tr_free (group);
+}
+
+tr_bandwidth_group *
+tr_sessionFindBandwidthGroup (tr_session * session, const char * name)
+{
+  assert (tr_isSession (session));
+
+  if ((name == NULL) || (*name == '\0'))
+    return NULL;
+
+  return tr_ptrArrayFindSorted (&session->bandwidthGroups, name, compareBandwidthGroupToName);
+}
+
+tr_bandwidth_group *
+tr_sessionGetBandwidthGroup (tr_session * session, const char * name)
+{
+  tr_bandwidth_group * group;
+
+  assert (tr_isSession (session));
+  assert (name && *name);
+
+  group = tr_sessionFindBandwidthGroup (session, name);
+
+  if (group == NULL)
+    {
+      group = tr_new0 (tr_bandwidth_group, 1);
+      group->name = tr_strdup (name);
+      tr_bandwidthConstruct (&group->bandwidth, session, &session->bandwidth);
+      tr_ptrArrayInsertSorted (&session->bandwidthGroups, group, compareBandwidthGroups);
+    }
+
+  return group;
+}
+
+tr_bandwidth_group **
+tr_sessionGetBandwidthGroups (tr_session * session, int * setme_count)
+{
+  int n;
+  tr_bandwidth_group ** groups;
+
+  assert (tr_isSession (session));
+
+  groups = (tr_bandwidth_group**) tr_ptrArrayPeek (&session->bandwidthGroups, &n);
+  *setme_count = n;
+  return tr_memdup (groups, sizeof (tr_bandwidth_group*) * n);
+}
+
+const char *
+tr_bandwidthGroupGetName (const tr_bandwidth_group * group)
+{
+  return group->name;
+}
+
+void
+tr_bandwidthGroupSetSpeedLimit_KBps (tr_bandwidth_group * group, tr_direction dir, unsigned int KBps)
+{
+  assert (tr_isDirection (dir));
+
+  tr_bandwidthSetDesiredSpeed_Bps (&group->bandwidth, dir, toSpeedBytes (KBps));
+}
+
+unsigned int
+tr_bandwidthGroupGetSpeedLimit_KBps (const tr_bandwidth_group * group, tr_direction dir)
+{
+  assert (tr_isDirection (dir));
+
+  return toSpeedKBps (tr_bandwidthGetDesiredSpeed_Bps (&group->bandwidth, dir));
+}
+
+void
+tr_bandwidthGroupLimitSpeed (tr_bandwidth_group * group, tr_direction dir, bool limited)
+{
+  assert (tr_isDirection (dir));
+
+  tr_bandwidthSetLimited (&group->bandwidth, dir, limited);
+}
+
+bool
+tr_bandwidthGroupIsSpeedLimited (const tr_bandwidth_group * group, tr_direction dir)
+{
+  assert (tr_isDirection (dir));
+
+  return tr_bandwidthIsLimited (&group->bandwidth, dir);
+}
+
+void
+tr_bandwidthGroupUseSessionLimits (tr_bandwidth_group * group, bool doUse)
+{
+  tr_bandwidthHonorParentLimits (&group->bandwidth, TR_UP, doUse);
+  tr_bandwidthHonorParentLimits (&group->bandwidth, TR_DOWN, doUse);
+}
+
+bool
+tr_bandwidthGroupUsesSessionLimits (const tr_bandwidth_group * group)
+{
+  return tr_bandwidthAreParentLimitsHonored (&group->bandwidth, TR_UP);
+}
+
+unsigned int
+tr_bandwidthGroupGetPieceSpeed_Bps (const tr_bandwidth_group * group, tr_direction dir)
+{
+  assert (tr_isDirection (dir));
+
+  return tr_bandwidthGetPieceSpeed_Bps (&group->bandwidth, 0, dir);
+}
+
+static void
+saveBandwidthGroups (tr_session * session, tr_variant * list)
+{
+  int i;
+  const int n = tr_ptrArraySize (&session->bandwidthGroups);
+
+  for (i=0; i<n; ++i)
+    {
+      const tr_bandwidth_group * group = tr_ptrArrayNth (&session->bandwidthGroups, i);
+      tr_variant * d = tr_variantListAddDict (list, 6);
+
+      tr_variantDictAddStr  (d, TR_KEY_name, group->name);
+      tr_variantDictAddBool (d, TR_KEY_honorsSessionLimits, tr_bandwidthGroupUsesSessionLimits (group));
+      tr_variantDictAddInt  (d, TR_KEY_speed_limit_down, tr_bandwidthGroupGetSpeedLimit_KBps (group, TR_DOWN));
+      tr_variantDictAddBool (d, TR_KEY_speed_limit_down_enabled, tr_bandwidthGroupIsSpeedLimited (group, TR_DOWN));
+      tr_variantDictAddInt  (d, TR_KEY_speed_limit_up, tr_bandwidthGroupGetSpeedLimit_KBps (group, TR_UP));
+      tr_variantDictAddBool (d, TR_KEY_speed_limit_up_enabled, tr_bandwidthGroupIsSpeedLimited (group, TR_UP));
+    }
+}
+
+static void
+loadBandwidthGroups (tr_session * session, tr_variant * list)
+{
+  size_t i;
+  const size_t n = tr_variantListSize (list);
+
+  for (i=0; i<n; ++i)
+    {
+      int64_t intVal;
+      bool boolVal;
+      const char * name;
+      tr_bandwidth_group * group;
+      tr_variant * d = tr_variantListChild (list, i);
+
+      if (!tr_variantDictFindStr (d, TR_KEY_name, &name, NULL) || !*name)
+        continue;
+
+      group = tr_sessionGetBandwidthGroup (session, name);
+
+      if (tr_variantDictFindBool (d, TR_KEY_honorsSessionLimits, &boolVal))
+        tr_bandwidthGroupUseSessionLimits (group, boolVal);
+      if (tr_variantDictFindInt (d, TR_KEY_speed_limit_down, &intVal))
+        tr_bandwidthGroupSetSpeedLimit_KBps (group, TR_DOWN, intVal);
+      if (tr_variantDictFindBool (d, TR_KEY_speed_limit_down_enabled, &boolVal))
+        tr_bandwidthGroupLimitSpeed (group, TR_DOWN, boolVal);
+      if (tr_variantDictFindInt (d, TR_KEY_speed_limit_up, &intVal))
+        tr_bandwidthGroupSetSpeedLimit_KBps (group, TR_UP, intVal);
+      if (tr_variantDictFindBool (d, TR_KEY_speed_limit_up_enabled, &boolVal))
+        tr_bandwidthGroupLimitSpeed (group, TR_UP, boolVal);
+    }
+}
+
+/***
+****
+***/
+
 void
 tr_sessionGetDefaultSettings (tr_variant * d)
 {
   assert (tr_variantIsDict (d));
 
-  tr_variantDictReserve (d, 63);
+  tr_variantDictReserve (d, 76);
+  tr_variantDictAddList (d, TR_KEY_bandwidth_groups,                0);
+  tr_variantDictAddInt  (d, TR_KEY_bandwidth_tick_msec,             DEFAULT_BANDWIDTH_TICK_MSEC);
   tr_variantDictAddBool (d, TR_KEY_blocklist_enabled,               false);
   tr_variantDictAddStr  (d, TR_KEY_blocklist_url,                   "http://www.example.com/blocklist");
   tr_variantDictAddInt  (d, TR_KEY_cache_size_mb,                   DEFAULT_CACHE_SIZE_MB);
   tr_variantDictAddBool (d, TR_KEY_dht_enabled,                     true);
+  tr_variantDictAddBool (d, TR_KEY_fast_verify_enabled,             DEFAULT_FAST_VERIFY_ENABLED);
   tr_variantDictAddBool (d, TR_KEY_utp_enabled,                     true);
   tr_variantDictAddBool (d, TR_KEY_lpd_enabled,                     false);
   tr_variantDictAddStr  (d, TR_KEY_download_dir,                    tr_getDefaultDownloadDir ());
   tr_variantDictAddInt  (d, TR_KEY_speed_limit_down,                100);
   tr_variantDictAddBool (d, TR_KEY_speed_limit_down_enabled,        false);
+  tr_variantDictAddInt  (d, TR_KEY_disk_io_threads,                 DEFAULT_DISK_IO_THREADS);
   tr_variantDictAddInt  (d, TR_KEY_encryption,                      TR_DEFAULT_ENCRYPTION);
   tr_variantDictAddInt  (d, TR_KEY_idle_seeding_limit,              30);
   tr_variantDictAddBool (d, TR_KEY_idle_seeding_limit_enabled,      false);
   tr_variantDictAddStr  (d, TR_KEY_incomplete_dir,                  tr_getDefaultDownloadDir ());
   tr_variantDictAddBool (d, TR_KEY_incomplete_dir_enabled,          false);
   tr_variantDictAddInt  (d, TR_KEY_message_level,                   TR_LOG_INFO);
+  tr_variantDictAddBool (d, TR_KEY_mmap_enabled,                    DEFAULT_MMAP_ENABLED);
   tr_variantDictAddInt  (d, TR_KEY_download_queue_size,             5);
   tr_variantDictAddBool (d, TR_KEY_download_queue_enabled,          true);
   tr_variantDictAddInt  (d, TR_KEY_peer_limit_global,               atoi (TR_DEFAULT_PEER_LIMIT_GLOBAL_STR));
@@ -346,10 +560,12 @@ tr_sessionGetDefaultSettings (tr_variant * d)
   tr_variantDictAddInt  (d, TR_KEY_preallocation,                   TR_PREALLOCATE_SPARSE);
   tr_variantDictAddBool (d, TR_KEY_prefetch_enabled,                DEFAULT_PREFETCH_ENABLED);
   tr_variantDictAddInt  (d, TR_KEY_peer_id_ttl_hours,               6);
+  tr_variantDictAddInt  (d, TR_KEY_peer_io_threads,                 0);
   tr_variantDictAddBool (d, TR_KEY_queue_stalled_enabled,           true);
   tr_variantDictAddInt  (d, TR_KEY_queue_stalled_minutes,           30);
   tr_variantDictAddReal (d, TR_KEY_ratio_limit,                     2.0);
   tr_variantDictAddBool (d, TR_KEY_ratio_limit_enabled,             false);
+  tr_variantDictAddInt  (d, TR_KEY_read_cache_size_mb,              DEFAULT_READ_CACHE_SIZE_MB);
   tr_variantDictAddBool (d, TR_KEY_rename_partial_files,            true);
   tr_variantDictAddBool (d, TR_KEY_rpc_authentication_required,     false);
   tr_variantDictAddStr  (d, TR_KEY_rpc_bind_address,                "0.0.0.0");
@@ -365,6 +581,7 @@ tr_sessionGetDefaultSettings (tr_variant * d)
   tr_variantDictAddBool (d, TR_KEY_script_torrent_done_enabled,     false);
   tr_variantDictAddInt  (d, TR_KEY_seed_queue_size,                 10);
   tr_variantDictAddBool (d, TR_KEY_seed_queue_enabled,              false);
+  tr_variantDictAddBool (d, TR_KEY_sendfile_enabled,                DEFAULT_SENDFILE_ENABLED);
   tr_variantDictAddBool (d, TR_KEY_alt_speed_enabled,               false);
   tr_variantDictAddInt  (d, TR_KEY_alt_speed_up,                    50); /* half the regular */
   tr_variantDictAddInt  (d, TR_KEY_alt_speed_down,                  50); /* half the regular */
@@ -374,12 +591,17 @@ tr_sessionGetDefaultSettings (tr_variant * d)
   tr_variantDictAddInt  (d, TR_KEY_alt_speed_time_day,              TR_SCHED_ALL);
   tr_variantDictAddInt  (d, TR_KEY_speed_limit_up,                  100);
   tr_variantDictAddBool (d, TR_KEY_speed_limit_up_enabled,          false);
+  tr_variantDictAddInt  (d, TR_KEY_speed_time_constant_msec,        DEFAULT_SPEED_TIME_CONSTANT_MSEC);
+  tr_variantDictAddInt  (d, TR_KEY_udp_sockets,                     DEFAULT_UDP_SOCKETS);
   tr_variantDictAddInt  (d, TR_KEY_umask,                           022);
+  tr_variantDictAddBool (d, TR_KEY_upload_slots_adaptive,           false);
   tr_variantDictAddInt  (d, TR_KEY_upload_slots_per_torrent,        14);
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv4,               TR_DEFAULT_BIND_ADDRESS_IPV4);
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv6,               TR_DEFAULT_BIND_ADDRESS_IPV6);
   tr_variantDictAddBool (d, TR_KEY_start_added_torrents,            true);
   tr_variantDictAddBool (d, TR_KEY_trash_original_torrent_files,    false);
+  tr_variantDictAddInt  (d, TR_KEY_verify_queue_size,               DEFAULT_VERIFY_QUEUE_SIZE);
+  tr_variantDictAddInt  (d, TR_KEY_verify_threads,                  DEFAULT_VERIFY_THREADS);
 }
 
 void
@@ -387,11 +609,14 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
 {
   assert (tr_variantIsDict (d));
 
-  tr_variantDictReserve (d, 63);
+  tr_variantDictReserve (d, 76);
+  saveBandwidthGroups (s, tr_variantDictAddList (d, TR_KEY_bandwidth_groups, tr_ptrArraySize (&s->bandwidthGroups)));
   tr_variantDictAddBool (d, TR_KEY_blocklist_enabled,            tr_blocklistIsEnabled (s));
+  tr_variantDictAddInt  (d, TR_KEY_bandwidth_tick_msec,          tr_sessionGetBandwidthTickMsec (s));
   tr_variantDictAddStr  (d, TR_KEY_blocklist_url,                tr_blocklistGetURL (s));
   tr_variantDictAddInt  (d, TR_KEY_cache_size_mb,                tr_sessionGetCacheLimit_MB (s));
   tr_variantDictAddBool (d, TR_KEY_dht_enabled,                  s->isDHTEnabled);
+  tr_variantDictAddBool (d, TR_KEY_fast_verify_enabled,          s->isFastVerifyEnabled);
   tr_variantDictAddBool (d, TR_KEY_utp_enabled,                  s->isUTPEnabled);
   tr_variantDictAddBool (d, TR_KEY_lpd_enabled,                  s->isLPDEnabled);
   tr_variantDictAddStr  (d, TR_KEY_download_dir,                 tr_sessionGetDownloadDir (s));
@@ -399,12 +624,14 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
   tr_variantDictAddBool (d, TR_KEY_download_queue_enabled,       tr_sessionGetQueueEnabled (s, TR_DOWN));
   tr_variantDictAddInt  (d, TR_KEY_speed_limit_down,             tr_sessionGetSpeedLimit_KBps (s, TR_DOWN));
   tr_variantDictAddBool (d, TR_KEY_speed_limit_down_enabled,     tr_sessionIsSpeedLimited (s, TR_DOWN));
+  tr_variantDictAddInt  (d, TR_KEY_disk_io_threads,              tr_sessionGetDiskIoThreads (s));
   tr_variantDictAddInt  (d, TR_KEY_encryption,                   s->encryptionMode);
   tr_variantDictAddInt  (d, TR_KEY_idle_seeding_limit,           tr_sessionGetIdleLimit (s));
   tr_variantDictAddBool (d, TR_KEY_idle_seeding_limit_enabled,   tr_sessionIsIdleLimited (s));
   tr_variantDictAddStr  (d, TR_KEY_incomplete_dir,               tr_sessionGetIncompleteDir (s));
   tr_variantDictAddBool (d, TR_KEY_incomplete_dir_enabled,       tr_sessionIsIncompleteDirEnabled (s));
   tr_variantDictAddInt  (d, TR_KEY_message_level,                tr_logGetLevel ());
+  tr_variantDictAddBool (d, TR_KEY_mmap_enabled,                 s->isMmapEnabled);
   tr_variantDictAddInt  (d, TR_KEY_peer_limit_global,            s->peerLimit);
   tr_variantDictAddInt  (d, TR_KEY_peer_limit_per_torrent,       s->peerLimitPerTorrent);
   tr_variantDictAddInt  (d, TR_KEY_peer_port,                    tr_sessionGetPeerPort (s));
@@ -418,10 +645,12 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
   tr_variantDictAddInt  (d, TR_KEY_preallocation,                s->preallocationMode);
   tr_variantDictAddInt  (d, TR_KEY_prefetch_enabled,             s->isPrefetchEnabled);
   tr_variantDictAddInt  (d, TR_KEY_peer_id_ttl_hours,            s->peer_id_ttl_hours);
+  tr_variantDictAddInt  (d, TR_KEY_peer_io_threads,              tr_sessionGetPeerIoThreads (s));
   tr_variantDictAddBool (d, TR_KEY_queue_stalled_enabled,        tr_sessionGetQueueStalledEnabled (s));
   tr_variantDictAddInt  (d, TR_KEY_queue_stalled_minutes,        tr_sessionGetQueueStalledMinutes (s));
   tr_variantDictAddReal (d, TR_KEY_ratio_limit,                  s->desiredRatio);
   tr_variantDictAddBool (d, TR_KEY_ratio_limit_enabled,          s->isRatioLimited);
+  tr_variantDictAddInt  (d, TR_KEY_read_cache_size_mb,           tr_sessionGetReadCacheLimit_MB (s));
   tr_variantDictAddBool (d, TR_KEY_rename_partial_files,         tr_sessionIsIncompleteFileNamingEnabled (s));
   tr_variantDictAddBool (d, TR_KEY_rpc_authentication_required,  tr_sessionIsRPCPasswordEnabled (s));
   tr_variantDictAddStr  (d, TR_KEY_rpc_bind_address,             tr_sessionGetRPCBindAddress (s));
@@ -437,6 +666,7 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
   tr_variantDictAddStr  (d, TR_KEY_script_torrent_done_filename, tr_sessionGetTorrentDoneScript (s));
   tr_variantDictAddInt  (d, TR_KEY_seed_queue_size,              tr_sessionGetQueueSize (s, TR_UP));
   tr_variantDictAddBool (d, TR_KEY_seed_queue_enabled,           tr_sessionGetQueueEnabled (s, TR_UP));
+  tr_variantDictAddBool (d, TR_KEY_sendfile_enabled,             s->isSendfileEnabled);
   tr_variantDictAddBool (d, TR_KEY_alt_speed_enabled,            tr_sessionUsesAltSpeed (s));
   tr_variantDictAddInt  (d, TR_KEY_alt_speed_up,                 tr_sessionGetAltSpeed_KBps (s, TR_UP));
   tr_variantDictAddInt  (d, TR_KEY_alt_speed_down,               tr_sessionGetAltSpeed_KBps (s, TR_DOWN));
@@ -446,12 +676,17 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
   tr_variantDictAddInt  (d, TR_KEY_alt_speed_time_day,           tr_sessionGetAltSpeedDay (s));
   tr_variantDictAddInt  (d, TR_KEY_speed_limit_up,               tr_sessionGetSpeedLimit_KBps (s, TR_UP));
   tr_variantDictAddBool (d, TR_KEY_speed_limit_up_enabled,       tr_sessionIsSpeedLimited (s, TR_UP));
+  tr_variantDictAddInt  (d, TR_KEY_speed_time_constant_msec,     tr_sessionGetSpeedTimeConstantMsec (s));
+  tr_variantDictAddInt  (d, TR_KEY_udp_sockets,                  tr_sessionGetUDPSocketCount (s));
   tr_variantDictAddInt  (d, TR_KEY_umask,                        s->umask);
+  tr_variantDictAddBool (d, TR_KEY_upload_slots_adaptive,        tr_sessionIsUploadSlotsAdaptive (s));
   tr_variantDictAddInt  (d, TR_KEY_upload_slots_per_torrent,     s->uploadSlotsPerTorrent);
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv4,            tr_address_to_string (&s->public_ipv4->addr));
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv6,            tr_address_to_string (&s->public_ipv6->addr));
   tr_variantDictAddBool (d, TR_KEY_start_added_torrents,         !tr_sessionGetPaused (s));
   tr_variantDictAddBool (d, TR_KEY_trash_original_torrent_files, tr_sessionGetDeleteSource (s));
+  tr_variantDictAddInt  (d, TR_KEY_verify_queue_size,            tr_sessionGetVerifyQueueSize (s));
+  tr_variantDictAddInt  (d, TR_KEY_verify_threads,               tr_sessionGetVerifyThreads (s));
 }
 
 bool
@@ -599,9 +834,12 @@ tr_sessionInit (const char  * tag,
   session->udp6_socket = -1;
   session->lock = tr_lockNew ();
   session->cache = tr_cacheNew (1024*1024*2);
+  session->diskIo = tr_diskIoNew (session);
   session->tag = tr_strdup (tag);
   session->magicNumber = SESSION_MAGIC_NUMBER;
+  session->speedTimeConstantMsec = DEFAULT_SPEED_TIME_CONSTANT_MSEC;
   tr_bandwidthConstruct (&session->bandwidth, session, NULL);
+  session->bandwidthGroups = TR_PTR_ARRAY_INIT;
   tr_variantInitList (&session->removedTorrents, 0);
 
   /* nice to start logging at the very beginning */
@@ -714,6 +952,8 @@ tr_sessionInitImpl (void * vdata)
 
   session->peerMgr = tr_peerMgrNew (session);
 
+  session->reactors = tr_reactorsNew (session);
+
   session->shared = tr_sharedInit (session);
 
   /**
@@ -762,6 +1002,7 @@ sessionSetImpl (void * vdata)
   double  d;
   bool boolVal;
   const char * str;
+  tr_variant * list;
   struct tr_bindinfo b;
   struct init_data * data = vdata;
   tr_session * session = data->session;
@@ -784,6 +1025,8 @@ sessionSetImpl (void * vdata)
   /* misc features */
   if (tr_variantDictFindInt (settings, TR_KEY_cache_size_mb, &i))
     tr_sessionSetCacheLimit_MB (session, i);
+  if (tr_variantDictFindInt (settings, TR_KEY_read_cache_size_mb, &i))
+    tr_sessionSetReadCacheLimit_MB (session, i);
   if (tr_variantDictFindInt (settings, TR_KEY_peer_limit_per_torrent, &i))
     tr_sessionSetPeerLimitPerTorrent (session, i);
   if (tr_variantDictFindBool (settings, TR_KEY_pex_enabled, &boolVal))
@@ -826,12 +1069,28 @@ sessionSetImpl (void * vdata)
     tr_sessionSetQueueSize (session, TR_UP, i);
   if (tr_variantDictFindBool (settings, TR_KEY_seed_queue_enabled, &boolVal))
     tr_sessionSetQueueEnabled (session, TR_UP, boolVal);
+  if (tr_variantDictFindInt (settings, TR_KEY_verify_queue_size, &i))
+    tr_sessionSetVerifyQueueSize (session, i);
 
   /* files and directories */
   if (tr_variantDictFindBool (settings, TR_KEY_prefetch_enabled, &boolVal))
     session->isPrefetchEnabled = boolVal;
+  if (tr_variantDictFindBool (settings, TR_KEY_mmap_enabled, &boolVal))
+    tr_sessionSetMmapEnabled (session, boolVal);
+  if (tr_variantDictFindBool (settings, TR_KEY_sendfile_enabled, &boolVal))
+    tr_sessionSetSendfileEnabled (session, boolVal);
   if (tr_variantDictFindInt (settings, TR_KEY_preallocation, &i))
     session->preallocationMode = i;
+  if (tr_variantDictFindInt (settings, TR_KEY_verify_threads, &i))
+    tr_sessionSetVerifyThreads (session, i);
+  if (tr_variantDictFindInt (settings, TR_KEY_disk_io_threads, &i))
+    tr_sessionSetDiskIoThreads (session, i);
+  if (tr_variantDictFindInt (settings, TR_KEY_udp_sockets, &i))
+    tr_sessionSetUDPSocketCount (session, i);
+  if (tr_variantDictFindInt (settings, TR_KEY_peer_io_threads, &i))
+    tr_sessionSetPeerIoThreads (session, i);
+  if (tr_variantDictFindBool (settings, TR_KEY_fast_verify_enabled, &boolVal))
+    tr_sessionSetFastVerifyEnabled (session, boolVal);
   if (tr_variantDictFindStr (settings, TR_KEY_download_dir, &str, NULL))
     tr_sessionSetDownloadDir (session, str);
   if (tr_variantDictFindStr (settings, TR_KEY_incomplete_dir, &str, NULL))
@@ -883,6 +1142,16 @@ sessionSetImpl (void * vdata)
 
   if (tr_variantDictFindInt (settings, TR_KEY_upload_slots_per_torrent, &i))
     session->uploadSlotsPerTorrent = i;
+  if (tr_variantDictFindBool (settings, TR_KEY_upload_slots_adaptive, &boolVal))
+    tr_sessionSetUploadSlotsAdaptive (session, boolVal);
+
+  if (tr_variantDictFindInt (settings, TR_KEY_bandwidth_tick_msec, &i))
+    tr_sessionSetBandwidthTickMsec (session, i);
+  if (tr_variantDictFindInt (settings, TR_KEY_speed_time_constant_msec, &i))
+    tr_sessionSetSpeedTimeConstantMsec (session, i);
+
+  if (tr_variantDictFindList (settings, TR_KEY_bandwidth_groups, &list))
+    loadBandwidthGroups (session, list);
 
   if (tr_variantDictFindInt (settings, TR_KEY_speed_limit_up, &i))
     tr_sessionSetSpeedLimit_KBps (session, TR_UP, i);
@@ -1452,6 +1721,62 @@ tr_sessionGetSpeedLimit_KBps (const tr_session * s, tr_direction d)
     return toSpeedKBps (tr_sessionGetSpeedLimit_Bps (s, d));
 }
 
+void
+tr_sessionSetBandwidthTickMsec (tr_session * s, int msec)
+{
+  assert (tr_isSession (s));
+
+  s->bandwidthTickMsec = MAX (MIN_BANDWIDTH_TICK_MSEC, MIN (msec, MAX_BANDWIDTH_TICK_MSEC));
+}
+
+int
+tr_sessionGetBandwidthTickMsec (const tr_session * s)
+{
+  assert (tr_isSession (s));
+
+  return s->bandwidthTickMsec;
+}
+
+void
+tr_sessionSetSpeedTimeConstantMsec (tr_session * s, int msec)
+{
+  assert (tr_isSession (s));
+
+  s->speedTimeConstantMsec = MAX (MIN_SPEED_TIME_CONSTANT_MSEC, MIN (msec, MAX_SPEED_TIME_CONSTANT_MSEC));
+}
+
+int
+tr_sessionGetSpeedTimeConstantMsec (const tr_session * s)
+{
+  assert (tr_isSession (s));
+
+  return s->speedTimeConstantMsec;
+}
+
+void
+tr_sessionSetUploadSlotsAdaptive (tr_session * s, bool adaptive)
+{
+  assert (tr_isSession (s));
+
+  s->uploadSlotsAdaptive = adaptive;
+}
+
+bool
+tr_sessionIsUploadSlotsAdaptive (const tr_session * s)
+{
+  assert (tr_isSession (s));
+
+  return s->uploadSlotsAdaptive;
+}
+
+void
+tr_sessionGetUploadSlotStats (tr_session * s, int * setme_slots, int * setme_used)
+{
+  assert (tr_isSession (s));
+
+  tr_peerMgrGetUploadSlotStats (s->peerMgr, setme_slots, setme_used);
+}
+
 void
 tr_sessionLimitSpeed (tr_session * s, tr_direction d, bool b)
 {
@@ -1826,6 +2151,10 @@ sessionCloseImpl (void * vsession)
      it won't be idle until the announce events are sent... */
   tr_webClose (session, TR_WEB_CLOSE_WHEN_IDLE);
 
+  /* the torrents have flushed their writes, so this won't be long */
+  tr_diskIoFree (session->diskIo);
+  session->diskIo = NULL;
+
   tr_cacheFree (session->cache);
   session->cache = NULL;
 
@@ -1846,6 +2175,10 @@ sessionCloseImpl (void * vsession)
   tr_statsClose (session);
   tr_peerMgrFree (session->peerMgr);
 
+  /* this goes *after* the peers are gone, since it waits on their sockets */
+  tr_reactorsFree (session->reactors);
+  session->reactors = NULL;
+
   closeBlocklists (session);
 
   tr_fdClose (session);
@@ -1916,6 +2249,7 @@ tr_sessionClose (tr_session * session)
 
   /* free the session memory */
   tr_variantFree (&session->removedTorrents);
+  tr_ptrArrayDestruct (&session->bandwidthGroups, (PtrArrayForeachFunc)bandwidthGroupFree);
   tr_bandwidthDestruct (&session->bandwidth);
   tr_bitfieldDestruct (&session->turtle.minutes);
   tr_lockFree (session->lock);
@@ -2180,6 +2514,188 @@ tr_sessionGetCacheLimit_MB (const tr_session * session)
   return toMemMB (tr_cacheGetLimit (session->cache));
 }
 
+void
+tr_sessionSetReadCacheLimit_MB (tr_session * session, int mb)
+{
+  assert (tr_isSession (session));
+
+  tr_cacheSetReadLimit (session->cache, toMemBytes (MAX (0, mb)));
+}
+
+int
+tr_sessionGetReadCacheLimit_MB (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return toMemMB (tr_cacheGetReadLimit (session->cache));
+}
+
+void
+tr_sessionGetReadCacheStats (const tr_session * session, uint64_t * setme_hits, uint64_t * setme_misses)
+{
+  assert (tr_isSession (session));
+
+  tr_cacheGetReadStats (session->cache, setme_hits, setme_misses);
+}
+
+void
+tr_sessionSetVerifyThreads (tr_session * session, int threadCount)
+{
+  assert (tr_isSession (session));
+
+  session->verifyThreads = MAX (1, MIN (threadCount, MAX_VERIFY_THREADS));
+}
+
+int
+tr_sessionGetVerifyThreads (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->verifyThreads;
+}
+
+void
+tr_sessionSetDiskIoThreads (tr_session * session, int threadCount)
+{
+  assert (tr_isSession (session));
+
+  tr_diskIoSetThreadCount (session->diskIo, MAX (0, MIN (threadCount, MAX_DISK_IO_THREADS)));
+}
+
+int
+tr_sessionGetDiskIoThreads (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return tr_diskIoGetThreadCount (session->diskIo);
+}
+
+static void
+udpSocketCountChanged (void * vsession)
+{
+  tr_udpSetSocketCount (vsession);
+}
+
+void
+tr_sessionSetUDPSocketCount (tr_session * session, int count)
+{
+  assert (tr_isSession (session));
+
+  count = MAX (1, MIN (count, MAX_UDP_SOCKETS));
+
+  if (count != session->udpSocketCount)
+    {
+      session->udpSocketCount = count;
+
+      /* if the sockets are already open, restart their readers */
+      if (session->udp_batch != NULL)
+        tr_runInEventThread (session, udpSocketCountChanged, session);
+    }
+}
+
+int
+tr_sessionGetUDPSocketCount (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->udpSocketCount;
+}
+
+static void
+peerIoThreadsChanged (void * vsession)
+{
+  tr_session * session = vsession;
+
+  if (session->reactors != NULL)
+    tr_reactorsSetThreadCount (session->reactors, session->peerIoThreadCount);
+}
+
+void
+tr_sessionSetPeerIoThreads (tr_session * session, int threadCount)
+{
+  assert (tr_isSession (session));
+
+  threadCount = MAX (0, MIN (threadCount, MAX_PEER_IO_THREADS));
+
+  if (threadCount != session->peerIoThreadCount)
+    {
+      session->peerIoThreadCount = threadCount;
+      tr_runInEventThread (session, peerIoThreadsChanged, session);
+    }
+}
+
+int
+tr_sessionGetPeerIoThreads (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->peerIoThreadCount;
+}
+
+void
+tr_sessionSetVerifyQueueSize (tr_session * session, int n)
+{
+  assert (tr_isSession (session));
+
+  session->verifyQueueSize = MAX (1, n);
+}
+
+int
+tr_sessionGetVerifyQueueSize (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->verifyQueueSize;
+}
+
+void
+tr_sessionSetFastVerifyEnabled (tr_session * session, bool enabled)
+{
+  assert (tr_isSession (session));
+
+  session->isFastVerifyEnabled = enabled;
+}
+
+bool
+tr_sessionIsFastVerifyEnabled (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->isFastVerifyEnabled;
+}
+
+void
+tr_sessionSetMmapEnabled (tr_session * session, bool enabled)
+{
+  assert (tr_isSession (session));
+
+  session->isMmapEnabled = enabled;
+}
+
+bool
+tr_sessionIsMmapEnabled (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->isMmapEnabled;
+}
+
+void
+tr_sessionSetSendfileEnabled (tr_session * session, bool enabled)
+{
+  assert (tr_isSession (session));
+
+  session->isSendfileEnabled = enabled;
+}
+
+bool
+tr_sessionIsSendfileEnabled (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->isSendfileEnabled;
+}
+
 /***
 ****
 ***/
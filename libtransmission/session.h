@@ -55,8 +55,20 @@ struct tr_announcer;
 struct tr_announcer_udp;
 struct tr_bindsockets;
 struct tr_cache;
+struct tr_disk_io;
+struct tr_reactors;
 struct tr_fdInfo;
 struct tr_device_info;
+struct tr_udp_batch;
+
+/* a named node in the bandwidth tree, between tr_session and the
+ * torrents that are in it, so that they're capped together */
+struct tr_bandwidth_group
+{
+    char * name;
+
+    struct tr_bandwidth bandwidth;
+};
 
 struct tr_turtle_info
 {
@@ -107,6 +119,9 @@ struct tr_session
     bool                         isLPDEnabled;
     bool                         isBlocklistEnabled;
     bool                         isPrefetchEnabled;
+    bool                         isFastVerifyEnabled;
+    bool                         isMmapEnabled;
+    bool                         isSendfileEnabled;
     bool                         isTorrentDoneScriptEnabled;
     bool                         isClosing;
     bool                         isClosed;
@@ -151,6 +166,21 @@ struct tr_session
 
     int                          uploadSlotsPerTorrent;
 
+    /* grow and shrink each torrent's upload slots to fit its bandwidth */
+    bool                         uploadSlotsAdaptive;
+
+    /* how often bandwidth is handed out to the peers */
+    int                          bandwidthTickMsec;
+
+    /* the time constant of the peers', torrents' and session's speeds */
+    int                          speedTimeConstantMsec;
+
+    /* how many threads hash pieces when a torrent is verified */
+    int                          verifyThreads;
+
+    /* how many torrents on different devices may be verified at once */
+    int                          verifyQueueSize;
+
     /* The UDP sockets used for the DHT and uTP. */
     tr_port                      udp_port;
     int                          udp_socket;
@@ -158,6 +188,8 @@ struct tr_session
     unsigned char *              udp6_bound;
     struct event                 *udp_event;
     struct event                 *udp6_event;
+    struct tr_udp_batch          *udp_batch;
+    int                          udpSocketCount;
 
     /* The open port on the local machine for incoming peer requests */
     tr_port                      private_peer_port;
@@ -196,6 +228,9 @@ struct tr_session
     struct tr_shared *           shared;
 
     struct tr_cache *            cache;
+    struct tr_disk_io *          diskIo;
+    struct tr_reactors *         reactors;
+    int                          peerIoThreadCount;
 
     struct tr_lock *             lock;
 
@@ -218,6 +253,9 @@ struct tr_session
     /* monitors the "global pool" speeds */
     struct tr_bandwidth          bandwidth;
 
+    /* struct tr_bandwidth_group, sorted by name */
+    tr_ptrArray                  bandwidthGroups;
+
     float                        desiredRatio;
 
     uint16_t                     idleLimitMinutes;
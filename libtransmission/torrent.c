@@ -24,6 +24,7 @@
 #include <assert.h>
 #include <math.h>
 #include <stdarg.h>
+#include <stdio.h> /* remove () */
 #include <string.h> /* memcmp */
 #include <stdlib.h> /* qsort */
 #include <limits.h> /* INT_MAX */
@@ -154,6 +155,7 @@ tr_torrentIsPieceTransferAllowed (const tr_torrent  * tor,
 {
   bool allowed = true;
   unsigned int limit;
+  const tr_bandwidth_group * group = tor->bandwidthGroup;
 
   assert (tr_isTorrent (tor));
   assert (tr_isDirection (direction));
@@ -162,11 +164,19 @@ tr_torrentIsPieceTransferAllowed (const tr_torrent  * tor,
     if (tr_torrentGetSpeedLimit_Bps (tor, direction) <= 0)
       allowed = false;
 
-  if (tr_torrentUsesSessionLimits (tor))
-    if (tr_sessionGetActiveSpeedLimit_Bps (tor->session, direction, &limit))
-      if (limit <= 0)
+  /* a torrent always honors its group's limits... */
+  if (group != NULL)
+    if (tr_bandwidthGroupIsSpeedLimited (group, direction))
+      if (tr_bandwidthGetDesiredSpeed_Bps (&group->bandwidth, direction) <= 0)
         allowed = false;
 
+  /* ...but the session's only if it and its group both want to */
+  if (tr_torrentUsesSessionLimits (tor))
+    if ((group == NULL) || tr_bandwidthGroupUsesSessionLimits (group))
+      if (tr_sessionGetActiveSpeedLimit_Bps (tor->session, direction, &limit))
+        if (limit <= 0)
+          allowed = false;
+
   return allowed;
 }
 
@@ -269,17 +279,29 @@ tr_torrentUsesSpeedLimit (const tr_torrent * tor, tr_direction dir)
   return tr_bandwidthIsLimited (&tor->bandwidth, dir);
 }
 
-void
-tr_torrentUseSessionLimits (tr_torrent * tor, bool doUse)
+/* The torrent's parent is its bandwidth group, if it has one, or else
+ * the session. A group's limits are always honored, so in a group the
+ * torrent's flag says whether to go on past it to the session's. */
+static bool
+torrentSetParentLimits (tr_torrent * tor, bool useSessionLimits)
 {
   bool changed;
+  const bool honorParent = useSessionLimits || (tor->bandwidthGroup != NULL);
 
-  assert (tr_isTorrent (tor));
+  changed = tr_bandwidthHonorParentLimits (&tor->bandwidth, TR_UP, honorParent);
+  changed |= tr_bandwidthHonorParentLimits (&tor->bandwidth, TR_DOWN, honorParent);
+  changed |= tr_bandwidthHonorGrandparentLimits (&tor->bandwidth, TR_UP, useSessionLimits);
+  changed |= tr_bandwidthHonorGrandparentLimits (&tor->bandwidth, TR_DOWN, useSessionLimits);
 
-  changed = tr_bandwidthHonorParentLimits (&tor->bandwidth, TR_UP, doUse);
-  changed |= tr_bandwidthHonorParentLimits (&tor->bandwidth, TR_DOWN, doUse);
+  return changed;
+}
 
-  if (changed)
+void
+tr_torrentUseSessionLimits (tr_torrent * tor, bool doUse)
+{
+  assert (tr_isTorrent (tor));
+
+  if (torrentSetParentLimits (tor, doUse))
     tr_torrentSetDirty (tor);
 }
 
@@ -288,7 +310,35 @@ tr_torrentUsesSessionLimits (const tr_torrent * tor)
 {
   assert (tr_isTorrent (tor));
 
-  return tr_bandwidthAreParentLimitsHonored (&tor->bandwidth, TR_UP);
+  return tr_bandwidthAreGrandparentLimitsHonored (&tor->bandwidth, TR_UP);
+}
+
+void
+tr_torrentSetBandwidthGroup (tr_torrent * tor, const char * name)
+{
+  tr_bandwidth_group * group = NULL;
+
+  assert (tr_isTorrent (tor));
+
+  if ((name != NULL) && (*name != '\0'))
+    group = tr_sessionGetBandwidthGroup (tor->session, name);
+
+  if (group != tor->bandwidthGroup)
+    {
+      tor->bandwidthGroup = group;
+      tr_bandwidthSetParent (&tor->bandwidth, group ? &group->bandwidth
+                                                    : &tor->session->bandwidth);
+      torrentSetParentLimits (tor, tr_torrentUsesSessionLimits (tor));
+      tr_torrentSetDirty (tor);
+    }
+}
+
+const char *
+tr_torrentGetBandwidthGroup (const tr_torrent * tor)
+{
+  assert (tr_isTorrent (tor));
+
+  return tor->bandwidthGroup ? tor->bandwidthGroup->name : NULL;
 }
 
 /***
@@ -426,6 +476,73 @@ tr_torrentGetIdleMode (const tr_torrent * tor)
   return tor->idleLimitMode;
 }
 
+/***
+****
+***/
+
+void
+tr_torrentSetSequentialDownload (tr_torrent * tor, bool sequential)
+{
+  assert (tr_isTorrent (tor));
+
+  if (sequential != tor->sequentialDownload)
+    {
+      tor->sequentialDownload = sequential;
+
+      tr_torrentSetDirty (tor);
+    }
+}
+
+bool
+tr_torrentGetSequentialDownload (const tr_torrent * tor)
+{
+  assert (tr_isTorrent (tor));
+
+  return tor->sequentialDownload;
+}
+
+void
+tr_torrentSetStreamingWindow (tr_torrent * tor, uint64_t windowBytes)
+{
+  assert (tr_isTorrent (tor));
+
+  if (windowBytes != tor->streamingWindow)
+    {
+      tor->streamingWindow = windowBytes;
+      tor->streamingMovedAt = tr_time_msec ();
+
+      tr_torrentSetDirty (tor);
+    }
+}
+
+uint64_t
+tr_torrentGetStreamingWindow (const tr_torrent * tor)
+{
+  assert (tr_isTorrent (tor));
+
+  return tor->streamingWindow;
+}
+
+void
+tr_torrentSetStreamingPosition (tr_torrent * tor, uint64_t position)
+{
+  assert (tr_isTorrent (tor));
+
+  if (position != tor->streamingPosition)
+    {
+      tor->streamingPosition = position;
+      tor->streamingMovedAt = tr_time_msec ();
+    }
+}
+
+uint64_t
+tr_torrentGetStreamingPosition (const tr_torrent * tor)
+{
+  assert (tr_isTorrent (tor));
+
+  return tor->streamingPosition;
+}
+
 void
 tr_torrentSetIdleLimit (tr_torrent * tor, uint16_t idleMinutes)
 {
@@ -1585,6 +1702,7 @@ freeTorrent (tr_torrent * tor)
 
   tr_free (tor->downloadDir);
   tr_free (tor->incompleteDir);
+  tr_free (tor->fingerprints);
 
   if (tor == session->torrentList)
     {
@@ -2568,6 +2686,58 @@ tr_torrentSetChecked (tr_torrent * tor, time_t when)
     tor->info.pieces[i].timeChecked = when;
 }
 
+void
+tr_torrentGetFileFingerprint (const tr_torrent    * tor,
+                              tr_file_index_t       fileIndex,
+                              tr_file_fingerprint * setme)
+{
+  struct stat sb;
+  char * filename = tr_torrentFindFile (tor, fileIndex);
+
+  memset (setme, 0, sizeof (tr_file_fingerprint));
+
+  if ((filename != NULL) && !stat (filename, &sb))
+    {
+      setme->size = sb.st_size;
+      setme->mtime = sb.st_mtime;
+      setme->inode = sb.st_ino;
+    }
+
+  tr_free (filename);
+}
+
+bool
+tr_torrentFileFingerprintsEqual (const tr_file_fingerprint * a,
+                                 const tr_file_fingerprint * b)
+{
+  return (a->size == b->size)
+      && (a->mtime == b->mtime)
+      && (a->inode == b->inode);
+}
+
+void
+tr_torrentSetVerified (tr_torrent * tor)
+{
+  tr_file_index_t i;
+
+  assert (tr_isTorrent (tor));
+
+  /* this runs in the verify thread, but the libevent
+   * thread reads the fingerprints when saving the .resume file */
+  tr_sessionLock (tor->session);
+
+  if (tor->fingerprints == NULL)
+    tor->fingerprints = tr_new0 (tr_file_fingerprint, tor->info.fileCount);
+
+  for (i=0; i<tor->info.fileCount; ++i)
+    tr_torrentGetFileFingerprint (tor, i, &tor->fingerprints[i]);
+
+  tor->verifiedDate = tr_time ();
+  tr_torrentSetDirty (tor);
+
+  tr_sessionUnlock (tor->session);
+}
+
 bool
 tr_torrentCheckPiece (tr_torrent * tor, tr_piece_index_t pieceIndex)
 {
@@ -2579,6 +2749,16 @@ tr_torrentCheckPiece (tr_torrent * tor, tr_piece_index_t pieceIndex)
   tor->anyDate = tr_time ();
   tr_torrentSetDirty (tor);
 
+  /* the local data is known to be bad, so the next verify
+   * has to reread all of it instead of trusting the fingerprints */
+  if (!pass && (tor->fingerprints != NULL))
+    {
+      tr_sessionLock (tor->session);
+      tr_free (tor->fingerprints);
+      tor->fingerprints = NULL;
+      tr_sessionUnlock (tor->session);
+    }
+
   return pass;
 }
 
@@ -3065,6 +3245,9 @@ setLocation (void * vdata)
       /* bad idea to move files while they're being verified... */
       tr_verifyRemove (tor);
 
+      /* ...or while they're being written to in the background */
+      tr_cacheFlushTorrent (tor->session->cache, tor);
+
       /* try to move the files.
        * FIXME: there are still all kinds of nasty cases, like what
        * if the target directory runs out of space halfway through... */
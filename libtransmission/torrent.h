@@ -109,6 +109,26 @@ void             tr_torrentSetPieceChecked (tr_torrent       * tor,
 
 void             tr_torrentSetChecked (tr_torrent * tor, time_t when);
 
+/** @brief what a file looked like on disk when its torrent was last verified */
+typedef struct tr_file_fingerprint
+{
+    uint64_t    size;
+    time_t      mtime;
+    uint64_t    inode;
+}
+tr_file_fingerprint;
+
+/** fills `setme' with what the file looks like now, or zeroes if it's missing */
+void             tr_torrentGetFileFingerprint (const tr_torrent    * tor,
+                                               tr_file_index_t       fileIndex,
+                                               tr_file_fingerprint * setme);
+
+bool             tr_torrentFileFingerprintsEqual (const tr_file_fingerprint * a,
+                                                  const tr_file_fingerprint * b);
+
+/** remember what the torrent's files look like after a completed verify */
+void             tr_torrentSetVerified (tr_torrent * tor);
+
 void             tr_torrentCheckSeedLimit (tr_torrent * tor);
 
 /** save a torrent's .resume file if it's changed since the last time it was saved */
@@ -223,6 +243,11 @@ struct tr_torrent
     time_t                     startDate;
     time_t                     anyDate;
 
+    /* what each file looked like the last time the torrent finished
+     * verifying, or NULL if it hasn't been verified yet */
+    tr_file_fingerprint      * fingerprints;
+    time_t                     verifiedDate;
+
     int                        secondsDownloading;
     int                        secondsSeeding;
 
@@ -264,6 +289,7 @@ struct tr_torrent
     int                        uniqueId;
 
     struct tr_bandwidth        bandwidth;
+    struct tr_bandwidth_group * bandwidthGroup; /* NULL if not in a group */
 
     struct tr_swarm          * swarm;
 
@@ -273,6 +299,13 @@ struct tr_torrent
     uint16_t                   idleLimitMinutes;
     tr_idlelimit               idleLimitMode;
     bool                       finishedSeedingByIdle;
+
+    bool                       sequentialDownload;
+
+    /* the streaming window's bytes: [streamingPosition, +streamingWindow) */
+    uint64_t                   streamingPosition;
+    uint64_t                   streamingWindow;
+    uint64_t                   streamingMovedAt; /* tr_time_msec () */
 };
 
 static inline tr_torrent*
@@ -21,11 +21,17 @@ THE SOFTWARE.
 
 */
 
+#if (defined (HAVE_RECVMMSG) || defined (HAVE_SENDMMSG)) && !defined (_GNU_SOURCE)
+ #define _GNU_SOURCE /* glibc's sys/socket.h needs this for recvmmsg () and sendmmsg () */
+#endif
+
 #include <assert.h>
+#include <errno.h>
+#include <stddef.h> /* offsetof () */
 #include <string.h> /* memcmp (), memcpy (), memset () */
 #include <stdlib.h> /* malloc (), free () */
 
-#include <unistd.h> /* close () */
+#include <unistd.h> /* close (), dup2 (), pipe () */
 
 #include <event2/event.h>
 
@@ -34,10 +40,17 @@ THE SOFTWARE.
 #include "transmission.h"
 #include "log.h"
 #include "net.h"
+#include "platform.h" /* tr_lock, tr_cond, tr_threadNew () */
 #include "session.h"
 #include "tr-dht.h"
 #include "tr-utp.h"
 #include "tr-udp.h"
+#include "utils.h"
+
+#if defined (SO_REUSEPORT) && !defined (WIN32)
+ #define USE_UDP_WORKERS
+ #include <poll.h>
+#endif
 
 /* Since we use a single UDP socket in order to implement multiple
    uTP sockets, try to set up huge buffers. */
@@ -97,6 +110,10 @@ set_socket_buffers (int fd, int large)
     }
 }
 
+#ifdef USE_UDP_WORKERS
+static void set_worker_socket_buffers (tr_session *, int large);
+#endif
+
 void
 tr_udpSetSocketBuffers (tr_session *session)
 {
@@ -105,6 +122,9 @@ tr_udpSetSocketBuffers (tr_session *session)
         set_socket_buffers (session->udp_socket, utp);
     if (session->udp6_socket >= 0)
         set_socket_buffers (session->udp6_socket, utp);
+#ifdef USE_UDP_WORKERS
+    set_worker_socket_buffers (session, utp);
+#endif
 }
 
 
@@ -187,22 +207,208 @@ rebind_ipv6 (tr_session *ss, bool force)
     }
 }
 
+/* Datagrams are read and written in batches, so that a busy uTP swarm
+   doesn't cost a system call per packet.  Incoming datagrams are
+   drained with recvmmsg (), until the socket would block.  Outgoing
+   ones are queued and sent together with sendmmsg (), either when the
+   incoming batch that triggered them has been handled or, for those
+   sent from elsewhere, once the event loop comes back around. */
+
+#define UDP_BATCH_SIZE 32
+#define UDP_MAX_RECV_PER_WAKEUP 1024
+#define UDP_RECV_SIZE 4096
+#define UDP_SEND_SIZE 1536 /* bigger datagrams skip the queue */
+
+/* Without MSG_DONTWAIT we can't tell whether there's more to read,
+   so read one datagram per wakeup as the socket is blocking. */
+#ifndef MSG_DONTWAIT
+ #undef HAVE_RECVMMSG
+ #define MSG_DONTWAIT 0
+ #define UDP_RECV_BATCH_SIZE 1
+#else
+ #define UDP_RECV_BATCH_SIZE UDP_BATCH_SIZE
+#endif
+
+struct udp_datagram
+{
+    int fd;
+    size_t len;
+    socklen_t tolen;
+    struct sockaddr_storage to;
+    unsigned char buf[UDP_SEND_SIZE];
+};
+
+struct udp_inbox
+{
+    unsigned char in[UDP_RECV_BATCH_SIZE][UDP_RECV_SIZE];
+    struct sockaddr_storage from[UDP_RECV_BATCH_SIZE];
+    socklen_t fromlen[UDP_RECV_BATCH_SIZE];
+    size_t inlen[UDP_RECV_BATCH_SIZE];
+};
+
+struct udp_workers;
+
+struct tr_udp_batch
+{
+    struct udp_inbox inbox;
+
+    struct udp_datagram out[UDP_BATCH_SIZE];
+    int outcount;
+
+    struct event *flush_event;
+
+    /* NULL unless the IPv4 socket is read by worker threads */
+    struct udp_workers *workers;
+
+    /* where the IPv4 socket is bound, and whether it shares the port */
+    struct sockaddr_in sin;
+    bool reuseport;
+};
+
 static void
-event_callback (evutil_socket_t s, short type UNUSED, void *sv)
+send_run (struct udp_datagram *out, int n)
 {
-    int rc;
-    socklen_t fromlen;
-    unsigned char buf[4096];
-    struct sockaddr_storage from;
-    tr_session *ss = sv;
+#ifdef HAVE_SENDMMSG
+    int i, rc;
+    struct iovec iov[UDP_BATCH_SIZE];
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+
+    memset (msgs, 0, sizeof (struct mmsghdr) * n);
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = out[i].buf;
+        iov[i].iov_len = out[i].len;
+        msgs[i].msg_hdr.msg_name = &out[i].to;
+        msgs[i].msg_hdr.msg_namelen = out[i].tolen;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
-    assert (tr_isSession (sv));
-    assert (type == EV_READ);
+    /* sendmmsg () stops at the first datagram that fails.  Drop that
+       one, like a plain sendto () would, and go on with the rest. */
+    for (i = 0; i < n; ) {
+        rc = sendmmsg (out[i].fd, msgs + i, n - i, 0);
+        if (rc <= 0)
+            tr_logAddNamedDbg ("UDP", "Couldn't send UDP datagram: %s",
+                               tr_strerror (errno));
+        i += rc > 0 ? rc : 1;
+    }
+#else
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (sendto (out[i].fd, out[i].buf, out[i].len, 0,
+                    (struct sockaddr*)&out[i].to, out[i].tolen) < 0)
+            tr_logAddNamedDbg ("UDP", "Couldn't send UDP datagram: %s",
+                               tr_strerror (errno));
+#endif
+}
+
+static void
+udp_flush (tr_session *ss)
+{
+    int i, j;
+    struct tr_udp_batch *b = ss->udp_batch;
+
+    if (b == NULL || b->outcount == 0)
+        return;
+
+    /* one run per socket, since the IPv4 and IPv6 datagrams
+       are interleaved in the queue */
+    for (i = 0; i < b->outcount; i = j) {
+        for (j = i + 1; j < b->outcount && b->out[j].fd == b->out[i].fd; j++)
+            ;
+        send_run (b->out + i, j - i);
+    }
+
+    b->outcount = 0;
+}
+
+static void
+flush_callback (evutil_socket_t s UNUSED, short type UNUSED, void *sv)
+{
+    udp_flush (sv);
+}
+
+int
+tr_udpSendTo (tr_session *ss, int fd, const void *buf, size_t buflen,
+              const struct sockaddr *to, socklen_t tolen)
+{
+    struct udp_datagram *d;
+    struct tr_udp_batch *b = ss->udp_batch;
+
+    if (b == NULL || buflen > UDP_SEND_SIZE || tolen > sizeof (d->to)) {
+        udp_flush (ss); /* keep the datagrams in order */
+        return sendto (fd, buf, buflen, 0, to, tolen);
+    }
+
+    if (b->outcount == UDP_BATCH_SIZE)
+        udp_flush (ss);
+
+    if (b->outcount == 0)
+        tr_timerAdd (b->flush_event, 0, 0);
+
+    d = &b->out[b->outcount++];
+    d->fd = fd;
+    d->len = buflen;
+    d->tolen = tolen;
+    memcpy (&d->to, to, tolen);
+    memcpy (d->buf, buf, buflen);
+    return buflen;
+}
+
+/* read up to UDP_RECV_BATCH_SIZE datagrams without blocking.
+   returns how many were read. */
+static int
+recv_batch (evutil_socket_t s, struct udp_inbox *b)
+{
+    int n;
+#ifdef HAVE_RECVMMSG
+    int i;
+    struct iovec iov[UDP_RECV_BATCH_SIZE];
+    struct mmsghdr msgs[UDP_RECV_BATCH_SIZE];
+
+    memset (msgs, 0, sizeof (msgs));
+    for (i = 0; i < UDP_RECV_BATCH_SIZE; i++) {
+        iov[i].iov_base = b->in[i];
+        iov[i].iov_len = UDP_RECV_SIZE - 1;
+        msgs[i].msg_hdr.msg_name = &b->from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof (b->from[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
-    fromlen = sizeof (from);
-    rc = recvfrom (s, buf, 4096 - 1, 0,
-                (struct sockaddr*)&from, &fromlen);
+    n = recvmmsg (s, msgs, UDP_RECV_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    for (i = 0; i < n; i++) {
+        b->inlen[i] = msgs[i].msg_len;
+        b->fromlen[i] = msgs[i].msg_hdr.msg_namelen;
+    }
+#else
+    for (n = 0; n < UDP_RECV_BATCH_SIZE; n++) {
+        const int flags = n == 0 ? 0 : MSG_DONTWAIT;
+        int rc;
+        b->fromlen[n] = sizeof (b->from[n]);
+        rc = recvfrom (s, b->in[n], UDP_RECV_SIZE - 1, flags,
+                       (struct sockaddr*)&b->from[n], &b->fromlen[n]);
+        if (rc < 0)
+            break;
+        b->inlen[n] = rc;
+    }
+#endif
 
+    return n < 0 ? 0 : n;
+}
+
+enum
+{
+    UDP_NONE,
+    UDP_DHT,
+    UDP_TRACKER,
+    UDP_UTP
+};
+
+static int
+classify_datagram (const unsigned char *buf, int rc)
+{
     /* Since most packets we receive here are ÂµTP, make quick inline
        checks for the other protocols.  The logic is as follows:
        - all DHT packets start with 'd';
@@ -210,27 +416,448 @@ event_callback (evutil_socket_t s, short type UNUSED, void *sv)
          is between 0 and 3;
        - the above cannot be ÂµTP packets, since these start with a 4-bit
          version number (1). */
-    if (rc > 0) {
-        if (buf[0] == 'd') {
-            if (tr_sessionAllowsDHT (ss)) {
-                buf[rc] = '\0'; /* required by the DHT code */
-                tr_dhtCallback (buf, rc, (struct sockaddr*)&from, fromlen, sv);
-            }
-        } else if (rc >= 8 &&
-                   buf[0] == 0 && buf[1] == 0 && buf[2] == 0 && buf[3] <= 3) {
-            rc = tau_handle_message (ss, buf, rc);
+    if (rc <= 0)
+        return UDP_NONE;
+    if (buf[0] == 'd')
+        return UDP_DHT;
+    if (rc >= 8 && buf[0] == 0 && buf[1] == 0 && buf[2] == 0 && buf[3] <= 3)
+        return UDP_TRACKER;
+    return UDP_UTP;
+}
+
+static void
+handle_datagram (tr_session *ss, int type, unsigned char *buf, int rc,
+                 struct sockaddr *from, socklen_t fromlen)
+{
+    switch (type) {
+    case UDP_DHT:
+        if (tr_sessionAllowsDHT (ss)) {
+            buf[rc] = '\0'; /* required by the DHT code */
+            tr_dhtCallback (buf, rc, from, fromlen, ss);
+        }
+        break;
+    case UDP_TRACKER:
+        rc = tau_handle_message (ss, buf, rc);
+        if (!rc)
+            tr_logAddNamedDbg ("UDP", "Couldn't parse UDP tracker packet.");
+        break;
+    case UDP_UTP:
+        if (tr_sessionIsUTPEnabled (ss)) {
+            rc = tr_utpPacket (buf, rc, from, fromlen, ss);
             if (!rc)
-                tr_logAddNamedDbg ("UDP", "Couldn't parse UDP tracker packet.");
-        } else {
-            if (tr_sessionIsUTPEnabled (ss)) {
-                rc = tr_utpPacket (buf, rc, (struct sockaddr*)&from, fromlen, ss);
-                if (!rc)
-                    tr_logAddNamedDbg ("UDP", "Unexpected UDP packet");
-            }
+                tr_logAddNamedDbg ("UDP", "Unexpected UDP packet");
         }
+        break;
     }
 }
 
+static void
+event_callback (evutil_socket_t s, short type UNUSED, void *sv)
+{
+    int i, n, total = 0;
+    tr_session *ss = sv;
+    struct udp_inbox *b = &ss->udp_batch->inbox;
+
+    assert (tr_isSession (sv));
+    assert (type == EV_READ);
+
+    do {
+        n = recv_batch (s, b);
+        for (i = 0; i < n; i++)
+            handle_datagram (ss, classify_datagram (b->in[i], b->inlen[i]),
+                             b->in[i], b->inlen[i],
+                             (struct sockaddr*)&b->from[i], b->fromlen[i]);
+        total += n;
+    } while (n == UDP_RECV_BATCH_SIZE && total < UDP_MAX_RECV_PER_WAKEUP);
+
+    /* send the replies and acks in one go */
+    udp_flush (ss);
+}
+
+#ifdef USE_UDP_WORKERS
+
+/* With more than one UDP socket, they're all bound to the peer port with
+   SO_REUSEPORT, so that the kernel spreads the incoming datagrams between
+   them by address.  Each socket is read by a thread of its own, which
+   sorts its datagrams and hands them to the libevent thread in batches.
+   libutp and the DHT aren't thread-safe, so the datagrams are still
+   handled there; what the threads take off the libevent thread is the
+   system calls, and the waiting on them.  Everything is sent from the
+   first socket, which is the one the DHT knows about. */
+
+#define UDP_MAX_SOCKETS 32
+#define UDP_MAX_QUEUED_BATCHES 256 /* past this, the threads drop datagrams */
+
+struct udp_rx_batch
+{
+    struct udp_rx_batch *next;
+    int count;
+    struct {
+        int type;
+        size_t len;
+        size_t offset;
+        socklen_t fromlen;
+        struct sockaddr_storage from;
+    } info[UDP_RECV_BATCH_SIZE];
+    unsigned char data[1];
+};
+
+struct udp_worker
+{
+    struct udp_workers *pool;
+    int fd;
+};
+
+struct udp_workers
+{
+    tr_lock *lock;
+    tr_cond *cond; /* signalled when a thread exits */
+    int threadCount;
+
+    /* workers_free () writes to stop[1] to wake the threads up and
+       have them exit.  It's never read, so they all see it. */
+    int stop[2];
+
+    struct udp_worker workers[UDP_MAX_SOCKETS];
+    int workerCount;
+
+    /* batches waiting for the libevent thread, oldest first */
+    struct udp_rx_batch *head;
+    struct udp_rx_batch *tail;
+    int queued;
+
+    /* a worker writes to wake[1] when head goes from NULL to non-NULL */
+    evutil_socket_t wake[2];
+    struct event *wake_event;
+};
+
+static void
+queue_batch (struct udp_workers *pool, const struct udp_inbox *inbox, int n)
+{
+    int i;
+    bool wake;
+    size_t total = 0;
+    struct udp_rx_batch *b;
+
+    for (i = 0; i < n; i++)
+        total += inbox->inlen[i] + 1; /* room for the DHT's '\0' */
+
+    b = tr_malloc (offsetof (struct udp_rx_batch, data) + total);
+    b->next = NULL;
+    b->count = n;
+    for (i = 0, total = 0; i < n; i++) {
+        b->info[i].type = classify_datagram (inbox->in[i], inbox->inlen[i]);
+        b->info[i].len = inbox->inlen[i];
+        b->info[i].offset = total;
+        b->info[i].fromlen = inbox->fromlen[i];
+        memcpy (&b->info[i].from, &inbox->from[i], inbox->fromlen[i]);
+        memcpy (b->data + total, inbox->in[i], inbox->inlen[i]);
+        total += inbox->inlen[i] + 1;
+    }
+
+    tr_lockLock (pool->lock);
+    if (pool->queued >= UDP_MAX_QUEUED_BATCHES) {
+        tr_lockUnlock (pool->lock);
+        tr_free (b);
+        return;
+    }
+    wake = pool->head == NULL;
+    if (pool->tail != NULL)
+        pool->tail->next = b;
+    else
+        pool->head = b;
+    pool->tail = b;
+    ++pool->queued;
+    tr_lockUnlock (pool->lock);
+
+    if (wake) {
+        const char ch = 'u';
+        send (pool->wake[1], &ch, 1, 0);
+    }
+}
+
+static void
+worker_func (void *vw)
+{
+    struct udp_worker *w = vw;
+    struct udp_workers *pool = w->pool;
+    struct udp_inbox *inbox = tr_new (struct udp_inbox, 1);
+    struct pollfd pfd[2];
+
+    pfd[0].fd = w->fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = pool->stop[0];
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        int n;
+
+        if (poll (pfd, 2, -1) <= 0)
+            continue;
+
+        if (pfd[1].revents != 0)
+            break;
+
+        while ((n = recv_batch (w->fd, inbox)) > 0) {
+            queue_batch (pool, inbox, n);
+            if (n < UDP_RECV_BATCH_SIZE)
+                break;
+        }
+    }
+
+    tr_free (inbox);
+
+    tr_lockLock (pool->lock);
+    --pool->threadCount;
+    tr_condBroadcast (pool->cond);
+    tr_lockUnlock (pool->lock);
+}
+
+static void
+wake_callback (evutil_socket_t s, short type UNUSED, void *sv)
+{
+    int i;
+    char buf[64];
+    tr_session *ss = sv;
+    struct udp_workers *pool = ss->udp_batch->workers;
+    struct udp_rx_batch *b, *next;
+
+    while (recv (s, buf, sizeof (buf), 0) > 0)
+        ;
+
+    tr_lockLock (pool->lock);
+    b = pool->head;
+    pool->head = pool->tail = NULL;
+    pool->queued = 0;
+    tr_lockUnlock (pool->lock);
+
+    for (; b != NULL; b = next) {
+        next = b->next;
+        for (i = 0; i < b->count; i++)
+            handle_datagram (ss, b->info[i].type,
+                             b->data + b->info[i].offset, b->info[i].len,
+                             (struct sockaddr*)&b->info[i].from,
+                             b->info[i].fromlen);
+        tr_free (b);
+    }
+
+    /* send the replies and acks in one go */
+    udp_flush (ss);
+}
+
+static int
+reuseport_socket (const struct sockaddr_in *sin)
+{
+    int one = 1;
+    int s = socket (PF_INET, SOCK_DGRAM, 0);
+
+    if (s < 0)
+        return -1;
+
+    if (setsockopt (s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one)) < 0 ||
+        bind (s, (const struct sockaddr*)sin, sizeof (*sin)) < 0) {
+        close (s);
+        return -1;
+    }
+
+    return s;
+}
+
+static void workers_free (struct udp_workers *pool);
+
+/* `ss->udp_socket' must already be bound with SO_REUSEPORT.
+   returns NULL if the threads couldn't be started. */
+static struct udp_workers *
+workers_new (tr_session *ss, const struct sockaddr_in *sin, int count)
+{
+    int i;
+    struct udp_workers *pool = tr_new0 (struct udp_workers, 1);
+
+    pool->lock = tr_lockNew ();
+    pool->cond = tr_condNew ();
+    pool->stop[0] = pool->stop[1] = -1;
+    pool->wake[0] = pool->wake[1] = -1;
+
+    count = MIN (count, UDP_MAX_SOCKETS);
+    pool->workers[pool->workerCount++].fd = ss->udp_socket;
+    for (i = 1; i < count; i++) {
+        const int s = reuseport_socket (sin);
+        if (s < 0) {
+            tr_logAddNamedError ("UDP", "Couldn't open UDP socket %d of %d: %s",
+                                 i + 1, count, tr_strerror (errno));
+            break;
+        }
+        pool->workers[pool->workerCount++].fd = s;
+    }
+
+    if (evutil_socketpair (AF_UNIX, SOCK_STREAM, 0, pool->wake) < 0 ||
+        pipe (pool->stop) < 0) {
+        tr_logAddNamedError ("UDP", "Couldn't create UDP wakeup socket: %s",
+                             tr_strerror (errno));
+        workers_free (pool);
+        return NULL;
+    }
+    evutil_make_socket_nonblocking (pool->wake[0]);
+    evutil_make_socket_nonblocking (pool->wake[1]);
+    pool->wake_event = event_new (ss->event_base, pool->wake[0],
+                                  EV_READ | EV_PERSIST, wake_callback, ss);
+    event_add (pool->wake_event, NULL);
+
+    for (i = 0; i < pool->workerCount; i++) {
+        pool->workers[i].pool = pool;
+        tr_threadNew (worker_func, &pool->workers[i]);
+        ++pool->threadCount;
+    }
+
+    tr_logAddNamedInfo ("UDP", "Reading %d UDP sockets in worker threads",
+                        pool->workerCount);
+    return pool;
+}
+
+static void
+workers_free (struct udp_workers *pool)
+{
+    int i;
+    struct udp_rx_batch *b;
+
+    if (pool->threadCount > 0) {
+        const char ch = 's';
+        while (write (pool->stop[1], &ch, 1) < 0 && errno == EINTR)
+            ;
+    }
+
+    tr_lockLock (pool->lock);
+    while (pool->threadCount > 0)
+        tr_condWait (pool->cond, pool->lock);
+    tr_lockUnlock (pool->lock);
+
+    /* the first socket is the session's */
+    for (i = 1; i < pool->workerCount; i++)
+        tr_netCloseSocket (pool->workers[i].fd);
+
+    if (pool->wake_event != NULL)
+        event_free (pool->wake_event);
+    if (pool->wake[0] >= 0)
+        evutil_closesocket (pool->wake[0]);
+    if (pool->wake[1] >= 0)
+        evutil_closesocket (pool->wake[1]);
+    if (pool->stop[0] >= 0)
+        close (pool->stop[0]);
+    if (pool->stop[1] >= 0)
+        close (pool->stop[1]);
+
+    while ((b = pool->head) != NULL) {
+        pool->head = b->next;
+        tr_free (b);
+    }
+
+    tr_condFree (pool->cond);
+    tr_lockFree (pool->lock);
+    tr_free (pool);
+}
+
+static void
+set_worker_socket_buffers (tr_session *ss, int large)
+{
+    int i;
+    const struct udp_workers *pool;
+
+    if (ss->udp_batch == NULL || ss->udp_batch->workers == NULL)
+        return;
+
+    pool = ss->udp_batch->workers;
+    for (i = 1; i < pool->workerCount; i++)
+        set_socket_buffers (pool->workers[i].fd, large);
+}
+
+/* reopen the IPv4 socket with SO_REUSEPORT, which has to be set before
+   it's bound.  It keeps its descriptor, since the DHT has it. */
+static bool
+rebind_reuseport (tr_session *ss)
+{
+    int one = 1;
+    struct tr_udp_batch *b = ss->udp_batch;
+    const int s = socket (PF_INET, SOCK_DGRAM, 0);
+
+    if (s < 0)
+        return false;
+
+    if (setsockopt (s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one)) < 0 ||
+        dup2 (s, ss->udp_socket) < 0) {
+        close (s);
+        return false;
+    }
+    close (s);
+
+    if (bind (ss->udp_socket, (struct sockaddr*)&b->sin, sizeof (b->sin)) < 0) {
+        tr_logAddNamedError ("UDP", "Couldn't rebind IPv4 socket: %s",
+                             tr_strerror (errno));
+        return false;
+    }
+
+    b->reuseport = true;
+    return true;
+}
+
+#endif /* USE_UDP_WORKERS */
+
+/* start reading the IPv4 socket, in worker threads if there's to be
+   more than one socket, or else in the libevent thread */
+static void
+start_ipv4 (tr_session *ss)
+{
+#ifdef USE_UDP_WORKERS
+    struct tr_udp_batch *b = ss->udp_batch;
+
+    if (ss->udpSocketCount > 1 && b->reuseport)
+        b->workers = workers_new (ss, &b->sin, ss->udpSocketCount);
+    if (b->workers != NULL)
+        return;
+#endif
+
+    ss->udp_event =
+        event_new (ss->event_base, ss->udp_socket, EV_READ | EV_PERSIST,
+                  event_callback, ss);
+    if (ss->udp_event == NULL)
+        tr_logAddNamedError ("UDP", "Couldn't allocate IPv4 event");
+    else
+        event_add (ss->udp_event, NULL);
+}
+
+static void
+stop_ipv4 (tr_session *ss)
+{
+#ifdef USE_UDP_WORKERS
+    if (ss->udp_batch->workers != NULL) {
+        workers_free (ss->udp_batch->workers);
+        ss->udp_batch->workers = NULL;
+    }
+#endif
+
+    if (ss->udp_event != NULL) {
+        event_free (ss->udp_event);
+        ss->udp_event = NULL;
+    }
+}
+
+void
+tr_udpSetSocketCount (tr_session *ss)
+{
+    if (ss->udp_batch == NULL || ss->udp_socket < 0)
+        return;
+
+    /* only the IPv4 socket's readers are restarted; the socket
+       itself, and the DHT and uTP state that goes with it, stay */
+    stop_ipv4 (ss);
+#ifdef USE_UDP_WORKERS
+    if (ss->udpSocketCount > 1 && !ss->udp_batch->reuseport)
+        rebind_reuseport (ss);
+#endif
+    start_ipv4 (ss);
+
+    tr_udpSetSocketBuffers (ss);
+}
+
 void
 tr_udpInit (tr_session *ss)
 {
@@ -246,6 +873,9 @@ tr_udpInit (tr_session *ss)
     if (ss->udp_port <= 0)
         return;
 
+    ss->udp_batch = tr_new0 (struct tr_udp_batch, 1);
+    ss->udp_batch->flush_event = evtimer_new (ss->event_base, flush_callback, ss);
+
     ss->udp_socket = socket (PF_INET, SOCK_DGRAM, 0);
     if (ss->udp_socket < 0) {
         tr_logAddNamedError ("UDP", "Couldn't create IPv4 socket");
@@ -258,6 +888,13 @@ tr_udpInit (tr_session *ss)
     if (public_addr && !is_default)
         memcpy (&sin.sin_addr, &public_addr->addr.addr4, sizeof (struct in_addr));
     sin.sin_port = htons (ss->udp_port);
+#ifdef USE_UDP_WORKERS
+    if (ss->udpSocketCount > 1) {
+        int one = 1;
+        ss->udp_batch->reuseport =
+            setsockopt (ss->udp_socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one)) == 0;
+    }
+#endif
     rc = bind (ss->udp_socket, (struct sockaddr*)&sin, sizeof (sin));
     if (rc < 0) {
         tr_logAddNamedError ("UDP", "Couldn't bind IPv4 socket");
@@ -265,11 +902,8 @@ tr_udpInit (tr_session *ss)
         ss->udp_socket = -1;
         goto ipv6;
     }
-    ss->udp_event =
-        event_new (ss->event_base, ss->udp_socket, EV_READ | EV_PERSIST,
-                  event_callback, ss);
-    if (ss->udp_event == NULL)
-        tr_logAddNamedError ("UDP", "Couldn't allocate IPv4 event");
+    ss->udp_batch->sin = sin;
+    start_ipv4 (ss);
 
  ipv6:
     if (tr_globalIPv6 ())
@@ -287,8 +921,6 @@ tr_udpInit (tr_session *ss)
     if (ss->isDHTEnabled)
         tr_dhtInit (ss);
 
-    if (ss->udp_event)
-        event_add (ss->udp_event, NULL);
     if (ss->udp6_event)
         event_add (ss->udp6_event, NULL);
 }
@@ -298,6 +930,17 @@ tr_udpUninit (tr_session *ss)
 {
     tr_dhtUninit (ss);
 
+    if (ss->udp_batch) {
+#ifdef USE_UDP_WORKERS
+        if (ss->udp_batch->workers)
+            workers_free (ss->udp_batch->workers);
+#endif
+        udp_flush (ss);
+        event_free (ss->udp_batch->flush_event);
+        tr_free (ss->udp_batch);
+        ss->udp_batch = NULL;
+    }
+
     if (ss->udp_socket >= 0) {
         tr_netCloseSocket (ss->udp_socket);
         ss->udp_socket = -1;
@@ -32,6 +32,17 @@ void tr_udpInit (tr_session *);
 void tr_udpUninit (tr_session *);
 void tr_udpSetSocketBuffers (tr_session *);
 
+/* call this when the session's udpSocketCount changes */
+void tr_udpSetSocketCount (tr_session *);
+
+/* queue a datagram to be sent on `fd' along with the others
+   that go out in this pass of the event loop.  Returns `buflen' if
+   it was queued or sent, or -1 with errno set if sending it right
+   away failed.  Queued datagrams that fail are logged when they're
+   flushed. */
+int tr_udpSendTo (tr_session *, int fd, const void * buf, size_t buflen,
+                  const struct sockaddr * to, socklen_t tolen);
+
 bool tau_handle_message (tr_session * session,
                          const uint8_t  * msg, size_t msglen);
 
@@ -33,6 +33,7 @@ THE SOFTWARE.
 #include "session.h"
 #include "crypto.h" /* tr_cryptoWeakRandInt () */
 #include "peer-mgr.h"
+#include "tr-udp.h"
 #include "tr-utp.h"
 #include "utils.h"
 
@@ -131,9 +132,9 @@ tr_utpSendTo (void *closure, const unsigned char *buf, size_t buflen,
     tr_session *ss = closure;
 
     if (to->sa_family == AF_INET && ss->udp_socket)
-        sendto (ss->udp_socket, buf, buflen, 0, to, tolen);
+        tr_udpSendTo (ss, ss->udp_socket, buf, buflen, to, tolen);
     else if (to->sa_family == AF_INET6 && ss->udp_socket)
-        sendto (ss->udp6_socket, buf, buflen, 0, to, tolen);
+        tr_udpSendTo (ss, ss->udp6_socket, buf, buflen, to, tolen);
 }
 
 static void
@@ -109,6 +109,7 @@ typedef struct tr_ctor tr_ctor;
 typedef struct tr_info tr_info;
 typedef struct tr_torrent tr_torrent;
 typedef struct tr_session tr_session;
+typedef struct tr_bandwidth_group tr_bandwidth_group;
 
 struct tr_variant;
 
@@ -562,6 +563,103 @@ void  tr_sessionSetLPDEnabled (tr_session * session, bool enabled);
 void  tr_sessionSetCacheLimit_MB (tr_session * session, int mb);
 int   tr_sessionGetCacheLimit_MB (const tr_session * session);
 
+/**
+ * @brief Set the size of the read cache, which keeps recently-read blocks
+ *        in memory so that popular pieces can be uploaded without going
+ *        back to the disk. It's separate from the write cache above.
+ */
+void  tr_sessionSetReadCacheLimit_MB (tr_session * session, int mb);
+int   tr_sessionGetReadCacheLimit_MB (const tr_session * session);
+
+/** @brief Get how many block reads were served by the read cache,
+           and how many had to go to the disk */
+void  tr_sessionGetReadCacheStats (const tr_session  * session,
+                                   uint64_t          * setme_hits,
+                                   uint64_t          * setme_misses);
+
+/**
+ * @brief Set how many threads may hash pieces when verifying a torrent.
+ *
+ * Pieces are hashed in parallel but their results are still
+ * handed to the torrent in piece order.
+ */
+void  tr_sessionSetVerifyThreads (tr_session * session, int threadCount);
+int   tr_sessionGetVerifyThreads (const tr_session * session);
+
+/**
+ * @brief Set how many threads write the cache to disk and read the
+ *        blocks that are uploaded to peers.
+ *
+ * Zero does all of the disk I/O in the libevent thread.
+ */
+void  tr_sessionSetDiskIoThreads (tr_session * session, int threadCount);
+int   tr_sessionGetDiskIoThreads (const tr_session * session);
+
+/**
+ * @brief Set how many UDP sockets to open on the peer port.
+ *
+ * With more than one, they share the port with SO_REUSEPORT and each
+ * is read by a thread of its own. The uTP, DHT and UDP tracker code
+ * still runs in the libevent thread. Where SO_REUSEPORT isn't
+ * supported, one socket is used. Values are clamped to [1..32].
+ */
+void  tr_sessionSetUDPSocketCount (tr_session * session, int count);
+int   tr_sessionGetUDPSocketCount (const tr_session * session);
+
+/**
+ * @brief Set how many threads do the socket reads and writes
+ *        for TCP peer connections.
+ *
+ * Each thread runs an event loop of its own, and new connections
+ * go to the one with the fewest. The peer protocol still runs in
+ * the libevent thread. Zero does all of the peer I/O there.
+ */
+void  tr_sessionSetPeerIoThreads (tr_session * session, int threadCount);
+int   tr_sessionGetPeerIoThreads (const tr_session * session);
+
+/**
+ * @brief Set how many torrents may be verified at the same time.
+ *
+ * Torrents whose data lives on the same device are still verified
+ * one at a time so that they don't make the disk seek back and forth.
+ */
+void  tr_sessionSetVerifyQueueSize (tr_session * session, int n);
+int   tr_sessionGetVerifyQueueSize (const tr_session * session);
+
+/**
+ * @brief Set whether verifying a torrent skips unchanged files.
+ *
+ * When enabled, pieces whose files have the same size, mtime, and
+ * inode as they did the last time the torrent finished verifying
+ * keep their old state instead of being read and hashed again.
+ */
+void  tr_sessionSetFastVerifyEnabled (tr_session * session, bool enabled);
+bool  tr_sessionIsFastVerifyEnabled (const tr_session * session);
+
+/**
+ * @brief Set whether blocks uploaded to unencrypted peers are read
+ *        from memory-mapped files instead of being copied.
+ *
+ * Not available on every platform; when mapping fails, the block
+ * is read with pread () as usual.
+ *
+ * Only enable this if nothing else truncates the torrent's files while
+ * it's seeding. A file that shrinks after it's been checked is left to
+ * pread (), but one that shrinks while a mapped block is still waiting
+ * to be sent makes the write raise SIGBUS, which kills the process.
+ */
+void  tr_sessionSetMmapEnabled (tr_session * session, bool enabled);
+bool  tr_sessionIsMmapEnabled (const tr_session * session);
+
+/**
+ * @brief Set whether blocks uploaded to unencrypted TCP peers are
+ *        written to the socket straight from the file with sendfile ().
+ *
+ * Each block that's waiting to be sent holds its own file descriptor.
+ */
+void  tr_sessionSetSendfileEnabled (tr_session * session, bool enabled);
+bool  tr_sessionIsSendfileEnabled (const tr_session * session);
+
 tr_encryption_mode tr_sessionGetEncryption (tr_session * session);
 void               tr_sessionSetEncryption (tr_session * session,
                                             tr_encryption_mode    mode);
@@ -620,6 +718,80 @@ unsigned int tr_sessionGetSpeedLimit_KBps (const tr_session *, tr_direction);
 void  tr_sessionLimitSpeed       (tr_session *, tr_direction, bool);
 bool  tr_sessionIsSpeedLimited   (const tr_session *, tr_direction);
 
+/**
+ * @brief Set how often the speed limits' token buckets are topped up
+ *        and bandwidth is handed out to the peers.
+ *
+ * Shorter ticks give smoother output on fast links, at the cost of
+ * waking up more often. Values are clamped to [10..1000].
+ */
+void  tr_sessionSetBandwidthTickMsec (tr_session * session, int msec);
+int   tr_sessionGetBandwidthTickMsec (const tr_session * session);
+
+/**
+ * @brief Set the time constant of the moving averages used for speeds.
+ *
+ * The peers', torrents' and session's speeds are exponentially-weighted
+ * moving averages. A longer time constant gives steadier speeds that are
+ * slower to follow changes. Values are clamped to [100..10000].
+ */
+void  tr_sessionSetSpeedTimeConstantMsec (tr_session * session, int msec);
+int   tr_sessionGetSpeedTimeConstantMsec (const tr_session * session);
+
+/**
+ * @brief Let each torrent's number of upload slots float.
+ *
+ * When enabled, a torrent whose upload is saturated by its own limit or
+ * one above it closes a slot only if the slowest unchoked peer gets less
+ * than half its share of the torrent's upload. A torrent with upload to
+ * spare opens a slot when every slot is busy and the slowest peer is
+ * still getting a fair amount, and otherwise drifts back to
+ * upload-slots-per-torrent. Just under saturation, the count holds.
+ */
+void  tr_sessionSetUploadSlotsAdaptive (tr_session * session, bool adaptive);
+bool  tr_sessionIsUploadSlotsAdaptive  (const tr_session * session);
+
+/** @brief Get the running torrents' total upload slots, and how many
+           were given to interested peers at their last rechoke */
+void  tr_sessionGetUploadSlotStats (tr_session * session,
+                                    int        * setme_slots,
+                                    int        * setme_used);
+
+
+/***
+****  Bandwidth groups
+****
+****  A named group has its own speed limits, which are shared by
+****  every torrent in it. Groups live under the session's limits.
+***/
+
+/** @brief Returns the group with this name, or NULL if there isn't one */
+tr_bandwidth_group * tr_sessionFindBandwidthGroup (tr_session * session,
+                                                   const char * name);
+
+/** @brief Returns the group with this name, creating it if needed */
+tr_bandwidth_group * tr_sessionGetBandwidthGroup (tr_session * session,
+                                                  const char * name);
+
+/** @brief Returns the session's groups, sorted by name.
+    The array must be tr_free ()d by the caller. */
+tr_bandwidth_group ** tr_sessionGetBandwidthGroups (tr_session * session,
+                                                    int        * setme_count);
+
+const char * tr_bandwidthGroupGetName (const tr_bandwidth_group *);
+
+void         tr_bandwidthGroupSetSpeedLimit_KBps (tr_bandwidth_group *, tr_direction, unsigned int KBps);
+unsigned int tr_bandwidthGroupGetSpeedLimit_KBps (const tr_bandwidth_group *, tr_direction);
+
+void  tr_bandwidthGroupLimitSpeed     (tr_bandwidth_group *, tr_direction, bool);
+bool  tr_bandwidthGroupIsSpeedLimited (const tr_bandwidth_group *, tr_direction);
+
+void  tr_bandwidthGroupUseSessionLimits  (tr_bandwidth_group *, bool);
+bool  tr_bandwidthGroupUsesSessionLimits (const tr_bandwidth_group *);
+
+/** @brief Returns the group's combined piece data speed */
+unsigned int tr_bandwidthGroupGetPieceSpeed_Bps (const tr_bandwidth_group *, tr_direction);
+
 
 /***
 ****  Alternative speed limits that are used during scheduled times
@@ -1252,6 +1424,17 @@ bool         tr_torrentUsesSpeedLimit     (const tr_torrent *, tr_direction);
 void         tr_torrentUseSessionLimits   (tr_torrent *, bool);
 bool         tr_torrentUsesSessionLimits  (const tr_torrent *);
 
+/**
+ * @brief Move a torrent into the named bandwidth group, creating the group
+ *        if needed. A NULL or empty name takes it out of its group.
+ *
+ * A torrent that doesn't honor the session limits ignores its group's, too.
+ */
+void         tr_torrentSetBandwidthGroup  (tr_torrent *, const char * name);
+
+/** @return the torrent's bandwidth group name, or NULL if it has none */
+const char * tr_torrentGetBandwidthGroup  (const tr_torrent *);
+
 
 /****
 *****  Ratio Limits
@@ -1322,6 +1505,32 @@ void          tr_torrentSetPeerLimit (tr_torrent * tor, uint16_t peerLimit);
 
 uint16_t      tr_torrentGetPeerLimit (const tr_torrent * tor);
 
+/****
+*****  Sequential Downloads and Streaming
+****/
+
+/** @brief Download the torrent's pieces in order instead of rarest first */
+void          tr_torrentSetSequentialDownload (tr_torrent * tor, bool sequential);
+
+bool          tr_torrentGetSequentialDownload (const tr_torrent * tor);
+
+/**
+ * @brief Stream the `windowBytes' bytes that follow the streaming position.
+ *
+ * Pieces in the window are requested before any others, nearest first,
+ * and each is given a deadline. Pieces that miss their deadlines are
+ * requested from more than one peer, as in the endgame.
+ * A window of 0 turns streaming off.
+ */
+void          tr_torrentSetStreamingWindow (tr_torrent * tor, uint64_t windowBytes);
+
+uint64_t      tr_torrentGetStreamingWindow (const tr_torrent * tor);
+
+/** @brief Move the streaming window, e.g. to follow a media player's reads */
+void          tr_torrentSetStreamingPosition (tr_torrent * tor, uint64_t position);
+
+uint64_t      tr_torrentGetStreamingPosition (const tr_torrent * tor);
+
 /****
 *****  File Priorities
 ****/
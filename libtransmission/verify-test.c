@@ -0,0 +1,418 @@
+#include <assert.h>
+#include <stdio.h> /* fopen() */
+#include <string.h> /* memcmp() */
+#include <time.h> /* time() */
+
+#include <sys/types.h> /* stat(), utime() */
+#include <sys/stat.h> /* stat() */
+#include <unistd.h> /* sync() */
+#include <utime.h> /* utime() */
+
+#include "transmission.h"
+#include "platform.h" /* tr_lock */
+#include "resume.h"
+#include "session.h" /* tr_sessionLock () */
+#include "torrent.h"
+#include "utils.h" /* tr_strdup_printf () */
+#include "variant.h"
+#include "verify.h" /* tr_verifySetDeviceFunc () */
+
+#include "libtransmission-test.h"
+
+/***
+****
+***/
+
+static int
+test_verify_with_settings (int threadCount, int queueSize, bool complete)
+{
+  tr_piece_index_t i;
+  tr_session * session;
+  tr_torrent * tor;
+  tr_variant settings;
+
+  tr_variantInitDict (&settings, 2);
+  tr_variantDictAddInt (&settings, TR_KEY_verify_threads, threadCount);
+  tr_variantDictAddInt (&settings, TR_KEY_verify_queue_size, queueSize);
+  session = libttest_session_init (&settings);
+  check_int_eq (threadCount, tr_sessionGetVerifyThreads (session));
+  check_int_eq (queueSize, tr_sessionGetVerifyQueueSize (session));
+
+  /* populate the torrent's files, then verify them */
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, complete);
+
+  /* every piece should be checked, and only the first
+   * piece should be missing when the torrent is incomplete */
+  for (i=0; i<tor->info.pieceCount; ++i)
+    {
+      check (tor->info.pieces[i].timeChecked != 0);
+      check (tr_torrentPieceIsComplete (tor, i) == (complete || (i != 0)));
+    }
+
+  /* verify again to confirm it gets the same answer
+     when the pieces already have their completion set */
+  libttest_blockingTorrentVerify (tor);
+  for (i=0; i<tor->info.pieceCount; ++i)
+    check (tr_torrentPieceIsComplete (tor, i) == (complete || (i != 0)));
+
+  /* cleanup */
+  tr_torrentRemove (tor, true, NULL);
+  libttest_session_close (session);
+  tr_variantFree (&settings);
+  return 0;
+}
+
+static int
+test_single_thread (void)
+{
+  int ret;
+
+  if ((ret = test_verify_with_settings (1, 1, true)))
+    return ret;
+
+  return test_verify_with_settings (1, 1, false);
+}
+
+static int
+test_multiple_threads (void)
+{
+  int ret;
+
+  if ((ret = test_verify_with_settings (4, 1, true)))
+    return ret;
+
+  return test_verify_with_settings (4, 1, false);
+}
+
+static int
+test_more_threads_than_pieces (void)
+{
+  return test_verify_with_settings (64, 1, false);
+}
+
+#define QUEUE_TORRENT_COUNT 4
+#define QUEUE_PIECE_SIZE 32768
+#define QUEUE_PIECE_COUNT 8
+
+struct queue_data
+{
+  tr_lock * lock;
+  int doneCount;
+  int abortedCount;
+};
+
+static void
+onQueuedVerifyDone (tr_torrent * tor UNUSED, bool aborted, void * vdata)
+{
+  struct queue_data * data = vdata;
+
+  tr_lockLock (data->lock);
+  ++data->doneCount;
+  if (aborted)
+    ++data->abortedCount;
+  tr_lockUnlock (data->lock);
+}
+
+static int
+test_queue_several_torrents (void)
+{
+  int i;
+  int doneCount;
+  int mostActive = 0;
+  tr_session * session;
+  tr_variant settings;
+  tr_torrent * tors[QUEUE_TORRENT_COUNT];
+  struct queue_data data;
+  const int badTorrent = 2;
+  const int badPiece = 5;
+
+  tr_variantInitDict (&settings, 2);
+  tr_variantDictAddInt (&settings, TR_KEY_verify_threads, 2);
+  tr_variantDictAddInt (&settings, TR_KEY_verify_queue_size, QUEUE_TORRENT_COUNT);
+  session = libttest_session_init (&settings);
+
+  for (i=0; i<QUEUE_TORRENT_COUNT; ++i)
+    {
+      char name[32];
+      tr_snprintf (name, sizeof (name), "queued-%d", i);
+      tors[i] = libttest_fill_torrent_init (session, name, (uint8_t)('a' + i), QUEUE_PIECE_SIZE, QUEUE_PIECE_COUNT);
+      libttest_fill_torrent_populate (tors[i], (uint8_t)('a' + i), i == badTorrent ? badPiece : -1);
+    }
+  sync ();
+
+  /* queue them all at once... */
+  data.lock = tr_lockNew ();
+  data.doneCount = 0;
+  data.abortedCount = 0;
+  for (i=0; i<QUEUE_TORRENT_COUNT; ++i)
+    tr_torrentVerify (tors[i], onQueuedVerifyDone, &data);
+
+  /* ...and watch them go. they all live on the same device,
+   * so no two of them should be read at the same time */
+  do
+    {
+      int active = 0;
+
+      for (i=0; i<QUEUE_TORRENT_COUNT; ++i)
+        if (tors[i]->verifyState == TR_VERIFY_NOW)
+          ++active;
+      mostActive = MAX (mostActive, active);
+
+      tr_lockLock (data.lock);
+      doneCount = data.doneCount;
+      tr_lockUnlock (data.lock);
+
+      if (doneCount < QUEUE_TORRENT_COUNT)
+        tr_wait_msec (1);
+    }
+  while (doneCount < QUEUE_TORRENT_COUNT);
+
+  check_int_eq (QUEUE_TORRENT_COUNT, doneCount);
+  check_int_eq (0, data.abortedCount);
+  check (mostActive <= 1);
+
+  /* every torrent should be fully checked, and only the
+   * bad piece of the bad torrent should be missing */
+  for (i=0; i<QUEUE_TORRENT_COUNT; ++i)
+    {
+      tr_piece_index_t j;
+      const tr_torrent * tor = tors[i];
+
+      check_int_eq (TR_VERIFY_NONE, tor->verifyState);
+
+      for (j=0; j<tor->info.pieceCount; ++j)
+        {
+          const bool expected = (i != badTorrent) || ((int)j != badPiece);
+          check (tor->info.pieces[j].timeChecked != 0);
+          check (tr_torrentPieceIsComplete (tor, j) == expected);
+        }
+
+      check_int_eq (i == badTorrent ? QUEUE_PIECE_SIZE : 0,
+                    (int64_t)tr_torrentStat (tors[i])->leftUntilDone);
+    }
+
+  /* cleanup */
+  for (i=0; i<QUEUE_TORRENT_COUNT; ++i)
+    tr_torrentRemove (tors[i], true, NULL);
+  tr_lockFree (data.lock);
+  libttest_session_close (session);
+  tr_variantFree (&settings);
+  return 0;
+}
+
+/* pretend that each torrent's files live on a device of their own */
+static char *
+getTorrentIdAsDevice (const tr_torrent * tor)
+{
+  return tr_strdup_printf ("device-%d", tr_torrentId (tor));
+}
+
+struct overlap_data
+{
+  tr_lock * lock;
+  int inCallback;
+  int mostInCallback;
+  int doneCount;
+};
+
+/* tr_verifyAdd ()'s callback runs in the torrent's verify thread before
+ * the torrent leaves the active list, so two callbacks can only overlap
+ * if two torrents are being verified at once. Each one waits a while
+ * for the other to show up. */
+static void
+onOverlappingVerifyDone (tr_torrent * tor UNUSED, bool aborted UNUSED, void * vdata)
+{
+  struct overlap_data * data = vdata;
+  const time_t deadline = time (NULL) + 5;
+
+  tr_lockLock (data->lock);
+  ++data->inCallback;
+  data->mostInCallback = MAX (data->mostInCallback, data->inCallback);
+  while ((data->mostInCallback < 2) && (time (NULL) <= deadline))
+    {
+      tr_lockUnlock (data->lock);
+      tr_wait_msec (10);
+      tr_lockLock (data->lock);
+    }
+  --data->inCallback;
+  ++data->doneCount;
+  tr_lockUnlock (data->lock);
+}
+
+static int
+test_queue_torrents_on_different_devices (void)
+{
+  int i;
+  int doneCount;
+  tr_session * session;
+  tr_variant settings;
+  tr_torrent * tors[2];
+  struct overlap_data data;
+
+  tr_variantInitDict (&settings, 2);
+  tr_variantDictAddInt (&settings, TR_KEY_verify_threads, 1);
+  tr_variantDictAddInt (&settings, TR_KEY_verify_queue_size, 2);
+  session = libttest_session_init (&settings);
+  tr_verifySetDeviceFunc (getTorrentIdAsDevice);
+
+  for (i=0; i<2; ++i)
+    {
+      char name[32];
+      tr_snprintf (name, sizeof (name), "device-%d", i);
+      tors[i] = libttest_fill_torrent_init (session, name, (uint8_t)('a' + i), QUEUE_PIECE_SIZE, QUEUE_PIECE_COUNT);
+      libttest_fill_torrent_populate (tors[i], (uint8_t)('a' + i), -1);
+    }
+  sync ();
+
+  /* the torrents are on different devices, so
+   * they should be verified at the same time */
+  memset (&data, 0, sizeof (data));
+  data.lock = tr_lockNew ();
+  tr_sessionLock (session);
+  for (i=0; i<2; ++i)
+    tr_verifyAdd (tors[i], onOverlappingVerifyDone, &data);
+  tr_sessionUnlock (session);
+
+  do
+    {
+      tr_wait_msec (10);
+      tr_lockLock (data.lock);
+      doneCount = data.doneCount;
+      tr_lockUnlock (data.lock);
+    }
+  while (doneCount < 2);
+
+  check_int_eq (2, data.mostInCallback);
+  for (i=0; i<2; ++i)
+    check_int_eq (0, (int64_t)tr_torrentStat (tors[i])->leftUntilDone);
+
+  /* cleanup */
+  tr_verifySetDeviceFunc (NULL);
+  for (i=0; i<2; ++i)
+    tr_torrentRemove (tors[i], true, NULL);
+  tr_lockFree (data.lock);
+  libttest_session_close (session);
+  tr_variantFree (&settings);
+  return 0;
+}
+
+static void
+overwrite_first_byte (const char * path, int ch, time_t mtime)
+{
+  FILE * fp;
+  struct utimbuf ut;
+
+  fp = fopen (path, "rb+");
+  assert (fp != NULL);
+  fputc (ch, fp);
+  fclose (fp);
+
+  ut.actime = mtime;
+  ut.modtime = mtime;
+  utime (path, &ut);
+  sync ();
+}
+
+static int
+test_fast_verify (void)
+{
+  char * path;
+  struct stat sb;
+  tr_session * session;
+  tr_torrent * tor;
+  tr_ctor * ctor;
+  tr_variant settings;
+  tr_file_fingerprint * saved;
+
+  tr_variantInitDict (&settings, 1);
+  tr_variantDictAddBool (&settings, TR_KEY_fast_verify_enabled, true);
+  session = libttest_session_init (&settings);
+  check (tr_sessionIsFastVerifyEnabled (session));
+
+  /* the first verify has nothing to compare against, so it reads everything */
+  tor = libttest_zero_torrent_init (session);
+  check (tor->fingerprints == NULL);
+  libttest_zero_torrent_populate (tor, true);
+  check (tor->fingerprints != NULL);
+  check (tor->verifiedDate != 0);
+  check (tr_torrentPieceIsComplete (tor, 0));
+
+  /* backdate the first file. That's a change, so it's reread */
+  path = tr_torrentFindFile (tor, 0);
+  check (path != NULL);
+  check (stat (path, &sb) == 0);
+  sb.st_mtime -= 10;
+  overwrite_first_byte (path, '\0', sb.st_mtime);
+  libttest_blockingTorrentVerify (tor);
+  check_int_eq (sb.st_mtime, tor->fingerprints[0].mtime);
+  check (tor->verifiedDate > sb.st_mtime);
+
+  /* corrupt the first piece, but keep its file's fingerprint the same.
+     fast verify trusts the file and doesn't notice */
+  overwrite_first_byte (path, '\1', sb.st_mtime);
+  libttest_blockingTorrentVerify (tor);
+  check (tr_torrentPieceIsComplete (tor, 0));
+  check (tor->info.pieces[0].timeChecked != 0);
+
+  /* ...until a piece check fails. Then the fingerprints can't be
+     trusted anymore, and the next verify rereads everything */
+  tr_sessionLock (session);
+  check (!tr_torrentCheckPiece (tor, 0));
+  tr_sessionUnlock (session);
+  check (tor->fingerprints == NULL);
+  overwrite_first_byte (path, '\0', sb.st_mtime);
+  libttest_blockingTorrentVerify (tor);
+  check (tr_torrentPieceIsComplete (tor, 0));
+  check (tor->fingerprints != NULL);
+
+  /* changing the file's mtime makes fast verify reread it */
+  overwrite_first_byte (path, '\1', sb.st_mtime + 1);
+  libttest_blockingTorrentVerify (tor);
+  check (!tr_torrentPieceIsComplete (tor, 0));
+  check (tr_torrentPieceIsComplete (tor, 1));
+  check_int_eq (sb.st_mtime + 1, tor->fingerprints[0].mtime);
+
+  /* and so does a file modified in the same second as the last verify,
+     since a change then might not have moved its mtime */
+  overwrite_first_byte (path, '\0', tor->verifiedDate);
+  tor->fingerprints[0].mtime = tor->verifiedDate;
+  libttest_blockingTorrentVerify (tor);
+  check (tr_torrentPieceIsComplete (tor, 0));
+
+  /* the fingerprints should survive a trip through the .resume file */
+  saved = tr_memdup (tor->fingerprints, sizeof (tr_file_fingerprint) * tor->info.fileCount);
+  tr_torrentSaveResume (tor);
+  tr_free (tor->fingerprints);
+  tor->fingerprints = NULL;
+  ctor = tr_ctorNew (session);
+  tr_torrentLoadResume (tor, TR_FR_PROGRESS, ctor);
+  check (tor->fingerprints != NULL);
+  check (!memcmp (saved, tor->fingerprints, sizeof (tr_file_fingerprint) * tor->info.fileCount));
+
+  /* cleanup */
+  tr_ctorFree (ctor);
+  tr_free (saved);
+  tr_free (path);
+  tr_torrentRemove (tor, true, NULL);
+  libttest_session_close (session);
+  tr_variantFree (&settings);
+  return 0;
+}
+
+/***
+****
+***/
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_single_thread,
+                             test_multiple_threads,
+                             test_more_threads_than_pieces,
+                             test_queue_several_torrents,
+                             test_queue_torrents_on_different_devices,
+                             test_fast_verify };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
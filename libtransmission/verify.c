@@ -18,14 +18,15 @@
  #include <fcntl.h> /* posix_fadvise () */
 #endif
 
-#include <openssl/sha.h>
-
 #include "transmission.h"
 #include "completion.h"
+#include "crypto-utils.h" /* tr_sha1_init (), tr_sha1_many () */
 #include "fdlimit.h"
+#include "inout.h" /* tr_ioFindFileLocation () */
 #include "list.h"
 #include "log.h"
-#include "platform.h" /* tr_lock () */
+#include "platform-quota.h" /* tr_device_info_create () */
+#include "platform.h" /* tr_lock, tr_cond */
 #include "torrent.h"
 #include "utils.h" /* tr_valloc (), tr_free () */
 #include "verify.h"
@@ -36,127 +37,459 @@
 
 enum
 {
-  MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY = 100
+  MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY = 100,
+
+  /* when tr_sha1_many () has lanes, each worker reads up to this many
+   * pieces into memory and hashes them together... */
+  VERIFY_MAX_LANES = 16,
+
+  /* ...as long as they fit in this much memory */
+  VERIFY_MAX_BATCH_SIZE = 8 * 1024 * 1024
+};
+
+enum
+{
+  PIECE_UNCHECKED,
+  PIECE_GOOD,
+  PIECE_BAD,
+
+  /* the piece's files haven't changed since the last verify,
+   * so it keeps whatever state it had before */
+  PIECE_UNCHANGED
 };
 
+/* state shared between the verify thread and its helper threads
+ * while a single torrent is being checked */
+struct verify_job
+{
+  tr_torrent * tor;
+  bool * stopFlag;
+  tr_lock * lock;
+
+  /* signalled when a helper stores results or exits */
+  tr_cond * cond;
+
+  /* the next piece that hasn't been claimed by a worker yet */
+  tr_piece_index_t nextPiece;
+
+  /* the next piece whose result is to be reported to the torrent */
+  tr_piece_index_t nextReport;
+
+  /* how many helper threads haven't exited yet */
+  int helperCount;
+
+  /* one PIECE_* value per piece */
+  uint8_t * results;
+};
+
+/* per-thread scratch space for hashing pieces */
+struct verify_worker
+{
+  struct verify_job * job;
+  int fd;
+  tr_file_index_t fileIndex;
+  uint8_t * buffer;
+  size_t buflen;
+  time_t lastSleptAt;
+
+  /* how many pieces to claim and hash at once */
+  size_t lanes;
+
+  /* room for `lanes' whole pieces, or NULL if lanes is 1 */
+  uint8_t * batch;
+};
+
+static void
+verifyWorkerInit (struct verify_worker * w, struct verify_job * job)
+{
+  w->job = job;
+  w->fd = -1;
+  w->fileIndex = job->tor->info.fileCount;
+  w->buflen = 1024 * 128; /* 128 KiB buffer */
+  w->buffer = tr_valloc (w->buflen);
+  w->lastSleptAt = 0;
+
+  w->lanes = tr_sha1_lanes ();
+  w->lanes = MIN (w->lanes, VERIFY_MAX_LANES);
+  w->lanes = MIN (w->lanes, VERIFY_MAX_BATCH_SIZE / job->tor->info.pieceSize);
+  w->lanes = MAX (w->lanes, 1);
+  w->batch = w->lanes > 1 ? tr_valloc (w->lanes * job->tor->info.pieceSize) : NULL;
+}
+
+static void
+verifyWorkerDestruct (struct verify_worker * w)
+{
+  if (w->fd >= 0)
+    tr_close_file (w->fd);
+
+  free (w->batch);
+  free (w->buffer);
+}
+
+/* Read `pieceIndex' from disk. If `dest' is non-NULL the whole piece
+ * is copied there; otherwise it's read through the worker's buffer a
+ * chunk at a time. Either way, what's read is added to `sha' if it's
+ * non-NULL. Returns false if any part of the piece couldn't be read. */
 static bool
-verifyTorrent (tr_torrent * tor, bool * stopFlag)
+verifyReadPiece (struct verify_worker * w,
+                 tr_piece_index_t       pieceIndex,
+                 uint8_t              * dest,
+                 tr_sha1_ctx_t          sha)
 {
-  time_t end;
-  SHA_CTX sha;
-  int fd = -1;
-  int64_t filePos = 0;
-  bool changed = 0;
-  bool hadPiece = 0;
-  time_t lastSleptAt = 0;
-  uint32_t piecePos = 0;
-  tr_file_index_t fileIndex = 0;
-  tr_file_index_t prevFileIndex = !fileIndex;
-  tr_piece_index_t pieceIndex = 0;
-  const time_t begin = tr_time ();
-  const size_t buflen = 1024 * 128; /* 128 KiB buffer */
-  uint8_t * buffer = tr_valloc (buflen);
+  uint64_t filePos;
+  tr_file_index_t fileIndex;
+  bool complete = true;
+  tr_torrent * tor = w->job->tor;
+  uint32_t leftInPiece = tr_torPieceCountBytes (tor, pieceIndex);
 
-  SHA1_Init (&sha);
+  tr_ioFindFileLocation (tor, pieceIndex, 0, &fileIndex, &filePos);
 
-  tr_logAddTorDbg (tor, "%s", "verifying torrent...");
-  tr_torrentSetChecked (tor, 0);
-  while (!*stopFlag && (pieceIndex < tor->info.pieceCount))
+  while (leftInPiece > 0 && !*w->job->stopFlag)
     {
-      uint32_t leftInPiece;
       uint32_t bytesThisPass;
-      uint64_t leftInFile;
       const tr_file * file = &tor->info.files[fileIndex];
+      const uint64_t leftInFile = file->length - filePos;
 
-      /* if we're starting a new piece... */
-      if (piecePos == 0)
-        hadPiece = tr_torrentPieceIsComplete (tor, pieceIndex);
+      /* skip past the end of this file, and any empty files after it */
+      if (leftInFile == 0)
+        {
+          ++fileIndex;
+          filePos = 0;
+          continue;
+        }
 
       /* if we're starting a new file... */
-      if (!filePos && (fd<0) && (fileIndex!=prevFileIndex))
+      if (fileIndex != w->fileIndex)
         {
-          char * filename = tr_torrentFindFile (tor, fileIndex);
-          fd = filename == NULL ? -1 : tr_open_file_for_scanning (filename);
+          char * filename;
+
+          if (w->fd >= 0)
+            tr_close_file (w->fd);
+
+          filename = tr_torrentFindFile (tor, fileIndex);
+          w->fd = filename == NULL ? -1 : tr_open_file_for_scanning (filename);
+          w->fileIndex = fileIndex;
           tr_free (filename);
-          prevFileIndex = fileIndex;
         }
 
       /* figure out how much we can read this pass */
-      leftInPiece = tr_torPieceCountBytes (tor, pieceIndex) - piecePos;
-      leftInFile = file->length - filePos;
       bytesThisPass = MIN (leftInFile, leftInPiece);
-      bytesThisPass = MIN (bytesThisPass, buflen);
+      if (dest == NULL)
+        bytesThisPass = MIN (bytesThisPass, w->buflen);
 
       /* read a bit */
-      if (fd >= 0)
+      if (w->fd >= 0)
         {
-          const ssize_t numRead = tr_pread (fd, buffer, bytesThisPass, filePos);
+          uint8_t * buf = dest != NULL ? dest : w->buffer;
+          const ssize_t numRead = tr_pread (w->fd, buf, bytesThisPass, filePos);
           if (numRead > 0)
             {
               bytesThisPass = (uint32_t)numRead;
-              SHA1_Update (&sha, buffer, bytesThisPass);
+              if (sha != NULL)
+                tr_sha1_update (sha, buf, bytesThisPass);
 #if defined HAVE_POSIX_FADVISE && defined POSIX_FADV_DONTNEED
-              posix_fadvise (fd, filePos, bytesThisPass, POSIX_FADV_DONTNEED);
+              posix_fadvise (w->fd, filePos, bytesThisPass, POSIX_FADV_DONTNEED);
 #endif
             }
+          else
+            {
+              complete = false;
+            }
+        }
+      else
+        {
+          complete = false;
         }
 
       /* move our offsets */
       leftInPiece -= bytesThisPass;
-      leftInFile -= bytesThisPass;
-      piecePos += bytesThisPass;
       filePos += bytesThisPass;
+      if (dest != NULL)
+        dest += bytesThisPass;
+    }
+
+  return complete && leftInPiece == 0;
+}
 
-      /* if we're finishing a piece... */
-      if (leftInPiece == 0)
+/* Check the `n' pieces in `pieces', setting good[i] for each one.
+ * If the worker has a batch buffer, they're all read into it and
+ * hashed together; otherwise `n' is 1 and the piece is streamed. */
+static void
+verifyPieces (struct verify_worker   * w,
+              const tr_piece_index_t * pieces,
+              size_t                   n,
+              bool                   * good)
+{
+  size_t i;
+  bool complete[VERIFY_MAX_LANES];
+  const void * data[VERIFY_MAX_LANES];
+  size_t lengths[VERIFY_MAX_LANES];
+  uint8_t hashes[VERIFY_MAX_LANES * SHA_DIGEST_LENGTH];
+  tr_torrent * tor = w->job->tor;
+
+  assert (n <= w->lanes);
+
+  if (w->batch == NULL)
+    {
+      tr_sha1_ctx_t sha = tr_sha1_init ();
+      complete[0] = verifyReadPiece (w, pieces[0], NULL, sha);
+      tr_sha1_final (sha, hashes);
+    }
+  else
+    {
+      for (i=0; i<n; ++i)
         {
-          time_t now;
-          bool hasPiece;
-          uint8_t hash[SHA_DIGEST_LENGTH];
+          uint8_t * piece = w->batch + i * tor->info.pieceSize;
+          complete[i] = verifyReadPiece (w, pieces[i], piece, NULL);
+          data[i] = piece;
+          lengths[i] = tr_torPieceCountBytes (tor, pieces[i]);
+        }
 
-          SHA1_Final (hash, &sha);
-          hasPiece = !memcmp (hash, tor->info.pieces[pieceIndex].hash, SHA_DIGEST_LENGTH);
+      tr_sha1_many (n, data, lengths, hashes);
+    }
 
-          if (hasPiece || hadPiece)
-            {
-              tr_torrentSetHasPiece (tor, pieceIndex, hasPiece);
-              changed |= hasPiece != hadPiece;
-            }
+  for (i=0; i<n; ++i)
+    good[i] = complete[i] && !memcmp (hashes + i * SHA_DIGEST_LENGTH,
+                                      tor->info.pieces[pieces[i]].hash,
+                                      SHA_DIGEST_LENGTH);
+}
 
-          tr_torrentSetPieceChecked (tor, pieceIndex);
-          now = tr_time ();
-          tor->anyDate = now;
+/* true if the next piece to be reported has been checked.
+ * The caller must hold job->lock. */
+static bool
+verifyHasResultToReport (const struct verify_job * job)
+{
+  return (job->nextReport < job->tor->info.pieceCount)
+      && (job->results[job->nextReport] != PIECE_UNCHECKED);
+}
 
-          /* sleeping even just a few msec per second goes a long
-           * way towards reducing IO load... */
-          if (lastSleptAt != now)
-            {
-              lastSleptAt = now;
-              tr_wait_msec (MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY);
-            }
+/* Hand the finished pieces to the torrent in piece order.
+ * This is only called from the verify thread, so the torrent
+ * never sees results from more than one thread. */
+static bool
+verifyReportResults (struct verify_job * job)
+{
+  bool changed = false;
+  tr_torrent * tor = job->tor;
+
+  for (;;)
+    {
+      int result;
+      bool hadPiece;
+      bool hasPiece;
+      const tr_piece_index_t pieceIndex = job->nextReport;
 
-          SHA1_Init (&sha);
-          pieceIndex++;
-          piecePos = 0;
+      if (pieceIndex == tor->info.pieceCount)
+        break;
+
+      tr_lockLock (job->lock);
+      result = job->results[pieceIndex];
+      tr_lockUnlock (job->lock);
+
+      if (result == PIECE_UNCHECKED)
+        break;
+
+      hadPiece = tr_torrentPieceIsComplete (tor, pieceIndex);
+      hasPiece = result == PIECE_UNCHANGED ? hadPiece : result == PIECE_GOOD;
+
+      if (hasPiece || hadPiece)
+        {
+          tr_torrentSetHasPiece (tor, pieceIndex, hasPiece);
+          changed |= hasPiece != hadPiece;
         }
 
-      /* if we're finishing a file... */
-      if (leftInFile == 0)
+      tr_torrentSetPieceChecked (tor, pieceIndex);
+      tor->anyDate = tr_time ();
+      ++job->nextReport;
+    }
+
+  return changed;
+}
+
+/* Claim up to `w->lanes' pieces at a time and hash them until none are left.
+ * If `changed' is non-NULL, this is the verify thread and it
+ * also reports the finished pieces to the torrent as it goes. */
+static void
+verifyWorkerRun (struct verify_worker * w, bool * changed)
+{
+  struct verify_job * job = w->job;
+
+  for (;;)
+    {
+      size_t i;
+      size_t n;
+      time_t now;
+      bool good[VERIFY_MAX_LANES];
+      tr_piece_index_t pieces[VERIFY_MAX_LANES];
+
+      tr_lockLock (job->lock);
+      for (n=0; n<w->lanes && !*job->stopFlag; )
         {
-          if (fd >= 0)
-            {
-              tr_close_file (fd);
-              fd = -1;
-            }
-          fileIndex++;
-          filePos = 0;
+          while ((job->nextPiece < job->tor->info.pieceCount)
+              && (job->results[job->nextPiece] != PIECE_UNCHECKED))
+            ++job->nextPiece;
+          if (job->nextPiece == job->tor->info.pieceCount)
+            break;
+          pieces[n++] = job->nextPiece++;
+        }
+      tr_lockUnlock (job->lock);
+
+      if (n == 0)
+        break;
+
+      verifyPieces (w, pieces, n, good);
+
+      tr_lockLock (job->lock);
+      for (i=0; i<n; ++i)
+        job->results[pieces[i]] = good[i] ? PIECE_GOOD : PIECE_BAD;
+      tr_condSignal (job->cond);
+      tr_lockUnlock (job->lock);
+
+      if (changed != NULL)
+        *changed |= verifyReportResults (job);
+
+      /* sleeping even just a few msec per second goes a long
+       * way towards reducing IO load... */
+      now = tr_time ();
+      if (w->lastSleptAt != now)
+        {
+          w->lastSleptAt = now;
+          tr_wait_msec (MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY);
         }
     }
+}
+
+static void
+verifyHelperThreadFunc (void * vjob)
+{
+  struct verify_worker w;
+  struct verify_job * job = vjob;
+
+  verifyWorkerInit (&w, job);
+  verifyWorkerRun (&w, NULL);
+  verifyWorkerDestruct (&w);
+
+  tr_lockLock (job->lock);
+  --job->helperCount;
+  tr_condSignal (job->cond);
+  tr_lockUnlock (job->lock);
+}
+
+/* In fast verify mode, pieces whose files all look the same as
+ * they did when the torrent was last verified aren't reread.
+ * A file modified in the same second as that verify, or later, could
+ * have changed without changing its mtime, so it's reread too.
+ * Returns the number of pieces that don't need to be hashed. */
+static tr_piece_index_t
+verifySkipUnchangedPieces (struct verify_job * job)
+{
+  tr_file_index_t fi;
+  tr_piece_index_t pi;
+  tr_piece_index_t skipped = 0;
+  tr_torrent * tor = job->tor;
+
+  /* a failed piece check can drop the fingerprints at any time */
+  tr_sessionLock (tor->session);
+
+  if (tor->fingerprints == NULL)
+    {
+      tr_sessionUnlock (tor->session);
+      return 0;
+    }
+
+  for (pi=0; pi<tor->info.pieceCount; ++pi)
+    job->results[pi] = PIECE_UNCHANGED;
+
+  for (fi=0; fi<tor->info.fileCount; ++fi)
+    {
+      tr_file_fingerprint fp;
+      const tr_file * file = &tor->info.files[fi];
+
+      if (file->length == 0)
+        continue;
+
+      tr_torrentGetFileFingerprint (tor, fi, &fp);
+
+      if (!tr_torrentFileFingerprintsEqual (&fp, &tor->fingerprints[fi])
+          || (fp.mtime >= tor->verifiedDate))
+        for (pi=file->firstPiece; pi<=file->lastPiece; ++pi)
+          job->results[pi] = PIECE_UNCHECKED;
+    }
+
+  tr_sessionUnlock (tor->session);
+
+  for (pi=0; pi<tor->info.pieceCount; ++pi)
+    if (job->results[pi] == PIECE_UNCHANGED)
+      ++skipped;
+
+  return skipped;
+}
+
+static bool
+verifyTorrent (tr_torrent * tor, bool * stopFlag)
+{
+  int i;
+  time_t end;
+  int helperCount;
+  bool changed = false;
+  struct verify_job job;
+  struct verify_worker w;
+  const time_t begin = tr_time ();
+
+  job.tor = tor;
+  job.stopFlag = stopFlag;
+  job.lock = tr_lockNew ();
+  job.cond = tr_condNew ();
+  job.nextPiece = 0;
+  job.nextReport = 0;
+  job.results = tr_new0 (uint8_t, tor->info.pieceCount);
+
+  /* the verify thread does its share of the hashing too,
+   * so it only needs to start threadCount-1 helpers */
+  helperCount = tr_sessionGetVerifyThreads (tor->session) - 1;
+  helperCount = MIN (helperCount, (int)tor->info.pieceCount - 1);
+  helperCount = MAX (helperCount, 0);
+  job.helperCount = helperCount;
+
+  tr_logAddTorDbg (tor, "verifying torrent with %d threads...", helperCount + 1);
+  tr_torrentSetChecked (tor, 0);
+
+  if (tr_sessionIsFastVerifyEnabled (tor->session))
+    {
+      const tr_piece_index_t skipped = verifySkipUnchangedPieces (&job);
+      tr_logAddTorDbg (tor, "fast verify: %"TR_PRIuSIZE" of %"TR_PRIuSIZE" pieces are unchanged",
+                       (size_t)skipped, (size_t)tor->info.pieceCount);
+    }
+
+  for (i=0; i<helperCount; ++i)
+    tr_threadNew (verifyHelperThreadFunc, &job);
+
+  /* hash our share of the pieces, reporting the results as we go */
+  verifyWorkerInit (&w, &job);
+  verifyWorkerRun (&w, &changed);
+  verifyWorkerDestruct (&w);
+
+  /* wait for the helpers to finish; they reference the torrent */
+  for (;;)
+    {
+      bool done;
+
+      tr_lockLock (job.lock);
+      while ((job.helperCount > 0) && !verifyHasResultToReport (&job))
+        tr_condWait (job.cond, job.lock);
+      done = job.helperCount == 0;
+      tr_lockUnlock (job.lock);
+
+      changed |= verifyReportResults (&job);
+
+      if (done)
+        break;
+    }
 
   /* cleanup */
-  if (fd >= 0)
-    tr_close_file (fd);
-  free (buffer);
+  tr_free (job.results);
+  tr_condFree (job.cond);
+  tr_lockFree (job.lock);
 
   /* stopwatch */
   end = tr_time ();
@@ -177,12 +510,32 @@ struct verify_node
   tr_verify_done_func   callback_func;
   void                * callback_data;
   uint64_t              current_size;
+
+  /* the device holding the torrent's data, or NULL if unknown */
+  char                * device;
+
+  /* set to true to make the node's verify thread stop early */
+  bool                  stopFlag;
 };
 
-static struct verify_node currentNode;
+/* torrents waiting to be verified */
 static tr_list * verifyList = NULL;
-static tr_thread * verifyThread = NULL;
-static bool stopCurrent = false;
+
+/* torrents being verified now, each in its own thread */
+static tr_list * activeList = NULL;
+
+static char *
+getTorrentDevice (const tr_torrent * tor)
+{
+  char * device;
+  struct tr_device_info * info = tr_device_info_create (tor->currentDir);
+
+  device = tr_strdup (info->device);
+  tr_device_info_free (info);
+  return device;
+}
+
+static tr_verify_device_func deviceFunc = getTorrentDevice;
 
 static tr_lock*
 getVerifyLock (void)
@@ -196,43 +549,81 @@ getVerifyLock (void)
 }
 
 static void
-verifyThreadFunc (void * unused UNUSED)
+verifyNodeFree (void * vnode)
 {
-  for (;;)
+  struct verify_node * node = vnode;
+
+  tr_free (node->device);
+  tr_free (node);
+}
+
+static int
+compareVerifyByDevice (const void * va, const void * vb)
+{
+  const struct verify_node * a = va;
+  const struct verify_node * b = vb;
+
+  /* if we can't tell where the data lives, assume it shares a disk */
+  if ((a->device == NULL) || (b->device == NULL))
+    return 0;
+
+  return strcmp (a->device, b->device);
+}
+
+static void verifyThreadFunc (void * vnode);
+
+/* Start verifying as many queued torrents as we're allowed to.
+ * Torrents on the same device are verified one at a time so
+ * that they don't make the disk thrash between them. */
+static void
+verifyStartQueued (tr_session * session)
+{
+  tr_list * l;
+  const int max = tr_sessionGetVerifyQueueSize (session);
+
+  assert (tr_lockHave (getVerifyLock ()));
+
+  for (l=verifyList; l!=NULL && tr_list_size (activeList) < max; )
     {
-      int changed = 0;
-      tr_torrent * tor;
-      struct verify_node * node;
-
-      tr_lockLock (getVerifyLock ());
-      stopCurrent = false;
-      node = (struct verify_node*) verifyList ? verifyList->data : NULL;
-      if (node == NULL)
+      struct verify_node * node = l->data;
+      l = l->next;
+
+      if (tr_list_find (activeList, node, compareVerifyByDevice) == NULL)
         {
-          currentNode.torrent = NULL;
-          break;
+          tr_list_remove_data (&verifyList, node);
+          tr_list_append (&activeList, node);
+          tr_threadNew (verifyThreadFunc, node);
         }
+    }
+}
 
-      currentNode = *node;
-      tor = currentNode.torrent;
-      tr_list_remove_data (&verifyList, node);
-      tr_free (node);
-      tr_lockUnlock (getVerifyLock ());
-
-      tr_logAddTorInfo (tor, "%s", _("Verifying torrent"));
-      tr_torrentSetVerifyState (tor, TR_VERIFY_NOW);
-      changed = verifyTorrent (tor, &stopCurrent);
-      tr_torrentSetVerifyState (tor, TR_VERIFY_NONE);
-      assert (tr_isTorrent (tor));
+static void
+verifyThreadFunc (void * vnode)
+{
+  bool changed;
+  struct verify_node * node = vnode;
+  tr_torrent * tor = node->torrent;
+
+  tr_logAddTorInfo (tor, "%s", _("Verifying torrent"));
+  tr_torrentSetVerifyState (tor, TR_VERIFY_NOW);
+  changed = verifyTorrent (tor, &node->stopFlag);
+  tr_torrentSetVerifyState (tor, TR_VERIFY_NONE);
+  assert (tr_isTorrent (tor));
 
-      if (!stopCurrent && changed)
-        tr_torrentSetDirty (tor);
+  /* remember what the files look like now, so that the
+   * next fast verify knows which ones it can skip */
+  if (!node->stopFlag)
+    tr_torrentSetVerified (tor);
+  else if (changed)
+    tr_torrentSetDirty (tor);
 
-      if (currentNode.callback_func)
-        (*currentNode.callback_func)(tor, stopCurrent, currentNode.callback_data);
-    }
+  if (node->callback_func)
+    (*node->callback_func)(tor, node->stopFlag, node->callback_data);
 
-  verifyThread = NULL;
+  tr_lockLock (getVerifyLock ());
+  tr_list_remove_data (&activeList, node);
+  verifyStartQueued (tor->session);
+  verifyNodeFree (node);
   tr_lockUnlock (getVerifyLock ());
 }
 
@@ -266,17 +657,21 @@ tr_verifyAdd (tr_torrent           * tor,
   assert (tr_isTorrent (tor));
   tr_logAddTorInfo (tor, "%s", _("Queued for verification"));
 
-  node = tr_new (struct verify_node, 1);
+  node = tr_new0 (struct verify_node, 1);
   node->torrent = tor;
   node->callback_func = callback_func;
   node->callback_data = callback_data;
   node->current_size = tr_torrentGetCurrentSizeOnDisk (tor);
 
+  /* looking up the device means scanning the mount table,
+   * so don't bother unless torrents can be verified in parallel */
+  if (tr_sessionGetVerifyQueueSize (tor->session) > 1)
+    node->device = deviceFunc (tor);
+
   tr_lockLock (getVerifyLock ());
   tr_torrentSetVerifyState (tor, TR_VERIFY_WAIT);
   tr_list_insert_sorted (&verifyList, node, compareVerifyByPriorityAndSize);
-  if (verifyThread == NULL)
-    verifyThread = tr_threadNew (verifyThreadFunc, NULL);
+  verifyStartQueued (tor->session);
   tr_lockUnlock (getVerifyLock ());
 }
 
@@ -291,16 +686,20 @@ compareVerifyByTorrent (const void * va, const void * vb)
 void
 tr_verifyRemove (tr_torrent * tor)
 {
+  tr_list * l;
   tr_lock * lock = getVerifyLock ();
   tr_lockLock (lock);
 
   assert (tr_isTorrent (tor));
 
-  if (tor == currentNode.torrent)
+  if ((l = tr_list_find (activeList, tor, compareVerifyByTorrent)) != NULL)
     {
-      stopCurrent = true;
+      struct verify_node * node = l->data;
+
+      node->stopFlag = true;
 
-      while (stopCurrent)
+      /* wait for its thread to notice and let go of the torrent */
+      while (tr_list_find (activeList, tor, compareVerifyByTorrent) != NULL)
         {
           tr_lockUnlock (lock);
           tr_wait_msec (100);
@@ -318,7 +717,7 @@ tr_verifyRemove (tr_torrent * tor)
           if (node->callback_func != NULL)
             (*node->callback_func)(tor, true, node->callback_data);
 
-          tr_free (node);
+          verifyNodeFree (node);
         }
     }
 
@@ -328,11 +727,20 @@ tr_verifyRemove (tr_torrent * tor)
 void
 tr_verifyClose (tr_session * session UNUSED)
 {
+  tr_list * l;
+
   tr_lockLock (getVerifyLock ());
 
-  stopCurrent = true;
-  tr_list_free (&verifyList, tr_free);
+  for (l=activeList; l!=NULL; l=l->next)
+    ((struct verify_node*)l->data)->stopFlag = true;
+
+  tr_list_free (&verifyList, verifyNodeFree);
 
   tr_lockUnlock (getVerifyLock ());
 }
 
+void
+tr_verifySetDeviceFunc (tr_verify_device_func func)
+{
+  deviceFunc = func != NULL ? func : getTorrentDevice;
+}
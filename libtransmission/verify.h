@@ -22,6 +22,10 @@
  * @{
  */
 
+/** @brief Returns a newly-allocated name for the device that holds
+    a torrent's files, or NULL if it can't be found */
+typedef char * (*tr_verify_device_func)(const tr_torrent * tor);
+
 void tr_verifyAdd (tr_torrent           * tor,
                    tr_verify_done_func    callback_func,
                    void                 * callback_user_data);
@@ -30,6 +34,11 @@ void tr_verifyRemove (tr_torrent * tor);
 
 void tr_verifyClose (tr_session *);
 
+/** @brief Change how the verify queue finds the device that holds a
+    torrent's files, or restore the default if `func' is NULL. Torrents
+    on the same device are verified one at a time. For tests. */
+void tr_verifySetDeviceFunc (tr_verify_device_func func);
+
 /* @} */
 
 #endif